@@ -1,43 +1,236 @@
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <utime.h>
+#ifdef FSMU_ZSTD
+#include <zstd.h>
+#endif
+#ifdef FSMU_SDT
+#include <sys/sdt.h>
+#endif
 
 static struct options {
     const char *backing_dir;
-    const char *mu_home;
     const char *mu;
     int refresh_timeout;
+    int refresh_min;
+    int refresh_max;
     int delete_remove;
+    int update_index;
+    int index_interval;
+    int compressed;
+    const char *trace_file;
+    int full_refresh_interval;
+    int evict_entries;
+    int evict_age;
+    int prefetch;
+    int header_cache;
+    int max_mu_runs;
+    int warm_up;
     int help;
 } options;
 
 static char *backing_dir_reverse;
 
+/* A mu database (muhome) that queries are run against.  range is the
+ * optional date range hint for the messages in the database (e.g.
+ * "2019..2019", or "1y.."), in mu's date: syntax, so that queries
+ * that cannot match any of those messages can skip the database. */
+struct shard {
+    char *mu_home;
+    char *range;
+};
+
+/* The mu databases given by way of --muhome.  If there are none, then
+ * mu's default database is used. */
+static struct shard *shards;
+static int shard_count;
+
+/* Get the number of mu databases that commands are run against. */
+static int get_shard_count(void)
+{
+    return (shard_count ? shard_count : 1);
+}
+
+/* Get the muhome for the database at index i, or NULL for mu's
+ * default database. */
+static const char *get_shard_mu_home(int i)
+{
+    return (shard_count ? shards[i].mu_home : NULL);
+}
+
+/* The keys for options that are handled by fsmu_opt_proc. */
+enum {
+    KEY_MUHOME
+};
+
+/* A rename that has taken effect in the underlying maildir and in the
+ * query directory where it was made, but that has not yet been
+ * propagated to the other query directories containing the message.
+ * maildir_path is the path recorded in the link mappings for the
+ * other query directories, and new_maildir_path is the current path
+ * of the message.  The remaining members are as per the arguments to
+ * update_link_mapping. */
+struct propagation {
+    char *maildir_path;
+    char *new_maildir_path;
+    char *basename_new;
+    char *flags;
+    struct propagation *next;
+};
+
+/* The propagation queue.  Entries are applied in order by a single
+ * background thread.  current is the entry being applied at the
+ * moment, if any.  mapping_mutex is held whenever link mappings are
+ * being changed as part of a rename, so that the background thread
+ * and the rename operation do not interfere with one another. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_mutex_t mapping_mutex;
+    struct propagation *head;
+    struct propagation *tail;
+    struct propagation *current;
+    pthread_t thread;
+    int started;
+    int stop;
+} propagation_queue = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
 #define OPTION(t, p) \
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--backing-dir=%s", backing_dir),
-    OPTION("--muhome=%s", mu_home),
+    FUSE_OPT_KEY("--muhome=", KEY_MUHOME),
     OPTION("--mu=%s", mu),
     OPTION("--refresh-timeout=%d", refresh_timeout),
+    OPTION("--refresh-min=%d", refresh_min),
+    OPTION("--refresh-max=%d", refresh_max),
     OPTION("--delete-remove", delete_remove),
+    OPTION("--update-index", update_index),
+    OPTION("--index-interval=%d", index_interval),
+    OPTION("--compressed", compressed),
+    OPTION("--trace-file=%s", trace_file),
+    OPTION("--full-refresh-interval=%d", full_refresh_interval),
+    OPTION("--evict-entries=%d", evict_entries),
+    OPTION("--evict-age=%d", evict_age),
+    OPTION("--prefetch=%d", prefetch),
+    OPTION("--header-cache=%d", header_cache),
+    OPTION("--max-mu-runs=%d", max_mu_runs),
+    OPTION("--warm-up=%d", warm_up),
     OPTION("--help", help),
     FUSE_OPT_END
 };
 
+/* The types of change that can be made to the mu index. */
+enum index_op {
+    INDEX_ADD,
+    INDEX_REMOVE
+};
+
+/* A pending change to the mu index. */
+struct index_update {
+    enum index_op op;
+    char *maildir_path;
+    struct index_update *next;
+};
+
+/* The index update queue.  Updates are applied in batches by a
+ * background thread, every index_interval seconds, or sooner if a
+ * refresh requires the index to be up-to-date. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_mutex_t flush_mutex;
+    struct index_update *head;
+    struct index_update *tail;
+    int count;
+    pthread_t thread;
+    int started;
+    int stop;
+} index_queue = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* The maximum number of paths passed to a single mu command. */
+#define INDEX_BATCH_SIZE 256
+
+/* The maximum number of bytes of mu's error output that are kept when
+ * a query fails. */
+#define MU_ERROR_MAX 1024
+
+/* The number of seconds before the start of the previous refresh of a
+ * query directory from which messages are fetched by an incremental
+ * refresh.  mu's changed: field is the time at which the message file
+ * last changed, rather than the time at which it was indexed, so this
+ * allows for messages that were delivered shortly before the previous
+ * refresh, but indexed after it. */
+#define INCREMENTAL_OVERLAP 3600
+
+/* The maximum number of changes kept in the change log for each query
+ * directory. */
+#define CHANGE_LOG_SIZE 4096
+
+/* The initial and maximum number of seconds for which a query
+ * directory whose refresh has failed is not refreshed again. */
+#define FAILURE_BACKOFF_MIN 5
+#define FAILURE_BACKOFF_MAX 3600
+
+/* The number of seconds between checks for query directories whose
+ * results should be evicted (see --evict-entries and --evict-age). */
+#define EVICT_INTERVAL 60
+
+/* The maximum number of bytes cached for each message by the header
+ * cache (see --header-cache), unless --header-cache is larger. */
+#define HEADER_CACHE_MAX 65536
+
+/* The number of links removed by the reaper (see reap_grave) while
+ * holding mapping_mutex. */
+#define REAP_BATCH_SIZE 256
+
+/* The number of message files kept open for each open .mbox file, so
+ * that FUSE can splice from them after mbox_read_buf has returned.  A
+ * single read uses at most a few of these, so this allows for a number
+ * of concurrent reads. */
+#define MBOX_OPEN_FILES 64
+
+/* The minimum number of bytes of a message that are returned as a file
+ * descriptor buffer (so that they can be spliced) when reading from a
+ * .mbox file, rather than being copied into memory. */
+#define MBOX_SPLICE_MIN 32768
+
+/* The number of bytes read at a time when scanning a message for the
+ * .mbox file. */
+#define MBOX_SCAN_CHUNK 65536
+
 /* Check whether the path is OK for further use. */
 static void verify_path(const char *path)
 {
@@ -47,1026 +240,7914 @@ static void verify_path(const char *path)
     }
 }
 
-/* Resolve a mount directory path into a backing directory path. */
-static int resolve_path_noexists(const char *path, char *buf)
+/* A path (or other string), held in a heap buffer that grows as
+ * required.  The length is tracked, so that appending to the path
+ * does not rescan it, and so that a common prefix can be reused by
+ * truncating the path back to the prefix's length.  A path should be
+ * initialised with PATH_INIT, and freed with path_free. */
+struct path {
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+#define PATH_INIT { NULL, 0, 0 }
+
+/* Make sure that path has room for a string of length len. */
+static int path_reserve(struct path *path, size_t len)
 {
-    if (strchr(path + 1, '/') != NULL) {
-        sprintf(buf, "%s/_%s", options.backing_dir, path + 1);
+    if (len < path->size) {
         return 0;
-    } else {
-        return -ENOENT;
     }
+    size_t size = (path->size ? path->size : 256);
+    while (size <= len) {
+        size *= 2;
+    }
+    char *buf = realloc(path->buf, size);
+    if (!buf) {
+        syslog(LOG_ERR, "path_reserve: unable to allocate %zu bytes",
+               size);
+        return -1;
+    }
+    if (!path->buf) {
+        buf[0] = 0;
+    }
+    path->buf = buf;
+    path->size = size;
+    return 0;
 }
 
-/* Resolve a mount directory path into a backing directory path.
- * Returns an error code if the backing directory path does not exist. */
-static int resolve_path(const char *path, char *buf)
+/* Append the first len characters of str to path. */
+static int path_append_len(struct path *path, const char *str,
+                           size_t len)
 {
-    if (strchr(path + 1, '/') != NULL) {
-        sprintf(buf, "%s/_%s", options.backing_dir, path + 1);
-        struct stat stbuf;
-        int res = stat(buf, &stbuf);
-        if (res != 0) {
-            return -ENOENT;
-        }
-        return 0;
-    } else {
-        return -ENOENT;
+    if (path_reserve(path, path->len + len) != 0) {
+        return -1;
     }
+    memcpy(path->buf + path->len, str, len);
+    path->len += len;
+    path->buf[path->len] = 0;
+    return 0;
 }
 
-/* Define init as a no-op. */
-static void *fsmu_init(struct fuse_conn_info *conn)
+/* Append str to path. */
+static int path_append(struct path *path, const char *str)
 {
-    return NULL;
+    return path_append_len(path, str, strlen(str));
 }
 
-/* Define open as a no-op. */
-static int fsmu_open(const char *path, struct fuse_file_info *info)
+/* Append a slash and then segment to path. */
+static int path_push(struct path *path, const char *segment)
 {
+    size_t len = strlen(segment);
+    if (path_reserve(path, path->len + 1 + len) != 0) {
+        return -1;
+    }
+    path->buf[path->len] = '/';
+    memcpy(path->buf + path->len + 1, segment, len + 1);
+    path->len += 1 + len;
     return 0;
 }
 
-/* Define release as a no-op. */
-static int fsmu_release(const char *path, struct fuse_file_info *info)
+/* Truncate path to len characters. */
+static void path_truncate(struct path *path, size_t len)
 {
-    return 0;
+    if (path->buf && (len < path->len)) {
+        path->len = len;
+        path->buf[len] = 0;
+    }
 }
 
-/* Define truncate as a no-op. */
-static int fsmu_truncate(const char *path, off_t offset)
+/* Set path to str. */
+static int path_set(struct path *path, const char *str)
 {
-    return 0;
+    path_truncate(path, 0);
+    return path_append(path, str);
 }
 
-/* Get the directory name for the file in path, and write it to buf. */
-static int dirname(const char *path, char *buf)
+/* Set path to the first len characters of str. */
+static int path_set_len(struct path *path, const char *str, size_t len)
 {
-    const char *last_slash = strrchr(path, '/');
-    if (!last_slash) {
-        syslog(LOG_ERR, "dirname: cannot get directory name "
-                        "for '%s'", path);
-        return -1;
-    }
-    int length = last_slash - path;
-    strncpy(buf, path, length);
-    buf[length] = 0;
-
-    return 0;
+    path_truncate(path, 0);
+    return path_append_len(path, str, len);
 }
 
-/* Get the basename for the file in path, and write it to buf. */
-static int basename(const char *path, char *buf)
+/* Append formatted output to path. */
+static int path_appendf(struct path *path, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+static int path_appendf(struct path *path, const char *format, ...)
 {
-    const char *last_slash = strrchr(path, '/');
-    if (!last_slash) {
-        syslog(LOG_ERR, "basename: cannot get base name "
-                        "for '%s'", path);
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if ((len < 0) || (path_reserve(path, path->len + len) != 0)) {
         return -1;
     }
-    int length = strlen(path) - (last_slash - path) - 1;
-    strncpy(buf, last_slash + 1, length);
-    buf[length] = 0;
-
+    va_start(args, format);
+    vsnprintf(path->buf + path->len, len + 1, format, args);
+    va_end(args);
+    path->len += len;
     return 0;
 }
 
-/* Returns a boolean indicating whether entry is "." or "..". */
-static int is_upwards(const char *entry)
+/* Set path to formatted output. */
+static int path_setf(struct path *path, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+static int path_setf(struct path *path, const char *format, ...)
 {
-    return ((strcmp(entry, ".")  == 0)
-         || (strcmp(entry, "..") == 0));
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    path_truncate(path, 0);
+    if ((len < 0) || (path_reserve(path, len) != 0)) {
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(path->buf, len + 1, format, args);
+    va_end(args);
+    path->len = len;
+    return 0;
 }
 
-/* Make a new backing directory (a maildir with "cur" and "new"
- * subdirectories) at the specified path, if it doesn't already exist.
- * */
-static int make_backing_dir_if_required(const char *backing_path)
+/* Set path to the target of the symbolic link at link_path. */
+static int path_readlink(struct path *path, const char *link_path)
 {
-    struct stat stbuf;
-    memset(&stbuf, 0, sizeof(struct stat));
-    int res = stat(backing_path, &stbuf);
-    if (res != 0) {
-        res = mkdir(backing_path, 0755);
-        if (res != 0) {
-            syslog(LOG_ERR, "make_backing_dir_if_required: "
-                            "cannot create '%s': %s",
-                   backing_path, strerror(errno));
+    path_truncate(path, 0);
+    /* The existing buffer is used as it is to begin with, and only
+     * grown if the link does not fit in it. */
+    size_t len_needed = (path->size ? path->size - 1 : 255);
+    for (;;) {
+        if (path_reserve(path, len_needed) != 0) {
             return -1;
         }
-    }
-
-    char backing_path_cur[PATH_MAX];
-    strcpy(backing_path_cur, backing_path);
-    strcat(backing_path_cur, "/cur");
-    memset(&stbuf, 0, sizeof(struct stat));
-    res = stat(backing_path_cur, &stbuf);
-    if (res != 0) {
-        res = mkdir(backing_path_cur, 0755);
-        if (res != 0) {
-            syslog(LOG_ERR, "make_backing_dir_if_required: "
-                            "cannot create '%s': %s",
-                   backing_path_cur, strerror(errno));
+        ssize_t len = readlink(link_path, path->buf, path->size);
+        if (len == -1) {
             return -1;
         }
+        if ((size_t) len < path->size) {
+            path->len = len;
+            path->buf[len] = 0;
+            return 0;
+        }
+        len_needed = path->size;
     }
+}
 
-    char backing_path_new[PATH_MAX];
-    strcpy(backing_path_new, backing_path);
-    strcat(backing_path_new, "/new");
-    memset(&stbuf, 0, sizeof(struct stat));
-    res = stat(backing_path_new, &stbuf);
-    if (res != 0) {
-        res = mkdir(backing_path_new, 0755);
-        if (res != 0) {
-            syslog(LOG_ERR, "make_backing_dir_if_required: "
-                            "cannot create '%s': %s",
-                   backing_path_new, strerror(errno));
-            return -1;
+/* Free the buffer for path. */
+static void path_free(struct path *path)
+{
+    free(path->buf);
+    path->buf = NULL;
+    path->len = 0;
+    path->size = 0;
+}
+
+/* Get the length of the directory part of the string str of length
+ * len (i.e. the part before the last slash), or -1 if there is no
+ * slash. */
+static ssize_t dirname_len(const char *str, size_t len)
+{
+    while (len > 0) {
+        if (str[--len] == '/') {
+            return len;
         }
     }
+    return -1;
+}
 
+/* Truncate path to its directory part (see dirname_len). */
+static int path_up(struct path *path)
+{
+    ssize_t len = dirname_len(path->buf, path->len);
+    if (len < 0) {
+        syslog(LOG_ERR, "path_up: cannot get directory name "
+                        "for '%s'", path->buf);
+        return -1;
+    }
+    path_truncate(path, len);
     return 0;
 }
 
-/* Make a new directory at path, as well as any parent directories
- * that don't already exist. */
-static int mkdirp(const char *path)
+/* Get a view of the last count segments of the string str of length
+ * len, starting with the slash that precedes them, or NULL if str does
+ * not have enough segments. */
+static const char *last_segments(const char *str, size_t len, int count)
 {
-    struct stat st_buf;
-    memset(&st_buf, 0, sizeof(struct stat));
-    int res = stat(path, &st_buf);
-    if (res != 0) {
-        res = mkdir(path, 0755);
-        if ((res != 0) && (errno == ENOENT)) {
-            char dir[PATH_MAX];
-            res = dirname(path, dir);
-            if (res != 0) {
-                return -1;
-            }
-            res = mkdirp(dir);
-            if (res != 0) {
-                return -1;
-            }
-            res = mkdir(path, 0755);
-            if (res != 0) {
-                syslog(LOG_ERR, "mkdirp: cannot make directory "
-                                "'%s': %s",
-                       path, strerror(errno));
-                return -1;
-            }
+    ssize_t end = len;
+    for (int i = 0; i < count; i++) {
+        end = dirname_len(str, end);
+        if (end < 0) {
+            return NULL;
         }
     }
+    return str + end;
+}
 
-    return 0;
+/* Get a view of the basename of str (i.e. the part after the last
+ * slash), or NULL if there is no slash. */
+static const char *basename_view(const char *str)
+{
+    const char *last_slash = strrchr(str, '/');
+    return (last_slash ? last_slash + 1 : NULL);
 }
 
-/* Write the reverse path for this maildir path and backing path pair
- * to buf.  (The reverse path is the concatenation of the reverse
- * backing directory (see backing_dir_reverse), the maildir path, and
- * the last three segments of the backing path.  It is used when
- * constructing link mappings, which in turn are maintained so that
- * it's possible to find all backing paths for a given maildir path.)
- * */
-static int get_reverse_path(const char *maildir_path,
-                            const char *backing_path,
-                            char *buf)
+/* Resolve a mount directory path into a backing directory path. */
+static int resolve_path_noexists(const char *path, struct path *buf)
 {
-    char filename[PATH_MAX];
-    int res = basename(backing_path, filename);
-    if (res != 0) {
-        return -1;
+    if (strchr(path + 1, '/') != NULL) {
+        if ((path_set(buf, options.backing_dir) != 0)
+                || (path_push(buf, "_") != 0)
+                || (path_append(buf, path + 1) != 0)) {
+            return -ENOMEM;
+        }
+        return 0;
+    } else {
+        return -ENOENT;
     }
+}
 
-    char backing_dir[PATH_MAX];
-    res = dirname(backing_path, backing_dir);
+/* Resolve a mount directory path into a backing directory path.
+ * Returns an error code if the backing directory path does not exist. */
+static int resolve_path(const char *path, struct path *buf)
+{
+    int res = resolve_path_noexists(path, buf);
     if (res != 0) {
-        return -1;
+        return res;
     }
-    char backing_dir_single[PATH_MAX];
-    res = basename(backing_dir, backing_dir_single);
+    struct stat stbuf;
+    res = lstat(buf->buf, &stbuf);
     if (res != 0) {
-        return -1;
+        return -ENOENT;
     }
+    return 0;
+}
 
-    char backing_dir2[PATH_MAX];
-    res = dirname(backing_dir, backing_dir2);
-    if (res != 0) {
-        return -1;
-    }
-    char backing_dir_single2[PATH_MAX];
-    res = basename(backing_dir2, backing_dir_single2);
-    if (res != 0) {
-        return -1;
+/* Get the name of the query directory that contains the mount path
+ * path (i.e. its first segment), as a newly-allocated string. */
+static char *get_query_name(const char *path)
+{
+    const char *separator = strchr(path + 1, '/');
+    size_t len = (separator ? (size_t) (separator - path - 1)
+                            : strlen(path + 1));
+    return strndup(path + 1, len);
+}
+
+/* Define truncate as a no-op. */
+static int fsmu_truncate(const char *path, off_t offset)
+{
+    return 0;
+}
+
+/* Returns a boolean indicating whether entry is "." or "..". */
+static int is_upwards(const char *entry)
+{
+    return ((strcmp(entry, ".")  == 0)
+         || (strcmp(entry, "..") == 0));
+}
+
+/* Static tracepoints.  Each phase of a refresh, rename, rmdir or
+ * link mapping update has a pair of probes, named <phase>_entry and
+ * <phase>_return, each taking the path being operated on as its
+ * argument. */
+#ifdef FSMU_SDT
+#define FSMU_PROBE(name, arg) DTRACE_PROBE1(fsmu, name, arg)
+#else
+#define FSMU_PROBE(name, arg)
+#endif
+
+/* A phase of an operation, as recorded in the trace file. */
+struct trace_span {
+    const char *name;
+    const char *arg;
+    uint64_t start;
+    uint64_t link_mapping_ns;
+};
+
+/* The trace file (see --trace-file), or NULL if tracing is not
+ * enabled. */
+static FILE *trace_file;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_epoch;
+static int trace_events;
+
+/* Time spent adding link mappings by the current thread, so that
+ * this can be reported against the enclosing phase, rather than as a
+ * separate span for each message. */
+static __thread uint64_t link_mapping_ns;
+
+/* Get the current time in nanoseconds, or 0 if tracing is not
+ * enabled. */
+static uint64_t trace_now(void)
+{
+    if (!trace_file) {
+        return 0;
     }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
 
-    strcpy(buf, backing_dir_reverse);
-    strcat(buf, maildir_path);
-    strcat(buf, "/");
-    strcat(buf, backing_dir_single2);
-    strcat(buf, "/");
-    strcat(buf, backing_dir_single);
-    strcat(buf, "/");
-    strcat(buf, filename);
+/* Write str to the trace file as a JSON string.  The caller must
+ * hold trace_mutex. */
+static void trace_write_string(const char *str)
+{
+    fputc('"', trace_file);
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if ((c == '"') || (c == '\\')) {
+            fputc('\\', trace_file);
+            fputc(c, trace_file);
+        } else if (c < 0x20) {
+            fprintf(trace_file, "\\u%04x", c);
+        } else {
+            fputc(c, trace_file);
+        }
+    }
+    fputc('"', trace_file);
+}
 
-    return 0;
+/* Start recording a phase in the trace file. */
+static void trace_begin(struct trace_span *span, const char *name,
+                        const char *arg)
+{
+    span->name = name;
+    span->arg = arg;
+    span->start = trace_now();
+    span->link_mapping_ns = link_mapping_ns;
 }
 
-/* Add a link mapping for the maildir path and backing path pair (i.e.
- * a link from the reverse path for this pair to the backing path). */
-static int add_link_mapping(const char *maildir_path,
-                            const char *backing_path)
+/* Finish recording a phase, and write it to the trace file as a
+ * complete ("X") event in the Chrome trace event format. */
+static void trace_end(struct trace_span *span)
 {
-    char reverse_path[PATH_MAX];
-    int res = get_reverse_path(maildir_path, backing_path,
-                               reverse_path);
-    if (res != 0) {
-        return -1;
+    if (!trace_file || !span->start) {
+        return;
     }
+    uint64_t end = trace_now();
+    uint64_t mapping_ns = link_mapping_ns - span->link_mapping_ns;
 
-    char reverse_path_dir[PATH_MAX];
-    res = dirname(reverse_path, reverse_path_dir);
-    if (res != 0) {
-        return -1;
+    pthread_mutex_lock(&trace_mutex);
+    if (!trace_file) {
+        pthread_mutex_unlock(&trace_mutex);
+        return;
     }
-    res = mkdirp(reverse_path_dir);
-    if (res != 0) {
-        return -1;
+    fprintf(trace_file,
+            "%s{\"name\":\"%s\",\"cat\":\"fsmu\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,"
+            "\"args\":{\"path\":",
+            (trace_events++ ? ",\n" : ""), span->name,
+            (span->start - trace_epoch) / 1000.0,
+            (end - span->start) / 1000.0,
+            (int) getpid(), (long) syscall(SYS_gettid));
+    trace_write_string(span->arg ? span->arg : "");
+    if (mapping_ns) {
+        fprintf(trace_file, ",\"add_link_mapping_us\":%.3f",
+                mapping_ns / 1000.0);
     }
+    fputs("}}", trace_file);
+    fflush(trace_file);
+    pthread_mutex_unlock(&trace_mutex);
+}
 
-    res = symlink(backing_path, reverse_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "add_link_mapping: failed for '%s' to '%s': %s",
-               backing_path, reverse_path, strerror(errno));
-        return -1;
+/* Mark the start and end of a phase, firing the corresponding probes
+ * and recording the phase in the trace file. */
+#define PHASE_BEGIN(span, name, arg) \
+    do { \
+        FSMU_PROBE(name##_entry, arg); \
+        trace_begin(&(span), #name, (arg)); \
+    } while (0)
+#define PHASE_END(span, name, arg) \
+    do { \
+        trace_end(&(span)); \
+        FSMU_PROBE(name##_return, arg); \
+    } while (0)
+
+/* An entry in a string-keyed hash table. */
+struct table_entry {
+    char *key;
+    void *value;
+    struct table_entry *next;
+};
+
+/* A string-keyed hash table.  Tables do not do any locking of their
+ * own. */
+struct table {
+    struct table_entry **buckets;
+    size_t size;
+    size_t count;
+};
+
+/* Get the hash for the given key (FNV-1a). */
+static size_t table_hash(const char *key)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (; *key; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
 
+/* Initialise an empty table. */
+static int table_init(struct table *table)
+{
+    table->size = 64;
+    table->count = 0;
+    table->buckets = calloc(table->size, sizeof(struct table_entry *));
+    if (!table->buckets) {
+        syslog(LOG_ERR, "table_init: unable to allocate buckets");
+        return -1;
+    }
     return 0;
 }
 
-/* Remove the link mapping for the maildir path and backing path pair.
- * This will also remove any empty directories from further up the
- * reverse path, as required. */
-static int remove_link_mapping(const char *maildir_path,
-                               const char *backing_path)
+/* Get the value for the given key, or NULL if there is no such
+ * value. */
+static void *table_get(struct table *table, const char *key)
 {
-    char reverse_path[PATH_MAX];
-    int res = get_reverse_path(maildir_path, backing_path,
-                               reverse_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "remove_link_mapping: "
-                        "can't get reverse path for '%s', '%s'",
-               maildir_path, backing_path);
-        return -1;
+    if (!table->buckets) {
+        return NULL;
+    }
+    struct table_entry *entry =
+        table->buckets[table_hash(key) % table->size];
+    for (; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            return entry->value;
+        }
     }
+    return NULL;
+}
 
-    res = unlink(reverse_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "remove_link_mapping: "
-                        "can't delete reverse path '%s': %s",
-               reverse_path, strerror(errno));
+/* Double the number of buckets in the table. */
+static void table_grow(struct table *table)
+{
+    size_t size = table->size * 2;
+    struct table_entry **buckets =
+        calloc(size, sizeof(struct table_entry *));
+    if (!buckets) {
+        /* The table will still work, it will just be slower. */
+        return;
+    }
+    for (size_t i = 0; i < table->size; i++) {
+        struct table_entry *entry = table->buckets[i];
+        while (entry) {
+            struct table_entry *next = entry->next;
+            size_t index = table_hash(entry->key) % size;
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+}
+
+/* Set the value for the given key.  If the key already has a value,
+ * then the previous value is written to previous (if not NULL). */
+static int table_put(struct table *table, const char *key, void *value,
+                     void **previous)
+{
+    if (previous) {
+        *previous = NULL;
+    }
+    if (!table->buckets && (table_init(table) != 0)) {
         return -1;
     }
-    char *last_slash = strrchr(reverse_path, '/');
-    *last_slash = 0;
-    res = rmdir(reverse_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "remove_link_mapping: "
-                        "can't remove directory '%s': %s",
-               reverse_path, strerror(errno));
+    size_t index = table_hash(key) % table->size;
+    struct table_entry *entry = table->buckets[index];
+    for (; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            if (previous) {
+                *previous = entry->value;
+            }
+            entry->value = value;
+            return 0;
+        }
+    }
+
+    entry = malloc(sizeof(struct table_entry));
+    if (!entry) {
+        syslog(LOG_ERR, "table_put: unable to allocate entry");
         return -1;
     }
-    last_slash = strrchr(reverse_path, '/');
-    *last_slash = 0;
-    res = rmdir(reverse_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "remove_link_mapping: "
-                        "can't remove directory '%s': %s",
-               reverse_path, strerror(errno));
+    entry->key = strdup(key);
+    if (!entry->key) {
+        syslog(LOG_ERR, "table_put: unable to allocate key");
+        free(entry);
         return -1;
     }
+    entry->value = value;
+    entry->next = table->buckets[index];
+    table->buckets[index] = entry;
+    table->count++;
+    if (table->count > (table->size * 2)) {
+        table_grow(table);
+    }
+    return 0;
+}
 
-    for (;;) {
-        last_slash = strrchr(reverse_path, '/');
-        *last_slash = 0;
-        int len = strlen(reverse_path);
-        if (len >= 9) {
-            const char *tail = reverse_path + len - 9;
-            if (strcmp(tail, "/_reverse") == 0) {
-                return 0;
-            }
+/* Remove the entry for the given key, and return its value (or NULL
+ * if there is no such entry). */
+static void *table_remove(struct table *table, const char *key)
+{
+    if (!table->buckets) {
+        return NULL;
+    }
+    struct table_entry **entry_ptr =
+        &(table->buckets[table_hash(key) % table->size]);
+    for (; *entry_ptr; entry_ptr = &((*entry_ptr)->next)) {
+        struct table_entry *entry = *entry_ptr;
+        if (strcmp(entry->key, key) == 0) {
+            void *value = entry->value;
+            *entry_ptr = entry->next;
+            free(entry->key);
+            free(entry);
+            table->count--;
+            return value;
         }
+    }
+    return NULL;
+}
 
-        DIR *reverse_handle = opendir(reverse_path);
-        if (!reverse_handle) {
-            syslog(LOG_ERR, "remove_link_mapping: unable "
-                            "to open directory '%s'",
-                   reverse_path);
-            return -1;
+/* Remove every entry from the table, freeing the keys and the values
+ * (which must have been allocated with malloc). */
+static void table_clear(struct table *table)
+{
+    if (!table->buckets) {
+        return;
+    }
+    for (size_t i = 0; i < table->size; i++) {
+        struct table_entry *entry = table->buckets[i];
+        while (entry) {
+            struct table_entry *next = entry->next;
+            free(entry->key);
+            free(entry->value);
+            free(entry);
+            entry = next;
         }
-        struct dirent *dent;
-        int count = 0;
-        while ((dent = readdir(reverse_handle)) != NULL) {
-            if (is_upwards(dent->d_name)) {
-                continue;
-            }
-            count++;
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    table->count = 0;
+}
+
+/* The device, inode, size and modification time of a maildir file, as
+ * at the time it was last seen by fsmu.  None of these are changed by
+ * a rename, and the size and modification time guard against the
+ * inode having been reused for another message. */
+struct identity {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+/* A map from maildir path to identity, used to find messages that
+ * have been renamed outside of fsmu. */
+static struct table identities;
+static pthread_mutex_t identities_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Record the identity of the maildir file at maildir_path, using the
+ * details from stbuf. */
+static void record_identity(const char *maildir_path,
+                            const struct stat *stbuf)
+{
+    pthread_mutex_lock(&identities_mutex);
+    struct identity *identity = table_get(&identities, maildir_path);
+    if (!identity) {
+        identity = malloc(sizeof(struct identity));
+        if (!identity) {
+            pthread_mutex_unlock(&identities_mutex);
+            return;
         }
-        closedir(reverse_handle);
-        if (count != 0) {
-            break;
+        if (table_put(&identities, maildir_path, identity, NULL) != 0) {
+            free(identity);
+            pthread_mutex_unlock(&identities_mutex);
+            return;
         }
-        res = rmdir(reverse_path);
-        if (res != 0) {
-            syslog(LOG_ERR, "remove_link_mapping: "
-                            "can't remove top level '%s': %s",
-                   reverse_path, strerror(errno));
-            return -1;
+    }
+    identity->dev = stbuf->st_dev;
+    identity->ino = stbuf->st_ino;
+    identity->size = stbuf->st_size;
+    identity->mtime = stbuf->st_mtim;
+    pthread_mutex_unlock(&identities_mutex);
+}
+
+/* Move the recorded identity for maildir_path (if any) to
+ * new_maildir_path. */
+static void move_identity(const char *maildir_path,
+                          const char *new_maildir_path)
+{
+    pthread_mutex_lock(&identities_mutex);
+    struct identity *identity = table_remove(&identities, maildir_path);
+    if (identity) {
+        void *previous;
+        if (table_put(&identities, new_maildir_path, identity,
+                      &previous) != 0) {
+            free(identity);
         }
+        free(previous);
     }
+    pthread_mutex_unlock(&identities_mutex);
+}
 
-    return 0;
+/* Forget the recorded identity for maildir_path (if any), once the
+ * message is no longer in any query directory. */
+static void forget_identity(const char *maildir_path)
+{
+    pthread_mutex_lock(&identities_mutex);
+    free(table_remove(&identities, maildir_path));
+    pthread_mutex_unlock(&identities_mutex);
 }
 
-/* Update an existing backing directory with the contents from the
- * search results directory (temp_path). */
-static int update_backing_dir(const char *backing_dir,
-                              const char *temp_path)
+/* Returns a boolean indicating whether the message at maildir_path has
+ * no link mappings.  reverse_path holds the reverse directory's path,
+ * which is reverse_len bytes long. */
+static int is_unmapped(const char *maildir_path, struct path *reverse_path,
+                       size_t reverse_len)
 {
-    struct dirent *dent;
     struct stat stbuf;
+    path_truncate(reverse_path, reverse_len);
+    return ((path_append(reverse_path, maildir_path) == 0)
+            && (lstat(reverse_path->buf, &stbuf) != 0)
+            && (errno == ENOENT));
+}
 
-    DIR *backing_dir_handle = opendir(backing_dir);
-    if (!backing_dir_handle) {
-        syslog(LOG_ERR, "update_backing_dir: cannot open '%s': %s",
-               backing_dir, strerror(errno));
-        return -1;
-    }
-    while ((dent = readdir(backing_dir_handle)) != NULL) {
-        if (is_upwards(dent->d_name)) {
-            continue;
-        }
-        char temp_path_ent[PATH_MAX];
-        strcpy(temp_path_ent, temp_path);
-        strcat(temp_path_ent, dent->d_name);
-        memset(&stbuf, 0, sizeof(struct stat));
-        int res = stat(temp_path_ent, &stbuf);
-        if (res == 0) {
-            res = unlink(temp_path_ent);
-            if (res != 0) {
-                syslog(LOG_ERR, "update_backing_dir: unable to remove link "
-                                "'%s' that already exists: %s",
-                       dent->d_name, strerror(errno));
-                closedir(backing_dir_handle);
-                return -1;
-            }
-        } else {
-            char backing_dir_ent[PATH_MAX];
-            strcpy(backing_dir_ent, backing_dir);
-            strcat(backing_dir_ent, dent->d_name);
-
-            char maildir_path[PATH_MAX];
-            ssize_t len = readlink(backing_dir_ent, maildir_path, PATH_MAX);
-            if (len == PATH_MAX) {
-                syslog(LOG_ERR, "update_backing_dir: too much path "
-                                "data for '%s",
-                       backing_dir_ent);
-                closedir(backing_dir_handle);
-                return -1;
-            }
-            if (len == -1) {
-                syslog(LOG_ERR, "update_backing_dir: unable to read "
-                                "link for '%s': %s",
-                       backing_dir_ent, strerror(errno));
-                closedir(backing_dir_handle);
-                return -1;
+/* Forget the recorded identities of messages that have no link
+ * mappings, in case their mappings were removed without going by way
+ * of remove_link_mapping.  The mappings are checked without holding
+ * identities_mutex, so that recording identities is not held up, and
+ * those found to be missing are checked again once it is held, since
+ * the message may have been added to a query directory meanwhile. */
+static void prune_identities(void)
+{
+    pthread_mutex_lock(&identities_mutex);
+    size_t count = identities.count;
+    char **keys = calloc(count ? count : 1, sizeof(char *));
+    size_t key_count = 0;
+    for (size_t i = 0;
+            keys && identities.buckets && (i < identities.size); i++) {
+        struct table_entry *entry = identities.buckets[i];
+        for (; entry && (key_count < count); entry = entry->next) {
+            if ((keys[key_count] = strdup(entry->key)) != NULL) {
+                key_count++;
             }
-            maildir_path[len] = 0;
+        }
+    }
+    pthread_mutex_unlock(&identities_mutex);
+    if (!keys) {
+        return;
+    }
 
-            res = remove_link_mapping(maildir_path, backing_dir_ent);
-            if (res != 0) {
-                syslog(LOG_ERR, "update_backing_dir: unable "
-                                "to remove link mapping");
-                closedir(backing_dir_handle);
-                return -1;
+    struct path reverse_path = PATH_INIT;
+    size_t missing = 0;
+    if (path_set(&reverse_path, backing_dir_reverse) == 0) {
+        size_t reverse_len = reverse_path.len;
+        for (size_t i = 0; i < key_count; i++) {
+            if (is_unmapped(keys[i], &reverse_path, reverse_len)) {
+                keys[missing++] = keys[i];
+            } else {
+                free(keys[i]);
             }
-            res = unlink(backing_dir_ent);
-            if (res != 0) {
-                syslog(LOG_ERR, "update_backing_dir: unable "
-                                "to remove previous backing path "
-                                "'%s': %s",
-                       backing_dir_ent, strerror(errno));
-                closedir(backing_dir_handle);
-                return -1;
+        }
+
+        size_t pruned = 0;
+        pthread_mutex_lock(&identities_mutex);
+        for (size_t i = 0; i < missing; i++) {
+            if (is_unmapped(keys[i], &reverse_path, reverse_len)) {
+                void *identity = table_remove(&identities, keys[i]);
+                pruned += (identity != NULL);
+                free(identity);
             }
         }
+        pthread_mutex_unlock(&identities_mutex);
+        if (pruned) {
+            syslog(LOG_DEBUG, "prune_identities: forgot %zu identities",
+                   pruned);
+        }
+    } else {
+        missing = key_count;
+    }
+    for (size_t i = 0; i < missing; i++) {
+        free(keys[i]);
     }
-    closedir(backing_dir_handle);
+    free(keys);
+    path_free(&reverse_path);
+}
 
-    DIR *temp_dir_handle = opendir(temp_path);
-    if (!temp_dir_handle) {
-        syslog(LOG_ERR, "update_backing_dir: cannot open '%s': %s",
-               temp_path, strerror(errno));
+/* Make a new backing directory (a maildir with "cur" and "new"
+ * subdirectories) at the specified path, if it doesn't already exist.
+ * */
+static int make_backing_dir_if_required(const char *backing_path)
+{
+    struct path path = PATH_INIT;
+    if (path_set(&path, backing_path) != 0) {
         return -1;
     }
-    while ((dent = readdir(temp_dir_handle)) != NULL) {
-        if (is_upwards(dent->d_name)) {
-            continue;
-        }
-        char backing_dir_ent[PATH_MAX];
-        strcpy(backing_dir_ent, backing_dir);
-        strcat(backing_dir_ent, dent->d_name);
-
-        char temp_path_ent[PATH_MAX];
-        strcpy(temp_path_ent, temp_path);
-        strcat(temp_path_ent, dent->d_name);
-
-        int res = rename(temp_path_ent, backing_dir_ent);
-        if (res != 0) {
-            syslog(LOG_ERR, "update_backing_dir: unable to "
-                            "rename link ('%s' -> '%s'): %s",
-                   temp_path_ent, backing_dir_ent, strerror(errno));
-            closedir(temp_dir_handle);
-            return -1;
-        }
+    size_t prefix_len = path.len;
 
-        char maildir_path[PATH_MAX];
-        ssize_t len = readlink(backing_dir_ent, maildir_path, PATH_MAX);
-        if (len == PATH_MAX) {
-            syslog(LOG_ERR, "update_backing_dir: too much path "
-                            "data for '%s'",
-                   backing_dir_ent);
-            closedir(temp_dir_handle);
+    const char *subdirs[] = { NULL, "cur", "new" };
+    for (int i = 0; i < 3; i++) {
+        path_truncate(&path, prefix_len);
+        if (subdirs[i] && (path_push(&path, subdirs[i]) != 0)) {
+            path_free(&path);
             return -1;
         }
-        if (len == -1) {
-            syslog(LOG_ERR, "update_backing_dir: unable to read "
-                            "link for '%s': %s",
-                   backing_dir_ent, strerror(errno));
-            closedir(temp_dir_handle);
-            return -1;
+        struct stat stbuf;
+        memset(&stbuf, 0, sizeof(struct stat));
+        int res = stat(path.buf, &stbuf);
+        if (res != 0) {
+            res = mkdir(path.buf, 0755);
+            if (res != 0) {
+                syslog(LOG_ERR, "make_backing_dir_if_required: "
+                                "cannot create '%s': %s",
+                       path.buf, strerror(errno));
+                path_free(&path);
+                return -1;
+            }
         }
-        maildir_path[len] = 0;
-
-        add_link_mapping(maildir_path, backing_dir_ent);
     }
-    closedir(temp_dir_handle);
 
+    path_free(&path);
     return 0;
 }
 
-/* Remove a temporary mail directory and its contents recursively.
- * This will remove as many files/directories as possible before
- * returning. */
-static int remove_dir(const char *dir_path)
+/* Make a new directory at path, as well as any parent directories
+ * that don't already exist. */
+static int mkdirp(const char *path)
 {
-    DIR *dir_handle = opendir(dir_path);
-    if (!dir_handle) {
-        syslog(LOG_ERR, "remove_dir: cannot open '%s': %s",
-               dir_handle, strerror(errno));
-        return -1;
-    }
-    struct dirent *dent;
-    struct stat stbuf;
-    while ((dent = readdir(dir_handle)) != NULL) {
-        if (is_upwards(dent->d_name)) {
-            continue;
-        }
-        char path[PATH_MAX];
-        strcpy(path, dir_path);
-        strcat(path, "/");
-        strcat(path, dent->d_name);
-        int res = lstat(path, &stbuf);
-        if (res != 0) {
-            syslog(LOG_INFO, "remove_dir: cannot lstat '%s': %s",
-                   path, strerror(errno));
-        } else if (S_ISDIR(stbuf.st_mode)) {
-            int res = remove_dir(path);
+    struct stat st_buf;
+    memset(&st_buf, 0, sizeof(struct stat));
+    int res = stat(path, &st_buf);
+    if (res != 0) {
+        res = mkdir(path, 0755);
+        if ((res != 0) && (errno == ENOENT)) {
+            ssize_t len = dirname_len(path, strlen(path));
+            if (len <= 0) {
+                return -1;
+            }
+            struct path dir = PATH_INIT;
+            if (path_set_len(&dir, path, len) != 0) {
+                return -1;
+            }
+            res = mkdirp(dir.buf);
+            path_free(&dir);
             if (res != 0) {
-                syslog(LOG_ERR, "remove_dir: cannot remove '%s': %s",
-                       path, strerror(errno));
+                return -1;
             }
-        } else {
-            int res = unlink(path);
+            res = mkdir(path, 0755);
             if (res != 0) {
-                syslog(LOG_ERR, "remove_dir: cannot unlink '%s': %s",
+                syslog(LOG_ERR, "mkdirp: cannot make directory "
+                                "'%s': %s",
                        path, strerror(errno));
+                return -1;
             }
         }
     }
-    closedir(dir_handle);
-
-    int res = rmdir(dir_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "remove_dir: cannot unlink directory '%s': %s",
-               dir_path, strerror(errno));
-        return -1;
-    }
 
     return 0;
 }
 
-/* Refresh the search results for a given mount directory.  If force
- * is false, then refresh will not happen if the timeout for the
- * corresponding backing directory has not been reached.  If force is
- * true, then refresh will always happen. */
-static int refresh_dir(const char *path, int force)
+/* Write the reverse path for this maildir path and backing path pair
+ * to buf.  (The reverse path is the concatenation of the reverse
+ * backing directory (see backing_dir_reverse), the maildir path, and
+ * the last three segments of the backing path.  It is used when
+ * constructing link mappings, which in turn are maintained so that
+ * it's possible to find all backing paths for a given maildir path.)
+ * */
+static int get_reverse_path(const char *maildir_path,
+                            const char *backing_path,
+                            struct path *buf)
 {
-    syslog(LOG_DEBUG, "refresh_dir: '%s'", path);
-    verify_path(path);
-
-    if ((strcmp(path, "/") == 0)
-            || (strlen(path) <= 1)
-            || (path[1] == '_')) {
-        syslog(LOG_DEBUG, "refresh_dir: '%s' cannot be refreshed", path);
-        return 0;
+    const char *suffix = last_segments(backing_path, strlen(backing_path), 3);
+    if (!suffix) {
+        syslog(LOG_ERR, "get_reverse_path: too few segments in '%s'",
+               backing_path);
+        return -1;
     }
 
-    char root_dirname[PATH_MAX];
-    strcpy(root_dirname, path);
-    char *separator = strchr(root_dirname + 1, '/');
-    if (separator != NULL) {
-        *separator = 0;
+    if ((path_set(buf, backing_dir_reverse) != 0)
+            || (path_append(buf, maildir_path) != 0)
+            || (path_append(buf, suffix) != 0)) {
+        return -1;
     }
 
-    char search_path[PATH_MAX];
-    sprintf(search_path, "%s%s", options.backing_dir, root_dirname);
-    struct stat stbuf;
-    int res = stat(search_path, &stbuf);
+    return 0;
+}
+
+/* Add a link mapping for the maildir path and backing path pair (i.e.
+ * a link from the reverse path for this pair to the backing path). */
+static int add_link_mapping(const char *maildir_path,
+                            const char *backing_path)
+{
+    struct path reverse_path = PATH_INIT;
+    int res = get_reverse_path(maildir_path, backing_path,
+                               &reverse_path);
     if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: '%s' cannot be refreshed", path);
+        path_free(&reverse_path);
         return -1;
     }
 
-    char last_update_path[PATH_MAX];
-    sprintf(last_update_path, "%s.last-update", search_path);
-    res = stat(last_update_path, &stbuf);
+    size_t len = reverse_path.len;
+    res = path_up(&reverse_path);
     if (res == 0) {
-        int threshold = time(NULL) - options.refresh_timeout;
-        if (!force && (stbuf.st_mtim.tv_sec > threshold)) {
-            syslog(LOG_DEBUG, "refresh_dir: '%s' refreshed "
-                              "less than %ds ago", path,
-                              options.refresh_timeout);
-            return 0;
-        }
-    } else if (errno == ENOENT) {
-        FILE *last_update_file = fopen(last_update_path, "w");
-        if (!last_update_file) {
-            syslog(LOG_ERR, "refresh_dir: cannot write "
-                            "last-update for '%s': %s",
-                            path, strerror(errno));
-            return -1;
-        }
-        res = fclose(last_update_file);
-        if (res != 0) {
-            syslog(LOG_ERR, "refresh_dir: cannot close "
-                            "last-update for '%s': %s",
-                            path, strerror(errno));
-            return -1;
-        }
+        res = mkdirp(reverse_path.buf);
     }
-    res = utime(last_update_path, NULL);
     if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot update "
-                        "last-update for '%s': %s",
-                        path, strerror(errno));
-        return -1;
-    }
-
-    char query[PATH_MAX];
-    strcpy(query, root_dirname + 1);
-    char backing_path[PATH_MAX];
-    sprintf(backing_path, "%s/_%s", options.backing_dir, query);
-
-    int len = strlen(query);
-    for (int i = 0; i < len; i++) {
-        if (query[i] == '+') {
-            query[i] = '/';
-        }
-    }
-
-    char template[PATH_MAX];
-    strcpy(template, options.backing_dir);
-    strcat(template, "/_tempdir.XXXXXX");
-    char *temp_dirname = mkdtemp(template);
-    if (!temp_dirname) {
-        syslog(LOG_ERR, "refresh_dir: unable to make temporary "
-                        "directory (%s): %s",
-               template, strerror(errno));
+        path_free(&reverse_path);
         return -1;
     }
-
-    char cmd[4 * PATH_MAX];
-    sprintf(cmd, "%s find %s%s --clearlinks --format=links "
-                 "--linksdir='%s' '%s'",
-            options.mu,
-            (options.mu_home ? "--muhome=" : ""),
-            (options.mu_home ? options.mu_home : ""),
-            temp_dirname, query);
-    syslog(LOG_INFO, "refresh_dir: running mu find: '%s'", cmd);
-    res = system(cmd);
-    /* 2 is the documented return code for "no results found".  1024
-     * is the return code seen in practice. */
-    if ((res != 0) && (res != 2) && (res != 1024)) {
-        syslog(LOG_ERR, "refresh_dir: mu find failed");
-        remove_dir(temp_dirname);
-        return -1;
+    /* path_up only terminates the path at its last slash, so the
+     * full path can be restored in place. */
+    reverse_path.buf[reverse_path.len] = '/';
+    reverse_path.len = len;
+
+    /* The mapping may already exist if the query directory was
+     * removed and then made again before the reaper removed the
+     * mappings for the earlier directory (see reap_grave), in which
+     * case the mapping is the same as the one being added. */
+    res = symlink(backing_path, reverse_path.buf);
+    if ((res != 0) && (errno == EEXIST)) {
+        res = 0;
     }
-
-    res = make_backing_dir_if_required(backing_path);
     if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot make backing directory");
-        remove_dir(temp_dirname);
+        syslog(LOG_ERR, "add_link_mapping: failed for '%s' to '%s': %s",
+               backing_path, reverse_path.buf, strerror(errno));
+        path_free(&reverse_path);
         return -1;
     }
 
-    char backing_path_cur[PATH_MAX];
-    strcpy(backing_path_cur, backing_path);
-    strcat(backing_path_cur, "/cur/");
-
-    char temp_path_cur[PATH_MAX];
-    strcpy(temp_path_cur, temp_dirname);
-    strcat(temp_path_cur, "/cur/");
+    path_free(&reverse_path);
+    return 0;
+}
 
-    res = update_backing_dir(backing_path_cur, temp_path_cur);
+/* Remove the link mapping for the maildir path and backing path pair.
+ * This will also remove any empty directories from further up the
+ * reverse path, as required. */
+static int remove_link_mapping(const char *maildir_path,
+                               const char *backing_path)
+{
+    struct path reverse_path = PATH_INIT;
+    int res = get_reverse_path(maildir_path, backing_path,
+                               &reverse_path);
     if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot update backing "
-                        "directory '%s' (from '%s')",
-               backing_path_cur, temp_path_cur);
-        remove_dir(temp_dirname);
+        syslog(LOG_ERR, "remove_link_mapping: "
+                        "can't get reverse path for '%s', '%s'",
+               maildir_path, backing_path);
+        path_free(&reverse_path);
         return -1;
     }
 
-    char backing_path_new[PATH_MAX];
-    strcpy(backing_path_new, backing_path);
-    strcat(backing_path_new, "/new/");
-
-    char temp_path_new[PATH_MAX];
-    strcpy(temp_path_new, temp_dirname);
-    strcat(temp_path_new, "/new/");
-
-    res = update_backing_dir(backing_path_new, temp_path_new);
+    res = unlink(reverse_path.buf);
     if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot update backing "
-                        "directory '%s' (from '%s')",
-               backing_path_new, temp_path_new);
-        remove_dir(temp_dirname);
+        syslog(LOG_ERR, "remove_link_mapping: "
+                        "can't delete reverse path '%s': %s",
+               reverse_path.buf, strerror(errno));
+        path_free(&reverse_path);
         return -1;
     }
+    for (int i = 0; i < 2; i++) {
+        path_up(&reverse_path);
+        res = rmdir(reverse_path.buf);
+        if (res != 0) {
+            syslog(LOG_ERR, "remove_link_mapping: "
+                            "can't remove directory '%s': %s",
+                   reverse_path.buf, strerror(errno));
+            path_free(&reverse_path);
+            return -1;
+        }
+    }
 
-    char tempdir_part[PATH_MAX];
-    strcpy(tempdir_part, temp_dirname);
-    strcat(tempdir_part, "/new");
-    res = rmdir(tempdir_part);
-    if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot remove temp/new: %s",
-               strerror(errno));
-        remove_dir(temp_dirname);
+    size_t reverse_len = strlen(backing_dir_reverse);
+    for (;;) {
+        if ((path_up(&reverse_path) != 0)
+                || (reverse_path.len <= reverse_len)) {
+            break;
+        }
+
+        DIR *reverse_handle = opendir(reverse_path.buf);
+        if (!reverse_handle) {
+            syslog(LOG_ERR, "remove_link_mapping: unable "
+                            "to open directory '%s'",
+                   reverse_path.buf);
+            path_free(&reverse_path);
+            return -1;
+        }
+        struct dirent *dent;
+        int count = 0;
+        while ((dent = readdir(reverse_handle)) != NULL) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            count++;
+            break;
+        }
+        closedir(reverse_handle);
+        if (count != 0) {
+            break;
+        }
+        res = rmdir(reverse_path.buf);
+        if (res != 0) {
+            syslog(LOG_ERR, "remove_link_mapping: "
+                            "can't remove top level '%s': %s",
+                   reverse_path.buf, strerror(errno));
+            path_free(&reverse_path);
+            return -1;
+        }
+        /* Once the message's own directory has been removed, it is
+         * no longer in any query directory. */
+        if (reverse_path.len == reverse_len + strlen(maildir_path)) {
+            forget_identity(maildir_path);
+        }
+    }
+
+    path_free(&reverse_path);
+    return 0;
+}
+
+/* A change to the contents of a query directory.  op is 'A' for a
+ * message that has been added, 'D' for one that has been removed, and
+ * 'R' for one that has been renamed (e.g. by changing its flags).
+ * path is relative to the query directory (e.g. "cur/<name>"), as is
+ * new_path, which is only set for renames. */
+struct change {
+    uint64_t seq;
+    char op;
+    char *path;
+    char *new_path;
+};
+
+/* The change log for a query directory, as a ring buffer of its most
+ * recent CHANGE_LOG_SIZE changes.  Changes with sequence numbers from
+ * visible_seq onwards were made to a generation that has not yet been
+ * published, and are not reported.  dropped_seq is the sequence number
+ * of the most recent change that is no longer in the log, so that
+ * changes after an earlier cursor cannot be reported. */
+struct change_log {
+    struct change *entries;
+    size_t start;
+    size_t count;
+    uint64_t next_seq;
+    uint64_t visible_seq;
+    uint64_t dropped_seq;
+};
+
+/* A map from query name to change log. */
+static struct table change_logs;
+static pthread_mutex_t change_logs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Get the change log for the query directory name, creating it if
+ * necessary.  The sequence numbers for a new log start from the
+ * current time in microseconds, so that they continue to increase if
+ * fsmu is restarted.  The caller must hold change_logs_mutex. */
+static struct change_log *get_change_log(const char *name)
+{
+    struct change_log *log = table_get(&change_logs, name);
+    if (log) {
+        return log;
+    }
+    log = calloc(1, sizeof(struct change_log));
+    if (!log || (table_put(&change_logs, name, log, NULL) != 0)) {
+        free(log);
+        return NULL;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    log->next_seq = ((uint64_t) ts.tv_sec * 1000000)
+                        + (ts.tv_nsec / 1000);
+    log->visible_seq = log->next_seq;
+    log->dropped_seq = log->next_seq - 1;
+    return log;
+}
+
+/* Free the change log for the query directory name. */
+static void remove_change_log(const char *name)
+{
+    pthread_mutex_lock(&change_logs_mutex);
+    struct change_log *log = table_remove(&change_logs, name);
+    pthread_mutex_unlock(&change_logs_mutex);
+    if (!log) {
+        return;
+    }
+    for (size_t i = 0; i < log->count; i++) {
+        struct change *change =
+            &log->entries[(log->start + i) % CHANGE_LOG_SIZE];
+        free(change->path);
+        free(change->new_path);
+    }
+    free(log->entries);
+    free(log);
+}
+
+/* Record a change to the query directory containing backing_path, a
+ * path of the form "<backing-dir>/_<query>/<cur|new>/<name>".  For a
+ * rename, new_backing_path is the path after the rename.  If pending
+ * is set, then the change is part of a generation that has not yet
+ * been published, and it is not reported until publish_changes is
+ * called. */
+static void log_change(char op, const char *backing_path,
+                       const char *new_backing_path, int pending)
+{
+    size_t prefix_len = strlen(options.backing_dir) + 2;
+    const char *rel = last_segments(backing_path, strlen(backing_path), 2);
+    const char *new_rel =
+        (new_backing_path
+            ? last_segments(new_backing_path, strlen(new_backing_path), 2)
+            : NULL);
+    if (!rel || (rel <= backing_path + prefix_len)
+            || (new_backing_path && !new_rel)
+            || (strncmp(backing_path, options.backing_dir,
+                        prefix_len - 2) != 0)
+            || (strncmp(backing_path + prefix_len - 2, "/_", 2) != 0)) {
+        return;
+    }
+    char *name = strndup(backing_path + prefix_len,
+                         rel - (backing_path + prefix_len));
+    char *path = strdup(rel + 1);
+    char *new_path = (new_rel ? strdup(new_rel + 1) : NULL);
+    if (!name || !path || (new_rel && !new_path)) {
+        free(name);
+        free(path);
+        free(new_path);
+        return;
+    }
+
+    pthread_mutex_lock(&change_logs_mutex);
+    struct change_log *log = get_change_log(name);
+    free(name);
+    if (log && !log->entries) {
+        log->entries = calloc(CHANGE_LOG_SIZE, sizeof(struct change));
+    }
+    if (!log || !log->entries) {
+        pthread_mutex_unlock(&change_logs_mutex);
+        free(path);
+        free(new_path);
+        return;
+    }
+    if (log->count == CHANGE_LOG_SIZE) {
+        struct change *oldest = &log->entries[log->start];
+        log->dropped_seq = oldest->seq;
+        free(oldest->path);
+        free(oldest->new_path);
+        log->start = (log->start + 1) % CHANGE_LOG_SIZE;
+        log->count--;
+    }
+    struct change *change =
+        &log->entries[(log->start + log->count) % CHANGE_LOG_SIZE];
+    change->seq = log->next_seq++;
+    change->op = op;
+    change->path = path;
+    change->new_path = new_path;
+    log->count++;
+    if (!pending) {
+        log->visible_seq = log->next_seq;
+    }
+    pthread_mutex_unlock(&change_logs_mutex);
+}
+
+/* Report the pending changes for the query directory name, once the
+ * generation containing them has been published. */
+static void publish_changes(const char *name)
+{
+    pthread_mutex_lock(&change_logs_mutex);
+    struct change_log *log = table_get(&change_logs, name);
+    if (log) {
+        log->visible_seq = log->next_seq;
+    }
+    pthread_mutex_unlock(&change_logs_mutex);
+}
+
+/* Get the sequence number of the next change to be reported for the
+ * query directory name, or 0 if it has no change log. */
+static uint64_t get_change_seq(const char *name)
+{
+    pthread_mutex_lock(&change_logs_mutex);
+    struct change_log *log = table_get(&change_logs, name);
+    uint64_t seq = (log ? log->visible_seq : 0);
+    pthread_mutex_unlock(&change_logs_mutex);
+    return seq;
+}
+
+/* Discard the pending changes for the query directory name, if the
+ * generation containing them could not be published. */
+static void discard_changes(const char *name)
+{
+    pthread_mutex_lock(&change_logs_mutex);
+    struct change_log *log = table_get(&change_logs, name);
+    while (log && (log->count > 0)) {
+        struct change *newest =
+            &log->entries[(log->start + log->count - 1)
+                              % CHANGE_LOG_SIZE];
+        if (newest->seq < log->visible_seq) {
+            break;
+        }
+        free(newest->path);
+        free(newest->new_path);
+        log->count--;
+    }
+    pthread_mutex_unlock(&change_logs_mutex);
+}
+
+/* Write the changes for the query directory name to buf.  The first
+ * line is "seq <n>", where n is the sequence number of the most recent
+ * change.  If has_cursor is set, then each change after cursor follows,
+ * as a line of the form "<seq> <op> <path> [<new path>]", unless some
+ * of those changes are no longer in the log, in which case the only
+ * line is "reset <n>". */
+static int format_changes(const char *name, int has_cursor,
+                          uint64_t cursor, struct path *buf)
+{
+    pthread_mutex_lock(&change_logs_mutex);
+    struct change_log *log = get_change_log(name);
+    if (!log) {
+        pthread_mutex_unlock(&change_logs_mutex);
+        return -1;
+    }
+    uint64_t latest = log->visible_seq - 1;
+    int reset = (has_cursor
+                    && ((cursor < log->dropped_seq) || (cursor > latest)));
+    int res = path_setf(buf, "%s %llu\n", (reset ? "reset" : "seq"),
+                        (unsigned long long) latest);
+    for (size_t i = 0; has_cursor && !reset && (res == 0)
+                           && (i < log->count); i++) {
+        struct change *change =
+            &log->entries[(log->start + i) % CHANGE_LOG_SIZE];
+        if ((change->seq <= cursor) || (change->seq > latest)) {
+            continue;
+        }
+        res = path_appendf(buf, "%llu %c %s%s%s\n",
+                           (unsigned long long) change->seq, change->op,
+                           change->path,
+                           (change->new_path ? " " : ""),
+                           (change->new_path ? change->new_path : ""));
+    }
+    pthread_mutex_unlock(&change_logs_mutex);
+
+    return res;
+}
+
+/* A message added to a query directory by a refresh, which may be
+ * prefetched into the page cache (see --prefetch). */
+struct prefetch_entry {
+    char *maildir_path;
+    off_t size;
+};
+
+/* The messages added to a query directory by a refresh. */
+struct prefetch_list {
+    struct prefetch_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+/* Add the message at maildir_path, of the given size, to list.  Errors
+ * are ignored, since prefetching is only an optimisation. */
+static void add_prefetch(struct prefetch_list *list,
+                         const char *maildir_path, off_t size)
+{
+    if (list->count == list->capacity) {
+        size_t new_capacity = (list->capacity ? list->capacity * 2 : 64);
+        struct prefetch_entry *new_entries =
+            realloc(list->entries,
+                    new_capacity * sizeof(struct prefetch_entry));
+        if (!new_entries) {
+            return;
+        }
+        list->entries = new_entries;
+        list->capacity = new_capacity;
+    }
+    char *path_copy = strdup(maildir_path);
+    if (!path_copy) {
+        return;
+    }
+    list->entries[list->count].maildir_path = path_copy;
+    list->entries[list->count].size = size;
+    list->count++;
+}
+
+/* Free the entries in list, leaving it empty. */
+static void clear_prefetch(struct prefetch_list *list)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].maildir_path);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+/* The numbers of bytes of messages that the kernel has accepted
+ * requests to prefetch since fsmu started, in total and from "new"
+ * directories (see run_prefetch). */
+static struct {
+    pthread_mutex_t mutex;
+    uint64_t bytes;
+    uint64_t new_bytes;
+} prefetch_totals = {
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Returns a boolean indicating whether the message at maildir_path is
+ * in the "new" directory of its maildir. */
+static int is_new_message(const char *maildir_path)
+{
+    const char *dir = last_segments(maildir_path, strlen(maildir_path), 2);
+    return (dir && (strncmp(dir, "/new/", 5) == 0));
+}
+
+/* Ask the kernel to read the messages in list into the page cache, so
+ * that the client's reads of them do not wait on the disk, until
+ * budget bytes have been requested.  Messages in "new" directories
+ * are requested first, since they are the ones most likely to be read
+ * next.  Returns the number of bytes requested. */
+static off_t run_prefetch(struct prefetch_list *list, off_t budget)
+{
+    off_t used = 0;
+    uint64_t prefetched = 0;
+    uint64_t prefetched_new = 0;
+    int full = 0;
+    for (int pass = 0; (pass < 2) && !full; pass++) {
+        for (size_t i = 0; i < list->count; i++) {
+            struct prefetch_entry *entry = &list->entries[i];
+            if (is_new_message(entry->maildir_path) != (pass == 0)) {
+                continue;
+            }
+            if (used + entry->size > budget) {
+                full = 1;
+                break;
+            }
+            int fd = open(entry->maildir_path, O_RDONLY);
+            if (fd == -1) {
+                continue;
+            }
+            int res = posix_fadvise(fd, 0, entry->size,
+                                    POSIX_FADV_WILLNEED);
+            if (res != 0) {
+                syslog(LOG_DEBUG, "prefetch: unable to prefetch '%s': %s",
+                       entry->maildir_path, strerror(res));
+            } else {
+                prefetched += entry->size;
+                prefetched_new += ((pass == 0) ? entry->size : 0);
+            }
+            close(fd);
+            used += entry->size;
+        }
+    }
+
+    pthread_mutex_lock(&prefetch_totals.mutex);
+    prefetch_totals.bytes += prefetched;
+    prefetch_totals.new_bytes += prefetched_new;
+    pthread_mutex_unlock(&prefetch_totals.mutex);
+    return used;
+}
+
+/* Move the links in temp_path (the "cur" or "new" directory of a
+ * search results directory) into gen_dir (the same directory in a
+ * generation of a query directory), and add link mappings for them,
+ * by way of their paths in backing_dir.  If pending is set, then the
+ * changes are not reported until the generation is published (see
+ * log_change).  The number of links moved is added to added, if it is
+ * not NULL, and the messages are added to prefetch, if it is not NULL.
+ * The caller must hold mapping_mutex. */
+static int add_results(const char *backing_dir, const char *temp_path,
+                       const char *gen_dir, int pending, size_t *added,
+                       struct prefetch_list *prefetch)
+{
+    struct dirent *dent;
+    struct stat stbuf;
+
+    struct path temp_path_ent = PATH_INIT;
+    struct path backing_dir_ent = PATH_INIT;
+    struct path gen_dir_ent = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    if ((path_set(&temp_path_ent, temp_path) != 0)
+            || (path_set(&backing_dir_ent, backing_dir) != 0)
+            || (path_set(&gen_dir_ent, gen_dir) != 0)) {
+        path_free(&temp_path_ent);
+        path_free(&backing_dir_ent);
+        path_free(&gen_dir_ent);
+        return -1;
+    }
+    size_t temp_len = temp_path_ent.len;
+    size_t backing_len = backing_dir_ent.len;
+    size_t gen_len = gen_dir_ent.len;
+    int error = 0;
+
+    DIR *temp_dir_handle = opendir(temp_path);
+    if (!temp_dir_handle) {
+        syslog(LOG_ERR, "add_results: cannot open '%s': %s",
+               temp_path, strerror(errno));
+        error = 1;
+    }
+    while (!error && ((dent = readdir(temp_dir_handle)) != NULL)) {
+        if (is_upwards(dent->d_name)) {
+            continue;
+        }
+        path_truncate(&backing_dir_ent, backing_len);
+        path_truncate(&temp_path_ent, temp_len);
+        path_truncate(&gen_dir_ent, gen_len);
+        if ((path_append(&backing_dir_ent, dent->d_name) != 0)
+                || (path_append(&temp_path_ent, dent->d_name) != 0)
+                || (path_append(&gen_dir_ent, dent->d_name) != 0)) {
+            error = 1;
+            break;
+        }
+
+        int res = rename(temp_path_ent.buf, gen_dir_ent.buf);
+        if (res != 0) {
+            syslog(LOG_ERR, "add_results: unable to "
+                            "rename link ('%s' -> '%s'): %s",
+                   temp_path_ent.buf, gen_dir_ent.buf,
+                   strerror(errno));
+            error = 1;
+            break;
+        }
+
+        res = path_readlink(&maildir_path, gen_dir_ent.buf);
+        if (res != 0) {
+            syslog(LOG_ERR, "add_results: unable to read "
+                            "link for '%s': %s",
+                   gen_dir_ent.buf, strerror(errno));
+            error = 1;
+            break;
+        }
+
+        if (stat(maildir_path.buf, &stbuf) == 0) {
+            record_identity(maildir_path.buf, &stbuf);
+            if (prefetch) {
+                add_prefetch(prefetch, maildir_path.buf, stbuf.st_size);
+            }
+        }
+        FSMU_PROBE(add_link_mapping_entry, backing_dir_ent.buf);
+        uint64_t start = trace_now();
+        add_link_mapping(maildir_path.buf, backing_dir_ent.buf);
+        link_mapping_ns += trace_now() - start;
+        FSMU_PROBE(add_link_mapping_return, backing_dir_ent.buf);
+        log_change('A', backing_dir_ent.buf, NULL, pending);
+        if (added) {
+            (*added)++;
+        }
+    }
+    if (temp_dir_handle) {
+        closedir(temp_dir_handle);
+    }
+
+    path_free(&temp_path_ent);
+    path_free(&backing_dir_ent);
+    path_free(&gen_dir_ent);
+    path_free(&maildir_path);
+    return (error ? -1 : 0);
+}
+
+/* Populate gen_dir (the "cur" or "new" directory of a new generation
+ * of a query directory) from the search results directory (temp_path)
+ * and the same directory in the current generation (backing_dir),
+ * which is left unchanged.  An entry that is in both keeps its current
+ * link, by way of a hard link to it.  Since the backing_dir paths also
+ * refer to the new generation once it is published, link mappings are
+ * only added or removed for entries that have been added or removed.
+ * The messages for added entries are added to prefetch, if it is not
+ * NULL.  The caller must hold mapping_mutex. */
+static int update_backing_dir(const char *backing_dir,
+                              const char *temp_path,
+                              const char *gen_dir,
+                              struct prefetch_list *prefetch)
+{
+    struct dirent *dent;
+    struct stat stbuf;
+
+    /* The directory paths are set once, and each entry's name is
+     * appended to them in turn. */
+    struct path temp_path_ent = PATH_INIT;
+    struct path backing_dir_ent = PATH_INIT;
+    struct path gen_dir_ent = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    if ((path_set(&temp_path_ent, temp_path) != 0)
+            || (path_set(&backing_dir_ent, backing_dir) != 0)
+            || (path_set(&gen_dir_ent, gen_dir) != 0)) {
+        path_free(&temp_path_ent);
+        path_free(&backing_dir_ent);
+        path_free(&gen_dir_ent);
+        return -1;
+    }
+    size_t temp_len = temp_path_ent.len;
+    size_t backing_len = backing_dir_ent.len;
+    size_t gen_len = gen_dir_ent.len;
+    int error = 0;
+
+    /* The backing directory will not exist if this is the first
+     * refresh. */
+    DIR *backing_dir_handle = opendir(backing_dir);
+    if (!backing_dir_handle && (errno != ENOENT)) {
+        syslog(LOG_ERR, "update_backing_dir: cannot open '%s': %s",
+               backing_dir, strerror(errno));
+        error = 1;
+    }
+    while (!error && backing_dir_handle
+            && ((dent = readdir(backing_dir_handle)) != NULL)) {
+        if (is_upwards(dent->d_name)) {
+            continue;
+        }
+        path_truncate(&temp_path_ent, temp_len);
+        path_truncate(&backing_dir_ent, backing_len);
+        if ((path_append(&temp_path_ent, dent->d_name) != 0)
+                || (path_append(&backing_dir_ent, dent->d_name) != 0)) {
+            error = 1;
+            break;
+        }
+        memset(&stbuf, 0, sizeof(struct stat));
+        int res = stat(temp_path_ent.buf, &stbuf);
+        if (res == 0) {
+            if (path_readlink(&maildir_path, temp_path_ent.buf) == 0) {
+                record_identity(maildir_path.buf, &stbuf);
+            }
+            res = unlink(temp_path_ent.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "update_backing_dir: unable to remove link "
+                                "'%s' that already exists: %s",
+                       dent->d_name, strerror(errno));
+                error = 1;
+                break;
+            }
+            path_truncate(&gen_dir_ent, gen_len);
+            if (path_append(&gen_dir_ent, dent->d_name) != 0) {
+                error = 1;
+                break;
+            }
+            res = linkat(AT_FDCWD, backing_dir_ent.buf,
+                         AT_FDCWD, gen_dir_ent.buf, 0);
+            if (res != 0) {
+                syslog(LOG_ERR, "update_backing_dir: unable to link "
+                                "'%s' into new generation: %s",
+                       backing_dir_ent.buf, strerror(errno));
+                error = 1;
+                break;
+            }
+        } else {
+            res = path_readlink(&maildir_path, backing_dir_ent.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "update_backing_dir: unable to read "
+                                "link for '%s': %s",
+                       backing_dir_ent.buf, strerror(errno));
+                error = 1;
+                break;
+            }
+
+            res = remove_link_mapping(maildir_path.buf,
+                                      backing_dir_ent.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "update_backing_dir: unable "
+                                "to remove link mapping");
+                error = 1;
+                break;
+            }
+            log_change('D', backing_dir_ent.buf, NULL, 1);
+        }
+    }
+    if (backing_dir_handle) {
+        closedir(backing_dir_handle);
+    }
+
+    path_free(&temp_path_ent);
+    path_free(&backing_dir_ent);
+    path_free(&gen_dir_ent);
+    path_free(&maildir_path);
+    if (error) {
+        return -1;
+    }
+
+    return add_results(backing_dir, temp_path, gen_dir, 1, NULL,
+                       prefetch);
+}
+
+/* Remove a temporary mail directory and its contents recursively.
+ * This will remove as many files/directories as possible before
+ * returning. */
+static int remove_dir(const char *dir_path)
+{
+    DIR *dir_handle = opendir(dir_path);
+    if (!dir_handle) {
+        syslog(LOG_ERR, "remove_dir: cannot open '%s': %s",
+               dir_handle, strerror(errno));
+        return -1;
+    }
+    struct path path = PATH_INIT;
+    if (path_set(&path, dir_path) != 0) {
+        closedir(dir_handle);
+        return -1;
+    }
+    size_t dir_len = path.len;
+    struct dirent *dent;
+    struct stat stbuf;
+    while ((dent = readdir(dir_handle)) != NULL) {
+        if (is_upwards(dent->d_name)) {
+            continue;
+        }
+        path_truncate(&path, dir_len);
+        if (path_push(&path, dent->d_name) != 0) {
+            continue;
+        }
+        int res = lstat(path.buf, &stbuf);
+        if (res != 0) {
+            syslog(LOG_INFO, "remove_dir: cannot lstat '%s': %s",
+                   path.buf, strerror(errno));
+        } else if (S_ISDIR(stbuf.st_mode)) {
+            int res = remove_dir(path.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "remove_dir: cannot remove '%s': %s",
+                       path.buf, strerror(errno));
+            }
+        } else {
+            int res = unlink(path.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "remove_dir: cannot unlink '%s': %s",
+                       path.buf, strerror(errno));
+            }
+        }
+    }
+    closedir(dir_handle);
+    path_free(&path);
+
+    int res = rmdir(dir_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "remove_dir: cannot unlink directory '%s': %s",
+               dir_path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The state of a generation: a complete set of results for a query
+ * directory, in a directory named "_gen.XXXXXX" in the backing
+ * directory, which is published by pointing the query directory's
+ * "_<query>" link at it.  readers is the number of readers using the
+ * generation, and retired is set once the generation has been
+ * replaced, so that it is removed when the last reader is finished
+ * with it.  If the query directory has been removed, then buried_name
+ * is its name, and the generation is moved to the graveyard (see
+ * bury_generation) rather than being removed. */
+struct generation {
+    int readers;
+    int retired;
+    char *buried_name;
+};
+
+/* A map from generation directory name to generation state.  Only
+ * generations that have readers have entries.  generations_mutex is
+ * also held while a generation is being published, so that a reader
+ * cannot acquire a generation that has already been retired. */
+static struct table generations;
+static pthread_mutex_t generations_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The header cache for a generation: a file named "<gen>.headers" in
+ * the backing directory, alongside the generation directory rather
+ * than within it so that it is not listed as part of the query
+ * directory, holding the start of each message in the generation (see
+ * build_header_cache), which is mapped into memory when it is first
+ * used.  The file consists of a header_cache_file
+ * header, followed by the cached data, followed by the index of
+ * entries, sorted by device and inode number. */
+struct header_cache_file {
+    char magic[8];
+    uint64_t count;
+    uint64_t index_offset;
+};
+
+/* An entry in a header cache index.  dev, ino, mtime_sec, mtime_nsec
+ * and size are those of the message when it was cached, and offset
+ * and len are the position of the cached data within the file. */
+struct header_cache_entry {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t len;
+};
+
+#define HEADER_CACHE_MAGIC "fsmuhc01"
+
+/* A mapped header cache. */
+struct header_cache {
+    char *map;
+    size_t size;
+    const struct header_cache_entry *entries;
+    uint64_t count;
+};
+
+/* A map from generation directory name to mapped header cache.  An
+ * entry is removed when its generation is removed, which only happens
+ * once the generation has no readers, so a reader can use a header
+ * cache without holding header_caches_mutex. */
+static struct table header_caches;
+static pthread_mutex_t header_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write the path of the header cache file for the generation gen to
+ * buf. */
+static int get_header_cache_path(const char *gen, struct path *buf)
+{
+    return path_setf(buf, "%s/%s.headers", options.backing_dir, gen);
+}
+
+/* Get the header cache for the generation gen, mapping it if
+ * necessary.  Returns NULL if the generation has no header cache (yet,
+ * or at all). */
+static struct header_cache *get_header_cache(const char *gen)
+{
+    pthread_mutex_lock(&header_caches_mutex);
+    struct header_cache *cache = table_get(&header_caches, gen);
+    if (cache) {
+        pthread_mutex_unlock(&header_caches_mutex);
+        return cache;
+    }
+
+    struct path cache_path = PATH_INIT;
+    int fd = -1;
+    struct stat stbuf;
+    char *map = MAP_FAILED;
+    if ((get_header_cache_path(gen, &cache_path) == 0)
+            && ((fd = open(cache_path.buf, O_RDONLY)) != -1)
+            && (fstat(fd, &stbuf) == 0)
+            && ((size_t) stbuf.st_size >= sizeof(struct header_cache_file))) {
+        map = mmap(NULL, stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    path_free(&cache_path);
+    if (map == MAP_FAILED) {
+        pthread_mutex_unlock(&header_caches_mutex);
+        return NULL;
+    }
+
+    const struct header_cache_file *header =
+        (const struct header_cache_file *) map;
+    size_t size = stbuf.st_size;
+    if ((memcmp(header->magic, HEADER_CACHE_MAGIC,
+                sizeof(header->magic)) != 0)
+            || (header->index_offset > size)
+            || (header->count > ((size - header->index_offset)
+                                  / sizeof(struct header_cache_entry)))) {
+        syslog(LOG_ERR, "header_cache: '%s' is invalid", gen);
+        munmap(map, size);
+        pthread_mutex_unlock(&header_caches_mutex);
+        return NULL;
+    }
+    cache = malloc(sizeof(struct header_cache));
+    if (!cache || (table_put(&header_caches, gen, cache, NULL) != 0)) {
+        free(cache);
+        munmap(map, size);
+        pthread_mutex_unlock(&header_caches_mutex);
+        return NULL;
+    }
+    cache->map = map;
+    cache->size = size;
+    cache->entries =
+        (const struct header_cache_entry *) (map + header->index_offset);
+    cache->count = header->count;
+    pthread_mutex_unlock(&header_caches_mutex);
+    return cache;
+}
+
+/* Unmap the header cache for the generation gen, if it is mapped, and
+ * remove its file.  Called when the generation is removed. */
+static void remove_header_cache(const char *gen)
+{
+    pthread_mutex_lock(&header_caches_mutex);
+    struct header_cache *cache = table_remove(&header_caches, gen);
+    pthread_mutex_unlock(&header_caches_mutex);
+    if (cache) {
+        munmap(cache->map, cache->size);
+        free(cache);
+    }
+    struct path cache_path = PATH_INIT;
+    if ((get_header_cache_path(gen, &cache_path) == 0)
+            && (unlink(cache_path.buf) != 0) && (errno != ENOENT)) {
+        syslog(LOG_ERR, "header_cache: unable to remove '%s': %s",
+               cache_path.buf, strerror(errno));
+    }
+    path_free(&cache_path);
+}
+
+/* Find the entry for the message with the attributes in stbuf in
+ * cache.  Returns NULL if the message is not in the cache, or if it
+ * has changed since it was cached. */
+static const struct header_cache_entry *
+find_header_cache_entry(struct header_cache *cache,
+                        const struct stat *stbuf)
+{
+    uint64_t dev = stbuf->st_dev;
+    uint64_t ino = stbuf->st_ino;
+    uint64_t low = 0;
+    uint64_t high = cache->count;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        const struct header_cache_entry *entry = &cache->entries[mid];
+        if ((entry->dev < dev)
+                || ((entry->dev == dev) && (entry->ino < ino))) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == cache->count) {
+        return NULL;
+    }
+    const struct header_cache_entry *entry = &cache->entries[low];
+    const struct header_cache_file *header =
+        (const struct header_cache_file *) cache->map;
+    if ((entry->dev != dev) || (entry->ino != ino)
+            || (entry->mtime_sec != stbuf->st_mtim.tv_sec)
+            || (entry->mtime_nsec != stbuf->st_mtim.tv_nsec)
+            || (entry->size != (uint64_t) stbuf->st_size)
+            || (entry->offset > header->index_offset)
+            || (entry->len > header->index_offset - entry->offset)) {
+        return NULL;
+    }
+    return entry;
+}
+
+/* Remove the generation directory gen. */
+static void remove_generation(const char *gen)
+{
+    remove_header_cache(gen);
+    struct path gen_path = PATH_INIT;
+    if (path_setf(&gen_path, "%s/%s", options.backing_dir, gen) == 0) {
+        remove_dir(gen_path.buf);
+    }
+    path_free(&gen_path);
+}
+
+/* The reaper, a background thread that removes the generations of
+ * removed query directories, along with their link mappings.  Those
+ * generations are moved into the "__graveyard" directory in the backing
+ * directory, each as "__graveyard/XXXXXX/_<query>", so that the last
+ * three segments of the path of each link in the generation are the
+ * same as those of the link's original backing path.  (The graveyard's
+ * name would be the results link of the query directory "_graveyard",
+ * which validate_query rejects, so it cannot be that of a query
+ * directory's results.)  mutex is held
+ * while entries are added to the graveyard, and pending is set when
+ * there may be entries to be reaped. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int pending;
+    int started;
+    int stop;
+} reaper = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+/* A map from query directory name to the number of entries for that
+ * query directory in the graveyard (including generations that will
+ * be moved there once their last reader is finished with them), so
+ * that link mappings that refer to those entries can be ignored.  The
+ * caller must hold mapping_mutex when using this table. */
+static struct table buried_queries;
+
+/* Record that the query directory name has another entry in the
+ * graveyard.  The caller must hold mapping_mutex. */
+static void add_buried_query(const char *name)
+{
+    int *count = table_get(&buried_queries, name);
+    if (count) {
+        (*count)++;
+        return;
+    }
+    count = malloc(sizeof(int));
+    if (!count) {
+        return;
+    }
+    *count = 1;
+    if (table_put(&buried_queries, name, count, NULL) != 0) {
+        free(count);
+    }
+}
+
+/* Record that an entry in the graveyard for the query directory name
+ * has been reaped.  The caller must hold mapping_mutex. */
+static void remove_buried_query(const char *name)
+{
+    int *count = table_get(&buried_queries, name);
+    if (count && (--(*count) == 0)) {
+        free(table_remove(&buried_queries, name));
+    }
+}
+
+/* Returns a boolean indicating whether the query directory name has
+ * entries in the graveyard.  The caller must hold mapping_mutex. */
+static int is_buried_query(const char *name)
+{
+    return (table_get(&buried_queries, name) != NULL);
+}
+
+/* Move the generation gen of the removed query directory name into
+ * the graveyard, and wake the reaper. */
+static int bury_generation(const char *gen, const char *name)
+{
+    remove_header_cache(gen);
+    struct path gen_path = PATH_INIT;
+    struct path grave_path = PATH_INIT;
+    if ((path_setf(&gen_path, "%s/%s", options.backing_dir, gen) != 0)
+            || (path_setf(&grave_path, "%s/__graveyard",
+                          options.backing_dir) != 0)) {
+        path_free(&gen_path);
+        path_free(&grave_path);
+        return -1;
+    }
+
+    /* The reaper only looks at the graveyard while holding the mutex,
+     * so it does not see the entry before the generation is in it. */
+    pthread_mutex_lock(&reaper.mutex);
+    int res = 0;
+    if ((mkdir(grave_path.buf, S_IRWXU) != 0) && (errno != EEXIST)) {
+        res = -1;
+    }
+    if ((res == 0)
+            && ((path_append(&grave_path, "/XXXXXX") != 0)
+                || !mkdtemp(grave_path.buf))) {
+        res = -1;
+    }
+    if (res == 0) {
+        size_t grave_len = grave_path.len;
+        res = path_appendf(&grave_path, "/_%s", name);
+        if ((res == 0) && (rename(gen_path.buf, grave_path.buf) != 0)) {
+            path_truncate(&grave_path, grave_len);
+            rmdir(grave_path.buf);
+            res = -1;
+        }
+    }
+    if (res == 0) {
+        reaper.pending = 1;
+        pthread_cond_signal(&reaper.cond);
+    }
+    pthread_mutex_unlock(&reaper.mutex);
+
+    if (res != 0) {
+        syslog(LOG_ERR, "bury_generation: unable to move '%s' to the "
+                        "graveyard: %s",
+               gen_path.buf, strerror(errno));
+    }
+    path_free(&gen_path);
+    path_free(&grave_path);
+    return res;
+}
+
+/* Set buf to the path of rest (e.g. "/cur", or "") within the current
+ * generation of the query directory name, and acquire that generation,
+ * so that it is not removed while it is in use.  Returns the name of
+ * the generation, to be passed to release_generation, or NULL if the
+ * query directory has no generation, in which case buf is set to the
+ * path within "_<name>". */
+static char *acquire_generation(const char *name, const char *rest,
+                                struct path *buf)
+{
+    struct path link_path = PATH_INIT;
+    struct path gen = PATH_INIT;
+    struct generation *generation = NULL;
+    if (path_setf(&link_path, "%s/_%s", options.backing_dir, name) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&generations_mutex);
+    if (path_readlink(&gen, link_path.buf) == 0) {
+        generation = table_get(&generations, gen.buf);
+        if (!generation) {
+            generation = calloc(1, sizeof(struct generation));
+            if (generation
+                    && (table_put(&generations, gen.buf, generation,
+                                  NULL) != 0)) {
+                free(generation);
+                generation = NULL;
+            }
+        }
+        if (generation) {
+            generation->readers++;
+        }
+    }
+    pthread_mutex_unlock(&generations_mutex);
+
+    if (!generation) {
+        path_free(&gen);
+        path_setf(buf, "%s%s", link_path.buf, rest);
+        path_free(&link_path);
+        return NULL;
+    }
+    path_free(&link_path);
+    path_setf(buf, "%s/%s%s", options.backing_dir, gen.buf, rest);
+    return gen.buf;
+}
+
+/* Release a generation acquired by way of acquire_generation, and free
+ * gen.  If this was the last reader of a retired generation, then the
+ * generation is removed, or moved to the graveyard if its query
+ * directory has been removed. */
+static void release_generation(char *gen)
+{
+    if (!gen) {
+        return;
+    }
+    int remove = 0;
+    char *buried_name = NULL;
+    pthread_mutex_lock(&generations_mutex);
+    struct generation *generation = table_get(&generations, gen);
+    if (generation && (--generation->readers == 0)) {
+        remove = generation->retired;
+        buried_name = generation->buried_name;
+        table_remove(&generations, gen);
+        free(generation);
+    }
+    pthread_mutex_unlock(&generations_mutex);
+
+    if (buried_name) {
+        bury_generation(gen, buried_name);
+    } else if (remove) {
+        remove_generation(gen);
+    }
+    free(buried_name);
+    free(gen);
+}
+
+/* Detach the current generation of a query directory from link_path
+ * (the query directory's "_<query>" path), and write its name to buf.
+ * If link_path is a directory (as used by earlier versions), then it
+ * is moved aside and treated as a generation.  Returns an error code if
+ * there is no current generation.  The caller must hold
+ * generations_mutex, and must then replace link_path (or remove it if
+ * it is still present) and retire the generation. */
+static int detach_generation(const char *link_path, struct path *buf)
+{
+    if (path_readlink(buf, link_path) == 0) {
+        return 0;
+    }
+    if (errno != EINVAL) {
+        return -1;
+    }
+    if ((path_setf(buf, "%s/_gen.XXXXXX", options.backing_dir) != 0)
+            || !mkdtemp(buf->buf)
+            || (rmdir(buf->buf) != 0)
+            || (rename(link_path, buf->buf) != 0)) {
+        syslog(LOG_ERR, "detach_generation: unable to move '%s' "
+                        "aside: %s",
+               link_path, strerror(errno));
+        return -1;
+    }
+    const char *gen = basename_view(buf->buf);
+    memmove(buf->buf, gen, strlen(gen) + 1);
+    buf->len = strlen(buf->buf);
+    return 0;
+}
+
+/* Retire the generation gen, and return a boolean indicating whether
+ * it can be removed straight away (i.e. whether it has no readers).
+ * The caller must hold generations_mutex. */
+static int retire_generation(const char *gen)
+{
+    struct generation *generation = table_get(&generations, gen);
+    if (generation) {
+        generation->retired = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/* Publish the generation gen as the current results for the query
+ * directory name, by replacing the "_<name>" link in a single rename,
+ * and retire the previous generation. */
+static int publish_generation(const char *name, const char *gen)
+{
+    struct path link_path = PATH_INIT;
+    struct path temp_link_path = PATH_INIT;
+    struct path old_gen = PATH_INIT;
+    if ((path_setf(&link_path, "%s/_%s", options.backing_dir, name) != 0)
+            || (path_setf(&temp_link_path, "%s/%s/link",
+                          options.backing_dir, gen) != 0)) {
+        path_free(&link_path);
+        path_free(&temp_link_path);
+        return -1;
+    }
+    int res = symlink(gen, temp_link_path.buf);
+    if (res != 0) {
+        syslog(LOG_ERR, "publish_generation: unable to link '%s': %s",
+               temp_link_path.buf, strerror(errno));
+        path_free(&link_path);
+        path_free(&temp_link_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&generations_mutex);
+    int has_old_gen = (detach_generation(link_path.buf, &old_gen) == 0);
+    res = rename(temp_link_path.buf, link_path.buf);
+    int remove = (has_old_gen && (res == 0)
+                    && retire_generation(old_gen.buf));
+    pthread_mutex_unlock(&generations_mutex);
+    if (res != 0) {
+        syslog(LOG_ERR, "publish_generation: unable to publish '%s': %s",
+               link_path.buf, strerror(errno));
+    }
+
+    if (remove) {
+        remove_generation(old_gen.buf);
+    }
+    path_free(&link_path);
+    path_free(&temp_link_path);
+    path_free(&old_gen);
+    return (res == 0) ? 0 : -1;
+}
+
+/* Remove the "_<name>" link for a removed query directory, and retire
+ * its current generation, which is moved to the graveyard once it has
+ * no readers.  The caller must hold mapping_mutex. */
+static int unpublish_generation(const char *name)
+{
+    struct path link_path = PATH_INIT;
+    struct path old_gen = PATH_INIT;
+    if (path_setf(&link_path, "%s/_%s", options.backing_dir, name) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&generations_mutex);
+    int has_old_gen = (detach_generation(link_path.buf, &old_gen) == 0);
+    int res = 0;
+    if (has_old_gen && (unlink(link_path.buf) != 0)
+            && (errno != ENOENT)) {
+        syslog(LOG_ERR, "unpublish_generation: cannot remove '%s': %s",
+               link_path.buf, strerror(errno));
+        res = -1;
+    }
+    int bury = 0;
+    if (has_old_gen && (res == 0)) {
+        add_buried_query(name);
+        bury = retire_generation(old_gen.buf);
+        if (!bury) {
+            struct generation *generation =
+                table_get(&generations, old_gen.buf);
+            generation->buried_name = strdup(name);
+        }
+    }
+    pthread_mutex_unlock(&generations_mutex);
+
+    if (bury) {
+        res = bury_generation(old_gen.buf, name);
+    }
+    path_free(&link_path);
+    path_free(&old_gen);
+    return res;
+}
+
+/* Reap part of the graveyard entry at grave_path: remove up to
+ * REAP_BATCH_SIZE of the links in the "cur" and "new" directories of
+ * the generation in the entry, along with their link mappings, or
+ * remove the entry if it has no links left.  A link mapping is kept if
+ * the query directory has since been made again, and its current
+ * generation has the same link.  Returns 1 if the entry has links
+ * left, and 0 if it has been removed. */
+static int reap_grave(const char *grave_path)
+{
+    DIR *grave_handle = opendir(grave_path);
+    if (!grave_handle) {
+        return 0;
+    }
+    struct path link_path = PATH_INIT;
+    struct dirent *dent;
+    while ((dent = readdir(grave_handle)) != NULL) {
+        if (dent->d_name[0] == '_') {
+            path_setf(&link_path, "%s/%s", grave_path, dent->d_name);
+            break;
+        }
+    }
+    closedir(grave_handle);
+    if (!link_path.buf) {
+        remove_dir(grave_path);
+        return 0;
+    }
+    char *name = strdup(basename_view(link_path.buf) + 1);
+    if (!name) {
+        path_free(&link_path);
+        return 1;
+    }
+
+    struct path live_path = PATH_INIT;
+    struct path reverse_path = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    struct path live_maildir_path = PATH_INIT;
+    const char *subdirs[] = { "cur", "new" };
+    size_t grave_len = link_path.len;
+    int remaining = REAP_BATCH_SIZE;
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    for (int i = 0; (i < 2) && (remaining > 0); i++) {
+        path_truncate(&link_path, grave_len);
+        if (path_push(&link_path, subdirs[i]) != 0) {
+            remaining = 0;
+            break;
+        }
+        size_t dir_len = link_path.len;
+        DIR *dir_handle = opendir(link_path.buf);
+        if (!dir_handle) {
+            continue;
+        }
+        while ((remaining > 0)
+                && ((dent = readdir(dir_handle)) != NULL)) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            path_truncate(&link_path, dir_len);
+            if ((path_push(&link_path, dent->d_name) != 0)
+                    || (path_setf(&live_path, "%s/_%s/%s/%s",
+                                  options.backing_dir, name,
+                                  subdirs[i], dent->d_name) != 0)) {
+                remaining = 0;
+                break;
+            }
+            remaining--;
+            struct stat stbuf;
+            if ((path_readlink(&maildir_path, link_path.buf) == 0)
+                    && ((path_readlink(&live_maildir_path,
+                                       live_path.buf) != 0)
+                        || (strcmp(live_maildir_path.buf,
+                                   maildir_path.buf) != 0))
+                    && (get_reverse_path(maildir_path.buf, link_path.buf,
+                                         &reverse_path) == 0)
+                    && (lstat(reverse_path.buf, &stbuf) == 0)) {
+                remove_link_mapping(maildir_path.buf, link_path.buf);
+            }
+            unlink(link_path.buf);
+        }
+        closedir(dir_handle);
+    }
+    int done = (remaining > 0);
+    if (done) {
+        remove_buried_query(name);
+    }
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    if (done) {
+        remove_dir(grave_path);
+    }
+
+    free(name);
+    path_free(&link_path);
+    path_free(&live_path);
+    path_free(&reverse_path);
+    path_free(&maildir_path);
+    path_free(&live_maildir_path);
+    return (done ? 0 : 1);
+}
+
+/* Call fn with the path of each entry in the graveyard.  Entries that
+ * are added while this is running may or may not be included. */
+static void for_each_grave(void (*fn)(const char *grave_path))
+{
+    struct path grave_path = PATH_INIT;
+    if (path_setf(&grave_path, "%s/__graveyard", options.backing_dir) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&reaper.mutex);
+    DIR *dir_handle = opendir(grave_path.buf);
+    pthread_mutex_unlock(&reaper.mutex);
+    if (!dir_handle) {
+        path_free(&grave_path);
+        return;
+    }
+    size_t dir_len = grave_path.len;
+    struct dirent *dent;
+    for (;;) {
+        pthread_mutex_lock(&reaper.mutex);
+        dent = readdir(dir_handle);
+        int stop = reaper.stop;
+        pthread_mutex_unlock(&reaper.mutex);
+        if (!dent || stop) {
+            break;
+        }
+        if (is_upwards(dent->d_name)) {
+            continue;
+        }
+        path_truncate(&grave_path, dir_len);
+        if (path_push(&grave_path, dent->d_name) == 0) {
+            fn(grave_path.buf);
+        }
+    }
+    closedir(dir_handle);
+    path_free(&grave_path);
+}
+
+/* Remove the graveyard once it is empty, so that nothing is left
+ * behind in the backing directory once the removed query directories
+ * have been reaped.  bury_generation creates it again as needed. */
+static void remove_graveyard(void)
+{
+    struct path grave_path = PATH_INIT;
+    if (path_setf(&grave_path, "%s/__graveyard", options.backing_dir) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&reaper.mutex);
+    if ((rmdir(grave_path.buf) != 0) && (errno != ENOENT)
+            && (errno != ENOTEMPTY) && (errno != EEXIST)) {
+        syslog(LOG_ERR, "reaper: unable to remove '%s': %s",
+               grave_path.buf, strerror(errno));
+    }
+    pthread_mutex_unlock(&reaper.mutex);
+    path_free(&grave_path);
+}
+
+/* Record the query directory of the graveyard entry at grave_path as
+ * being buried (see buried_queries).  Used for entries left over from
+ * a previous run. */
+static void count_grave(const char *grave_path)
+{
+    DIR *grave_handle = opendir(grave_path);
+    if (!grave_handle) {
+        return;
+    }
+    struct dirent *dent;
+    while ((dent = readdir(grave_handle)) != NULL) {
+        if (dent->d_name[0] == '_') {
+            add_buried_query(dent->d_name + 1);
+            break;
+        }
+    }
+    closedir(grave_handle);
+}
+
+/* Reap the graveyard entry at grave_path completely, releasing
+ * mapping_mutex between batches so that other operations can
+ * proceed. */
+static void reap_grave_fully(const char *grave_path)
+{
+    for (;;) {
+        pthread_mutex_lock(&reaper.mutex);
+        int stop = reaper.stop;
+        pthread_mutex_unlock(&reaper.mutex);
+        if (stop || (reap_grave(grave_path) == 0)) {
+            break;
+        }
+    }
+}
+
+/* Returns the offset just past the blank line that ends the header
+ * block of the message start in buf, or 0 if the header block does
+ * not end within the first len bytes. */
+static size_t find_header_end(const char *buf, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (buf[i] != '\n') {
+            continue;
+        }
+        if (buf[i + 1] == '\n') {
+            return i + 2;
+        }
+        if ((i + 2 < len) && (buf[i + 1] == '\r') && (buf[i + 2] == '\n')) {
+            return i + 3;
+        }
+    }
+    return 0;
+}
+
+/* Read the start of the message at path, being of size file_size, into
+ * buf, which has space for limit bytes.  This is the message's header
+ * block, extended to at least --header-cache bytes if it is shorter.
+ * Returns the number of bytes read, or -1 on error. */
+static ssize_t read_message_start(const char *path, off_t file_size,
+                                  char *buf, size_t limit)
+{
+    FILE *message_file = fopen(path, "r");
+    if (!message_file) {
+        return -1;
+    }
+    if ((off_t) limit > file_size) {
+        limit = file_size;
+    }
+    size_t min_len = options.header_cache;
+    size_t len = 0;
+    size_t header_end = 0;
+    while (len < limit) {
+        size_t chunk = limit - len;
+        if (chunk > 4096) {
+            chunk = 4096;
+        }
+        size_t bytes = fread(buf + len, 1, chunk, message_file);
+        if (bytes == 0) {
+            break;
+        }
+        /* The blank line may straddle the chunk boundary. */
+        size_t start = ((len > 2) ? len - 2 : 0);
+        len += bytes;
+        if (!header_end) {
+            size_t end = find_header_end(buf + start, len - start);
+            header_end = (end ? start + end : 0);
+        }
+        if (header_end && (len >= min_len)) {
+            break;
+        }
+    }
+    int error = ferror(message_file);
+    fclose(message_file);
+    if (error) {
+        return -1;
+    }
+    size_t cached = ((header_end > min_len) ? header_end : min_len);
+    return ((cached < len) ? cached : len);
+}
+
+/* Compare header cache entries by device and inode number. */
+static int compare_header_cache_entries(const void *a, const void *b)
+{
+    const struct header_cache_entry *entry_a = a;
+    const struct header_cache_entry *entry_b = b;
+    if (entry_a->dev != entry_b->dev) {
+        return (entry_a->dev < entry_b->dev) ? -1 : 1;
+    }
+    return (entry_a->ino < entry_b->ino) ? -1 : (entry_a->ino > entry_b->ino);
+}
+
+/* Returns a boolean indicating whether the header cache is in use.
+ * Compressed messages are not cached, since reads are of their
+ * decompressed contents. */
+static int use_header_cache(void)
+{
+    return ((options.header_cache > 0) && !options.compressed);
+}
+
+/* Build the header cache for the current generation of the query
+ * directory name.  The start of each message is copied from the
+ * header cache of old_gen, the previous generation, where that has an
+ * up-to-date entry for it, and is otherwise read from the message. */
+static int build_header_cache(const char *name, const char *old_gen)
+{
+    struct path gen_path = PATH_INIT;
+    char *gen = acquire_generation(name, "", &gen_path);
+    if (!gen) {
+        path_free(&gen_path);
+        return -1;
+    }
+    struct header_cache *old_cache =
+        (old_gen ? get_header_cache(old_gen) : NULL);
+
+    size_t limit = HEADER_CACHE_MAX;
+    if ((size_t) options.header_cache > limit) {
+        limit = options.header_cache;
+    }
+    struct path temp_path = PATH_INIT;
+    struct path cache_path = PATH_INIT;
+    struct path message_path = PATH_INIT;
+    char *buf = malloc(limit);
+    FILE *cache_file = NULL;
+    if (!buf
+            || (get_header_cache_path(gen, &cache_path) != 0)
+            || (path_setf(&temp_path, "%s.tmp", cache_path.buf) != 0)
+            || !(cache_file = fopen(temp_path.buf, "w"))) {
+        free(buf);
+        path_free(&temp_path);
+        path_free(&cache_path);
+        path_free(&gen_path);
+        release_generation(gen);
+        return -1;
+    }
+
+    /* The data for each message is written as it is read, with the
+     * index being written after it, and the header last of all. */
+    struct header_cache_file header;
+    memset(&header, 0, sizeof(header));
+    int error = (fwrite(&header, sizeof(header), 1, cache_file) != 1);
+    uint64_t offset = sizeof(header);
+    struct header_cache_entry *entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t reused = 0;
+    const char *subdirs[] = { "cur", "new" };
+    for (int i = 0; (i < 2) && !error; i++) {
+        if (path_setf(&message_path, "%s/%s", gen_path.buf,
+                      subdirs[i]) != 0) {
+            error = 1;
+            break;
+        }
+        size_t dir_len = message_path.len;
+        DIR *dir_handle = opendir(message_path.buf);
+        if (!dir_handle) {
+            continue;
+        }
+        struct dirent *dent;
+        while (!error && ((dent = readdir(dir_handle)) != NULL)) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            path_truncate(&message_path, dir_len);
+            if (path_push(&message_path, dent->d_name) != 0) {
+                error = 1;
+                break;
+            }
+            /* The link is followed to the message itself. */
+            struct stat stbuf;
+            if ((stat(message_path.buf, &stbuf) != 0)
+                    || !S_ISREG(stbuf.st_mode)) {
+                continue;
+            }
+            if (count == capacity) {
+                size_t new_capacity = (capacity ? capacity * 2 : 256);
+                struct header_cache_entry *new_entries =
+                    realloc(entries, new_capacity
+                                         * sizeof(struct header_cache_entry));
+                if (!new_entries) {
+                    error = 1;
+                    break;
+                }
+                entries = new_entries;
+                capacity = new_capacity;
+            }
+
+            const struct header_cache_entry *old_entry =
+                (old_cache ? find_header_cache_entry(old_cache, &stbuf)
+                           : NULL);
+            const char *data = buf;
+            ssize_t len;
+            if (old_entry) {
+                data = old_cache->map + old_entry->offset;
+                len = old_entry->len;
+                reused++;
+            } else {
+                len = read_message_start(message_path.buf, stbuf.st_size,
+                                         buf, limit);
+                if (len < 0) {
+                    continue;
+                }
+            }
+            if ((len > 0)
+                    && (fwrite(data, len, 1, cache_file) != 1)) {
+                error = 1;
+                break;
+            }
+            struct header_cache_entry *entry = &entries[count++];
+            entry->dev = stbuf.st_dev;
+            entry->ino = stbuf.st_ino;
+            entry->mtime_sec = stbuf.st_mtim.tv_sec;
+            entry->mtime_nsec = stbuf.st_mtim.tv_nsec;
+            entry->size = stbuf.st_size;
+            entry->offset = offset;
+            entry->len = len;
+            offset += len;
+        }
+        closedir(dir_handle);
+    }
+
+    /* A message linked to more than once only needs one entry. */
+    if (!error && (count > 0)) {
+        qsort(entries, count, sizeof(struct header_cache_entry),
+              compare_header_cache_entries);
+        size_t unique = 1;
+        for (size_t i = 1; i < count; i++) {
+            if (compare_header_cache_entries(&entries[unique - 1],
+                                             &entries[i]) != 0) {
+                entries[unique++] = entries[i];
+            }
+        }
+        count = unique;
+        error = (fwrite(entries, sizeof(struct header_cache_entry), count,
+                        cache_file) != count);
+    }
+    if (!error) {
+        memcpy(header.magic, HEADER_CACHE_MAGIC, sizeof(header.magic));
+        header.count = count;
+        header.index_offset = offset;
+        error = ((fseek(cache_file, 0, SEEK_SET) != 0)
+                    || (fwrite(&header, sizeof(header), 1,
+                               cache_file) != 1));
+    }
+    error |= (fclose(cache_file) != 0);
+    if (!error && (rename(temp_path.buf, cache_path.buf) != 0)) {
+        error = 1;
+    }
+    if (error) {
+        syslog(LOG_ERR, "build_header_cache: unable to build header "
+                        "cache for '%s': %s",
+               name, strerror(errno));
+        unlink(temp_path.buf);
+    } else {
+        syslog(LOG_DEBUG, "build_header_cache: cached %zu messages for "
+                          "'%s' (%zu reused, %llu bytes)",
+               count, name, reused, (unsigned long long) offset);
+    }
+
+    free(entries);
+    free(buf);
+    path_free(&message_path);
+    path_free(&temp_path);
+    path_free(&cache_path);
+    path_free(&gen_path);
+    release_generation(gen);
+    return (error ? -1 : 0);
+}
+
+/* Read data from the message at the mount path path by way of the
+ * header cache of its query directory's current generation.  Returns
+ * the number of bytes read, or -1 if the requested range is not in
+ * the cache, in which case the message should be read instead. */
+static int read_header_cache(const char *path, char *buf, size_t size,
+                             off_t offset)
+{
+    char *name = get_query_name(path);
+    if (!name) {
+        return -1;
+    }
+    struct path message_path = PATH_INIT;
+    char *gen = acquire_generation(name, path + 1 + strlen(name),
+                                   &message_path);
+    free(name);
+    if (!gen) {
+        path_free(&message_path);
+        return -1;
+    }
+
+    int res = -1;
+    struct stat stbuf;
+    struct header_cache *cache = get_header_cache(gen);
+    if (cache && (stat(message_path.buf, &stbuf) == 0)) {
+        const struct header_cache_entry *entry =
+            find_header_cache_entry(cache, &stbuf);
+        uint64_t end = (uint64_t) offset + size;
+        if (end > (uint64_t) stbuf.st_size) {
+            end = stbuf.st_size;
+        }
+        if (entry && (offset >= 0) && (end <= entry->len)) {
+            res = (((uint64_t) offset < end) ? end - offset : 0);
+            memcpy(buf, cache->map + entry->offset + offset, res);
+        }
+    }
+    path_free(&message_path);
+    release_generation(gen);
+    return res;
+}
+
+/* Append arg to cmd, quoted for use by the shell. */
+static int append_quoted(struct path *cmd, const char *arg)
+{
+    if (path_append(cmd, "'") != 0) {
+        return -1;
+    }
+    for (;;) {
+        const char *quote = strchr(arg, '\'');
+        if (!quote) {
+            break;
+        }
+        if ((path_append_len(cmd, arg, quote - arg) != 0)
+                || (path_append(cmd, "'\\''") != 0)) {
+            return -1;
+        }
+        arg = quote + 1;
+    }
+    if ((path_append(cmd, arg) != 0)
+            || (path_append(cmd, "'") != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue a change to the mu index for maildir_path.  A change that
+ * reverses a change that is already queued for the same path cancels
+ * that change out, rather than being queued itself. */
+static void queue_index_update(enum index_op op, const char *maildir_path)
+{
+    if (!options.update_index) {
+        return;
+    }
+
+    pthread_mutex_lock(&index_queue.mutex);
+    struct index_update *prev = NULL;
+    struct index_update *update;
+    for (update = index_queue.head; update; update = update->next) {
+        if ((update->op != op)
+                && (strcmp(update->maildir_path, maildir_path) == 0)) {
+            break;
+        }
+        prev = update;
+    }
+    if (update) {
+        if (prev) {
+            prev->next = update->next;
+        } else {
+            index_queue.head = update->next;
+        }
+        if (index_queue.tail == update) {
+            index_queue.tail = prev;
+        }
+        index_queue.count--;
+        free(update->maildir_path);
+        free(update);
+        pthread_mutex_unlock(&index_queue.mutex);
+        return;
+    }
+
+    update = calloc(1, sizeof(struct index_update));
+    if (update) {
+        update->maildir_path = strdup(maildir_path);
+    }
+    if (!update || !update->maildir_path) {
+        syslog(LOG_ERR, "queue_index_update: unable to queue "
+                        "update for '%s'",
+               maildir_path);
+        free(update);
+        pthread_mutex_unlock(&index_queue.mutex);
+        return;
+    }
+    update->op = op;
+    if (index_queue.tail) {
+        index_queue.tail->next = update;
+    } else {
+        index_queue.head = update;
+    }
+    index_queue.tail = update;
+    index_queue.count++;
+    if (index_queue.count >= INDEX_BATCH_SIZE) {
+        pthread_cond_broadcast(&index_queue.cond);
+    }
+    pthread_mutex_unlock(&index_queue.mutex);
+}
+
+/* Run a single mu command (add or remove) for the given updates. */
+static int run_index_command(const char *command,
+                             struct index_update **updates,
+                             int count)
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    /* The paths are the same for each database, so that part of the
+     * command is only built once. */
+    struct path paths = PATH_INIT;
+    int res = path_set(&paths, "");
+    for (int i = 0; (res == 0) && (i < count); i++) {
+        res = path_append(&paths, " ");
+        if (res == 0) {
+            res = append_quoted(&paths, updates[i]->maildir_path);
+        }
+    }
+    struct path cmd = PATH_INIT;
+    int error = 0;
+    for (int i = 0; (res == 0) && (i < get_shard_count()); i++) {
+        const char *mu_home = get_shard_mu_home(i);
+        res = path_setf(&cmd, "%s %s%s%s%s",
+                        options.mu, command,
+                        (mu_home ? " --muhome=" : ""),
+                        (mu_home ? mu_home : ""), paths.buf);
+        if (res != 0) {
+            break;
+        }
+        syslog(LOG_INFO, "run_index_command: running mu %s for %d "
+                         "paths",
+               command, count);
+        int status = system(cmd.buf);
+        if (status != 0) {
+            syslog(LOG_ERR, "run_index_command: mu %s failed (%d)",
+                   command, status);
+            error = 1;
+        }
+    }
+    path_free(&cmd);
+    path_free(&paths);
+    if (res != 0) {
+        syslog(LOG_ERR, "run_index_command: unable to allocate "
+                        "command");
+        return -1;
+    }
+
+    return (error ? -1 : 0);
+}
+
+/* Apply all queued index updates.  Removals are applied before
+ * additions, with each mu command handling up to INDEX_BATCH_SIZE
+ * paths. */
+static int flush_index_updates(void)
+{
+    if (!options.update_index) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&index_queue.flush_mutex);
+    pthread_mutex_lock(&index_queue.mutex);
+    struct index_update *head = index_queue.head;
+    index_queue.head = NULL;
+    index_queue.tail = NULL;
+    index_queue.count = 0;
+    pthread_mutex_unlock(&index_queue.mutex);
+
+    int error = 0;
+    struct index_update *batch[INDEX_BATCH_SIZE];
+    enum index_op ops[] = { INDEX_REMOVE, INDEX_ADD };
+    const char *commands[] = { "remove", "add" };
+    for (int i = 0; i < 2; i++) {
+        int count = 0;
+        struct index_update *update;
+        for (update = head; update; update = update->next) {
+            if (update->op != ops[i]) {
+                continue;
+            }
+            batch[count++] = update;
+            if (count == INDEX_BATCH_SIZE) {
+                error |= run_index_command(commands[i], batch, count);
+                count = 0;
+            }
+        }
+        error |= run_index_command(commands[i], batch, count);
+    }
+
+    while (head) {
+        struct index_update *next = head->next;
+        free(head->maildir_path);
+        free(head);
+        head = next;
+    }
+    pthread_mutex_unlock(&index_queue.flush_mutex);
+
+    return (error ? -1 : 0);
+}
+
+/* Apply queued index updates periodically, until the queue is
+ * stopped. */
+static void *index_thread(void *arg)
+{
+    pthread_mutex_lock(&index_queue.mutex);
+    while (!index_queue.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += options.index_interval;
+        while (!index_queue.stop
+                && (index_queue.count < INDEX_BATCH_SIZE)) {
+            int res = pthread_cond_timedwait(&index_queue.cond,
+                                             &index_queue.mutex,
+                                             &deadline);
+            if (res == ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&index_queue.mutex);
+        flush_index_updates();
+        pthread_mutex_lock(&index_queue.mutex);
+    }
+    pthread_mutex_unlock(&index_queue.mutex);
+
+    return NULL;
+}
+
+/* Remove the temporary directory used for a refresh, once its
+ * links have been moved into the backing directory.  If removal
+ * fails part-way through, then the directory is removed
+ * recursively. */
+static int remove_temp_dir(const char *temp_dirname)
+{
+    struct path path = PATH_INIT;
+    if (path_set(&path, temp_dirname) != 0) {
+        remove_dir(temp_dirname);
+        return -1;
+    }
+    size_t dir_len = path.len;
+
+    const char *subdirs[] = { "new", "cur", "tmp" };
+    for (int i = 0; i < 3; i++) {
+        path_truncate(&path, dir_len);
+        int res = path_push(&path, subdirs[i]);
+        if (res == 0) {
+            res = rmdir(path.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "remove_temp_dir: cannot remove "
+                                "temp/%s: %s",
+                       subdirs[i], strerror(errno));
+            }
+        }
+        if (res != 0) {
+            path_free(&path);
+            remove_dir(temp_dirname);
+            return -1;
+        }
+    }
+
+    DIR *temp_dir_handle = opendir(temp_dirname);
+    if (!temp_dir_handle) {
+        syslog(LOG_ERR, "remove_temp_dir: cannot open '%s': %s",
+               temp_dirname, strerror(errno));
+        path_free(&path);
+        remove_dir(temp_dirname);
+        return -1;
+    }
+    struct dirent *dent;
+    while ((dent = readdir(temp_dir_handle)) != NULL) {
+        if (is_upwards(dent->d_name)) {
+            continue;
+        }
+        path_truncate(&path, dir_len);
+        int res = path_push(&path, dent->d_name);
+        if (res == 0) {
+            res = unlink(path.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "remove_temp_dir: cannot unlink "
+                                "'%s': %s",
+                       path.buf, strerror(errno));
+            }
+        }
+        if (res != 0) {
+            closedir(temp_dir_handle);
+            path_free(&path);
+            remove_dir(temp_dirname);
+            return -1;
+        }
+    }
+    closedir(temp_dir_handle);
+    path_free(&path);
+    int res = rmdir(temp_dirname);
+    if (res != 0) {
+        syslog(LOG_ERR, "remove_temp_dir: cannot remove temp: %s",
+               strerror(errno));
+        remove_dir(temp_dirname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse a bound from a date range in mu's date: syntax (e.g.
+ * "20200131", "2020-01", "3m", "now") into a time.  An absolute date
+ * is taken to mean the start of the period that it describes, or the
+ * end of that period if is_end is set (e.g. "2020" as an end bound is
+ * the end of 2020).  Returns 0 if the bound is empty or cannot be
+ * parsed, meaning that the range is unbounded in that direction. */
+static time_t parse_date_bound(const char *str, size_t len, int is_end)
+{
+    if (len == 0) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    if ((len == 3) && (strncasecmp(str, "now", 3) == 0)) {
+        return now;
+    }
+    if ((len == 5) && (strncasecmp(str, "today", 5) == 0)) {
+        tm.tm_hour = (is_end ? 23 : 0);
+        tm.tm_min = (is_end ? 59 : 0);
+        tm.tm_sec = (is_end ? 59 : 0);
+        return mktime(&tm);
+    }
+
+    /* Relative bounds are a number followed by a unit. */
+    size_t digits = strspn(str, "0123456789");
+    if ((digits > 0) && (digits == len - 1)) {
+        int count = atoi(str);
+        switch (str[len - 1]) {
+        case 'h': tm.tm_hour -= count; break;
+        case 'd': tm.tm_mday -= count; break;
+        case 'w': tm.tm_mday -= 7 * count; break;
+        case 'm': tm.tm_mon -= count; break;
+        case 'y': tm.tm_year -= count; break;
+        default: return 0;
+        }
+        return mktime(&tm);
+    }
+
+    /* Absolute bounds are YYYY[MM[DD[hh[mm[ss]]]]], with optional
+     * separators. */
+    int values[6] = { 0 };
+    int widths[6] = { 4, 2, 2, 2, 2, 2 };
+    int field = 0;
+    int width = 0;
+    for (size_t i = 0; i < len; i++) {
+        if ((str[i] >= '0') && (str[i] <= '9')) {
+            if (field == 6) {
+                return 0;
+            }
+            values[field] = values[field] * 10 + (str[i] - '0');
+            if (++width == widths[field]) {
+                field++;
+                width = 0;
+            }
+        } else if (!strchr("-/:.T ", str[i]) || (width != 0)) {
+            return 0;
+        }
+    }
+    if ((width != 0) || (field == 0)) {
+        return 0;
+    }
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+    tm.tm_year = values[0] - 1900;
+    tm.tm_mon = ((field > 1) ? values[1] - 1 : (is_end ? 11 : 0));
+    /* Day 0 of the following month is the last day of this one. */
+    tm.tm_mday = ((field > 2) ? values[2] : (is_end ? 0 : 1));
+    if ((field <= 2) && is_end) {
+        tm.tm_mon++;
+    }
+    tm.tm_hour = ((field > 3) ? values[3] : (is_end ? 23 : 0));
+    tm.tm_min = ((field > 4) ? values[4] : (is_end ? 59 : 0));
+    tm.tm_sec = ((field > 5) ? values[5] : (is_end ? 59 : 0));
+    return mktime(&tm);
+}
+
+/* Parse a date range in mu's date: syntax (e.g. "2019..2020", "3m..",
+ * or "2020-01") of length len into from and to (see
+ * parse_date_bound). */
+static void parse_date_range(const char *str, size_t len,
+                             time_t *from, time_t *to)
+{
+    const char *dots = NULL;
+    for (size_t i = 0; i + 1 < len; i++) {
+        if ((str[i] == '.') && (str[i + 1] == '.')) {
+            dots = str + i;
+            break;
+        }
+    }
+    if (!dots) {
+        *from = parse_date_bound(str, len, 0);
+        *to = parse_date_bound(str, len, 1);
+    } else {
+        *from = parse_date_bound(str, dots - str, 0);
+        *to = parse_date_bound(dots + 2, len - (dots + 2 - str), 1);
+    }
+}
+
+/* Find the value of the date: term in query, writing its start to
+ * range and its length to len.  Returns an error code unless the query
+ * has a single date: term and no OR/NOT operators (so that the term
+ * restricts every result). */
+static int find_date_term(const char *query, const char **range,
+                          size_t *len_ptr)
+{
+    int found = 0;
+    const char *c = query;
+    while (*c) {
+        c += strspn(c, " \t()");
+        size_t len = strcspn(c, " \t()");
+        if (len == 0) {
+            continue;
+        }
+        if (((len == 2) && (strncasecmp(c, "or", 2) == 0))
+                || ((len == 3) && (strncasecmp(c, "not", 3) == 0))
+                || ((len == 3) && (strncasecmp(c, "xor", 3) == 0))) {
+            return -1;
+        }
+        size_t prefix = 0;
+        if ((len > 5) && (strncasecmp(c, "date:", 5) == 0)) {
+            prefix = 5;
+        } else if ((len > 2) && (strncasecmp(c, "d:", 2) == 0)) {
+            prefix = 2;
+        }
+        if (prefix) {
+            if (found) {
+                return -1;
+            }
+            found = 1;
+            *range = c + prefix;
+            *len_ptr = len - prefix;
+        }
+        c += len;
+    }
+
+    return (found ? 0 : -1);
+}
+
+/* Get the range of dates that the results for query may have, by way
+ * of its date: term (see find_date_term). */
+static int get_query_date_range(const char *query, time_t *from,
+                                time_t *to)
+{
+    const char *range;
+    size_t len;
+    if (find_date_term(query, &range, &len) != 0) {
+        return -1;
+    }
+    parse_date_range(range, len, from, to);
+    return 0;
+}
+
+/* Returns a boolean indicating whether the bound of length len is
+ * relative to the current time (e.g. "3m", "today"). */
+static int is_relative_bound(const char *str, size_t len)
+{
+    if (((len == 3) && (strncasecmp(str, "now", 3) == 0))
+            || ((len == 5) && (strncasecmp(str, "today", 5) == 0))) {
+        return 1;
+    }
+    size_t digits = strspn(str, "0123456789");
+    return ((digits > 0) && (digits == len - 1)
+                && strchr("hdwmy", str[len - 1]));
+}
+
+/* If query's results are those dated within a window that ends at the
+ * current time, such as with "date:3m..", then write the start of
+ * the window to from.  Returns an error code if the query does not
+ * have such a window. */
+static int get_sliding_window(const char *query, time_t *from)
+{
+    const char *range;
+    size_t len;
+    if (find_date_term(query, &range, &len) != 0) {
+        return -1;
+    }
+    const char *dots = NULL;
+    for (size_t i = 0; i + 1 < len; i++) {
+        if ((range[i] == '.') && (range[i + 1] == '.')) {
+            dots = range + i;
+            break;
+        }
+    }
+    if (!dots || !is_relative_bound(range, dots - range)) {
+        return -1;
+    }
+    size_t end_len = len - (dots + 2 - range);
+    if ((end_len != 0)
+            && !((end_len == 3)
+                    && (strncasecmp(dots + 2, "now", 3) == 0))) {
+        return -1;
+    }
+    *from = parse_date_bound(range, dots - range, 0);
+    return 0;
+}
+
+/* Returns a boolean indicating whether the shard may contain messages
+ * dated within the given range. */
+static int shard_may_match(const struct shard *shard, time_t from,
+                           time_t to)
+{
+    if (!shard->range) {
+        return 1;
+    }
+    time_t shard_from;
+    time_t shard_to;
+    parse_date_range(shard->range, strlen(shard->range),
+                     &shard_from, &shard_to);
+    if (from && shard_to && (shard_to < from)) {
+        return 0;
+    }
+    if (to && shard_from && (shard_from > to)) {
+        return 0;
+    }
+    return 1;
+}
+
+/* The priority classes of mu runs.  Refreshes made on behalf of a
+ * file system operation are interactive, and all others are
+ * background refreshes. */
+enum mu_priority {
+    MU_INTERACTIVE,
+    MU_BACKGROUND
+};
+
+/* Set while the current thread is refreshing query directories in the
+ * background, rather than on behalf of a file system operation. */
+static __thread int background_refresh;
+
+/* The mu run scheduler, which limits the number of queries being run
+ * by mu at once to --max-mu-runs.  Queries waiting to run are started
+ * in the order in which they arrived within each priority class, and
+ * waiting interactive queries are started before any background ones.
+ * A sharded query takes a single slot for all of its databases.
+ * next_ticket and serving give the order within each class, and
+ * waited_ms and runs are the totals for each class, from which the
+ * mean wait time is reported. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    int queued[2];
+    uint64_t next_ticket[2];
+    uint64_t serving[2];
+    uint64_t waited_ms[2];
+    uint64_t runs[2];
+} mu_scheduler = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+/* Wait for a slot in which to run a query using mu, at the priority of
+ * the current thread.  The slot is released by way of
+ * release_mu_slot. */
+static void acquire_mu_slot(const char *query)
+{
+    int priority = (background_refresh ? MU_BACKGROUND : MU_INTERACTIVE);
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    pthread_mutex_lock(&mu_scheduler.mutex);
+    uint64_t ticket = mu_scheduler.next_ticket[priority]++;
+    mu_scheduler.queued[priority]++;
+    while ((ticket != mu_scheduler.serving[priority])
+            || ((options.max_mu_runs > 0)
+                && (mu_scheduler.running >= options.max_mu_runs))
+            || ((priority == MU_BACKGROUND)
+                && (mu_scheduler.queued[MU_INTERACTIVE] > 0))) {
+        pthread_cond_wait(&mu_scheduler.cond, &mu_scheduler.mutex);
+    }
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    long waited_ms = ((finished.tv_sec - started.tv_sec) * 1000)
+                         + ((finished.tv_nsec - started.tv_nsec) / 1000000);
+    mu_scheduler.queued[priority]--;
+    mu_scheduler.serving[priority]++;
+    mu_scheduler.running++;
+    mu_scheduler.waited_ms[priority] += waited_ms;
+    mu_scheduler.runs[priority]++;
+    /* The next query in this class may be able to start as well. */
+    pthread_cond_broadcast(&mu_scheduler.cond);
+    pthread_mutex_unlock(&mu_scheduler.mutex);
+
+    if (waited_ms > 0) {
+        syslog(LOG_DEBUG, "run_query: '%s' waited %ld ms to run",
+               query, waited_ms);
+    }
+}
+
+/* Release a slot acquired by way of acquire_mu_slot. */
+static void release_mu_slot(void)
+{
+    pthread_mutex_lock(&mu_scheduler.mutex);
+    mu_scheduler.running--;
+    pthread_cond_broadcast(&mu_scheduler.cond);
+    pthread_mutex_unlock(&mu_scheduler.mutex);
+}
+
+/* Start running the query using mu against the database at mu_home
+ * (or the default database, if mu_home is NULL), with the results
+ * being written to linksdir.  If newest_first is set, then the most
+ * recent results are written first.  The command's standard error is
+ * redirected to a pipe, the read end of which is written to err_fd.
+ * Returns the process ID of the command, or -1 on error. */
+static pid_t start_find(const char *query, const char *linksdir,
+                        const char *mu_home, int newest_first,
+                        int *err_fd)
+{
+    struct path cmd = PATH_INIT;
+    int res = path_setf(&cmd, "%s find %s%s%s --clearlinks "
+                              "--format=links --linksdir=",
+                        options.mu,
+                        (mu_home ? "--muhome=" : ""),
+                        (mu_home ? mu_home : ""),
+                        (newest_first ? " --reverse" : ""));
+    if (res == 0) {
+        res = append_quoted(&cmd, linksdir);
+    }
+    if (res == 0) {
+        res = path_append(&cmd, " ");
+    }
+    if (res == 0) {
+        res = append_quoted(&cmd, query);
+    }
+    if (res != 0) {
+        path_free(&cmd);
+        return -1;
+    }
+    /* The pipe is not inherited by commands started by other threads
+     * in the meantime, since they would otherwise hold its write end
+     * open. */
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        syslog(LOG_ERR, "run_query: unable to make pipe: %s",
+               strerror(errno));
+        path_free(&cmd);
+        return -1;
+    }
+    syslog(LOG_INFO, "run_query: running mu find: '%s'", cmd.buf);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd.buf, (char *) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid == -1) {
+        syslog(LOG_ERR, "run_query: unable to fork: %s",
+               strerror(errno));
+        close(fds[0]);
+    } else {
+        *err_fd = fds[0];
+    }
+    path_free(&cmd);
+    return pid;
+}
+
+/* Read the standard error output of a mu command from err_fd, until
+ * end of file, and then close err_fd.  Up to MU_ERROR_MAX bytes of the
+ * output are written to error (if not NULL), with newlines replaced
+ * by spaces, and the remainder is discarded. */
+static void read_find_error(int err_fd, struct path *error)
+{
+    char buf[MU_ERROR_MAX];
+    size_t len = 0;
+    for (;;) {
+        char discard[256];
+        char *dest = ((len < sizeof(buf)) ? buf + len : discard);
+        size_t size = ((len < sizeof(buf)) ? sizeof(buf) - len
+                                           : sizeof(discard));
+        ssize_t bytes = read(err_fd, dest, size);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        if (dest == buf + len) {
+            len += bytes;
+        }
+    }
+    close(err_fd);
+    while ((len > 0) && ((buf[len - 1] == '\n') || (buf[len - 1] == ' '))) {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            buf[i] = ' ';
+        }
+    }
+    if (error && (len > 0)) {
+        path_set_len(error, buf, len);
+    }
+}
+
+/* Wait for the mu find command with the given process ID to complete,
+ * reading its standard error output from err_fd.  If the command
+ * fails, then a description of the failure is written to error (if
+ * not NULL). */
+static int wait_find(pid_t pid, int err_fd, struct path *error)
+{
+    struct path output = PATH_INIT;
+    read_find_error(err_fd, &output);
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            syslog(LOG_ERR, "run_query: unable to wait for mu find: %s",
+                   strerror(errno));
+            path_free(&output);
+            return -1;
+        }
+    }
+    /* 2 is the documented return code for "no results found".  1024
+     * is the return code seen in practice. */
+    if ((status != 0) && (status != 2) && (status != 1024)) {
+        syslog(LOG_ERR, "run_query: mu find failed (%d): %s",
+               status, (output.buf ? output.buf : ""));
+        if (error && output.buf) {
+            path_set(error, output.buf);
+        } else if (error) {
+            path_setf(error, "mu find failed (%d)", status);
+        }
+        path_free(&output);
+        return -1;
+    }
+    path_free(&output);
+    return 0;
+}
+
+/* Move the links written by mu find to shard_dirname into the "cur"
+ * and "new" directories in temp_dirname, and then remove
+ * shard_dirname.  A message found by way of more than one database has
+ * the same link name for each, so that it only appears once. */
+static int merge_shard_results(const char *temp_dirname,
+                               const char *shard_dirname)
+{
+    struct path from = PATH_INIT;
+    struct path to = PATH_INIT;
+    const char *subdirs[] = { "cur", "new" };
+    int res = 0;
+    for (int i = 0; (i < 2) && (res == 0); i++) {
+        if ((path_setf(&from, "%s/%s", shard_dirname, subdirs[i]) != 0)
+                || (path_setf(&to, "%s/%s", temp_dirname,
+                              subdirs[i]) != 0)) {
+            res = -1;
+            break;
+        }
+        size_t from_len = from.len;
+        size_t to_len = to.len;
+        DIR *dir_handle = opendir(from.buf);
+        if (!dir_handle) {
+            /* mu may not create the directories if there are no
+             * results. */
+            continue;
+        }
+        struct dirent *dent;
+        while ((dent = readdir(dir_handle)) != NULL) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            path_truncate(&from, from_len);
+            path_truncate(&to, to_len);
+            if ((path_push(&from, dent->d_name) != 0)
+                    || (path_push(&to, dent->d_name) != 0)) {
+                res = -1;
+                break;
+            }
+            res = rename(from.buf, to.buf);
+            if (res != 0) {
+                syslog(LOG_ERR, "run_query: unable to move '%s' to "
+                                "'%s': %s",
+                       from.buf, to.buf, strerror(errno));
+                break;
+            }
+        }
+        closedir(dir_handle);
+    }
+    path_free(&from);
+    path_free(&to);
+
+    if (res != 0) {
+        remove_dir(shard_dirname);
+        return -1;
+    }
+    return remove_temp_dir(shard_dirname);
+}
+
+/* Run the query using mu against each database that may have results
+ * for it, in parallel, and merge the results into temp_dirname.  If a
+ * command fails, then a description of the first such failure is
+ * written to error. */
+static int run_sharded_query(const char *query, const char *temp_dirname,
+                             struct path *error)
+{
+    time_t from = 0;
+    time_t to = 0;
+    int restricted = (get_query_date_range(query, &from, &to) == 0);
+
+    const char *subdirs[] = { "cur", "new", "tmp" };
+    struct path path = PATH_INIT;
+    int res = 0;
+    for (int i = 0; (i < 3) && (res == 0); i++) {
+        res = path_setf(&path, "%s/%s", temp_dirname, subdirs[i]);
+        if ((res == 0) && (mkdir(path.buf, S_IRWXU) != 0)) {
+            syslog(LOG_ERR, "run_query: unable to make '%s': %s",
+                   path.buf, strerror(errno));
+            res = -1;
+        }
+    }
+
+    pid_t *pids = calloc(shard_count, sizeof(pid_t));
+    int *err_fds = calloc(shard_count, sizeof(int));
+    if (!pids || !err_fds) {
+        res = -1;
+    }
+    for (int i = 0; (i < shard_count) && (res == 0); i++) {
+        if (restricted && !shard_may_match(&shards[i], from, to)) {
+            syslog(LOG_DEBUG, "run_query: skipping '%s' for '%s'",
+                   shards[i].mu_home, query);
+            continue;
+        }
+        res = path_setf(&path, "%s/shard.%d", temp_dirname, i);
+        if ((res == 0) && (mkdir(path.buf, S_IRWXU) != 0)) {
+            res = -1;
+        }
+        if (res == 0) {
+            pids[i] = start_find(query, path.buf, shards[i].mu_home, 0,
+                                 &err_fds[i]);
+            res = ((pids[i] == -1) ? -1 : 0);
+        }
+    }
+
+    /* Every command that was started is waited for, even if a
+     * previous one failed. */
+    int failed = (res != 0);
+    for (int i = 0; pids && err_fds && (i < shard_count); i++) {
+        if (pids[i] > 0) {
+            failed |= (wait_find(pids[i], err_fds[i],
+                                 (failed ? NULL : error)) != 0);
+        }
+    }
+    for (int i = 0; pids && err_fds && (i < shard_count) && !failed;
+            i++) {
+        if (pids[i] <= 0) {
+            continue;
+        }
+        failed |= (path_setf(&path, "%s/shard.%d", temp_dirname, i) != 0);
+        if (!failed) {
+            failed |= (merge_shard_results(temp_dirname, path.buf) != 0);
+        }
+    }
+    free(pids);
+    free(err_fds);
+    path_free(&path);
+
+    return (failed ? -1 : 0);
+}
+
+/* Run the query using mu, and write the results to temp_dirname.  If
+ * mu fails, then a description of the failure (ordinarily, mu's error
+ * output) is written to error. */
+static int run_query(const char *query, const char *temp_dirname,
+                     struct path *error)
+{
+    int res = flush_index_updates();
+    if (res != 0) {
+        syslog(LOG_INFO, "run_query: unable to update index, "
+                         "results may be out of date");
+    }
+
+    struct trace_span span;
+    PHASE_BEGIN(span, mu_queue, query);
+    acquire_mu_slot(query);
+    PHASE_END(span, mu_queue, query);
+    PHASE_BEGIN(span, mu_find, query);
+    if (shard_count > 1) {
+        res = run_sharded_query(query, temp_dirname, error);
+    } else {
+        int err_fd;
+        pid_t pid = start_find(query, temp_dirname, get_shard_mu_home(0),
+                               0, &err_fd);
+        res = ((pid == -1) ? -1 : wait_find(pid, err_fd, error));
+    }
+    PHASE_END(span, mu_find, query);
+    release_mu_slot();
+
+    return res;
+}
+
+static int refresh_dir(const char *path, int force, int progressive);
+
+/* The maximum depth to which query directories may be derived from
+ * other derived query directories. */
+#define DERIVE_MAX_DEPTH 4
+
+/* The maximum number of operands in a derived query. */
+#define DERIVE_MAX_OPERANDS 16
+
+static __thread int derive_depth;
+
+/* The types of operand that may appear in a derived query. */
+enum operand_type {
+    OPERAND_QUERY_DIR,
+    OPERAND_FLAG
+};
+
+/* An operand in a derived query.  For OPERAND_QUERY_DIR, name is the
+ * name of the other query directory.  For OPERAND_FLAG, flag is the
+ * maildir flag character, or 'N' for a message in "new", or 'U' for
+ * an unread message. */
+struct operand {
+    enum operand_type type;
+    int negated;
+    const char *name;
+    char flag;
+};
+
+/* Returns a boolean indicating whether word (of length len) is
+ * keyword, ignoring case. */
+static int is_keyword(const char *word, size_t len, const char *keyword)
+{
+    return ((strlen(keyword) == len)
+         && (strncasecmp(word, keyword, len) == 0));
+}
+
+/* Get the flag character for a flag: term value, or 0 if the value
+ * is not supported. */
+static char get_flag_char(const char *value)
+{
+    static const char *names[][2] = {
+        { "draft",   "D" }, { "d", "D" },
+        { "flagged", "F" }, { "f", "F" },
+        { "passed",  "P" }, { "p", "P" },
+        { "replied", "R" }, { "r", "R" },
+        { "seen",    "S" }, { "s", "S" },
+        { "trashed", "T" }, { "t", "T" },
+        { "new",     "N" }, { "n", "N" },
+        { "unread",  "U" }, { "u", "U" },
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcasecmp(value, names[i][0]) == 0) {
+            return names[i][1][0];
+        }
+    }
+    return 0;
+}
+
+/* Parse the query directory name (modified in place) into operands,
+ * if it is a conjunction or disjunction of other query directories
+ * and/or flag terms, or the negation of either.  Sets is_or if the
+ * operands are to be combined by disjunction.  Returns the number of
+ * operands, or -1 if the name cannot be handled in this way. */
+static int parse_derived_query(char *name, struct operand *operands,
+                               int *is_or)
+{
+    int count = 0;
+    int negated = 0;
+    int expect_operand = 1;
+    int op = 0;
+    char *p = name;
+
+    for (;;) {
+        while (*p == ' ') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+
+        char *word = p;
+        int depth = 0;
+        int quoted = 0;
+        while (*p && (quoted || (depth > 0) || (*p != ' '))) {
+            if (*p == '"') {
+                quoted = !quoted;
+            } else if (!quoted && (*p == '(')) {
+                depth++;
+            } else if (!quoted && (*p == ')')) {
+                depth--;
+            }
+            p++;
+        }
+        if (quoted || (depth != 0)) {
+            return -1;
+        }
+        size_t len = p - word;
+        if (*p) {
+            *p++ = 0;
+        }
+
+        int word_op = (is_keyword(word, len, "and") ? 1
+                    : is_keyword(word, len, "or")  ? 2
+                    : 0);
+        if (word_op) {
+            if (expect_operand || (op && (op != word_op))) {
+                return -1;
+            }
+            op = word_op;
+            expect_operand = 1;
+            continue;
+        }
+        if (is_keyword(word, len, "not")) {
+            if (negated) {
+                return -1;
+            }
+            negated = 1;
+            continue;
+        }
+        if (!expect_operand) {
+            /* Adjacent terms are implicitly combined by conjunction,
+             * as per mu. */
+            if (op == 2) {
+                return -1;
+            }
+            op = 1;
+        }
+        if (count == DERIVE_MAX_OPERANDS) {
+            return -1;
+        }
+
+        if ((word[0] == '(') && (word[len - 1] == ')')) {
+            word[len - 1] = 0;
+            word++;
+        }
+        struct operand *operand = &operands[count++];
+        operand->negated = negated;
+        operand->name = word;
+        operand->flag = 0;
+        if (strncmp(word, "flag:", 5) == 0) {
+            operand->type = OPERAND_FLAG;
+            operand->flag = get_flag_char(word + 5);
+        } else if (strncmp(word, "g:", 2) == 0) {
+            operand->type = OPERAND_FLAG;
+            operand->flag = get_flag_char(word + 2);
+        } else {
+            operand->type = OPERAND_QUERY_DIR;
+        }
+        if ((operand->type == OPERAND_FLAG) && !operand->flag) {
+            return -1;
+        }
+        negated = 0;
+        expect_operand = 0;
+    }
+    if (expect_operand || (count < 2)) {
+        return -1;
+    }
+
+    *is_or = (op == 2);
+    return count;
+}
+
+/* Returns a boolean indicating whether the message at maildir_path
+ * has the given flag (per struct operand). */
+static int has_flag(const char *maildir_path, char flag)
+{
+    const char *filename = strrchr(maildir_path, '/');
+    if (!filename) {
+        return 0;
+    }
+    int is_new = ((filename - maildir_path >= 4)
+               && (strncmp(filename - 4, "/new", 4) == 0));
+    const char *info = strstr(filename, ":2,");
+    int seen = (info && strchr(info + 3, 'S'));
+    switch (flag) {
+        case 'N':
+            return is_new;
+        case 'U':
+            return (is_new || !seen);
+        default:
+            return (info && strchr(info + 3, flag));
+    }
+}
+
+/* Load the current results for the named query directory into set,
+ * as a map from maildir path to link name. */
+static int load_result_set(const char *name, struct table *set)
+{
+    const char *subdirs[] = { "cur", "new" };
+    struct path link_path = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    int error = 0;
+    char *gen = acquire_generation(name, "/", &link_path);
+    size_t gen_len = link_path.len;
+    for (int i = 0; (i < 2) && !error; i++) {
+        path_truncate(&link_path, gen_len);
+        if (path_append(&link_path, subdirs[i]) != 0) {
+            error = 1;
+            break;
+        }
+        size_t dir_len = link_path.len;
+        DIR *dir_handle = opendir(link_path.buf);
+        if (!dir_handle) {
+            if (errno == ENOENT) {
+                continue;
+            }
+            syslog(LOG_ERR, "load_result_set: cannot open '%s': %s",
+                   link_path.buf, strerror(errno));
+            error = 1;
+            break;
+        }
+        struct dirent *dent;
+        while ((dent = readdir(dir_handle)) != NULL) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            path_truncate(&link_path, dir_len);
+            if (path_push(&link_path, dent->d_name) != 0) {
+                error = 1;
+                break;
+            }
+            if (path_readlink(&maildir_path, link_path.buf) != 0) {
+                continue;
+            }
+            char *link_name = strdup(dent->d_name);
+            void *previous;
+            if (!link_name
+                    || (table_put(set, maildir_path.buf, link_name,
+                                  &previous) != 0)) {
+                free(link_name);
+                error = 1;
+                break;
+            }
+            free(previous);
+        }
+        closedir(dir_handle);
+    }
+    release_generation(gen);
+
+    path_free(&link_path);
+    path_free(&maildir_path);
+    return (error ? -1 : 0);
+}
+
+/* Derive the results for the query directory name from its parsed
+ * operands (see derive_query). */
+static int derive_operands(const char *name, struct operand *operands,
+                           int count, int is_or,
+                           const char *temp_dirname, int force)
+{
+    /* At least one operand must be a query directory that is not
+     * negated, so that the results are bounded by that directory's
+     * results.  For disjunctions, every operand must be such a
+     * directory. */
+    int positive_dirs = 0;
+    for (int i = 0; i < count; i++) {
+        struct operand *operand = &operands[i];
+        if (operand->type == OPERAND_QUERY_DIR) {
+            if ((strcmp(operand->name, name) == 0)
+                    || strchr(operand->name, '/')
+                    || (operand->name[0] == '_')) {
+                return 0;
+            }
+            struct path dir_path = PATH_INIT;
+            if ((path_set(&dir_path, options.backing_dir) != 0)
+                    || (path_push(&dir_path, operand->name) != 0)) {
+                path_free(&dir_path);
+                return -1;
+            }
+            struct stat stbuf;
+            int res = stat(dir_path.buf, &stbuf);
+            path_free(&dir_path);
+            if ((res != 0) || !S_ISDIR(stbuf.st_mode)) {
+                return 0;
+            }
+            if (!operand->negated) {
+                positive_dirs++;
+            }
+        }
+        if (is_or
+                && ((operand->type != OPERAND_QUERY_DIR)
+                    || operand->negated)) {
+            return 0;
+        }
+    }
+    if (!positive_dirs) {
+        return 0;
+    }
+
+    syslog(LOG_INFO, "derive_query: deriving '%s' from %d operands",
+           name, count);
+    derive_depth++;
+    int error = 0;
+    struct path path = PATH_INIT;
+    struct table result = { NULL, 0, 0 };
+    int result_loaded = 0;
+    /* Non-negated operands are handled first, so that negated
+     * operands always have something to be subtracted from. */
+    for (int i = 0; (i < (2 * count)) && !error; i++) {
+        struct operand *operand = &operands[i % count];
+        if ((operand->type != OPERAND_QUERY_DIR)
+                || (operand->negated != (i >= count))) {
+            continue;
+        }
+        if ((path_setf(&path, "/%s", operand->name) != 0)
+                || (refresh_dir(path.buf, force, 0) != 0)) {
+            error = 1;
+            break;
+        }
+        if (!result_loaded && !operand->negated) {
+            error = (load_result_set(operand->name, &result) != 0);
+            result_loaded = 1;
+            continue;
+        }
+        struct table set = { NULL, 0, 0 };
+        if (load_result_set(operand->name, &set) != 0) {
+            table_clear(&set);
+            error = 1;
+            break;
+        }
+        if (is_or) {
+            for (size_t j = 0; set.buckets && (j < set.size); j++) {
+                struct table_entry *entry;
+                for (entry = set.buckets[j]; entry; entry = entry->next) {
+                    if (table_get(&result, entry->key)) {
+                        continue;
+                    }
+                    char *link_name = strdup(entry->value);
+                    if (!link_name
+                            || (table_put(&result, entry->key,
+                                          link_name, NULL) != 0)) {
+                        free(link_name);
+                        error = 1;
+                    }
+                }
+            }
+        } else {
+            for (size_t j = 0; result.buckets && (j < result.size); j++) {
+                struct table_entry *entry = result.buckets[j];
+                while (entry) {
+                    struct table_entry *next = entry->next;
+                    int present = (table_get(&set, entry->key) != NULL);
+                    if (present == operand->negated) {
+                        free(table_remove(&result, entry->key));
+                    }
+                    entry = next;
+                }
+            }
+        }
+        table_clear(&set);
+    }
+    derive_depth--;
+
+    /* Apply the flag operands, and write the remaining results. */
+    const char *subdirs[] = { "cur", "new", "tmp" };
+    for (int i = 0; (i < 3) && !error; i++) {
+        if (path_setf(&path, "%s/%s", temp_dirname, subdirs[i]) != 0) {
+            error = 1;
+            break;
+        }
+        if ((mkdir(path.buf, 0755) != 0) && (errno != EEXIST)) {
+            syslog(LOG_ERR, "derive_query: cannot make '%s': %s",
+                   path.buf, strerror(errno));
+            error = 1;
+        }
+    }
+    for (size_t i = 0; !error && result.buckets && (i < result.size);
+            i++) {
+        struct table_entry *entry;
+        for (entry = result.buckets[i]; entry; entry = entry->next) {
+            int include = 1;
+            for (int j = 0; j < count; j++) {
+                struct operand *operand = &operands[j];
+                if ((operand->type == OPERAND_FLAG)
+                        && (has_flag(entry->key, operand->flag)
+                            == operand->negated)) {
+                    include = 0;
+                    break;
+                }
+            }
+            if (!include) {
+                continue;
+            }
+            int is_new = has_flag(entry->key, 'N');
+            if (path_setf(&path, "%s/%s/%s", temp_dirname,
+                          (is_new ? "new" : "cur"),
+                          (char *) entry->value) != 0) {
+                error = 1;
+                break;
+            }
+            if (symlink(entry->key, path.buf) != 0) {
+                syslog(LOG_ERR, "derive_query: cannot link '%s': %s",
+                       path.buf, strerror(errno));
+                error = 1;
+                break;
+            }
+        }
+    }
+    table_clear(&result);
+    path_free(&path);
+
+    return (error ? -1 : 1);
+}
+
+/* If the named query is a combination of other existing query
+ * directories (see parse_derived_query), then compute its results
+ * from the results of those query directories, rather than by running
+ * mu, and write them to temp_dirname.  Returns 1 if the results were
+ * computed, 0 if the query cannot be computed in this way, and -1 on
+ * error. */
+static int derive_query(const char *name, const char *temp_dirname,
+                        int force)
+{
+    if (derive_depth >= DERIVE_MAX_DEPTH) {
+        return 0;
+    }
+
+    char *parsed = strdup(name);
+    if (!parsed) {
+        return -1;
+    }
+    struct operand operands[DERIVE_MAX_OPERANDS];
+    int is_or = 0;
+    int count = parse_derived_query(parsed, operands, &is_or);
+    if (count < 0) {
+        free(parsed);
+        return 0;
+    }
+    int res = derive_operands(name, operands, count, is_or,
+                              temp_dirname, force);
+    free(parsed);
+    return res;
+}
+
+/* The incremental refresh state for a query directory that has a
+ * sliding date window (see get_sliding_window).  last_refresh is the
+ * time at which the last successful refresh started, and last_full is
+ * the time at which the last successful full refresh started. */
+struct sliding_state {
+    time_t last_refresh;
+    time_t last_full;
+};
+
+/* A map from query name to incremental refresh state.  This is not
+ * persisted, so the first refresh of each query directory after fsmu
+ * starts is a full refresh. */
+static struct table sliding_states;
+static pthread_mutex_t sliding_states_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* A map from maildir path to the time from the message's Date header,
+ * for messages in query directories that have sliding date windows. */
+static struct table message_dates;
+static pthread_mutex_t message_dates_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Get the time from which an incremental refresh of the query
+ * directory name should fetch messages, or 0 if the next refresh
+ * should be a full refresh. */
+static time_t get_incremental_since(const char *name)
+{
+    if (options.full_refresh_interval <= 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&sliding_states_mutex);
+    struct sliding_state *state = table_get(&sliding_states, name);
+    time_t since = 0;
+    if (state && (time(NULL) - state->last_full
+                    < options.full_refresh_interval)) {
+        since = state->last_refresh - INCREMENTAL_OVERLAP;
+    }
+    pthread_mutex_unlock(&sliding_states_mutex);
+    return since;
+}
+
+/* Record a successful refresh of the query directory name, which
+ * started at started. */
+static void record_sliding_refresh(const char *name, time_t started,
+                                   int full)
+{
+    pthread_mutex_lock(&sliding_states_mutex);
+    struct sliding_state *state = table_get(&sliding_states, name);
+    if (!state) {
+        state = calloc(1, sizeof(struct sliding_state));
+        if (!state
+                || (table_put(&sliding_states, name, state, NULL) != 0)) {
+            pthread_mutex_unlock(&sliding_states_mutex);
+            free(state);
+            return;
+        }
+    }
+    state->last_refresh = started;
+    if (full) {
+        state->last_full = started;
+    }
+    pthread_mutex_unlock(&sliding_states_mutex);
+}
+
+/* Clear the incremental refresh state for the query directory name,
+ * so that its next refresh is a full refresh. */
+static void clear_sliding_state(const char *name)
+{
+    pthread_mutex_lock(&sliding_states_mutex);
+    free(table_remove(&sliding_states, name));
+    pthread_mutex_unlock(&sliding_states_mutex);
+}
+
+/* Parse the Date header of the message at maildir_path into date.
+ * Returns an error code if the message has no Date header, or if it
+ * cannot be parsed. */
+static int parse_message_date(const char *maildir_path, time_t *date)
+{
+    int fd = open(maildir_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    char buf[8192];
+    ssize_t bytes = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (bytes <= 0) {
+        return -1;
+    }
+    buf[bytes] = '\0';
+
+    /* Dates without a time zone are taken to be in UTC. */
+    const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S %z",
+        "%d %b %Y %H:%M:%S %z",
+        "%a, %d %b %Y %H:%M %z",
+        "%a, %d %b %Y %H:%M:%S",
+        "%d %b %Y %H:%M:%S",
+        NULL
+    };
+    /* The header ends at the first empty line. */
+    char *line = buf;
+    while (line && (*line != '\0') && (*line != '\n')
+            && (*line != '\r')) {
+        if (strncasecmp(line, "Date:", 5) == 0) {
+            const char *value = line + 5 + strspn(line + 5, " \t");
+            for (int i = 0; formats[i]; i++) {
+                struct tm tm;
+                memset(&tm, 0, sizeof(tm));
+                if (strptime(value, formats[i], &tm)) {
+                    *date = timegm(&tm) - tm.tm_gmtoff;
+                    return 0;
+                }
+            }
+            return -1;
+        }
+        line = strchr(line, '\n');
+        if (line) {
+            line++;
+        }
+    }
+    return -1;
+}
+
+/* Get the date of the message at maildir_path, parsing it from the
+ * message if it has not been seen before. */
+static int get_message_date(const char *maildir_path, time_t *date)
+{
+    pthread_mutex_lock(&message_dates_mutex);
+    time_t *cached = table_get(&message_dates, maildir_path);
+    if (cached) {
+        *date = *cached;
+    }
+    pthread_mutex_unlock(&message_dates_mutex);
+    if (cached) {
+        return 0;
+    }
+
+    if (parse_message_date(maildir_path, date) != 0) {
+        return -1;
+    }
+    time_t *value = malloc(sizeof(time_t));
+    if (value) {
+        *value = *date;
+        void *previous = NULL;
+        pthread_mutex_lock(&message_dates_mutex);
+        if (table_put(&message_dates, maildir_path, value,
+                      &previous) != 0) {
+            free(value);
+        }
+        pthread_mutex_unlock(&message_dates_mutex);
+        free(previous);
+    }
+    return 0;
+}
+
+/* Forget the date of the message at maildir_path. */
+static void forget_message_date(const char *maildir_path)
+{
+    pthread_mutex_lock(&message_dates_mutex);
+    free(table_remove(&message_dates, maildir_path));
+    pthread_mutex_unlock(&message_dates_mutex);
+}
+
+/* Refresh the query directory name incrementally, writing its new
+ * results to temp_dirname.  query is run restricted to the messages
+ * that have changed since since, and those results are combined with
+ * the current results, less those that no longer exist or that are
+ * dated before window_start. */
+static int run_incremental_query(const char *name, const char *query,
+                                 const char *temp_dirname, time_t since,
+                                 time_t window_start, struct path *reason)
+{
+    const char *subdirs[] = { "cur", "new", "tmp" };
+    struct path path = PATH_INIT;
+    int res = 0;
+    for (int i = 0; (i < 3) && (res == 0); i++) {
+        res = path_setf(&path, "%s/%s", temp_dirname, subdirs[i]);
+        if ((res == 0) && (mkdir(path.buf, S_IRWXU) != 0)) {
+            syslog(LOG_ERR, "run_query: unable to make '%s': %s",
+                   path.buf, strerror(errno));
+            res = -1;
+        }
+    }
+
+    /* The changed messages are written to a subdirectory by mu, and
+     * then moved into place. */
+    char since_str[32];
+    struct tm tm;
+    localtime_r(&since, &tm);
+    strftime(since_str, sizeof(since_str), "%Y%m%d%H%M%S", &tm);
+    struct path incremental_query = PATH_INIT;
+    if (res == 0) {
+        res = path_setf(&incremental_query, "(%s) AND changed:%s..",
+                        query, since_str);
+    }
+    if (res == 0) {
+        res = path_setf(&path, "%s/incremental", temp_dirname);
+    }
+    if ((res == 0) && (mkdir(path.buf, S_IRWXU) != 0)) {
+        res = -1;
+    }
+    if (res == 0) {
+        res = run_query(incremental_query.buf, path.buf, reason);
+    }
+    if (res == 0) {
+        res = merge_shard_results(temp_dirname, path.buf);
+    }
+    path_free(&incremental_query);
+
+    /* Note the maildir paths of the changed messages, so that they
+     * are not also carried over from the current results. */
+    struct table changed = { 0 };
+    struct path link_path = PATH_INIT;
+    struct path target = PATH_INIT;
+    for (int i = 0; (i < 2) && (res == 0); i++) {
+        res = path_setf(&link_path, "%s/%s/", temp_dirname, subdirs[i]);
+        size_t dir_len = link_path.len;
+        DIR *dir_handle = ((res == 0) ? opendir(link_path.buf) : NULL);
+        if (!dir_handle) {
+            res = -1;
+            break;
+        }
+        struct dirent *dent;
+        while ((dent = readdir(dir_handle)) != NULL) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            path_truncate(&link_path, dir_len);
+            if ((path_append(&link_path, dent->d_name) != 0)
+                    || (path_readlink(&target, link_path.buf) != 0)) {
+                continue;
+            }
+            char *link_name = strdup(dent->d_name);
+            if (!link_name
+                    || (table_put(&changed, target.buf, link_name,
+                                  NULL) != 0)) {
+                free(link_name);
+                res = -1;
+                break;
+            }
+        }
+        closedir(dir_handle);
+    }
+
+    /* Carry over the current results, other than those that have
+     * changed, that no longer exist, or that have fallen out of the
+     * window.  The carried-over links have the same names as the
+     * current links, so that update_backing_dir retains them. */
+    char *gen = acquire_generation(name, "/", &link_path);
+    size_t gen_len = link_path.len;
+    for (int i = 0; (i < 2) && (res == 0); i++) {
+        path_truncate(&link_path, gen_len);
+        if (path_append(&link_path, subdirs[i]) != 0) {
+            res = -1;
+            break;
+        }
+        size_t dir_len = link_path.len;
+        DIR *dir_handle = opendir(link_path.buf);
+        if (!dir_handle) {
+            if (errno == ENOENT) {
+                continue;
+            }
+            syslog(LOG_ERR, "run_query: cannot open '%s': %s",
+                   link_path.buf, strerror(errno));
+            res = -1;
+            break;
+        }
+        struct dirent *dent;
+        while ((dent = readdir(dir_handle)) != NULL) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            path_truncate(&link_path, dir_len);
+            if ((path_push(&link_path, dent->d_name) != 0)
+                    || (path_readlink(&target, link_path.buf) != 0)
+                    || table_get(&changed, target.buf)) {
+                continue;
+            }
+            struct stat stbuf;
+            time_t date;
+            if ((lstat(target.buf, &stbuf) != 0)
+                    || ((get_message_date(target.buf, &date) == 0)
+                        && (date < window_start))) {
+                forget_message_date(target.buf);
+                continue;
+            }
+            if ((path_setf(&path, "%s/%s/%s", temp_dirname, subdirs[i],
+                           dent->d_name) != 0)
+                    || (symlink(target.buf, path.buf) != 0)) {
+                syslog(LOG_ERR, "run_query: cannot link '%s'",
+                       path.buf);
+                res = -1;
+                break;
+            }
+        }
+        closedir(dir_handle);
+    }
+    release_generation(gen);
+    table_clear(&changed);
+    path_free(&link_path);
+    path_free(&target);
+    path_free(&path);
+
+    return res;
+}
+
+static int start_population(const char *path, const char *name,
+                            const char *query, const char *temp_dirname,
+                            int sliding, time_t started);
+
+/* Run the query for the query directory name, and update its backing
+ * directory with the results.  path is the mount path being
+ * refreshed.  If the query fails, then a description of the failure
+ * may be written to reason.  If progressive is set and the query
+ * directory has no results yet, then the query directory may instead
+ * be populated as the query runs (see start_population), in which
+ * case 1 is returned once the first results are available. */
+static int update_query_dir(const char *path, const char *name,
+                            int force, int progressive,
+                            struct path *reason)
+{
+    /* The mu query is the query directory name, with each '+'
+     * replaced by '/'. */
+    char *query = strdup(name);
+    if (!query) {
+        return -1;
+    }
+    for (char *c = query; *c; c++) {
+        if (*c == '+') {
+            *c = '/';
+        }
+    }
+
+    struct path template = PATH_INIT;
+    struct path backing_path = PATH_INIT;
+    struct path temp_path = PATH_INIT;
+    if ((path_setf(&template, "%s/_tempdir.XXXXXX",
+                   options.backing_dir) != 0)
+            || (path_setf(&backing_path, "%s/_%s",
+                          options.backing_dir, name) != 0)) {
+        free(query);
+        path_free(&template);
+        path_free(&backing_path);
+        return -1;
+    }
+
+    struct trace_span span;
+    PHASE_BEGIN(span, refresh_mkdtemp, path);
+    char *temp_dirname = mkdtemp(template.buf);
+    PHASE_END(span, refresh_mkdtemp, path);
+    if (!temp_dirname) {
+        syslog(LOG_ERR, "refresh_dir: unable to make temporary "
+                        "directory (%s): %s",
+               template.buf, strerror(errno));
+        free(query);
+        path_free(&template);
+        path_free(&backing_path);
+        return -1;
+    }
+
+    PHASE_BEGIN(span, refresh_query, path);
+    time_t started = time(NULL);
+    int res = derive_query(name, temp_dirname, force);
+    time_t window_start = 0;
+    int sliding = ((res == 0)
+                    && (get_sliding_window(query, &window_start) == 0));
+    time_t since = (sliding ? get_incremental_since(name) : 0);
+    int populating = 0;
+    if ((res == 0) && since) {
+        syslog(LOG_DEBUG, "refresh_dir: refreshing '%s' incrementally",
+               path);
+        res = run_incremental_query(name, query, temp_dirname, since,
+                                    window_start, reason);
+    } else if (res == 0) {
+        if (progressive && (shard_count <= 1)) {
+            populating = start_population(path, name, query, temp_dirname,
+                                          sliding, started);
+        }
+        if (populating == 0) {
+            res = run_query(query, temp_dirname, reason);
+        } else if (populating < 0) {
+            res = -1;
+        }
+    } else if (res < 0) {
+        path_set(reason, "unable to refresh other query directories");
+    }
+    PHASE_END(span, refresh_query, path);
+    free(query);
+    if (populating > 0) {
+        path_free(&template);
+        path_free(&backing_path);
+        return 1;
+    }
+    int error = (res < 0);
+
+    /* The new generation is built alongside the current one, which
+     * readers continue to see until the new one is published.
+     * mapping_mutex is held throughout, so that renames and other
+     * refreshes do not change the link mappings in the meantime.
+     * This is a single lock for all query directories, rather than
+     * one per query directory: a rename relinks the message in every
+     * query directory that contains it (see update_link_mapping), so
+     * if renames could proceed during the build, then a rename of a
+     * message in the current generation after it had been linked
+     * into the new one would be lost on publishing.  The query itself
+     * has already been run by this point, so the lock only covers the
+     * linking of the results. */
+    struct path gen_path = PATH_INIT;
+    struct path marker_path = PATH_INIT;
+    char *gen_dirname = NULL;
+    if (!error) {
+        if (path_setf(&gen_path, "%s/_gen.XXXXXX",
+                      options.backing_dir) != 0) {
+            error = 1;
+        } else if (!(gen_dirname = mkdtemp(gen_path.buf))) {
+            syslog(LOG_ERR, "refresh_dir: unable to make generation "
+                            "directory (%s): %s",
+                   gen_path.buf, strerror(errno));
+            error = 1;
+        } else if (make_backing_dir_if_required(gen_dirname) != 0) {
+            syslog(LOG_ERR, "refresh_dir: cannot make backing directory");
+            error = 1;
+        }
+    }
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+
+    /* The previous generation is kept until the header cache has been
+     * built, so that its header cache can be reused. */
+    struct path old_gen_path = PATH_INIT;
+    char *old_gen = NULL;
+    if (!error && use_header_cache()) {
+        old_gen = acquire_generation(name, "", &old_gen_path);
+    }
+    path_free(&old_gen_path);
+
+    /* The query directory may have been removed while the query was
+     * running. */
+    struct stat stbuf;
+    if (!error) {
+        if (path_setf(&marker_path, "%s/%s", options.backing_dir,
+                      name) != 0) {
+            error = 1;
+        } else if (lstat(marker_path.buf, &stbuf) != 0) {
+            syslog(LOG_INFO, "refresh_dir: '%s' has been removed", path);
+            error = 1;
+        }
+    }
+
+    /* The "cur" and "new" paths share their prefixes with the backing,
+     * temporary and generation directory paths.  The backing paths
+     * refer to the current generation, by way of the "_<query>"
+     * link. */
+    size_t backing_len = backing_path.len;
+    size_t gen_len = gen_path.len;
+    struct prefetch_list prefetch = { NULL, 0, 0 };
+    struct prefetch_list *prefetch_ptr =
+        ((options.prefetch > 0) ? &prefetch : NULL);
+    const char *subdirs[] = { "/cur/", "/new/" };
+    for (int i = 0; (i < 2) && !error; i++) {
+        path_truncate(&backing_path, backing_len);
+        path_truncate(&gen_path, gen_len);
+        if ((path_append(&backing_path, subdirs[i]) != 0)
+                || (path_append(&gen_path, subdirs[i]) != 0)
+                || (path_setf(&temp_path, "%s%s", temp_dirname,
+                              subdirs[i]) != 0)) {
+            error = 1;
+            break;
+        }
+
+        if (i == 0) {
+            PHASE_BEGIN(span, refresh_update_cur, path);
+            res = update_backing_dir(backing_path.buf, temp_path.buf,
+                                     gen_path.buf, prefetch_ptr);
+            PHASE_END(span, refresh_update_cur, path);
+        } else {
+            PHASE_BEGIN(span, refresh_update_new, path);
+            res = update_backing_dir(backing_path.buf, temp_path.buf,
+                                     gen_path.buf, prefetch_ptr);
+            PHASE_END(span, refresh_update_new, path);
+        }
+        if (res != 0) {
+            syslog(LOG_ERR, "refresh_dir: cannot update backing "
+                            "directory '%s' (from '%s')",
+                   backing_path.buf, temp_path.buf);
+            error = 1;
+        }
+    }
+    if (!error) {
+        path_truncate(&gen_path, gen_len);
+        error = (publish_generation(name, basename_view(gen_path.buf)) != 0);
+    }
+    if (error) {
+        discard_changes(name);
+    } else {
+        publish_changes(name);
+    }
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    path_free(&backing_path);
+    path_free(&temp_path);
+    if (!error) {
+        run_prefetch(&prefetch, options.prefetch);
+    }
+    clear_prefetch(&prefetch);
+    if (!error && use_header_cache()) {
+        PHASE_BEGIN(span, refresh_header_cache, path);
+        build_header_cache(name, old_gen);
+        PHASE_END(span, refresh_header_cache, path);
+    }
+    release_generation(old_gen);
+
+    if (error) {
+        if (gen_dirname) {
+            path_truncate(&gen_path, gen_len);
+            remove_dir(gen_path.buf);
+        }
+        path_free(&gen_path);
+        path_free(&marker_path);
+        remove_dir(temp_dirname);
+        path_free(&template);
+        return -1;
+    }
+    path_free(&gen_path);
+    path_free(&marker_path);
+
+    if (sliding) {
+        record_sliding_refresh(name, started, !since);
+    }
+
+    PHASE_BEGIN(span, refresh_cleanup, path);
+    res = remove_temp_dir(temp_dirname);
+    PHASE_END(span, refresh_cleanup, path);
+    path_free(&template);
+    if (res != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The details of a query directory whose most recent refresh failed.
+ * count is the number of consecutive failures, and the query is not
+ * run again until retry_at, except by way of a forced refresh. */
+struct query_failure {
+    int count;
+    time_t retry_at;
+    char *error;
+};
+
+/* A map from query name to failure details.  Query directories that
+ * have not failed, or whose most recent refresh succeeded, have no
+ * entry. */
+static struct table query_failures;
+static pthread_mutex_t query_failures_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns a boolean indicating whether the query directory name has
+ * failed recently enough that it should not be refreshed yet. */
+static int in_failure_backoff(const char *name)
+{
+    pthread_mutex_lock(&query_failures_mutex);
+    struct query_failure *failure = table_get(&query_failures, name);
+    int res = (failure && (time(NULL) < failure->retry_at));
+    pthread_mutex_unlock(&query_failures_mutex);
+    return res;
+}
+
+/* Record a failure to refresh the query directory name, and set the
+ * time before which it is not refreshed again.  The backoff period
+ * starts at FAILURE_BACKOFF_MIN seconds and doubles with each
+ * consecutive failure, up to FAILURE_BACKOFF_MAX seconds. */
+static void record_query_failure(const char *name, const char *error)
+{
+    char *error_copy = strdup(error);
+    if (!error_copy) {
+        return;
+    }
+    pthread_mutex_lock(&query_failures_mutex);
+    struct query_failure *failure = table_get(&query_failures, name);
+    if (!failure) {
+        failure = calloc(1, sizeof(struct query_failure));
+        if (!failure
+                || (table_put(&query_failures, name, failure, NULL) != 0)) {
+            pthread_mutex_unlock(&query_failures_mutex);
+            free(failure);
+            free(error_copy);
+            return;
+        }
+    }
+    int backoff = FAILURE_BACKOFF_MIN;
+    for (int i = 0; (i < failure->count)
+                        && (backoff < FAILURE_BACKOFF_MAX); i++) {
+        backoff *= 2;
+    }
+    if (backoff > FAILURE_BACKOFF_MAX) {
+        backoff = FAILURE_BACKOFF_MAX;
+    }
+    int count = ++failure->count;
+    failure->retry_at = time(NULL) + backoff;
+    free(failure->error);
+    failure->error = error_copy;
+    pthread_mutex_unlock(&query_failures_mutex);
+
+    syslog(LOG_ERR, "refresh_dir: '%s' failed (%d time(s)), not "
+                    "retrying for %ds: %s",
+           name, count, backoff, error);
+}
+
+/* Clear any recorded failure for the query directory name. */
+static void clear_query_failure(const char *name)
+{
+    pthread_mutex_lock(&query_failures_mutex);
+    struct query_failure *failure = table_remove(&query_failures, name);
+    pthread_mutex_unlock(&query_failures_mutex);
+    if (failure) {
+        free(failure->error);
+        free(failure);
+    }
+}
+
+/* Statistics for the most recent successful refresh of a query
+ * directory: the number of results, the time at which the refresh
+ * completed, and the time that it took in milliseconds. */
+struct query_stats {
+    size_t count;
+    time_t last_refresh;
+    long refresh_ms;
+};
+
+/* A map from query name to refresh statistics.  Query directories that
+ * have not been refreshed since fsmu started have no entry. */
+static struct table query_stats;
+static pthread_mutex_t query_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Record the statistics for a successful refresh of the query
+ * directory name. */
+static void record_query_stats(const char *name, size_t count,
+                               long refresh_ms)
+{
+    pthread_mutex_lock(&query_stats_mutex);
+    struct query_stats *stats = table_get(&query_stats, name);
+    if (!stats) {
+        stats = calloc(1, sizeof(struct query_stats));
+        if (stats
+                && (table_put(&query_stats, name, stats, NULL) != 0)) {
+            free(stats);
+            stats = NULL;
+        }
+    }
+    if (stats) {
+        stats->count = count;
+        stats->last_refresh = time(NULL);
+        stats->refresh_ms = refresh_ms;
+    }
+    pthread_mutex_unlock(&query_stats_mutex);
+}
+
+/* Adjust the recorded number of results for the query directory name
+ * by delta, after a result has been added or removed other than by
+ * way of a refresh. */
+static void adjust_query_count(const char *name, int delta)
+{
+    pthread_mutex_lock(&query_stats_mutex);
+    struct query_stats *stats = table_get(&query_stats, name);
+    if (stats && ((delta > 0) || (stats->count >= (size_t) -delta))) {
+        stats->count += delta;
+    }
+    pthread_mutex_unlock(&query_stats_mutex);
+}
+
+/* Forget the refresh statistics for the query directory name. */
+static void clear_query_stats(const char *name)
+{
+    pthread_mutex_lock(&query_stats_mutex);
+    free(table_remove(&query_stats, name));
+    pthread_mutex_unlock(&query_stats_mutex);
+}
+
+/* Count the results in the current generation of the query directory
+ * name. */
+static size_t count_query_entries(const char *name)
+{
+    struct path gen_path = PATH_INIT;
+    char *gen = acquire_generation(name, "", &gen_path);
+    size_t count = 0;
+    size_t gen_len = gen_path.len;
+    const char *subdirs[] = { "cur", "new" };
+    for (int i = 0; (i < 2) && gen_path.buf; i++) {
+        path_truncate(&gen_path, gen_len);
+        if (path_push(&gen_path, subdirs[i]) != 0) {
+            break;
+        }
+        DIR *dir_handle = opendir(gen_path.buf);
+        if (!dir_handle) {
+            continue;
+        }
+        struct dirent *dent;
+        while ((dent = readdir(dir_handle)) != NULL) {
+            if (!is_upwards(dent->d_name)) {
+                count++;
+            }
+        }
+        closedir(dir_handle);
+    }
+    release_generation(gen);
+    path_free(&gen_path);
+    return count;
+}
+
+/* Held while files are added to or removed from the state directory,
+ * "__state" in the backing directory, so that it is not removed while
+ * a file is being written to it.  (As for the graveyard, the name is
+ * one that no query directory's results link can have.) */
+static pthread_mutex_t state_dir_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create the state directory if necessary, and write its path to buf.
+ * The caller must hold state_dir_mutex. */
+static int make_state_dir(struct path *buf)
+{
+    if ((path_setf(buf, "%s/__state", options.backing_dir) != 0)
+            || ((mkdir(buf->buf, S_IRWXU) != 0) && (errno != EEXIST))) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Remove the state directory if it no longer holds any files, so that
+ * nothing is left behind in the backing directory once all of the
+ * query directories have been removed.  The caller must hold
+ * state_dir_mutex. */
+static void remove_state_dir(void)
+{
+    struct path state_path = PATH_INIT;
+    if ((path_setf(&state_path, "%s/__state", options.backing_dir) == 0)
+            && (rmdir(state_path.buf) != 0)
+            && (errno != ENOENT) && (errno != ENOTEMPTY)
+            && (errno != EEXIST)) {
+        syslog(LOG_ERR, "remove_state_dir: unable to remove '%s': %s",
+               state_path.buf, strerror(errno));
+    }
+    path_free(&state_path);
+}
+
+/* The refresh time in milliseconds at which a query's refresh interval
+ * is neither lengthened nor shortened on account of its cost (see
+ * get_refresh_interval). */
+#define REFRESH_COST_MS 1000
+
+/* The weight given to each new sample in the running averages of a
+ * query's refresh cost and change rate. */
+#define REFRESH_SAMPLE_WEIGHT 0.25
+
+/* The recent refresh behaviour of a query directory, from which its
+ * refresh interval is derived.  cost_ms is the running average of the
+ * time its refreshes take, and change_rate is the running average of
+ * the proportion of its refreshes that changed its results.  interval
+ * is the interval set for the query directory by way of its
+ * user.fsmu.refresh_interval attribute, if any, which is used instead
+ * of the derived interval.  This state is kept in "__state/<name>" in
+ * the backing directory, so that it persists across restarts, and
+ * dirty is set when it has changed since it was last written there
+ * (see save_refresh_states). */
+struct refresh_state {
+    double cost_ms;
+    double change_rate;
+    int samples;
+    int interval;
+    int dirty;
+};
+
+/* A map from query name to refresh state. */
+static struct table refresh_states;
+static pthread_mutex_t refresh_states_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write the path of the file that holds the refresh state for the
+ * query directory name to buf. */
+static int get_refresh_state_path(const char *name, struct path *buf)
+{
+    return path_setf(buf, "%s/__state/%s", options.backing_dir, name);
+}
+
+/* Get the refresh state for the query directory name, loading it from
+ * the backing directory or creating it if necessary.  The caller must
+ * hold refresh_states_mutex. */
+static struct refresh_state *get_refresh_state(const char *name)
+{
+    struct refresh_state *state = table_get(&refresh_states, name);
+    if (state) {
+        return state;
+    }
+    state = calloc(1, sizeof(struct refresh_state));
+    if (!state || (table_put(&refresh_states, name, state, NULL) != 0)) {
+        free(state);
+        return NULL;
+    }
+    state->change_rate = 0.5;
+
+    struct path state_path = PATH_INIT;
+    FILE *state_file = NULL;
+    if ((get_refresh_state_path(name, &state_path) == 0)
+            && ((state_file = fopen(state_path.buf, "r")) != NULL)) {
+        struct refresh_state loaded = { 0 };
+        if (fscanf(state_file, "%lf %lf %d %d", &loaded.cost_ms,
+                   &loaded.change_rate, &loaded.samples,
+                   &loaded.interval) == 4) {
+            *state = loaded;
+        } else {
+            syslog(LOG_ERR, "refresh_state: '%s' is invalid",
+                   state_path.buf);
+        }
+        fclose(state_file);
+    }
+    path_free(&state_path);
+    return state;
+}
+
+/* Write the refresh state for the query directory name to the backing
+ * directory.  Returns 0 on success, or -1 on error.  The caller must
+ * hold refresh_states_mutex and state_dir_mutex. */
+static int save_refresh_state(const char *name,
+                              const struct refresh_state *state)
+{
+    struct path state_path = PATH_INIT;
+    struct path temp_path = PATH_INIT;
+    if ((make_state_dir(&state_path) != 0)
+            || (get_refresh_state_path(name, &state_path) != 0)
+            || (path_setf(&temp_path, "%s.tmp", state_path.buf) != 0)) {
+        path_free(&state_path);
+        path_free(&temp_path);
+        return -1;
+    }
+    FILE *state_file = fopen(temp_path.buf, "w");
+    int res = -1;
+    if (state_file) {
+        res = (fprintf(state_file, "%.3f %.4f %d %d\n", state->cost_ms,
+                       state->change_rate, state->samples,
+                       state->interval) < 0);
+        res |= (fclose(state_file) != 0);
+    }
+    if ((res != 0) || (rename(temp_path.buf, state_path.buf) != 0)) {
+        syslog(LOG_ERR, "refresh_state: unable to write '%s': %s",
+               state_path.buf, strerror(errno));
+        unlink(temp_path.buf);
+        res = -1;
+    }
+    path_free(&state_path);
+    path_free(&temp_path);
+    return res;
+}
+
+/* Write the refresh states that have changed since they were last
+ * written to the backing directory.  This is done periodically by the
+ * reaper (see reaper_thread), and when fsmu stops, rather than after
+ * each refresh, in the same way as for the access log.  A state that
+ * cannot be written is tried again next time. */
+static void save_refresh_states(void)
+{
+    pthread_mutex_lock(&refresh_states_mutex);
+    pthread_mutex_lock(&state_dir_mutex);
+    for (size_t i = 0; i < refresh_states.size; i++) {
+        struct table_entry *entry = refresh_states.buckets[i];
+        for (; entry; entry = entry->next) {
+            struct refresh_state *state = entry->value;
+            if (state->dirty
+                    && (save_refresh_state(entry->key, state) == 0)) {
+                state->dirty = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&state_dir_mutex);
+    pthread_mutex_unlock(&refresh_states_mutex);
+}
+
+/* Get the interval in seconds between refreshes of the query directory
+ * name.  Unless an interval has been set for the query directory, this
+ * is --refresh-timeout, scaled up in proportion to the query's average
+ * refresh time (relative to REFRESH_COST_MS) and down in proportion to
+ * the proportion of its refreshes that change its results (relative to
+ * one half), and then limited to --refresh-min and --refresh-max. */
+static int get_refresh_interval(const char *name)
+{
+    int min = (options.refresh_min ? options.refresh_min
+                                   : options.refresh_timeout);
+    int max = (options.refresh_max ? options.refresh_max
+                                   : options.refresh_timeout);
+    double interval = options.refresh_timeout;
+
+    pthread_mutex_lock(&refresh_states_mutex);
+    struct refresh_state *state = get_refresh_state(name);
+    if (state && (state->interval > 0)) {
+        int res = state->interval;
+        pthread_mutex_unlock(&refresh_states_mutex);
+        return res;
+    }
+    if (state && (state->samples > 0)) {
+        double change_rate = ((state->change_rate > 0.0625)
+                                 ? state->change_rate : 0.0625);
+        interval *= ((state->cost_ms + REFRESH_COST_MS)
+                         / (2.0 * REFRESH_COST_MS))
+                    * (0.5 / change_rate);
+    }
+    pthread_mutex_unlock(&refresh_states_mutex);
+
+    if (interval < min) {
+        return min;
+    }
+    return ((interval > max) ? max : (int) interval);
+}
+
+/* Record a successful refresh of the query directory name, which took
+ * refresh_ms milliseconds, and which changed its results if changed
+ * is set.  changed is -1 if it is not known whether the results
+ * changed (e.g. because this was the query directory's first
+ * refresh). */
+static void record_refresh_sample(const char *name, long refresh_ms,
+                                  int changed)
+{
+    pthread_mutex_lock(&refresh_states_mutex);
+    struct refresh_state *state = get_refresh_state(name);
+    if (state) {
+        if (state->samples == 0) {
+            state->cost_ms = refresh_ms;
+        } else {
+            state->cost_ms += REFRESH_SAMPLE_WEIGHT
+                                  * (refresh_ms - state->cost_ms);
+        }
+        if (changed >= 0) {
+            state->change_rate += REFRESH_SAMPLE_WEIGHT
+                                      * (changed - state->change_rate);
+        }
+        state->samples++;
+        state->dirty = 1;
+    }
+    pthread_mutex_unlock(&refresh_states_mutex);
+}
+
+/* Set the interval in seconds between refreshes of the query directory
+ * name, or go back to deriving the interval if interval is 0. */
+static int set_refresh_interval(const char *name, int interval)
+{
+    pthread_mutex_lock(&refresh_states_mutex);
+    struct refresh_state *state = get_refresh_state(name);
+    if (state) {
+        state->interval = interval;
+        pthread_mutex_lock(&state_dir_mutex);
+        state->dirty = (save_refresh_state(name, state) != 0);
+        pthread_mutex_unlock(&state_dir_mutex);
+    }
+    pthread_mutex_unlock(&refresh_states_mutex);
+    return (state ? 0 : -1);
+}
+
+/* Forget the refresh state for the removed query directory name. */
+static void clear_refresh_state(const char *name)
+{
+    struct path state_path = PATH_INIT;
+    pthread_mutex_lock(&refresh_states_mutex);
+    free(table_remove(&refresh_states, name));
+    pthread_mutex_lock(&state_dir_mutex);
+    if (get_refresh_state_path(name, &state_path) == 0) {
+        unlink(state_path.buf);
+    }
+    remove_state_dir();
+    pthread_mutex_unlock(&state_dir_mutex);
+    pthread_mutex_unlock(&refresh_states_mutex);
+    path_free(&state_path);
+}
+
+/* The interval in milliseconds at which the results written so far by
+ * mu are added to a query directory that is being populated (see
+ * start_population). */
+#define POPULATE_INTERVAL_MS 50
+
+/* A query directory that is being populated as its query runs.  gen is
+ * the generation that the results are added to, which is published
+ * before the query is started.  prefetched is the number of bytes of
+ * results that have been prefetched so far.  waiting is set if a
+ * waiter thread has been started for the query, exited and res are
+ * set once mu has finished, and published is set once the first
+ * results have been added. */
+struct population {
+    char *path;
+    char *name;
+    char *query;
+    char *temp_dirname;
+    char *gen;
+    int sliding;
+    time_t started;
+    struct timespec begun;
+    pid_t pid;
+    int err_fd;
+    struct path reason;
+    off_t prefetched;
+    pthread_t waiter;
+    int waiting;
+    int exited;
+    int res;
+    int published;
+};
+
+/* A map from query name to population, for query directories that are
+ * being populated.  populations_cond is signalled whenever a
+ * population adds results or finishes. */
+static struct table populations;
+static pthread_mutex_t populations_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t populations_cond = PTHREAD_COND_INITIALIZER;
+
+/* Returns a boolean indicating whether the query directory name is
+ * being populated. */
+static int is_populating(const char *name)
+{
+    pthread_mutex_lock(&populations_mutex);
+    int res = (table_get(&populations, name) != NULL);
+    pthread_mutex_unlock(&populations_mutex);
+    return res;
+}
+
+/* Wait until the query directory name is not being populated. */
+static void wait_for_population(const char *name)
+{
+    pthread_mutex_lock(&populations_mutex);
+    while (table_get(&populations, name)) {
+        pthread_cond_wait(&populations_cond, &populations_mutex);
+    }
+    pthread_mutex_unlock(&populations_mutex);
+}
+
+/* Returns a boolean indicating whether the generation for pop is still
+ * the current generation of a query directory that exists.  The
+ * caller must hold mapping_mutex. */
+static int is_population_current(struct population *pop)
+{
+    struct path path = PATH_INIT;
+    struct path gen = PATH_INIT;
+    struct stat stbuf;
+    int res = ((path_setf(&path, "%s/%s", options.backing_dir,
+                          pop->name) == 0)
+                && (stat(path.buf, &stbuf) == 0)
+                && (path_setf(&path, "%s/_%s", options.backing_dir,
+                              pop->name) == 0)
+                && (path_readlink(&gen, path.buf) == 0)
+                && (strcmp(gen.buf, pop->gen) == 0));
+    path_free(&path);
+    path_free(&gen);
+    return res;
+}
+
+/* Add the results written so far by mu to the generation for pop, and
+ * add the number added to added.  The results are prefetched (see
+ * --prefetch) until the population's prefetch budget has been used.
+ * Returns an error code if the generation is no longer current (e.g.
+ * because the query directory has been removed), or if the results
+ * cannot be added. */
+static int add_population_results(struct population *pop, size_t *added)
+{
+    struct path backing_path = PATH_INIT;
+    struct path temp_path = PATH_INIT;
+    struct path gen_path = PATH_INIT;
+    struct prefetch_list prefetch = { NULL, 0, 0 };
+    struct prefetch_list *prefetch_ptr =
+        ((pop->prefetched < options.prefetch) ? &prefetch : NULL);
+    const char *subdirs[] = { "/cur/", "/new/" };
+    int res = 0;
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    if (!is_population_current(pop)) {
+        syslog(LOG_INFO, "refresh_dir: '%s' has been removed",
+               pop->path);
+        res = -1;
+    }
+    for (int i = 0; (i < 2) && (res == 0); i++) {
+        res = ((path_setf(&backing_path, "%s/_%s%s", options.backing_dir,
+                          pop->name, subdirs[i]) == 0)
+                && (path_setf(&temp_path, "%s%s", pop->temp_dirname,
+                              subdirs[i]) == 0)
+                && (path_setf(&gen_path, "%s/%s%s", options.backing_dir,
+                              pop->gen, subdirs[i]) == 0))
+                ? add_results(backing_path.buf, temp_path.buf,
+                              gen_path.buf, 0, added, prefetch_ptr)
+                : -1;
+    }
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    path_free(&backing_path);
+    path_free(&temp_path);
+    path_free(&gen_path);
+    if (res == 0) {
+        pop->prefetched += run_prefetch(&prefetch,
+                                        options.prefetch - pop->prefetched);
+    }
+    clear_prefetch(&prefetch);
+    return res;
+}
+
+/* Wait for the mu command for a population to finish, and then record
+ * its result and wake the population thread. */
+static void *population_waiter_thread(void *arg)
+{
+    struct population *pop = arg;
+    int res = wait_find(pop->pid, pop->err_fd, &pop->reason);
+    release_mu_slot();
+    pthread_mutex_lock(&populations_mutex);
+    pop->res = res;
+    pop->exited = 1;
+    pthread_cond_broadcast(&populations_cond);
+    pthread_mutex_unlock(&populations_mutex);
+    return NULL;
+}
+
+/* Finish populating a query directory.  If the query succeeded, then
+ * the refresh is recorded as for any other refresh.  Otherwise, the
+ * partial results are removed, and the failure is recorded. */
+static void finish_population(struct population *pop, int error)
+{
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    long refresh_ms = ((finished.tv_sec - pop->begun.tv_sec) * 1000)
+                          + ((finished.tv_nsec - pop->begun.tv_nsec)
+                              / 1000000);
+
+    /* The query directory may have been removed or refreshed in the
+     * meantime, in which case it is left as it is. */
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    int current = is_population_current(pop);
+    if (current && !error) {
+        clear_query_failure(pop->name);
+        record_query_stats(pop->name, count_query_entries(pop->name),
+                           refresh_ms);
+        record_refresh_sample(pop->name, refresh_ms, -1);
+        if (pop->sliding) {
+            record_sliding_refresh(pop->name, pop->started, 1);
+        }
+    } else if (current) {
+        unpublish_generation(pop->name);
+        record_query_failure(pop->name,
+                             (pop->reason.len ? pop->reason.buf
+                                              : "unable to refresh "
+                                                "query directory"));
+    }
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    if (current && error) {
+        remove_change_log(pop->name);
+    } else if (current && use_header_cache()) {
+        build_header_cache(pop->name, NULL);
+    }
+
+    if (error) {
+        remove_dir(pop->temp_dirname);
+    } else {
+        remove_temp_dir(pop->temp_dirname);
+    }
+}
+
+/* Free a population. */
+static void free_population(struct population *pop)
+{
+    free(pop->path);
+    free(pop->name);
+    free(pop->query);
+    free(pop->temp_dirname);
+    free(pop->gen);
+    path_free(&pop->reason);
+    free(pop);
+}
+
+/* Populate a query directory as its query runs, by adding the results
+ * written so far by mu to the query directory's generation every
+ * POPULATE_INTERVAL_MS milliseconds, until mu has finished. */
+static void *population_thread(void *arg)
+{
+    struct population *pop = arg;
+    struct trace_span span;
+    PHASE_BEGIN(span, mu_find, pop->query);
+
+    int error = 0;
+    for (;;) {
+        pthread_mutex_lock(&populations_mutex);
+        int exited = pop->exited;
+        pthread_mutex_unlock(&populations_mutex);
+
+        size_t added = 0;
+        error = (add_population_results(pop, &added) != 0);
+
+        pthread_mutex_lock(&populations_mutex);
+        if (added && !pop->published) {
+            pop->published = 1;
+            pthread_cond_broadcast(&populations_cond);
+        }
+        if (exited || error) {
+            pthread_mutex_unlock(&populations_mutex);
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += POPULATE_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!pop->exited) {
+            pthread_cond_timedwait(&populations_cond, &populations_mutex,
+                                   &deadline);
+        }
+        pthread_mutex_unlock(&populations_mutex);
+    }
+
+    /* If the results could not be added, then the query is left to
+     * finish regardless. */
+    if (pop->waiting) {
+        pthread_join(pop->waiter, NULL);
+    }
+    PHASE_END(span, mu_find, pop->query);
+    error |= (pop->res != 0);
+    finish_population(pop, error);
+    syslog(LOG_DEBUG, "refresh_dir: '%s' populated", pop->path);
+
+    pthread_mutex_lock(&populations_mutex);
+    table_remove(&populations, pop->name);
+    pthread_cond_broadcast(&populations_cond);
+    pthread_mutex_unlock(&populations_mutex);
+    free_population(pop);
+    return NULL;
+}
+
+/* Start populating the query directory name, which is being refreshed
+ * by way of the mount path path, as its query runs, so that the first
+ * results can be listed without waiting for the query to finish.  The
+ * query is run with the most recent results first, in temp_dirname
+ * (which is copied).  This only happens if the query directory has no
+ * results yet: the results are added to a new generation that is
+ * published straight away, rather than once it is complete.  Returns
+ * 1 once the first results have been added (or the query has
+ * finished), 0 if the query directory already has results, and -1 on
+ * error. */
+static int start_population(const char *path, const char *name,
+                            const char *query, const char *temp_dirname,
+                            int sliding, time_t started)
+{
+    struct population *pop = calloc(1, sizeof(struct population));
+    if (!pop) {
+        return -1;
+    }
+    struct path gen_path = PATH_INIT;
+    struct path link_path = PATH_INIT;
+    pop->path = strdup(path);
+    pop->name = strdup(name);
+    pop->query = strdup(query);
+    pop->temp_dirname = strdup(temp_dirname);
+    pop->sliding = sliding;
+    pop->started = started;
+    clock_gettime(CLOCK_MONOTONIC, &pop->begun);
+    if (!pop->path || !pop->name || !pop->query || !pop->temp_dirname
+            || (make_backing_dir_if_required(temp_dirname) != 0)
+            || (path_setf(&gen_path, "%s/_gen.XXXXXX",
+                          options.backing_dir) != 0)
+            || (path_setf(&link_path, "%s/_%s", options.backing_dir,
+                          name) != 0)) {
+        path_free(&gen_path);
+        path_free(&link_path);
+        free_population(pop);
+        return -1;
+    }
+    if (!mkdtemp(gen_path.buf)
+            || (make_backing_dir_if_required(gen_path.buf) != 0)) {
+        syslog(LOG_ERR, "refresh_dir: unable to make generation "
+                        "directory (%s): %s",
+               gen_path.buf, strerror(errno));
+        path_free(&gen_path);
+        path_free(&link_path);
+        free_population(pop);
+        return -1;
+    }
+    pop->gen = strdup(basename_view(gen_path.buf));
+
+    /* The population is registered before the generation is published,
+     * so that other refreshes wait for it to finish rather than using
+     * the partial results. */
+    int res = 0;
+    pthread_mutex_lock(&populations_mutex);
+    if (!pop->gen || table_get(&populations, name)
+            || (table_put(&populations, name, pop, NULL) != 0)) {
+        res = -1;
+    }
+    pthread_mutex_unlock(&populations_mutex);
+    if (res == 0) {
+        struct stat stbuf;
+        pthread_mutex_lock(&propagation_queue.mapping_mutex);
+        if (lstat(link_path.buf, &stbuf) == 0) {
+            res = 1;
+        } else if (publish_generation(name, pop->gen) != 0) {
+            res = -1;
+        }
+        pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+        if (res != 0) {
+            pthread_mutex_lock(&populations_mutex);
+            table_remove(&populations, name);
+            pthread_cond_broadcast(&populations_cond);
+            pthread_mutex_unlock(&populations_mutex);
+        }
+    }
+    path_free(&link_path);
+    if (res != 0) {
+        remove_dir(gen_path.buf);
+        path_free(&gen_path);
+        free_population(pop);
+        /* The query directory already has results. */
+        return ((res == 1) ? 0 : -1);
+    }
+    path_free(&gen_path);
+
+    if (flush_index_updates() != 0) {
+        syslog(LOG_INFO, "run_query: unable to update index, "
+                         "results may be out of date");
+    }
+    /* The slot is held until mu has finished, rather than until the
+     * first results are published. */
+    struct trace_span span;
+    PHASE_BEGIN(span, mu_queue, query);
+    acquire_mu_slot(query);
+    PHASE_END(span, mu_queue, query);
+    pop->pid = start_find(query, temp_dirname, get_shard_mu_home(0), 1,
+                          &pop->err_fd);
+    if (pop->pid == -1) {
+        release_mu_slot();
+        pop->exited = 1;
+        pop->res = -1;
+    } else if (pthread_create(&pop->waiter, NULL,
+                              population_waiter_thread, pop) == 0) {
+        pop->waiting = 1;
+    } else {
+        syslog(LOG_ERR, "refresh_dir: unable to start waiter thread");
+        pop->res = wait_find(pop->pid, pop->err_fd, &pop->reason);
+        release_mu_slot();
+        pop->exited = 1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, population_thread, pop) != 0) {
+        syslog(LOG_ERR, "refresh_dir: unable to start population "
+                        "thread");
+        population_thread(pop);
+        return 1;
+    }
+    pthread_detach(thread);
+
+    pthread_mutex_lock(&populations_mutex);
+    while ((table_get(&populations, name) == pop) && !pop->published) {
+        pthread_cond_wait(&populations_cond, &populations_mutex);
+    }
+    pthread_mutex_unlock(&populations_mutex);
+    return 1;
+}
+
+/* A map from query directory name to the time at which the directory
+ * was last accessed, for evicting the results of idle query
+ * directories and for warming up the most recently used ones first.
+ * query_accesses_dirty is set when the map has changed since it was
+ * last written to the access log (see save_query_accesses). */
+static struct table query_accesses;
+static int query_accesses_dirty;
+static pthread_mutex_t query_accesses_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Record that the query directory name has been accessed. */
+static void record_query_access(const char *name)
+{
+    time_t now = time(NULL);
+    pthread_mutex_lock(&query_accesses_mutex);
+    time_t *last_access = table_get(&query_accesses, name);
+    if (!last_access) {
+        last_access = malloc(sizeof(time_t));
+        if (last_access
+                && (table_put(&query_accesses, name, last_access,
+                              NULL) != 0)) {
+            free(last_access);
+            last_access = NULL;
+        }
+    }
+    if (last_access) {
+        *last_access = now;
+        query_accesses_dirty = 1;
+    }
+    pthread_mutex_unlock(&query_accesses_mutex);
+}
+
+/* Forget the last access time for the query directory name. */
+static void clear_query_access(const char *name)
+{
+    pthread_mutex_lock(&query_accesses_mutex);
+    free(table_remove(&query_accesses, name));
+    query_accesses_dirty = 1;
+    pthread_mutex_unlock(&query_accesses_mutex);
+}
+
+/* Get the time at which the query directory name was last accessed.
+ * If it has not been accessed since fsmu started, then the time of its
+ * last refresh is used instead.  Returns 0 if neither is known. */
+static time_t get_query_access(const char *name)
+{
+    pthread_mutex_lock(&query_accesses_mutex);
+    time_t *last_access = table_get(&query_accesses, name);
+    time_t res = (last_access ? *last_access : 0);
+    pthread_mutex_unlock(&query_accesses_mutex);
+    if (last_access) {
+        return res;
+    }
+
+    struct path last_update_path = PATH_INIT;
+    struct stat stbuf;
+    if ((path_setf(&last_update_path, "%s/%s.last-update",
+                   options.backing_dir, name) == 0)
+            && (stat(last_update_path.buf, &stbuf) == 0)) {
+        res = stbuf.st_mtime;
+    }
+    path_free(&last_update_path);
+    return res;
+}
+
+/* Write the last access times of query directories to the access log,
+ * "__state/_access" in the backing directory, if they have changed
+ * since it was last written, so that they are known when fsmu is next
+ * started (see load_query_accesses).  Each line of the log is an access
+ * time followed by a query directory name.  The log is removed once
+ * there are no query directories left to record. */
+static void save_query_accesses(void)
+{
+    struct path contents = PATH_INIT;
+    int res = 0;
+    pthread_mutex_lock(&query_accesses_mutex);
+    int dirty = query_accesses_dirty;
+    for (size_t i = 0; dirty && (i < query_accesses.size); i++) {
+        struct table_entry *entry = query_accesses.buckets[i];
+        for (; entry && (res == 0); entry = entry->next) {
+            res = path_appendf(&contents, "%lld %s\n",
+                               (long long) *((time_t *) entry->value),
+                               entry->key);
+        }
+    }
+    query_accesses_dirty = 0;
+    pthread_mutex_unlock(&query_accesses_mutex);
+    if (!dirty) {
+        return;
+    }
+
+    struct path log_path = PATH_INIT;
+    struct path temp_path = PATH_INIT;
+    FILE *log_file = NULL;
+    pthread_mutex_lock(&state_dir_mutex);
+    if ((res == 0) && (contents.len == 0)) {
+        if ((path_setf(&log_path, "%s/__state/_access",
+                       options.backing_dir) != 0)
+                || ((unlink(log_path.buf) != 0) && (errno != ENOENT))) {
+            res = -1;
+        }
+        remove_state_dir();
+    } else if ((res == 0)
+            && (make_state_dir(&log_path) == 0)
+            && (path_append(&log_path, "/_access") == 0)
+            && (path_setf(&temp_path, "%s.tmp", log_path.buf) == 0)
+            && ((log_file = fopen(temp_path.buf, "w")) != NULL)) {
+        res = (fwrite(contents.buf, contents.len, 1, log_file) != 1);
+        res |= (fclose(log_file) != 0);
+        if ((res == 0) && (rename(temp_path.buf, log_path.buf) != 0)) {
+            res = -1;
+        }
+    } else {
+        res = -1;
+    }
+    pthread_mutex_unlock(&state_dir_mutex);
+    if (res != 0) {
+        syslog(LOG_ERR, "save_query_accesses: unable to write access "
+                        "log: %s",
+               strerror(errno));
+        if (temp_path.buf) {
+            unlink(temp_path.buf);
+        }
+        /* The log is written again next time. */
+        pthread_mutex_lock(&query_accesses_mutex);
+        query_accesses_dirty = 1;
+        pthread_mutex_unlock(&query_accesses_mutex);
+    }
+    path_free(&contents);
+    path_free(&log_path);
+    path_free(&temp_path);
+}
+
+/* Read the last access times of query directories from the access log
+ * (see save_query_accesses).  Entries for query directories that no
+ * longer exist are ignored. */
+static void load_query_accesses(void)
+{
+    struct path log_path = PATH_INIT;
+    FILE *log_file = NULL;
+    if ((path_setf(&log_path, "%s/__state/_access",
+                   options.backing_dir) != 0)
+            || !(log_file = fopen(log_path.buf, "r"))) {
+        path_free(&log_path);
+        return;
+    }
+
+    struct path marker_path = PATH_INIT;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, log_file)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        char *name;
+        long long last_access = strtoll(line, &name, 10);
+        struct stat stbuf;
+        if ((*name != ' ') || (name[1] == '\0') || (name[1] == '_')
+                || strchr(name + 1, '/')
+                || (path_setf(&marker_path, "%s/%s", options.backing_dir,
+                              name + 1) != 0)
+                || (stat(marker_path.buf, &stbuf) != 0)) {
+            continue;
+        }
+        pthread_mutex_lock(&query_accesses_mutex);
+        if (!table_get(&query_accesses, name + 1)) {
+            time_t *value = malloc(sizeof(time_t));
+            if (value
+                    && (table_put(&query_accesses, name + 1, value,
+                                  NULL) != 0)) {
+                free(value);
+                value = NULL;
+            }
+            if (value) {
+                *value = last_access;
+            }
+        }
+        pthread_mutex_unlock(&query_accesses_mutex);
+    }
+    free(line);
+    fclose(log_file);
+    path_free(&marker_path);
+    path_free(&log_path);
+}
+
+/* Get the number of seconds between checks for query directories whose
+ * results should be evicted.  This is shortened if --evict-age is less
+ * than EVICT_INTERVAL, so that the age is applied more accurately. */
+static int get_eviction_interval(void)
+{
+    if ((options.evict_age > 0) && (options.evict_age < EVICT_INTERVAL)) {
+        return options.evict_age;
+    }
+    return EVICT_INTERVAL;
+}
+
+/* Evict the results of the query directory name, so that only the
+ * query directory itself is kept, and it is repopulated when it is
+ * next accessed.  Nothing is evicted if the query directory has been
+ * accessed since last_access.  The results are removed by the reaper,
+ * in the same way as for a removed query directory. */
+static void evict_query_dir(const char *name, time_t last_access)
+{
+    struct path marker_path = PATH_INIT;
+    if (path_setf(&marker_path, "%s/%s", options.backing_dir, name) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    struct stat stbuf;
+    int res = -1;
+    if ((get_query_access(name) == last_access)
+            && !is_populating(name)
+            && (stat(marker_path.buf, &stbuf) == 0)) {
+        res = unpublish_generation(name);
+    }
+    if ((res == 0)
+            && (path_append(&marker_path, ".last-update") == 0)
+            && (unlink(marker_path.buf) != 0) && (errno != ENOENT)) {
+        syslog(LOG_ERR, "evict: unable to remove '%s': %s",
+               marker_path.buf, strerror(errno));
+    }
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    path_free(&marker_path);
+    if (res != 0) {
+        return;
+    }
+
+    clear_sliding_state(name);
+    remove_change_log(name);
+    clear_query_stats(name);
+    syslog(LOG_INFO, "evict: evicted results for '%s'", name);
+}
+
+/* A query directory that has results, as listed by
+ * list_query_usage. */
+struct query_usage {
+    char *name;
+    time_t last_access;
+    size_t entries;
+};
+
+/* Compare two query directories by last access time. */
+static int compare_query_usage(const void *a, const void *b)
+{
+    time_t access_a = ((const struct query_usage *) a)->last_access;
+    time_t access_b = ((const struct query_usage *) b)->last_access;
+    return (access_a < access_b) ? -1 : (access_a > access_b);
+}
+
+/* List the query directories that have results, least recently
+ * accessed first, along with their numbers of results if
+ * count_entries is set.  The number of query directories is written
+ * to count. */
+static struct query_usage *list_query_usage(int count_entries,
+                                            size_t *count)
+{
+    *count = 0;
+    DIR *dir_handle = opendir(options.backing_dir);
+    if (!dir_handle) {
+        syslog(LOG_ERR, "list_query_usage: cannot open '%s': %s",
+               options.backing_dir, strerror(errno));
+        return NULL;
+    }
+    struct query_usage *queries = NULL;
+    size_t capacity = 0;
+    struct path link_path = PATH_INIT;
+    struct dirent *dent;
+    while ((dent = readdir(dir_handle)) != NULL) {
+        if (is_upwards(dent->d_name) || (dent->d_name[0] == '_')) {
+            continue;
+        }
+        /* Only query directories with results have a "_<query>"
+         * link. */
+        struct stat stbuf;
+        if ((path_setf(&link_path, "%s/_%s", options.backing_dir,
+                       dent->d_name) != 0)
+                || (lstat(link_path.buf, &stbuf) != 0)) {
+            continue;
+        }
+        if (*count == capacity) {
+            size_t new_capacity = (capacity ? capacity * 2 : 16);
+            struct query_usage *new_queries =
+                realloc(queries,
+                        new_capacity * sizeof(struct query_usage));
+            if (!new_queries) {
+                break;
+            }
+            queries = new_queries;
+            capacity = new_capacity;
+        }
+        struct query_usage *query = &queries[*count];
+        query->name = strdup(dent->d_name);
+        if (!query->name) {
+            break;
+        }
+        query->last_access = get_query_access(dent->d_name);
+        query->entries = (count_entries
+                            ? count_query_entries(dent->d_name)
+                            : 0);
+        (*count)++;
+    }
+    closedir(dir_handle);
+    path_free(&link_path);
+
+    qsort(queries, *count, sizeof(struct query_usage),
+          compare_query_usage);
+    return queries;
+}
+
+/* Evict the results of query directories that have not been accessed
+ * for --evict-age seconds, and then those of the least recently
+ * accessed query directories, until the total number of results is
+ * within --evict-entries.  Query directories that have been accessed
+ * within the refresh timeout are not evicted. */
+static void evict_idle_queries(void)
+{
+    size_t count;
+    struct query_usage *candidates =
+        list_query_usage(options.evict_entries, &count);
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += candidates[i].entries;
+    }
+    time_t now = time(NULL);
+    for (size_t i = 0; i < count; i++) {
+        struct query_usage *candidate = &candidates[i];
+        time_t idle = now - candidate->last_access;
+        if ((idle >= options.refresh_timeout)
+                && (((options.evict_age > 0)
+                        && (idle >= options.evict_age))
+                    || ((options.evict_entries > 0)
+                        && (total > (size_t) options.evict_entries)))) {
+            evict_query_dir(candidate->name, candidate->last_access);
+            total -= candidate->entries;
+        }
+        free(candidate->name);
+    }
+    free(candidates);
+}
+
+/* The warm-up of query directories when fsmu starts (see
+ * --warm-up).  queries is the list of query directories to be
+ * refreshed, most recently used last, and next is the number of them
+ * that have not yet been taken by a warm-up thread.  stop is set when
+ * fsmu is stopping, so that no more are taken. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    struct query_usage *queries;
+    size_t next;
+    int started;
+    int stop;
+} warm_up = {
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Refresh query directories from the warm-up list, most recently used
+ * first, until there are none left.  The refreshes are background
+ * refreshes, so that they wait for any interactive ones, and they do
+ * not count as accesses. */
+static void *warm_up_worker_thread(void *arg)
+{
+    background_refresh = 1;
+    struct path path = PATH_INIT;
+    for (;;) {
+        pthread_mutex_lock(&warm_up.mutex);
+        char *name = NULL;
+        if (!warm_up.stop && (warm_up.next > 0)) {
+            name = warm_up.queries[--warm_up.next].name;
+        }
+        pthread_mutex_unlock(&warm_up.mutex);
+        if (!name) {
+            break;
+        }
+        if (path_setf(&path, "/%s", name) == 0) {
+            syslog(LOG_DEBUG, "warm_up: refreshing '%s'", name);
+            refresh_dir(path.buf, 0, 0);
+        }
+    }
+    path_free(&path);
+    return NULL;
+}
+
+/* List the query directories that have results, and refresh them by
+ * way of --warm-up worker threads. */
+static void *warm_up_thread(void *arg)
+{
+    size_t count;
+    struct query_usage *queries = list_query_usage(0, &count);
+    pthread_mutex_lock(&warm_up.mutex);
+    warm_up.queries = queries;
+    warm_up.next = count;
+    pthread_mutex_unlock(&warm_up.mutex);
+    syslog(LOG_INFO, "warm_up: refreshing %zu query directories", count);
+
+    int thread_count = options.warm_up;
+    if ((size_t) thread_count > count) {
+        thread_count = count;
+    }
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; threads && (i < thread_count); i++) {
+        if (pthread_create(&threads[i], NULL, warm_up_worker_thread,
+                           NULL) != 0) {
+            syslog(LOG_ERR, "warm_up: unable to start worker thread");
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        warm_up_worker_thread(NULL);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    pthread_mutex_lock(&warm_up.mutex);
+    warm_up.queries = NULL;
+    warm_up.next = 0;
+    pthread_mutex_unlock(&warm_up.mutex);
+    for (size_t i = 0; i < count; i++) {
+        free(queries[i].name);
+    }
+    free(queries);
+    syslog(LOG_INFO, "warm_up: finished");
+    return NULL;
+}
+
+/* Reap the graveyard entries as they are added, and periodically
+ * write the access log and refresh states and evict the results of
+ * idle query directories, if that is enabled.  The thread runs at the lowest
+ * scheduling priority, since nothing waits on it. */
+static void *reaper_thread(void *arg)
+{
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) != 0) {
+        syslog(LOG_INFO, "reaper: unable to lower priority: %s",
+               strerror(errno));
+    }
+    int evicting = (options.evict_entries || options.evict_age);
+    struct timespec next_check;
+    clock_gettime(CLOCK_REALTIME, &next_check);
+    next_check.tv_sec += get_eviction_interval();
+
+    pthread_mutex_lock(&reaper.mutex);
+    while (!reaper.stop) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int check = (now.tv_sec >= next_check.tv_sec);
+        if (!reaper.pending && !check) {
+            pthread_cond_timedwait(&reaper.cond, &reaper.mutex,
+                                   &next_check);
+            continue;
+        }
+        reaper.pending = 0;
+        pthread_mutex_unlock(&reaper.mutex);
+        if (check) {
+            save_query_accesses();
+            save_refresh_states();
+            prune_identities();
+            if (evicting) {
+                evict_idle_queries();
+            }
+            clock_gettime(CLOCK_REALTIME, &next_check);
+            next_check.tv_sec += get_eviction_interval();
+        }
+        for_each_grave(reap_grave_fully);
+        remove_graveyard();
+        pthread_mutex_lock(&reaper.mutex);
+    }
+    pthread_mutex_unlock(&reaper.mutex);
+
+    return NULL;
+}
+
+/* Refresh the search results for a given mount directory.  If force
+ * is false, then refresh will not happen if the timeout for the
+ * corresponding backing directory has not been reached.  If force is
+ * true, then refresh will always happen.  If progressive is set, then
+ * a query directory without results may be populated as its query
+ * runs (see start_population), and this returns once the first
+ * results are available.  Otherwise, this waits for any such
+ * population to finish. */
+static int refresh_dir(const char *path, int force, int progressive)
+{
+    syslog(LOG_DEBUG, "refresh_dir: '%s'", path);
+    verify_path(path);
+
+    if ((strcmp(path, "/") == 0)
+            || (strlen(path) <= 1)
+            || (path[1] == '_')) {
+        syslog(LOG_DEBUG, "refresh_dir: '%s' cannot be refreshed", path);
+        return 0;
+    }
+
+    char *name = get_query_name(path);
+    if (!name) {
+        return -1;
+    }
+
+    struct path search_path = PATH_INIT;
+    if ((path_set(&search_path, options.backing_dir) != 0)
+            || (path_push(&search_path, name) != 0)) {
+        path_free(&search_path);
+        free(name);
+        return -1;
+    }
+    struct stat stbuf;
+    int res = stat(search_path.buf, &stbuf);
+    if (res != 0) {
+        syslog(LOG_ERR, "refresh_dir: '%s' cannot be refreshed", path);
+        path_free(&search_path);
+        free(name);
+        return -1;
+    }
+    if (!background_refresh) {
+        record_query_access(name);
+    }
+
+    /* A query directory that is being populated is not refreshed again
+     * until that has finished. */
+    if (progressive && is_populating(name)) {
+        syslog(LOG_DEBUG, "refresh_dir: '%s' is being populated", path);
+        path_free(&search_path);
+        free(name);
+        return 0;
+    }
+    wait_for_population(name);
+
+    /* A query that has failed recently is not run again until its
+     * backoff period has passed, unless the refresh is forced. */
+    if (!force && in_failure_backoff(name)) {
+        syslog(LOG_DEBUG, "refresh_dir: '%s' failed recently, "
+                          "not refreshing", path);
+        path_free(&search_path);
+        free(name);
+        return -1;
+    }
+
+    /* The last-update path is the query directory's backing path,
+     * with a suffix. */
+    if (path_append(&search_path, ".last-update") != 0) {
+        path_free(&search_path);
+        free(name);
+        return -1;
+    }
+    res = stat(search_path.buf, &stbuf);
+    if (res == 0) {
+        int interval = get_refresh_interval(name);
+        int threshold = time(NULL) - interval;
+        if (!force && (stbuf.st_mtim.tv_sec > threshold)) {
+            syslog(LOG_DEBUG, "refresh_dir: '%s' refreshed "
+                              "less than %ds ago", path, interval);
+            path_free(&search_path);
+            free(name);
+            return 0;
+        }
+    } else if (errno == ENOENT) {
+        FILE *last_update_file = fopen(search_path.buf, "w");
+        if (!last_update_file) {
+            syslog(LOG_ERR, "refresh_dir: cannot write "
+                            "last-update for '%s': %s",
+                            path, strerror(errno));
+            path_free(&search_path);
+            free(name);
+            return -1;
+        }
+        res = fclose(last_update_file);
+        if (res != 0) {
+            syslog(LOG_ERR, "refresh_dir: cannot close "
+                            "last-update for '%s': %s",
+                            path, strerror(errno));
+            path_free(&search_path);
+            free(name);
+            return -1;
+        }
+    }
+    res = utime(search_path.buf, NULL);
+    path_free(&search_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "refresh_dir: cannot update "
+                        "last-update for '%s': %s",
+                        path, strerror(errno));
+        free(name);
+        return -1;
+    }
+
+    struct path reason = PATH_INIT;
+    struct timespec started;
+    struct timespec finished;
+    uint64_t seq = get_change_seq(name);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    res = update_query_dir(path, name, force, progressive, &reason);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (res > 0) {
+        /* The refresh is recorded once the population has finished. */
+        res = 0;
+    } else if (res == 0) {
+        long refresh_ms = ((finished.tv_sec - started.tv_sec) * 1000)
+                              + ((finished.tv_nsec - started.tv_nsec)
+                                  / 1000000);
+        clear_query_failure(name);
+        record_query_stats(name, count_query_entries(name), refresh_ms);
+        /* Whether the results changed is only known if there were
+         * results before the refresh. */
+        record_refresh_sample(name, refresh_ms,
+                              (seq ? (get_change_seq(name) != seq) : -1));
+    } else {
+        record_query_failure(name,
+                             (reason.len ? reason.buf
+                                         : "unable to refresh query "
+                                           "directory"));
+    }
+    path_free(&reason);
+    free(name);
+    return res;
+}
+
+static int resolve_maildir_path(const char *backing_path,
+                                struct path *buf);
+static void move_backing_message_version(const char *from,
+                                         const char *to);
+static int is_batch_path(const char *path);
+static size_t get_batch_results_size(const char *path);
+static int is_status_path(const char *path);
+static int get_query_status(const char *path, struct path *buf);
+static int is_changes_path(const char *path, int *has_cursor,
+                           uint64_t *cursor);
+static int get_changes(const char *path, int has_cursor, uint64_t cursor,
+                       struct path *buf);
+static int is_mbox_path(const char *path);
+#ifdef FSMU_ZSTD
+static void set_decompressed_size(const char *maildir_path,
+                                  struct stat *stbuf);
+#endif
+
+/* Read the contents of the mount directory at path. */
+static int fsmu_readdir(const char *path, void *buf,
+                        fuse_fill_dir_t filler,
+                        off_t offset, struct fuse_file_info *info)
+{
+    syslog(LOG_DEBUG, "readdir: '%s'", path);
+    verify_path(path);
+
+    if (strcmp(path, "/") == 0) {
+        DIR *backing_dir_handle = opendir(options.backing_dir);
+        if (!backing_dir_handle) {
+            syslog(LOG_ERR, "readdir: cannot open '%s': %s",
+                   path, strerror(errno));
+            return -1;
+        }
+        struct dirent *dent;
+        while ((dent = readdir(backing_dir_handle)) != NULL) {
+            if (dent->d_name[0] == '_') {
+                continue;
+            }
+            filler(buf, dent->d_name, 0, 0);
+        }
+        closedir(backing_dir_handle);
+
+        syslog(LOG_DEBUG, "readdir: '%s' completed", path);
+        return 0;
+    }
+
+    struct path backing_path = PATH_INIT;
+    int res = resolve_path(path, &backing_path);
+    if (res != 0) {
+        if (path[1] == '_') {
+            path_free(&backing_path);
+            return -ENOENT;
+        }
+        refresh_dir(path, 0, 1);
+    }
+
+    /* The directory is read from the current generation, which is
+     * not changed by refreshes, and which is kept until the read is
+     * complete. */
+    char *name = get_query_name(path);
+    if (!name) {
+        path_free(&backing_path);
+        return -ENOMEM;
+    }
+    char *gen = acquire_generation(name, path + 1 + strlen(name),
+                                   &backing_path);
+    free(name);
+    DIR *dir_handle = opendir(backing_path.buf);
+    path_free(&backing_path);
+    if (!dir_handle) {
+        syslog(LOG_ERR, "readdir: cannot open '%s': %s",
+               path, strerror(errno));
+        release_generation(gen);
+        return -1;
+    }
+    struct dirent *dent;
+    while ((dent = readdir(dir_handle)) != NULL) {
+        filler(buf, dent->d_name, 0, 0);
+    }
+    closedir(dir_handle);
+    release_generation(gen);
+
+    syslog(LOG_DEBUG, "readdir: '%s' completed", path);
+    return 0;
+}
+
+/* Get the attributes for the specified mount path. */
+static int fsmu_getattr(const char *path, struct stat *stbuf)
+{
+    syslog(LOG_DEBUG, "getattr: '%s'", path);
+    verify_path(path);
+
+    memset(stbuf, 0, sizeof(struct stat));
+    if (strcmp(path, "/") == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        syslog(LOG_DEBUG, "getattr: '%s' completed", path);
+        return 0;
+    }
+
+    int len = strlen(path);
+    if (len >= 4) {
+        const char *tail = path + len - 4;
+        if (   (strcmp(tail, "/cur") == 0)
+            || (strcmp(tail, "/new") == 0)) {
+            syslog(LOG_INFO, "getattr: refreshing cur/new path");
+            refresh_dir(path, 0, 1);
+        }
+    }
+    if (len >= 9) {
+        const char *tail = path + len - 9;
+        if (strcmp(tail, "/.refresh") == 0) {
+            stbuf->st_mode = S_IFREG;
+            /* This previously used to report 0, but a change
+             * somewhere else (possibly in a newer version of FUSE)
+             * means that if the size is reported as 0, reading the
+             * file doesn't actually hit fsmu_read, and the refresh
+             * doesn't happen.  Changing it to have a size of 1
+             * 'fixes' this. */
+            stbuf->st_size = 1;
+            return 0;
+        }
+    }
+    if (is_batch_path(path)) {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = get_batch_results_size(path);
+        return 0;
+    }
+    if (is_status_path(path)) {
+        struct path status = PATH_INIT;
+        int res = get_query_status(path, &status);
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = status.len;
+        path_free(&status);
+        return ((res == 0) ? 0 : -ENOMEM);
+    }
+    int has_cursor;
+    uint64_t cursor;
+    if (is_changes_path(path, &has_cursor, &cursor)) {
+        struct path changes = PATH_INIT;
+        int res = get_changes(path, has_cursor, cursor, &changes);
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = changes.len;
+        path_free(&changes);
+        return ((res == 0) ? 0 : -ENOMEM);
+    }
+    if (is_mbox_path(path)) {
+        /* The size is not known until every message has been read, so
+         * it is reported as 0, and the file is opened with direct_io,
+         * so that reads continue until the end of the file. */
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        return 0;
+    }
+
+    struct path backing_path = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    int res = resolve_path_noexists(path, &backing_path);
+    if (res == -ENOENT) {
+        res = path_setf(&backing_path, "%s%s", options.backing_dir, path);
+    }
+    if (res != 0) {
+        path_free(&backing_path);
+        return -ENOMEM;
+    }
+
+    res = stat(backing_path.buf, stbuf);
+    if ((res != 0) && (errno == ENOENT)) {
+        if ((lstat(backing_path.buf, stbuf) == 0)
+                && S_ISLNK(stbuf->st_mode)
+                && (resolve_maildir_path(backing_path.buf,
+                                         &maildir_path) == 0)
+                && (lstat(backing_path.buf, stbuf) == 0)) {
+            res = stat(maildir_path.buf, stbuf);
+        } else {
+            /* Either the link could not be resolved, or resolving
+             * it led to this entry being renamed. */
+            errno = ENOENT;
+        }
+    }
+    if (res != 0) {
+        res = -1 * errno;
+        syslog(LOG_ERR, "getattr: unable to stat '%s': %s",
+               path, strerror(errno));
+        path_free(&backing_path);
+        path_free(&maildir_path);
+        return res;
+    }
+
+#ifdef FSMU_ZSTD
+    if (options.compressed && S_ISREG(stbuf->st_mode)
+            && (resolve_maildir_path(backing_path.buf,
+                                     &maildir_path) == 0)) {
+        set_decompressed_size(maildir_path.buf, stbuf);
+    }
+#endif
+    path_free(&backing_path);
+    path_free(&maildir_path);
+
+    syslog(LOG_DEBUG, "getattr: '%s' completed", path);
+    return res;
+}
+
+/* Append filename to buf, with its maildir flags (if present)
+ * replaced by flags. */
+static int append_with_flags(struct path *buf, const char *filename,
+                             const char *flags)
+{
+    const char *to_flags = strrchr(filename, ':');
+    size_t len = (to_flags ? (size_t) (to_flags - filename)
+                           : strlen(filename));
+    if ((path_append_len(buf, filename, len) != 0)
+            || (path_append(buf, flags) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Update the link mappings for the given maildir path (being renamed
+ * to new_maildir_path).  If flags are not being set (this happens
+ * when the new path involves more than flag modification), then
+ * basename_new must be set. */
+static int update_link_mapping(const char *maildir_path,
+                               const char *new_maildir_path,
+                               const char *basename_new,
+                               const char *flags)
+{
+    /* The "cur" or "new" segment of the new maildir path (including
+     * the preceding slash), which is the directory that the new
+     * backing paths will be in. */
+    const char *new_type = last_segments(new_maildir_path,
+                                         strlen(new_maildir_path), 2);
+    if (!new_type) {
+        syslog(LOG_ERR, "update_link_mapping: cannot get directory "
+                        "for '%s'",
+               new_maildir_path);
+        return -1;
+    }
+    size_t new_type_len = strchr(new_type + 1, '/') - new_type;
+
+    /* reverse_path is extended and truncated as the three levels of
+     * the reverse mapping (query directory, type, link) are walked. */
+    struct path reverse_path = PATH_INIT;
+    struct path backing_path = PATH_INIT;
+    struct path backing_path_new = PATH_INIT;
+    if ((path_set(&reverse_path, backing_dir_reverse) != 0)
+            || (path_append(&reverse_path, maildir_path) != 0)) {
+        path_free(&reverse_path);
+        return -1;
+    }
+
+    struct dirent *dent;
+    struct dirent *dent_search;
+    struct dirent *dent_type;
+
+    struct trace_span span;
+    PHASE_BEGIN(span, update_link_mapping, maildir_path);
+    DIR *reverse_handle = opendir(reverse_path.buf);
+    if (!reverse_handle) {
+        int res = 0;
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "update_link_mapping: cannot open '%s': %s",
+                   reverse_path.buf, strerror(errno));
+            res = -1;
+        }
+        /* Otherwise, no other query directories contain this
+         * message. */
+        PHASE_END(span, update_link_mapping, maildir_path);
+        path_free(&reverse_path);
+        return res;
+    }
+    size_t reverse_len = reverse_path.len;
+    int reverse_error = 0;
+    while ((dent = readdir(reverse_handle)) != NULL) {
+        if (is_upwards(dent->d_name)) {
+            continue;
+        }
+        path_truncate(&reverse_path, reverse_len);
+        if (path_push(&reverse_path, dent->d_name) != 0) {
+            reverse_error = 1;
+            break;
+        }
+        DIR *search_dir_handle = opendir(reverse_path.buf);
+        if (!search_dir_handle) {
+            syslog(LOG_ERR, "update_link_mapping: cannot open search path '%s': %s",
+                   reverse_path.buf, strerror(errno));
+            reverse_error = 1;
+            break;
+        }
+        size_t search_len = reverse_path.len;
+        int search_error = 0;
+        while ((dent_search = readdir(search_dir_handle)) != NULL) {
+            if (is_upwards(dent_search->d_name)) {
+                continue;
+            }
+            path_truncate(&reverse_path, search_len);
+            if (path_push(&reverse_path, dent_search->d_name) != 0) {
+                search_error = 1;
+                break;
+            }
+            DIR *type_dir_handle = opendir(reverse_path.buf);
+            if (!type_dir_handle) {
+                syslog(LOG_ERR, "update_link_mapping: cannot open type path '%s': %s",
+                       reverse_path.buf, strerror(errno));
+                search_error = 1;
+                break;
+            }
+            size_t type_len = reverse_path.len;
+            int type_error = 0;
+            while ((dent_type = readdir(type_dir_handle)) != NULL) {
+                if (is_upwards(dent_type->d_name)) {
+                    continue;
+                }
+                path_truncate(&reverse_path, type_len);
+                if (path_push(&reverse_path, dent_type->d_name) != 0) {
+                    type_error = 1;
+                    break;
+                }
+
+                int res = path_readlink(&backing_path, reverse_path.buf);
+                if (res != 0) {
+                    syslog(LOG_ERR, "update_link_mapping: unable to read link for '%s': %s",
+                           reverse_path.buf, strerror(errno));
+                    type_error = 1;
+                    break;
+                }
+
+                res = remove_link_mapping(maildir_path, backing_path.buf);
+                if (res != 0) {
+                    syslog(LOG_ERR, "update_link_mapping: cannot remove old link mapping");
+                    type_error = 1;
+                    break;
+                }
+                res = unlink(backing_path.buf);
+                if ((res != 0) && (errno == ENOENT)
+                        && is_buried_query(dent->d_name + 1)) {
+                    /* The query directory has been removed, and its
+                     * link is in the graveyard. */
+                    continue;
+                }
+                if (res != 0) {
+                    syslog(LOG_ERR, "update_link_mapping: cannot remove old backing path");
+                    type_error = 1;
+                    break;
+                }
+
+                /* The new backing path is the old one, with its
+                 * "cur"/"new" segment and its filename replaced. */
+                const char *filename = basename_view(backing_path.buf);
+                const char *old_type = last_segments(backing_path.buf,
+                                                     backing_path.len, 2);
+                if (!filename || !old_type) {
+                    type_error = 1;
+                    break;
+                }
+                res = path_set_len(&backing_path_new, backing_path.buf,
+                                   old_type - backing_path.buf);
+                if (res == 0) {
+                    res = path_append_len(&backing_path_new, new_type,
+                                          new_type_len);
+                }
+                if (res == 0) {
+                    res = path_append(&backing_path_new, "/");
+                }
+                if (res == 0) {
+                    if (!flags) {
+                        res = path_append(&backing_path_new, basename_new);
+                    } else {
+                        res = append_with_flags(&backing_path_new,
+                                                filename, flags);
+                    }
+                }
+                if (res != 0) {
+                    type_error = 1;
+                    break;
+                }
+
+                res = add_link_mapping(new_maildir_path,
+                                       backing_path_new.buf);
+                if (res != 0) {
+                    type_error = 1;
+                    break;
+                }
+
+                res = symlink(new_maildir_path, backing_path_new.buf);
+                if (res != 0) {
+                    syslog(LOG_ERR, "update_link_mapping: unable to "
+                                    "relink backing path '%s': %s",
+                           backing_path_new.buf, strerror(errno));
+                    type_error = 1;
+                    break;
+                }
+                log_change('R', backing_path.buf, backing_path_new.buf, 0);
+                move_backing_message_version(backing_path.buf,
+                                             backing_path_new.buf);
+            }
+            closedir(type_dir_handle);
+            if (type_error) {
+                search_error = 1;
+                break;
+            }
+        }
+        closedir(search_dir_handle);
+        if (search_error) {
+            reverse_error = 1;
+            break;
+        }
+    }
+    closedir(reverse_handle);
+    PHASE_END(span, update_link_mapping, maildir_path);
+    path_free(&reverse_path);
+    path_free(&backing_path);
+    path_free(&backing_path_new);
+    if (reverse_error) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void free_propagation(struct propagation *prop)
+{
+    free(prop->maildir_path);
+    free(prop->new_maildir_path);
+    free(prop->basename_new);
+    free(prop->flags);
+    free(prop);
+}
+
+/* Queue the propagation of a rename (from maildir_path to
+ * new_maildir_path) to the other query directories containing the
+ * message.  If a propagation for the same message is already queued,
+ * then the two are coalesced, so that repeated flag changes lead to a
+ * single update of the other query directories.  The caller must hold
+ * mapping_mutex.  Returns an error code if the propagation could not
+ * be queued, in which case it should be applied directly. */
+static int queue_propagation(const char *maildir_path,
+                             const char *new_maildir_path,
+                             const char *basename_new,
+                             const char *flags)
+{
+    pthread_mutex_lock(&propagation_queue.mutex);
+    if (!propagation_queue.started || propagation_queue.stop) {
+        pthread_mutex_unlock(&propagation_queue.mutex);
+        return -1;
+    }
+
+    struct propagation *prev = NULL;
+    struct propagation *prop;
+    for (prop = propagation_queue.head; prop; prop = prop->next) {
+        if (strcmp(prop->new_maildir_path, maildir_path) == 0) {
+            break;
+        }
+        prev = prop;
+    }
+
+    if (prop) {
+        /* The other query directories still refer to
+         * prop->maildir_path, so only the target and the change to
+         * their filenames need to be updated. */
+        char *new_path = strdup(new_maildir_path);
+        if (!new_path) {
+            pthread_mutex_unlock(&propagation_queue.mutex);
+            return -1;
+        }
+        free(prop->new_maildir_path);
+        prop->new_maildir_path = new_path;
+        if (flags && !prop->flags) {
+            struct path filename = PATH_INIT;
+            if (append_with_flags(&filename, prop->basename_new,
+                                  flags) != 0) {
+                path_free(&filename);
+            }
+            free(prop->basename_new);
+            prop->basename_new = filename.buf;
+        } else if (flags) {
+            free(prop->flags);
+            prop->flags = strdup(flags);
+        } else {
+            free(prop->flags);
+            prop->flags = NULL;
+            free(prop->basename_new);
+            prop->basename_new = strdup(basename_new);
+        }
+        if (!prop->flags && !prop->basename_new) {
+            syslog(LOG_ERR, "queue_propagation: unable to coalesce "
+                            "propagation for '%s'",
+                   prop->maildir_path);
+        }
+
+        /* If the message is back where it started, and the filenames
+         * in the other query directories would not change, then
+         * there is nothing left to do. */
+        if (prop->flags
+                && (strcmp(prop->maildir_path,
+                           prop->new_maildir_path) == 0)) {
+            if (prev) {
+                prev->next = prop->next;
+            } else {
+                propagation_queue.head = prop->next;
+            }
+            if (propagation_queue.tail == prop) {
+                propagation_queue.tail = prev;
+            }
+            free_propagation(prop);
+        }
+        pthread_mutex_unlock(&propagation_queue.mutex);
+        return 0;
+    }
+
+    prop = calloc(1, sizeof(struct propagation));
+    if (!prop) {
+        pthread_mutex_unlock(&propagation_queue.mutex);
+        return -1;
+    }
+    prop->maildir_path = strdup(maildir_path);
+    prop->new_maildir_path = strdup(new_maildir_path);
+    prop->basename_new = (basename_new ? strdup(basename_new) : NULL);
+    prop->flags = (flags ? strdup(flags) : NULL);
+    if (!prop->maildir_path || !prop->new_maildir_path
+            || (basename_new && !prop->basename_new)
+            || (flags && !prop->flags)) {
+        free_propagation(prop);
+        pthread_mutex_unlock(&propagation_queue.mutex);
+        return -1;
+    }
+    if (propagation_queue.tail) {
+        propagation_queue.tail->next = prop;
+    } else {
+        propagation_queue.head = prop;
+    }
+    propagation_queue.tail = prop;
+    pthread_cond_broadcast(&propagation_queue.cond);
+    pthread_mutex_unlock(&propagation_queue.mutex);
+
+    return 0;
+}
+
+/* Find the current path for a message that was at maildir_path, by
+ * way of any pending propagations, and write it to buf.  Returns an
+ * error code if there is no pending propagation for the message. */
+static int lookup_propagation(const char *maildir_path, struct path *buf)
+{
+    int res = -1;
+    const char *path = maildir_path;
+
+    pthread_mutex_lock(&propagation_queue.mutex);
+    struct propagation *prop = propagation_queue.current;
+    if (prop && (strcmp(prop->maildir_path, path) == 0)) {
+        path = prop->new_maildir_path;
+    }
+    for (prop = propagation_queue.head; prop; prop = prop->next) {
+        if (strcmp(prop->maildir_path, path) == 0) {
+            path = prop->new_maildir_path;
+        }
+    }
+    /* path is only copied while the queue is locked, since it may
+     * belong to a propagation that is about to be freed. */
+    if (path != maildir_path) {
+        res = path_set(buf, path);
+    }
+    pthread_mutex_unlock(&propagation_queue.mutex);
+
+    return res;
+}
+
+/* Apply queued propagations until the queue is stopped and empty. */
+static void *propagation_thread(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&propagation_queue.mutex);
+        while (!propagation_queue.head && !propagation_queue.stop) {
+            pthread_cond_wait(&propagation_queue.cond,
+                              &propagation_queue.mutex);
+        }
+        struct propagation *prop = propagation_queue.head;
+        if (!prop) {
+            pthread_mutex_unlock(&propagation_queue.mutex);
+            break;
+        }
+        propagation_queue.head = prop->next;
+        if (!propagation_queue.head) {
+            propagation_queue.tail = NULL;
+        }
+        propagation_queue.current = prop;
+        pthread_mutex_unlock(&propagation_queue.mutex);
+
+        pthread_mutex_lock(&propagation_queue.mapping_mutex);
+        int res = update_link_mapping(prop->maildir_path,
+                                      prop->new_maildir_path,
+                                      prop->basename_new,
+                                      prop->flags);
+        pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+        if (res != 0) {
+            syslog(LOG_ERR, "propagation_thread: unable to propagate "
+                            "'%s' to '%s'",
+                   prop->maildir_path, prop->new_maildir_path);
+        }
+
+        pthread_mutex_lock(&propagation_queue.mutex);
+        propagation_queue.current = NULL;
+        pthread_cond_broadcast(&propagation_queue.cond);
+        pthread_mutex_unlock(&propagation_queue.mutex);
+        free_propagation(prop);
+    }
+
+    return NULL;
+}
+
+/* Find the current path of a message that was at maildir_path, but
+ * that has since been renamed by something other than fsmu (e.g. a
+ * flag change made by another mail client), and write it to buf.  The
+ * message is looked for in the "cur" and "new" directories of its
+ * maildir, by way of its recorded identity, or by way of the part of
+ * its filename preceding the flags if it has no recorded identity. */
+static int find_moved_message(const char *maildir_path, struct path *buf)
+{
+    struct identity identity = { 0 };
+    int has_identity = 0;
+    pthread_mutex_lock(&identities_mutex);
+    struct identity *recorded = table_get(&identities, maildir_path);
+    if (recorded) {
+        identity = *recorded;
+        has_identity = 1;
+    }
+    pthread_mutex_unlock(&identities_mutex);
+
+    /* The maildir's root is the message path without its last two
+     * segments. */
+    const char *type = last_segments(maildir_path, strlen(maildir_path), 2);
+    if (!type) {
+        return -1;
+    }
+    const char *filename = basename_view(maildir_path);
+    size_t unique_len = strcspn(filename, ":");
+
+    struct path path = PATH_INIT;
+    const char *subdirs[] = { "cur", "new" };
+    for (int i = 0; i < 2; i++) {
+        if ((path_set_len(&path, maildir_path, type - maildir_path) != 0)
+                || (path_push(&path, subdirs[i]) != 0)) {
+            break;
+        }
+        size_t dir_len = path.len;
+        DIR *dir_handle = opendir(path.buf);
+        if (!dir_handle) {
+            continue;
+        }
+        struct dirent *dent;
+        while ((dent = readdir(dir_handle)) != NULL) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            if (has_identity) {
+                if (dent->d_ino != identity.ino) {
+                    continue;
+                }
+            } else if ((strncmp(dent->d_name, filename, unique_len) != 0)
+                    || ((dent->d_name[unique_len] != 0)
+                        && (dent->d_name[unique_len] != ':'))) {
+                continue;
+            }
+            path_truncate(&path, dir_len);
+            if (path_push(&path, dent->d_name) != 0) {
+                continue;
+            }
+            struct stat stbuf;
+            if (stat(path.buf, &stbuf) != 0) {
+                continue;
+            }
+            if (has_identity
+                    && ((stbuf.st_dev != identity.dev)
+                        || (stbuf.st_ino != identity.ino)
+                        || (stbuf.st_size != identity.size)
+                        || (stbuf.st_mtim.tv_sec != identity.mtime.tv_sec)
+                        || (stbuf.st_mtim.tv_nsec
+                                != identity.mtime.tv_nsec))) {
+                continue;
+            }
+            closedir(dir_handle);
+            int res = path_set(buf, path.buf);
+            path_free(&path);
+            return res;
+        }
+        closedir(dir_handle);
+    }
+
+    path_free(&path);
+    return -1;
+}
+
+/* Find the current path of a message that was at maildir_path, but
+ * that has since been renamed by something other than fsmu, write it
+ * to buf, and update every query directory containing the message so
+ * that it refers to the current path.  The caller must hold
+ * mapping_mutex. */
+static int repair_maildir_path(const char *maildir_path,
+                               struct path *buf)
+{
+    int res = find_moved_message(maildir_path, buf);
+    if (res != 0) {
+        return -1;
+    }
+    syslog(LOG_INFO, "repair_maildir_path: '%s' is now '%s'",
+           maildir_path, buf->buf);
+
+    /* If only the flags have changed, then treat this in the same way
+     * as a flag change made by way of fsmu_rename, so that the
+     * filenames in the query directories are otherwise retained. */
+    const char *filename = basename_view(maildir_path);
+    const char *new_filename = basename_view(buf->buf);
+    size_t unique_len = strcspn(filename, ":");
+    const char *flags = NULL;
+    if ((strncmp(filename, new_filename, unique_len) == 0)
+            && (new_filename[unique_len] == ':')
+            && (strlen(new_filename + unique_len) > 1)) {
+        flags = new_filename + unique_len;
+    }
+
+    /* The identity is moved first, since removing the last of the
+     * old mappings forgets the identity recorded for the old path. */
+    move_identity(maildir_path, buf->buf);
+    res = update_link_mapping(maildir_path, buf->buf, new_filename,
+                              flags);
+    if (res != 0) {
+        syslog(LOG_ERR, "repair_maildir_path: unable to update link "
+                        "mappings for '%s'",
+               maildir_path);
+        return -1;
+    }
+    queue_index_update(INDEX_REMOVE, maildir_path);
+    queue_index_update(INDEX_ADD, buf->buf);
+
+    return 0;
+}
+
+/* Read the maildir path for the backing path, and write it to buf.
+ * If the maildir path no longer exists, because a rename affecting it
+ * has not yet been propagated, or because it was renamed by something
+ * other than fsmu, then the current maildir path is written to buf
+ * instead. */
+static int resolve_maildir_path(const char *backing_path,
+                                struct path *buf)
+{
+    int res = path_readlink(buf, backing_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "resolve_maildir_path: unable to read link "
+                        "for '%s': %s",
+               backing_path, strerror(errno));
+        return -1;
+    }
+
+    struct stat stbuf;
+    if ((lstat(buf->buf, &stbuf) == 0) || (errno != ENOENT)) {
+        return 0;
+    }
+    if (lookup_propagation(buf->buf, buf) == 0) {
+        return 0;
+    }
+
+    /* Another thread may have repaired the link in the meantime, so
+     * check it again once mapping_mutex is held. */
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    struct path maildir_path = PATH_INIT;
+    res = path_readlink(&maildir_path, backing_path);
+    if (res == 0) {
+        if (lstat(maildir_path.buf, &stbuf) == 0) {
+            res = path_set(buf, maildir_path.buf);
+        } else {
+            res = repair_maildir_path(maildir_path.buf, buf);
+        }
+    }
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    path_free(&maildir_path);
+
+    return res;
+}
+
+#ifdef FSMU_ZSTD
+/* The magic numbers for zstd frames, and for the footer of the seek
+ * table used by the zstd seekable format. */
+#define ZSTD_FRAME_MAGIC 0xFD2FB528U
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1U
+#define ZSTD_SEEKABLE_FOOTER_SIZE 9
+
+/* The maximum size of a zstd frame header. */
+#define ZSTD_FRAME_HEADER_MAX 18
+
+/* The maximum number of decompressed sizes that are cached (see
+ * set_decompressed_size). */
+#define COMPRESSED_SIZES_MAX 65536
+
+/* The state for an open compressed maildir file.  If the file is in
+ * the zstd seekable format, then frame_count is non-zero, and the
+ * offsets arrays give the start of each frame (plus the end of the
+ * last frame) in the compressed and decompressed data, and the most
+ * recently decompressed frame is retained.  Otherwise, the file is
+ * decompressed as a stream, and the most recently decompressed chunk
+ * is retained, so that sequential reads do not need to restart the
+ * stream. */
+struct compressed_file {
+    pthread_mutex_t mutex;
+    int fd;
+    ZSTD_DCtx *dctx;
+    uint64_t size;
+    size_t frame_count;
+    uint64_t *compressed_offsets;
+    uint64_t *decompressed_offsets;
+    size_t cached_frame;
+    char *out_buf;
+    size_t out_buf_size;
+    uint64_t out_start;
+    size_t out_len;
+    char *in_buf;
+    size_t in_buf_size;
+    ZSTD_inBuffer in;
+    off_t in_offset;
+    int in_eof;
+};
+
+/* Read a little-endian 32-bit integer from buf. */
+static uint32_t read_le32(const unsigned char *buf)
+{
+    return ((uint32_t) buf[0])
+         | ((uint32_t) buf[1] << 8)
+         | ((uint32_t) buf[2] << 16)
+         | ((uint32_t) buf[3] << 24);
+}
+
+/* Returns a boolean indicating whether the file open at fd is
+ * compressed using zstd. */
+static int is_zstd_file(int fd)
+{
+    unsigned char magic[4];
+    if (pread(fd, magic, 4, 0) != 4) {
+        return 0;
+    }
+    return (read_le32(magic) == ZSTD_FRAME_MAGIC);
+}
+
+/* Load the seek table for the zstd file at fd into cf, if the file is
+ * in the seekable format. */
+static int load_seek_table(struct compressed_file *cf, off_t file_size)
+{
+    unsigned char footer[ZSTD_SEEKABLE_FOOTER_SIZE];
+    if (file_size < ZSTD_SEEKABLE_FOOTER_SIZE) {
+        return 0;
+    }
+    if (pread(cf->fd, footer, ZSTD_SEEKABLE_FOOTER_SIZE,
+              file_size - ZSTD_SEEKABLE_FOOTER_SIZE)
+            != ZSTD_SEEKABLE_FOOTER_SIZE) {
+        return -1;
+    }
+    if (read_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC) {
+        return 0;
+    }
+    size_t frame_count = read_le32(footer);
+    size_t entry_size = ((footer[4] & 0x80) ? 12 : 8);
+    size_t table_size = frame_count * entry_size;
+    if ((frame_count == 0)
+            || (table_size + ZSTD_SEEKABLE_FOOTER_SIZE
+                > (size_t) file_size)) {
+        return 0;
+    }
+
+    unsigned char *table = malloc(table_size);
+    cf->compressed_offsets = calloc(frame_count + 1, sizeof(uint64_t));
+    cf->decompressed_offsets = calloc(frame_count + 1, sizeof(uint64_t));
+    if (!table || !cf->compressed_offsets || !cf->decompressed_offsets) {
+        free(table);
+        return -1;
+    }
+    off_t table_offset = file_size - ZSTD_SEEKABLE_FOOTER_SIZE - table_size;
+    if (pread(cf->fd, table, table_size, table_offset)
+            != (ssize_t) table_size) {
+        free(table);
+        return -1;
+    }
+    for (size_t i = 0; i < frame_count; i++) {
+        const unsigned char *entry = table + (i * entry_size);
+        cf->compressed_offsets[i + 1] =
+            cf->compressed_offsets[i] + read_le32(entry);
+        cf->decompressed_offsets[i + 1] =
+            cf->decompressed_offsets[i] + read_le32(entry + 4);
+    }
+    free(table);
+    cf->frame_count = frame_count;
+    cf->size = cf->decompressed_offsets[frame_count];
+
+    return 0;
+}
+
+/* Get the total decompressed size of the zstd frames in the file open
+ * at fd, as recorded in the frame headers.  Only the frame and block
+ * headers are read, rather than the whole file.  Returns (uint64_t) -1
+ * if any frame does not record its size. */
+static uint64_t get_content_size(int fd, off_t file_size)
+{
+    const int dict_id_sizes[] = { 0, 1, 2, 4 };
+    const int content_size_sizes[] = { 0, 2, 4, 8 };
+    uint64_t total = 0;
+    off_t offset = 0;
+    while (offset < file_size) {
+        unsigned char header[ZSTD_FRAME_HEADER_MAX];
+        ssize_t len = pread(fd, header, sizeof(header), offset);
+        if (len < 6) {
+            return (uint64_t) -1;
+        }
+        uint32_t magic = read_le32(header);
+        if ((magic & 0xFFFFFFF0U) == ZSTD_MAGIC_SKIPPABLE_START) {
+            if (len < 8) {
+                return (uint64_t) -1;
+            }
+            offset += 8 + (off_t) read_le32(header + 4);
+            continue;
+        }
+        if (magic != ZSTD_FRAME_MAGIC) {
+            return (uint64_t) -1;
+        }
+        unsigned long long content_size =
+            ZSTD_getFrameContentSize(header, len);
+        if ((content_size == ZSTD_CONTENTSIZE_UNKNOWN)
+                || (content_size == ZSTD_CONTENTSIZE_ERROR)) {
+            return (uint64_t) -1;
+        }
+        total += content_size;
+
+        /* The size of the frame header is given by its descriptor
+         * byte, which follows the magic number. */
+        int descriptor = header[4];
+        int single_segment = ((descriptor >> 5) & 1);
+        int content_size_flag = (descriptor >> 6);
+        offset += 5 + !single_segment + dict_id_sizes[descriptor & 3]
+                + (content_size_flag ? content_size_sizes[content_size_flag]
+                                     : single_segment);
+
+        /* Each block has a three-byte header giving its type and
+         * size, and whether it is the last block in the frame. */
+        for (;;) {
+            unsigned char block[3];
+            if (pread(fd, block, 3, offset) != 3) {
+                return (uint64_t) -1;
+            }
+            uint32_t block_header = ((uint32_t) block[0])
+                                  | ((uint32_t) block[1] << 8)
+                                  | ((uint32_t) block[2] << 16);
+            int type = ((block_header >> 1) & 3);
+            if (type == 3) {
+                return (uint64_t) -1;
+            }
+            /* RLE blocks have a single byte of content, repeated
+             * the given number of times. */
+            offset += 3 + ((type == 1) ? 1 : (block_header >> 3));
+            if (block_header & 1) {
+                break;
+            }
+        }
+        if (descriptor & 0x04) {
+            offset += 4;
+        }
+    }
+
+    return ((offset == file_size) ? total : (uint64_t) -1);
+}
+
+/* Free the state for a compressed file. */
+static void free_compressed_file(struct compressed_file *cf)
+{
+    if (cf->fd != -1) {
+        close(cf->fd);
+    }
+    ZSTD_freeDCtx(cf->dctx);
+    pthread_mutex_destroy(&cf->mutex);
+    free(cf->compressed_offsets);
+    free(cf->decompressed_offsets);
+    free(cf->out_buf);
+    free(cf->in_buf);
+    free(cf);
+}
+
+/* Reset the stream for a compressed file that is not in the seekable
+ * format, so that decompression starts again from the beginning. */
+static void reset_stream(struct compressed_file *cf)
+{
+    ZSTD_DCtx_reset(cf->dctx, ZSTD_reset_session_only);
+    cf->in.src = cf->in_buf;
+    cf->in.size = 0;
+    cf->in.pos = 0;
+    cf->in_offset = 0;
+    cf->in_eof = 0;
+    cf->out_start = 0;
+    cf->out_len = 0;
+}
+
+/* Decompress the next chunk of a compressed file that is not in the
+ * seekable format.  Returns the number of bytes decompressed (0 at
+ * the end of the stream), or -1 on error. */
+static ssize_t next_chunk(struct compressed_file *cf)
+{
+    cf->out_start += cf->out_len;
+    cf->out_len = 0;
+    for (;;) {
+        if ((cf->in.pos == cf->in.size) && !cf->in_eof) {
+            ssize_t bytes = pread(cf->fd, cf->in_buf, cf->in_buf_size,
+                                  cf->in_offset);
+            if (bytes < 0) {
+                return -1;
+            }
+            if (bytes == 0) {
+                cf->in_eof = 1;
+            }
+            cf->in_offset += bytes;
+            cf->in.size = bytes;
+            cf->in.pos = 0;
+        }
+        ZSTD_outBuffer out = { cf->out_buf, cf->out_buf_size, 0 };
+        size_t res = ZSTD_decompressStream(cf->dctx, &out, &(cf->in));
+        if (ZSTD_isError(res)) {
+            syslog(LOG_ERR, "next_chunk: decompression failed: %s",
+                   ZSTD_getErrorName(res));
+            return -1;
+        }
+        if (out.pos > 0) {
+            cf->out_len = out.pos;
+            return out.pos;
+        }
+        if (cf->in_eof && (cf->in.pos == cf->in.size)) {
+            return 0;
+        }
+    }
+}
+
+/* Make sure that the decompressed frame with the given index is
+ * available in out_buf, for a file in the seekable format. */
+static int load_frame(struct compressed_file *cf, size_t frame)
+{
+    if (cf->cached_frame == frame) {
+        return 0;
+    }
+    size_t compressed_size =
+        cf->compressed_offsets[frame + 1] - cf->compressed_offsets[frame];
+    size_t decompressed_size =
+        cf->decompressed_offsets[frame + 1]
+            - cf->decompressed_offsets[frame];
+    if (compressed_size > cf->in_buf_size) {
+        char *in_buf = realloc(cf->in_buf, compressed_size);
+        if (!in_buf) {
+            return -1;
+        }
+        cf->in_buf = in_buf;
+        cf->in_buf_size = compressed_size;
+    }
+    if (decompressed_size > cf->out_buf_size) {
+        char *out_buf = realloc(cf->out_buf, decompressed_size);
+        if (!out_buf) {
+            return -1;
+        }
+        cf->out_buf = out_buf;
+        cf->out_buf_size = decompressed_size;
+    }
+    if (pread(cf->fd, cf->in_buf, compressed_size,
+              cf->compressed_offsets[frame])
+            != (ssize_t) compressed_size) {
+        return -1;
+    }
+    size_t res = ZSTD_decompressDCtx(cf->dctx, cf->out_buf,
+                                     decompressed_size, cf->in_buf,
+                                     compressed_size);
+    if (ZSTD_isError(res) || (res != decompressed_size)) {
+        syslog(LOG_ERR, "load_frame: decompression failed");
+        cf->cached_frame = (size_t) -1;
+        return -1;
+    }
+    cf->cached_frame = frame;
+    cf->out_start = cf->decompressed_offsets[frame];
+    cf->out_len = decompressed_size;
+
+    return 0;
+}
+
+/* Read up to size bytes of decompressed data from offset into buf.
+ * Returns the number of bytes read, or -1 on error. */
+static ssize_t read_compressed(struct compressed_file *cf, char *buf,
+                               size_t size, off_t offset)
+{
+    size_t done = 0;
+    uint64_t position = offset;
+    while (done < size) {
+        if ((position < cf->out_start)
+                || (position >= cf->out_start + cf->out_len)) {
+            if (cf->frame_count) {
+                if (position >= cf->size) {
+                    break;
+                }
+                size_t low = 0;
+                size_t high = cf->frame_count - 1;
+                while (low < high) {
+                    size_t mid = (low + high + 1) / 2;
+                    if (cf->decompressed_offsets[mid] <= position) {
+                        low = mid;
+                    } else {
+                        high = mid - 1;
+                    }
+                }
+                if (load_frame(cf, low) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (position < cf->out_start) {
+                reset_stream(cf);
+            }
+            ssize_t bytes = next_chunk(cf);
+            if (bytes < 0) {
+                return -1;
+            }
+            if (bytes == 0) {
+                break;
+            }
+            continue;
+        }
+        size_t available = cf->out_start + cf->out_len - position;
+        size_t count = (size - done < available) ? (size - done) : available;
+        memcpy(buf + done, cf->out_buf + (position - cf->out_start), count);
+        done += count;
+        position += count;
+    }
+
+    return done;
+}
+
+/* Open the compressed maildir file at maildir_path.  Returns NULL if
+ * the file is not compressed, or on error. */
+static struct compressed_file *open_compressed(const char *maildir_path)
+{
+    int fd = open(maildir_path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat stbuf;
+    if ((fstat(fd, &stbuf) != 0) || !is_zstd_file(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct compressed_file *cf = calloc(1, sizeof(struct compressed_file));
+    if (!cf) {
+        close(fd);
+        return NULL;
+    }
+    pthread_mutex_init(&cf->mutex, NULL);
+    cf->fd = fd;
+    cf->cached_frame = (size_t) -1;
+    cf->dctx = ZSTD_createDCtx();
+    if (!cf->dctx || (load_seek_table(cf, stbuf.st_size) != 0)) {
+        free_compressed_file(cf);
+        return NULL;
+    }
+    if (!cf->frame_count) {
+        cf->in_buf_size = ZSTD_DStreamInSize();
+        cf->out_buf_size = ZSTD_DStreamOutSize();
+        cf->in_buf = malloc(cf->in_buf_size);
+        cf->out_buf = malloc(cf->out_buf_size);
+        if (!cf->in_buf || !cf->out_buf) {
+            free_compressed_file(cf);
+            return NULL;
+        }
+        reset_stream(cf);
+    }
+
+    return cf;
+}
+
+/* The decompressed size of a compressed maildir file, as at the time
+ * that the file had the given modification time and size. */
+struct compressed_size {
+    struct timespec mtime;
+    off_t size;
+    uint64_t decompressed_size;
+};
+
+/* A map from maildir path to decompressed size, so that getattr does
+ * not need to decompress files more than once.  This holds at most
+ * COMPRESSED_SIZES_MAX entries. */
+static struct table compressed_sizes;
+static pthread_mutex_t compressed_sizes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* If the maildir file described by stbuf is compressed, then set its
+ * size in stbuf to the decompressed size. */
+static void set_decompressed_size(const char *maildir_path,
+                                  struct stat *stbuf)
+{
+    if (!S_ISREG(stbuf->st_mode)) {
+        return;
+    }
+    pthread_mutex_lock(&compressed_sizes_mutex);
+    struct compressed_size *cs = table_get(&compressed_sizes, maildir_path);
+    if (cs && (cs->size == stbuf->st_size)
+            && (cs->mtime.tv_sec == stbuf->st_mtim.tv_sec)
+            && (cs->mtime.tv_nsec == stbuf->st_mtim.tv_nsec)) {
+        if (cs->decompressed_size != (uint64_t) -1) {
+            stbuf->st_size = cs->decompressed_size;
+        }
+        pthread_mutex_unlock(&compressed_sizes_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&compressed_sizes_mutex);
+
+    uint64_t decompressed_size = (uint64_t) -1;
+    struct compressed_file *cf = open_compressed(maildir_path);
+    if (cf) {
+        if (cf->frame_count) {
+            decompressed_size = cf->size;
+        } else {
+            /* Walking the frame headers is much cheaper than
+             * decompressing the file, so try that first. */
+            decompressed_size = get_content_size(cf->fd, stbuf->st_size);
+            if (decompressed_size == (uint64_t) -1) {
+                /* The size is not recorded in the file, so it has to
+                 * be determined by decompressing the whole file. */
+                uint64_t total = 0;
+                ssize_t chunk;
+                while ((chunk = next_chunk(cf)) > 0) {
+                    total += chunk;
+                }
+                if (chunk == 0) {
+                    decompressed_size = total;
+                }
+            }
+        }
+        free_compressed_file(cf);
+    }
+
+    pthread_mutex_lock(&compressed_sizes_mutex);
+    cs = table_get(&compressed_sizes, maildir_path);
+    if (!cs && (compressed_sizes.count >= COMPRESSED_SIZES_MAX)) {
+        /* Sizes are cheap to recompute, so the whole cache is
+         * dropped, rather than tracking which entries are in use. */
+        table_clear(&compressed_sizes);
+    }
+    if (!cs) {
+        cs = malloc(sizeof(struct compressed_size));
+        if (cs && (table_put(&compressed_sizes, maildir_path, cs,
+                             NULL) != 0)) {
+            free(cs);
+            cs = NULL;
+        }
+    }
+    if (cs) {
+        cs->mtime = stbuf->st_mtim;
+        cs->size = stbuf->st_size;
+        cs->decompressed_size = decompressed_size;
+    }
+    pthread_mutex_unlock(&compressed_sizes_mutex);
+
+    if (decompressed_size != (uint64_t) -1) {
+        stbuf->st_size = decompressed_size;
+    }
+}
+#endif
+
+/* The maximum amount of data that can be written to a .batch file. */
+#define BATCH_MAX_SIZE (16 * 1024 * 1024)
+
+/* Data written to an open .batch file.  This is applied as a single
+ * batch when the file is flushed. */
+struct batch_buffer {
+    char *data;
+    size_t size;
+};
+
+/* The results of the most recent batch applied in each query
+ * directory, keyed by query. */
+static struct table batch_results;
+static pthread_mutex_t batch_results_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns a boolean indicating whether path is the .batch control
+ * file for a query directory. */
+static int is_batch_path(const char *path)
+{
+    const char *slash = strchr(path + 1, '/');
+    return (slash && (strcmp(slash, "/.batch") == 0));
+}
+
+/* Get the size of the results of the most recent batch for the query
+ * directory containing the .batch file at path. */
+static size_t get_batch_results_size(const char *path)
+{
+    char *query = get_query_name(path);
+    if (!query) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&batch_results_mutex);
+    const char *results = table_get(&batch_results, query);
+    size_t size = (results ? strlen(results) : 0);
+    pthread_mutex_unlock(&batch_results_mutex);
+    free(query);
+
+    return size;
+}
+
+/* Read the results of the most recent batch for the query directory
+ * containing the .batch file at path. */
+static int read_batch_results(const char *path, char *buf, size_t size,
+                              off_t offset)
+{
+    char *query = get_query_name(path);
+    if (!query) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&batch_results_mutex);
+    const char *results = table_get(&batch_results, query);
+    free(query);
+    size_t len = (results ? strlen(results) : 0);
+    size_t bytes = 0;
+    if ((size_t) offset < len) {
+        bytes = len - offset;
+        if (bytes > size) {
+            bytes = size;
+        }
+        memcpy(buf, results + offset, bytes);
+    }
+    pthread_mutex_unlock(&batch_results_mutex);
+
+    return bytes;
+}
+
+/* Returns a boolean indicating whether path is the .status file for a
+ * query directory. */
+static int is_status_path(const char *path)
+{
+    const char *slash = strchr(path + 1, '/');
+    return (slash && (strcmp(slash, "/.status") == 0));
+}
+
+/* Write the status of the query directory containing the .status file
+ * at path to buf.  This is "ok" if the most recent refresh succeeded
+ * (or if there has not been one), and otherwise the error from that
+ * refresh, the number of consecutive failures, and the number of
+ * seconds until the query will next be run. */
+static int get_query_status(const char *path, struct path *buf)
+{
+    char *query = get_query_name(path);
+    if (!query) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&query_failures_mutex);
+    struct query_failure *failure = table_get(&query_failures, query);
+    int res;
+    if (!failure) {
+        res = path_set(buf, "ok\n");
+    } else {
+        long retry_in = (long) (failure->retry_at - time(NULL));
+        res = path_setf(buf, "error: %s\nfailures: %d\nretry-in: %ld\n",
+                        failure->error, failure->count,
+                        ((retry_in > 0) ? retry_in : 0));
+    }
+    pthread_mutex_unlock(&query_failures_mutex);
+    free(query);
+
+    return res;
+}
+
+/* Returns a boolean indicating whether path is a change log file for a
+ * query directory: either ".changes", or ".changes.<cursor>", in which
+ * case the cursor is written to cursor and has_cursor is set. */
+static int is_changes_path(const char *path, int *has_cursor,
+                           uint64_t *cursor)
+{
+    const char *slash = strchr(path + 1, '/');
+    if (!slash || (strncmp(slash, "/.changes", 9) != 0)) {
+        return 0;
+    }
+    const char *suffix = slash + 9;
+    if (*suffix == '\0') {
+        *has_cursor = 0;
+        return 1;
+    }
+    if ((suffix[0] != '.') || (suffix[1] == '\0')
+            || (strspn(suffix + 1, "0123456789") != strlen(suffix + 1))) {
+        return 0;
+    }
+    *has_cursor = 1;
+    *cursor = strtoull(suffix + 1, NULL, 10);
+    return 1;
+}
+
+/* Write the contents of the change log file at path (see
+ * is_changes_path and format_changes) to buf. */
+static int get_changes(const char *path, int has_cursor, uint64_t cursor,
+                       struct path *buf)
+{
+    char *query = get_query_name(path);
+    if (!query) {
         return -1;
     }
-    strcpy(tempdir_part, temp_dirname);
-    strcat(tempdir_part, "/cur");
-    res = rmdir(tempdir_part);
-    if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot remove temp/cur: %s",
-               strerror(errno));
-        remove_dir(temp_dirname);
-        return -1;
+    int res = format_changes(query, has_cursor, cursor, buf);
+    free(query);
+    return res;
+}
+
+/* Returns a boolean indicating whether path is the .mbox file for a
+ * query directory. */
+static int is_mbox_path(const char *path)
+{
+    const char *slash = strchr(path + 1, '/');
+    return (slash && (strcmp(slash, "/.mbox") == 0));
+}
+
+/* A message in the .mbox file for a query directory.  name is the
+ * message's filename within subdir ("cur" or "new") of the query
+ * directory.  The other members are set when the message is scanned:
+ * offset is the offset of the message's separator line in the .mbox
+ * file, length is the number of bytes the message takes up there (0 if
+ * it could not be read), size is the size of the message file,
+ * escapes is the number of lines in the message that are prefixed with
+ * an extra '>' (mboxrd-style), so that they are not taken to be
+ * separator lines, and needs_newline is set if the message does not
+ * end with a newline. */
+struct mbox_message {
+    char *name;
+    const char *subdir;
+    char *maildir_path;
+    time_t mtime;
+    off_t offset;
+    off_t length;
+    off_t size;
+    off_t escapes;
+    int needs_newline;
+    int compressed;
+};
+
+/* An open message file, used for file descriptor buffers. */
+struct mbox_open_file {
+    size_t index;
+    int fd;
+};
+
+/* The state for an open .mbox file.  The messages are those in the
+ * generation of the query directory that was current when the file was
+ * opened, which is kept until the file is released.  Messages are
+ * scanned in order as reads require them, so that only the first
+ * scanned messages have offsets.  escaped holds the contents of
+ * message escaped_index after escaping, if that message has lines that
+ * need escaping. */
+struct mbox_file {
+    pthread_mutex_t mutex;
+    char *gen;
+    struct path gen_path;
+    struct mbox_message *messages;
+    size_t count;
+    size_t scanned;
+    struct mbox_open_file files[MBOX_OPEN_FILES];
+    size_t next_file;
+    char *chunk;
+    char *escaped;
+    size_t escaped_index;
+#ifdef FSMU_ZSTD
+    struct compressed_file *cf;
+    size_t cf_index;
+#endif
+};
+
+/* The state for escaping separator lines within a message: matched is
+ * the number of characters of "From " matched on the current line
+ * after any leading '>' characters, or -1 if the line does not need
+ * escaping, line_start and position are offsets in the escaped
+ * output, and last is the last character of the message. */
+struct mbox_scan {
+    int matched;
+    size_t line_start;
+    size_t position;
+    off_t escapes;
+    char last;
+};
+
+/* Scan len bytes of message data, counting the lines that need
+ * escaping.  If out is not NULL, the escaped data is written to out,
+ * at the current position. */
+static void mbox_scan_chunk(struct mbox_scan *scan, const char *data,
+                            size_t len, char *out)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (out) {
+            out[scan->position] = c;
+        }
+        scan->position++;
+        if (c == '\n') {
+            scan->matched = 0;
+            scan->line_start = scan->position;
+            continue;
+        }
+        if ((scan->matched < 0) || ((scan->matched == 0) && (c == '>'))) {
+            continue;
+        }
+        if (c != "From "[scan->matched]) {
+            scan->matched = -1;
+            continue;
+        }
+        if (++scan->matched == 5) {
+            if (out) {
+                memmove(out + scan->line_start + 1,
+                        out + scan->line_start,
+                        scan->position - scan->line_start);
+                out[scan->line_start] = '>';
+            }
+            scan->position++;
+            scan->escapes++;
+            scan->matched = -1;
+        }
+    }
+    if (len) {
+        scan->last = data[len - 1];
     }
-    strcpy(tempdir_part, temp_dirname);
-    strcat(tempdir_part, "/tmp");
-    res = rmdir(tempdir_part);
-    if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot remove temp/tmp: %s",
-               strerror(errno));
-        remove_dir(temp_dirname);
+}
+
+/* Write the separator line for a message with the given modification
+ * time to buf, and return its length. */
+static size_t mbox_separator(time_t mtime, char *buf, size_t size)
+{
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    return strftime(buf, size, "From - %a %b %e %H:%M:%S %Y\n", &tm);
+}
+
+/* Get a file descriptor for message i of the .mbox file, opening the
+ * message file if necessary.  The descriptor remains open until it is
+ * displaced by MBOX_OPEN_FILES other messages, or until the .mbox file
+ * is released.  Returns -1 on error. */
+static int mbox_get_fd(struct mbox_file *mf, size_t i)
+{
+    for (size_t j = 0; j < MBOX_OPEN_FILES; j++) {
+        if ((mf->files[j].fd != -1) && (mf->files[j].index == i)) {
+            return mf->files[j].fd;
+        }
+    }
+    int fd = open(mf->messages[i].maildir_path, O_RDONLY);
+    if (fd == -1) {
+        syslog(LOG_ERR, "mbox: unable to open '%s': %s",
+               mf->messages[i].maildir_path, strerror(errno));
         return -1;
     }
+    struct mbox_open_file *file = &mf->files[mf->next_file];
+    mf->next_file = (mf->next_file + 1) % MBOX_OPEN_FILES;
+    if (file->fd != -1) {
+        close(file->fd);
+    }
+    file->index = i;
+    file->fd = fd;
+    return fd;
+}
 
-    DIR *temp_dir_handle = opendir(temp_dirname);
-    if (!temp_dir_handle) {
-        syslog(LOG_ERR, "refresh_dir: cannot open '%s': %s",
-               temp_dirname, strerror(errno));
-        remove_dir(temp_dirname);
+/* Read up to size bytes of message i of the .mbox file (before
+ * escaping), starting at offset, into buf.  Returns the number of bytes
+ * read, or -1 on error. */
+static ssize_t mbox_read_message(struct mbox_file *mf, size_t i,
+                                 char *buf, size_t size, off_t offset)
+{
+#ifdef FSMU_ZSTD
+    if (mf->messages[i].compressed) {
+        if (!mf->cf || (mf->cf_index != i)) {
+            if (mf->cf) {
+                free_compressed_file(mf->cf);
+            }
+            mf->cf = open_compressed(mf->messages[i].maildir_path);
+            mf->cf_index = i;
+            if (!mf->cf) {
+                return -1;
+            }
+        }
+        return read_compressed(mf->cf, buf, size, offset);
+    }
+#endif
+    int fd = mbox_get_fd(mf, i);
+    if (fd == -1) {
         return -1;
     }
-    struct dirent *dent;
-    while ((dent = readdir(temp_dir_handle)) != NULL) {
-        if (is_upwards(dent->d_name)) {
-            continue;
-        }
-        char path[PATH_MAX];
-        strcpy(path, temp_dirname);
-        strcat(path, "/");
-        strcat(path, dent->d_name);
-        res = unlink(path);
-        if (res != 0) {
-            syslog(LOG_ERR, "refresh_dir: cannot unlink '%s': %s",
-                   path, strerror(errno));
-            closedir(temp_dir_handle);
-            remove_dir(temp_dirname);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes = pread(fd, buf + done, size - done, offset + done);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return -1;
         }
+        if (bytes == 0) {
+            break;
+        }
+        done += bytes;
     }
-    closedir(temp_dir_handle);
-    res = rmdir(temp_dirname);
-    if (res != 0) {
-        syslog(LOG_ERR, "refresh_dir: cannot remove temp: %s",
-               strerror(errno));
-        remove_dir(temp_dirname);
-        return -1;
-    }
-
-    return 0;
+    return done;
 }
 
-/* Read the contents of the mount directory at path. */
-static int fsmu_readdir(const char *path, void *buf,
-                        fuse_fill_dir_t filler,
-                        off_t offset, struct fuse_file_info *info)
+/* Scan message i of the .mbox file, setting its offset and length,
+ * which depend on the size of the message and the number of lines in it
+ * that need escaping.  If the message cannot be read, then its length
+ * is set to 0, so that it is omitted. */
+static void mbox_scan_message(struct mbox_file *mf, size_t i)
 {
-    syslog(LOG_DEBUG, "readdir: '%s'", path);
-    verify_path(path);
+    struct mbox_message *msg = &mf->messages[i];
+    msg->offset = 0;
+    if (i > 0) {
+        msg->offset = mf->messages[i - 1].offset
+                    + mf->messages[i - 1].length;
+    }
+    msg->length = 0;
 
-    if (strcmp(path, "/") == 0) {
-        DIR *backing_dir_handle = opendir(options.backing_dir);
-        if (!backing_dir_handle) {
-            syslog(LOG_ERR, "readdir: cannot open '%s': %s",
-                   path, strerror(errno));
-            return -1;
-        }
-        struct dirent *dent;
-        while ((dent = readdir(backing_dir_handle)) != NULL) {
-            if (dent->d_name[0] == '_') {
-                continue;
+    struct path backing_path = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    struct stat stbuf;
+    if ((path_setf(&backing_path, "%s/%s/%s", mf->gen_path.buf,
+                   msg->subdir, msg->name) != 0)
+            || (resolve_maildir_path(backing_path.buf,
+                                     &maildir_path) != 0)
+            || (stat(maildir_path.buf, &stbuf) != 0)) {
+        syslog(LOG_ERR, "mbox: unable to find '%s'", backing_path.buf);
+        path_free(&backing_path);
+        path_free(&maildir_path);
+        return;
+    }
+    path_free(&backing_path);
+    msg->maildir_path = maildir_path.buf;
+    msg->mtime = stbuf.st_mtime;
+#ifdef FSMU_ZSTD
+    if (options.compressed) {
+        struct compressed_file *cf = open_compressed(msg->maildir_path);
+        if (cf) {
+            if (mf->cf) {
+                free_compressed_file(mf->cf);
             }
-            filler(buf, dent->d_name, 0, 0);
+            mf->cf = cf;
+            mf->cf_index = i;
+            msg->compressed = 1;
         }
-        closedir(backing_dir_handle);
+    }
+#endif
 
-        syslog(LOG_DEBUG, "readdir: '%s' completed", path);
-        return 0;
+    struct mbox_scan scan = { 0 };
+    off_t size = 0;
+    for (;;) {
+        ssize_t bytes = mbox_read_message(mf, i, mf->chunk,
+                                          MBOX_SCAN_CHUNK, size);
+        if (bytes < 0) {
+            syslog(LOG_ERR, "mbox: unable to read '%s'",
+                   msg->maildir_path);
+            return;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        mbox_scan_chunk(&scan, mf->chunk, bytes, NULL);
+        size += bytes;
     }
 
-    char backing_path[PATH_MAX];
-    int res = resolve_path(path, backing_path);
-    if (res != 0) {
-        if (path[1] == '_') {
-            return -ENOENT;
+    char separator[64];
+    msg->size = size;
+    msg->escapes = scan.escapes;
+    msg->needs_newline = ((size == 0) || (scan.last != '\n'));
+    msg->length = mbox_separator(msg->mtime, separator, sizeof(separator))
+                + size + scan.escapes + msg->needs_newline + 1;
+}
+
+/* Find the message of the .mbox file that contains offset, scanning
+ * further messages as necessary.  Returns the number of messages if
+ * offset is at or after the end of the file. */
+static size_t mbox_find(struct mbox_file *mf, off_t offset)
+{
+    while (mf->scanned < mf->count) {
+        if (mf->scanned > 0) {
+            struct mbox_message *last = &mf->messages[mf->scanned - 1];
+            if (offset < last->offset + last->length) {
+                break;
+            }
         }
-        refresh_dir(path, 0);
-        sprintf(backing_path, "%s/_%s", options.backing_dir, path + 1);
+        mbox_scan_message(mf, mf->scanned);
+        mf->scanned++;
+    }
+    if (mf->scanned == 0) {
+        return mf->count;
     }
 
-    DIR *dir_handle = opendir(backing_path);
-    if (!dir_handle) {
-        syslog(LOG_ERR, "readdir: cannot open '%s': %s",
-               path, strerror(errno));
-        return -1;
+    /* Messages that could not be read have the same offset as the
+     * following message, so this finds the last message with an offset
+     * at or before the given offset. */
+    size_t low = 0;
+    size_t high = mf->scanned - 1;
+    while (low < high) {
+        size_t mid = (low + high + 1) / 2;
+        if (mf->messages[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
     }
-    struct dirent *dent;
-    while ((dent = readdir(dir_handle)) != NULL) {
-        filler(buf, dent->d_name, 0, 0);
+    struct mbox_message *msg = &mf->messages[low];
+    if (offset >= msg->offset + msg->length) {
+        return mf->count;
     }
-    closedir(dir_handle);
+    return low;
+}
 
-    syslog(LOG_DEBUG, "readdir: '%s' completed", path);
+/* Escape the contents of message i of the .mbox file into
+ * mf->escaped, if that has not already been done. */
+static int mbox_escape(struct mbox_file *mf, size_t i)
+{
+    if (mf->escaped && (mf->escaped_index == i)) {
+        return 0;
+    }
+    free(mf->escaped);
+    mf->escaped = NULL;
+
+    /* The message may have changed since it was scanned, so the
+     * escaped buffer allows for a separator on every line, and its
+     * contents are then padded or truncated to the scanned length. */
+    struct mbox_message *msg = &mf->messages[i];
+    size_t length = msg->size + msg->escapes;
+    char *data = malloc(msg->size + 1);
+    char *escaped = malloc(msg->size + (msg->size / 5) + length + 1);
+    ssize_t bytes = -1;
+    if (data && escaped) {
+        bytes = mbox_read_message(mf, i, data, msg->size, 0);
+    }
+    if (bytes < 0) {
+        syslog(LOG_ERR, "mbox: unable to read '%s'", msg->maildir_path);
+        free(data);
+        free(escaped);
+        return -1;
+    }
+    struct mbox_scan scan = { 0 };
+    mbox_scan_chunk(&scan, data, bytes, escaped);
+    if (scan.position < length) {
+        memset(escaped + scan.position, '\n', length - scan.position);
+    }
+    free(data);
+    mf->escaped = escaped;
+    mf->escaped_index = i;
     return 0;
 }
 
-/* Get the attributes for the specified mount path. */
-static int fsmu_getattr(const char *path, struct stat *stbuf)
-{
-    syslog(LOG_DEBUG, "getattr: '%s'", path);
-    verify_path(path);
+/* The buffers for a read from a .mbox file.  remaining is the number
+ * of bytes still to be read, and each memory buffer is allocated with
+ * that many bytes, so that it can hold the rest of the read. */
+struct mbox_output {
+    struct fuse_bufvec *bufv;
+    size_t capacity;
+    size_t remaining;
+};
 
-    memset(stbuf, 0, sizeof(struct stat));
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        syslog(LOG_DEBUG, "getattr: '%s' completed", path);
-        return 0;
+/* Get a pointer to the free space in the current memory buffer of the
+ * output, adding a buffer if required.  Returns NULL on error. */
+static char *mbox_output_reserve(struct mbox_output *out)
+{
+    struct fuse_bufvec *bufv = out->bufv;
+    struct fuse_buf *buf = NULL;
+    if (bufv->count > 0) {
+        buf = &bufv->buf[bufv->count - 1];
+    }
+    if (!buf || (buf->flags & FUSE_BUF_IS_FD)) {
+        if (bufv->count == out->capacity) {
+            return NULL;
+        }
+        buf = &bufv->buf[bufv->count];
+        memset(buf, 0, sizeof(struct fuse_buf));
+        buf->fd = -1;
+        buf->mem = malloc(out->remaining);
+        if (!buf->mem) {
+            return NULL;
+        }
+        bufv->count++;
     }
+    return (char *) buf->mem + buf->size;
+}
 
-    char backing_path[PATH_MAX];
-    int res = resolve_path_noexists(path, backing_path);
-    if (res != 0) {
-        sprintf(backing_path, "%s%s", options.backing_dir, path);
+/* Record that count bytes have been written to the space returned by
+ * mbox_output_reserve. */
+static void mbox_output_commit(struct mbox_output *out, size_t count)
+{
+    out->bufv->buf[out->bufv->count - 1].size += count;
+    out->remaining -= count;
+}
+
+/* Copy count bytes from data to the output. */
+static int mbox_output_copy(struct mbox_output *out, const char *data,
+                            size_t count)
+{
+    char *dest = mbox_output_reserve(out);
+    if (!dest) {
+        return -ENOMEM;
     }
+    memcpy(dest, data, count);
+    mbox_output_commit(out, count);
+    return 0;
+}
 
-    int len = strlen(backing_path);
-    if (len >= 4) {
-        const char *tail = backing_path + len - 4;
-        if (   (strcmp(tail, "/cur") == 0)
-            || (strcmp(tail, "/new") == 0)) {
-            syslog(LOG_INFO, "getattr: refreshing cur/new path");
-            refresh_dir(path, 0);
+/* Write count bytes of the (escaped) contents of message i of the .mbox
+ * file to the output, starting at offset.  Where possible, this adds a
+ * file descriptor buffer for the message file, so that FUSE can splice
+ * the data, rather than copying it. */
+static int mbox_output_content(struct mbox_file *mf, size_t i,
+                               struct mbox_output *out, off_t offset,
+                               size_t count)
+{
+    struct mbox_message *msg = &mf->messages[i];
+    if (msg->escapes) {
+        if (mbox_escape(mf, i) != 0) {
+            return -EIO;
         }
+        return mbox_output_copy(out, mf->escaped + offset, count);
     }
-    if (len >= 9) {
-        const char *tail = backing_path + len - 9;
-        if (strcmp(tail, "/.refresh") == 0) {
-            stbuf->st_mode = S_IFREG;
-            /* This previously used to report 0, but a change
-             * somewhere else (possibly in a newer version of FUSE)
-             * means that if the size is reported as 0, reading the
-             * file doesn't actually hit fsmu_read, and the refresh
-             * doesn't happen.  Changing it to have a size of 1
-             * 'fixes' this. */
-            stbuf->st_size = 1;
+
+    struct fuse_bufvec *bufv = out->bufv;
+    if ((count >= MBOX_SPLICE_MIN) && !msg->compressed
+            && (bufv->count < out->capacity)) {
+        int fd = mbox_get_fd(mf, i);
+        if (fd != -1) {
+            struct fuse_buf *buf = &bufv->buf[bufv->count++];
+            memset(buf, 0, sizeof(struct fuse_buf));
+            buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK
+                       | FUSE_BUF_FD_RETRY;
+            buf->fd = fd;
+            buf->pos = offset;
+            buf->size = count;
+            out->remaining -= count;
             return 0;
         }
     }
 
-    res = stat(backing_path, stbuf);
-    if (res != 0) {
-        syslog(LOG_ERR, "getattr: unable to stat '%s': %s",
-               path, strerror(errno));
-        return -1 * errno;
+    char *dest = mbox_output_reserve(out);
+    if (!dest) {
+        return -ENOMEM;
+    }
+    ssize_t bytes = mbox_read_message(mf, i, dest, count, offset);
+    if (bytes < 0) {
+        syslog(LOG_ERR, "mbox: unable to read '%s'", msg->maildir_path);
+        return -EIO;
     }
+    /* If the message has shrunk since it was scanned, then it is padded,
+     * so that the offsets of the later messages do not change. */
+    memset(dest + bytes, '\n', count - bytes);
+    mbox_output_commit(out, count);
+    return 0;
+}
 
-    syslog(LOG_DEBUG, "getattr: '%s' completed", path);
-    return res;
+/* Free the buffers in bufv, as well as bufv itself. */
+static void mbox_free_bufv(struct fuse_bufvec *bufv)
+{
+    for (size_t i = 0; i < bufv->count; i++) {
+        free(bufv->buf[i].mem);
+    }
+    free(bufv);
 }
 
-/* Update the link mappings for the given maildir path (being renamed
- * to new_maildir_path).  If flags are not being set (this happens
- * when the new path involves more than flag modification), then
- * basename_new must be set. */
-static int update_link_mapping(const char *maildir_path,
-                               const char *new_maildir_path,
-                               const char *basename_new,
-                               const char *flags)
+/* Read up to size bytes from the .mbox file, starting at offset, into
+ * a new buffer vector.  Each message is presented as a separator line,
+ * followed by its contents (with any lines beginning with "From ",
+ * after any number of '>' characters, being prefixed with '>'), and a
+ * blank line. */
+static int mbox_read_buf(struct mbox_file *mf, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset)
 {
-    char reverse_path[PATH_MAX];
-    strcpy(reverse_path, backing_dir_reverse);
-    strcat(reverse_path, "/");
-    strcat(reverse_path, maildir_path);
+    struct mbox_output out;
+    out.capacity = (2 * (size / MBOX_SPLICE_MIN)) + 2;
+    out.remaining = size;
+    out.bufv = malloc(sizeof(struct fuse_bufvec)
+                      + (out.capacity * sizeof(struct fuse_buf)));
+    if (!out.bufv) {
+        return -ENOMEM;
+    }
+    *out.bufv = FUSE_BUFVEC_INIT(0);
+    out.bufv->count = 0;
+
+    pthread_mutex_lock(&mf->mutex);
+    int res = 0;
+    off_t position = offset;
+    while ((out.remaining > 0) && (res == 0)) {
+        size_t i = mbox_find(mf, position);
+        if (i == mf->count) {
+            break;
+        }
+        struct mbox_message *msg = &mf->messages[i];
+        char separator[64];
+        off_t separator_len =
+            mbox_separator(msg->mtime, separator, sizeof(separator));
+        off_t content_len = msg->size + msg->escapes;
+        off_t relative = position - msg->offset;
+        size_t count;
+        if (relative < separator_len) {
+            count = separator_len - relative;
+            if (count > out.remaining) {
+                count = out.remaining;
+            }
+            res = mbox_output_copy(&out, separator + relative, count);
+        } else if (relative < separator_len + content_len) {
+            relative -= separator_len;
+            count = content_len - relative;
+            if (count > out.remaining) {
+                count = out.remaining;
+            }
+            res = mbox_output_content(mf, i, &out, relative, count);
+        } else {
+            relative -= separator_len + content_len;
+            count = msg->needs_newline + 1 - relative;
+            if (count > out.remaining) {
+                count = out.remaining;
+            }
+            res = mbox_output_copy(&out, "\n\n", count);
+        }
+        position += count;
+    }
+    pthread_mutex_unlock(&mf->mutex);
 
-    struct dirent *dent;
-    struct dirent *dent_search;
-    struct dirent *dent_type;
+    if (res != 0) {
+        mbox_free_bufv(out.bufv);
+        return res;
+    }
+    if (out.bufv->count == 0) {
+        out.bufv->count = 1;
+    }
+    *bufp = out.bufv;
+    return 0;
+}
 
-    DIR *reverse_handle = opendir(reverse_path);
-    if (!reverse_handle) {
-        syslog(LOG_ERR, "update_link_mapping: cannot open '%s': %s",
-               reverse_path, strerror(errno));
-        return -1;
+/* Read up to size bytes from the .mbox file, starting at offset, into
+ * buf.  This is for callers that cannot use buffer vectors. */
+static int mbox_read(struct mbox_file *mf, char *buf, size_t size,
+                     off_t offset)
+{
+    struct fuse_bufvec *bufv;
+    int res = mbox_read_buf(mf, &bufv, size, offset);
+    if (res != 0) {
+        return res;
     }
-    int reverse_error = 0;
-    while ((dent = readdir(reverse_handle)) != NULL) {
-        if (is_upwards(dent->d_name)) {
+    size_t done = 0;
+    for (size_t i = 0; (i < bufv->count) && (res == 0); i++) {
+        struct fuse_buf *part = &bufv->buf[i];
+        if (!(part->flags & FUSE_BUF_IS_FD)) {
+            memcpy(buf + done, part->mem, part->size);
+            done += part->size;
             continue;
         }
-        char search_path[PATH_MAX];
-        strcpy(search_path, reverse_path);
-        strcat(search_path, "/");
-        strcat(search_path, dent->d_name);
-        DIR *search_dir_handle = opendir(search_path);
-        if (!search_dir_handle) {
-            syslog(LOG_ERR, "update_link_mapping: cannot open search path '%s': %s",
-                   search_path, strerror(errno));
-            reverse_error = 1;
-            break;
-        }
-        int search_error = 0;
-        while ((dent_search = readdir(search_dir_handle)) != NULL) {
-            if (is_upwards(dent_search->d_name)) {
+        size_t part_done = 0;
+        while (part_done < part->size) {
+            ssize_t bytes = pread(part->fd, buf + done + part_done,
+                                  part->size - part_done,
+                                  part->pos + part_done);
+            if ((bytes < 0) && (errno == EINTR)) {
                 continue;
             }
-            char type_path[PATH_MAX];
-            strcpy(type_path, search_path);
-            strcat(type_path, "/");
-            strcat(type_path, dent_search->d_name);
-            DIR *type_dir_handle = opendir(type_path);
-            if (!type_dir_handle) {
-                syslog(LOG_ERR, "update_link_mapping: cannot open type path '%s': %s",
-                       type_path, strerror(errno));
-                search_error = 1;
+            if (bytes <= 0) {
+                res = -EIO;
                 break;
             }
-            int type_error = 0;
-            while ((dent_type = readdir(type_dir_handle)) != NULL) {
-                if (is_upwards(dent_type->d_name)) {
-                    continue;
-                }
-                char reverse_path_full[PATH_MAX];
-                strcpy(reverse_path_full, type_path);
-                strcat(reverse_path_full, "/");
-                strcat(reverse_path_full, dent_type->d_name);
-                char backing_path[PATH_MAX];
-
-                ssize_t len = readlink(reverse_path_full, backing_path, PATH_MAX);
-                if (len == PATH_MAX) {
-                    syslog(LOG_ERR, "update_link_mapping: too much path data for '%s'",
-                           reverse_path_full);
-                    type_error = 1;
-                    break;
-                }
-                if (len == -1) {
-                    syslog(LOG_ERR, "update_link_mapping: unable to read link for '%s': %s",
-                           reverse_path_full, strerror(errno));
-                    type_error = 1;
-                    break;
-                }
-                backing_path[len] = 0;
-
-                int res = remove_link_mapping(maildir_path, backing_path);
-                if (res != 0) {
-                    syslog(LOG_ERR, "update_link_mapping: cannot remove old link mapping");
-                    type_error = 1;
-                    break;
-                }
-                res = unlink(backing_path);
-                if (res != 0) {
-                    syslog(LOG_ERR, "update_link_mapping: cannot remove old backing path");
-                    type_error = 1;
-                    break;
-                }
+            part_done += bytes;
+        }
+        done += part_done;
+    }
+    mbox_free_bufv(bufv);
+    return ((res == 0) ? (int) done : res);
+}
 
-                char backing_path_new[PATH_MAX];
-                char backing_path_dir[PATH_MAX];
-                res = dirname(backing_path, backing_path_dir);
-                if (res != 0) {
-                    type_error = 1;
-                    break;
-                }
-                char backing_path_dir2[PATH_MAX];
-                res = dirname(backing_path_dir, backing_path_dir2);
-                if (res != 0) {
-                    type_error = 1;
-                    break;
-                }
-                char new_maildir_path_dir[PATH_MAX];
-                res = dirname(new_maildir_path, new_maildir_path_dir);
-                if (res != 0) {
-                    type_error = 1;
-                    break;
-                }
-                char new_maildir_path_dir_single[PATH_MAX];
-                res = basename(new_maildir_path_dir,
-                               new_maildir_path_dir_single);
-                if (res != 0) {
-                    type_error = 1;
-                    break;
-                }
+/* Free the state for an open .mbox file, releasing its generation. */
+static void free_mbox_file(struct mbox_file *mf)
+{
+    for (size_t i = 0; i < mf->count; i++) {
+        free(mf->messages[i].name);
+        free(mf->messages[i].maildir_path);
+    }
+    for (size_t i = 0; i < MBOX_OPEN_FILES; i++) {
+        if (mf->files[i].fd != -1) {
+            close(mf->files[i].fd);
+        }
+    }
+#ifdef FSMU_ZSTD
+    if (mf->cf) {
+        free_compressed_file(mf->cf);
+    }
+#endif
+    release_generation(mf->gen);
+    path_free(&mf->gen_path);
+    pthread_mutex_destroy(&mf->mutex);
+    free(mf->messages);
+    free(mf->chunk);
+    free(mf->escaped);
+    free(mf);
+}
 
-                strcpy(backing_path_new, backing_path_dir2);
-                strcat(backing_path_new, "/");
-                strcat(backing_path_new, new_maildir_path_dir_single);
-                strcat(backing_path_new, "/");
-
-                if (!flags) {
-                    strcat(backing_path_new, basename_new);
-                } else {
-                    char filename[PATH_MAX];
-                    res = basename(backing_path, filename);
-                    if (res != 0) {
-                        type_error = 1;
-                        break;
-                    }
-                    char *to_flags = strrchr(filename, ':');
-                    if (!to_flags) {
-                        strcat(backing_path_new, filename);
-                        strcat(backing_path_new, flags);
-                    } else {
-                        strcpy(to_flags, flags);
-                        strcat(backing_path_new, filename);
-                    }
-                }
+/* Compare two .mbox messages by filename. */
+static int compare_mbox_messages(const void *a, const void *b)
+{
+    return strcmp(((const struct mbox_message *) a)->name,
+                  ((const struct mbox_message *) b)->name);
+}
 
-                res = add_link_mapping(new_maildir_path, backing_path_new);
-                if (res != 0) {
-                    type_error = 1;
-                    break;
-                }
+/* Set up the state for reading the .mbox file at path, which is
+ * written to mfp.  This lists the messages in the current generation of
+ * the query directory, but does not read them. */
+static int open_mbox(const char *path, struct mbox_file **mfp)
+{
+    char *name = get_query_name(path);
+    if (!name) {
+        return -ENOMEM;
+    }
+    refresh_dir(path, 0, 0);
 
-                res = symlink(new_maildir_path, backing_path_new);
-                if (res != 0) {
-                    syslog(LOG_ERR, "update_link_mapping: unable to "
-                                    "relink backing path '%s': %s",
-                           backing_path_new, strerror(errno));
-                    type_error = 1;
+    struct mbox_file *mf = calloc(1, sizeof(struct mbox_file));
+    if (!mf) {
+        free(name);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&mf->mutex, NULL);
+    for (size_t i = 0; i < MBOX_OPEN_FILES; i++) {
+        mf->files[i].fd = -1;
+    }
+    mf->gen = acquire_generation(name, "", &mf->gen_path);
+    free(name);
+    mf->chunk = malloc(MBOX_SCAN_CHUNK);
+    if (!mf->chunk || !mf->gen_path.buf) {
+        free_mbox_file(mf);
+        return -ENOMEM;
+    }
+
+    const char *subdirs[] = { "cur", "new" };
+    struct path dir_path = PATH_INIT;
+    size_t capacity = 0;
+    int res = 0;
+    for (int i = 0; (i < 2) && (res == 0); i++) {
+        if (path_setf(&dir_path, "%s/%s", mf->gen_path.buf,
+                      subdirs[i]) != 0) {
+            res = -ENOMEM;
+            break;
+        }
+        DIR *dir_handle = opendir(dir_path.buf);
+        if (!dir_handle) {
+            continue;
+        }
+        size_t start = mf->count;
+        struct dirent *dent;
+        while ((dent = readdir(dir_handle)) != NULL) {
+            if (is_upwards(dent->d_name)) {
+                continue;
+            }
+            if (mf->count == capacity) {
+                size_t new_capacity = (capacity ? capacity * 2 : 64);
+                struct mbox_message *messages =
+                    realloc(mf->messages,
+                            new_capacity * sizeof(struct mbox_message));
+                if (!messages) {
+                    res = -ENOMEM;
                     break;
                 }
+                mf->messages = messages;
+                capacity = new_capacity;
             }
-            closedir(type_dir_handle);
-            if (type_error) {
-                search_error = 1;
+            struct mbox_message *msg = &mf->messages[mf->count];
+            memset(msg, 0, sizeof(struct mbox_message));
+            msg->name = strdup(dent->d_name);
+            if (!msg->name) {
+                res = -ENOMEM;
                 break;
             }
+            msg->subdir = subdirs[i];
+            mf->count++;
         }
-        closedir(search_dir_handle);
-        if (search_error) {
-            reverse_error = 1;
-            break;
-        }
-    }
-    closedir(reverse_handle);
-    if (reverse_error) {
-        return -1;
+        closedir(dir_handle);
+        qsort(mf->messages + start, mf->count - start,
+              sizeof(struct mbox_message), compare_mbox_messages);
     }
+    path_free(&dir_path);
 
+    if (res != 0) {
+        free_mbox_file(mf);
+        return res;
+    }
+    *mfp = mf;
     return 0;
 }
 
@@ -1103,6 +8184,302 @@ static int equal_to_flags(const char *path1, const char *path2)
     }
 }
 
+/* Rename the message at from_maildir_path (linked to from
+ * from_backing_path by way of link_maildir_path) to to_maildir_path,
+ * and update the link mappings accordingly (see rename_message).
+ * Propagation to the other query directories is based on
+ * propagation_path. */
+static int move_message(const char *link_maildir_path,
+                        const char *from_maildir_path,
+                        const char *propagation_path,
+                        const char *to_maildir_path,
+                        const char *from_backing_path,
+                        const char *to_backing_path,
+                        const char *to_basename,
+                        const char *flags)
+{
+    struct trace_span span;
+    PHASE_BEGIN(span, rename_maildir, from_maildir_path);
+    int res = rename(from_maildir_path, to_maildir_path);
+    PHASE_END(span, rename_maildir, from_maildir_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "rename: unable to rename '%s' to '%s': %s",
+               from_maildir_path, to_maildir_path,
+               strerror(errno));
+        return -1;
+    }
+
+    queue_index_update(INDEX_REMOVE, from_maildir_path);
+    queue_index_update(INDEX_ADD, to_maildir_path);
+    move_identity(link_maildir_path, to_maildir_path);
+
+    /* Update this query directory straight away, and leave the other
+     * query directories to the propagation thread. */
+    PHASE_BEGIN(span, rename_relink, from_backing_path);
+    res = remove_link_mapping(link_maildir_path, from_backing_path);
+    if (res != 0) {
+        syslog(LOG_INFO, "rename: unable to remove link mapping "
+                         "for '%s'",
+               from_backing_path);
+    }
+    res = unlink(from_backing_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "rename: cannot remove old backing path "
+                        "'%s': %s",
+               from_backing_path, strerror(errno));
+        PHASE_END(span, rename_relink, from_backing_path);
+        return -1;
+    }
+    res = symlink(to_maildir_path, to_backing_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "rename: unable to link backing path "
+                        "'%s': %s",
+               to_backing_path, strerror(errno));
+        PHASE_END(span, rename_relink, from_backing_path);
+        return -1;
+    }
+    res = add_link_mapping(to_maildir_path, to_backing_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "rename: unable to add link mapping "
+                        "for '%s'",
+               to_backing_path);
+    }
+    log_change('R', from_backing_path, to_backing_path, 0);
+    PHASE_END(span, rename_relink, from_backing_path);
+
+    PHASE_BEGIN(span, rename_propagate, to_maildir_path);
+    res = queue_propagation(propagation_path, to_maildir_path,
+                            to_basename, flags);
+    if (res != 0) {
+        res = update_link_mapping(propagation_path, to_maildir_path,
+                                  to_basename, flags);
+    }
+    PHASE_END(span, rename_propagate, to_maildir_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "rename: update link mapping failed: %s",
+               strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Rename the message linked to from from_backing_path, so that it is
+ * in the to_dir ("cur" or "new") directory of its maildir and is
+ * linked to from to_backing_path.  If flags is set, then only the
+ * flags of the message's filename are changed, and otherwise its
+ * filename is changed to to_basename.  The query directory containing
+ * from_backing_path is updated straight away, and the change is
+ * queued for propagation to the other query directories.  The caller
+ * must hold mapping_mutex. */
+static int rename_message(const char *from_backing_path,
+                          const char *to_backing_path,
+                          const char *to_dir_next_single,
+                          const char *to_basename,
+                          const char *flags)
+{
+    struct path link_maildir_path = PATH_INIT;
+    struct path from_maildir_path = PATH_INIT;
+    struct path to_maildir_path = PATH_INIT;
+    int res = path_readlink(&link_maildir_path, from_backing_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "rename: unable to read link for '%s': %s",
+               from_backing_path, strerror(errno));
+        return -1;
+    }
+
+    /* The link may refer to a path that has since been renamed by
+     * way of another query directory, if that rename has not yet been
+     * propagated to this query directory, or that has since been
+     * renamed by something other than fsmu.  In the latter case, the
+     * other query directories will also refer to the link's path, so
+     * that path is used as the basis for propagation. */
+    const char *propagation_path = NULL;
+    struct stat stbuf;
+    if ((lstat(link_maildir_path.buf, &stbuf) != 0) && (errno == ENOENT)) {
+        res = lookup_propagation(link_maildir_path.buf, &from_maildir_path);
+        if (res != 0) {
+            res = find_moved_message(link_maildir_path.buf,
+                                     &from_maildir_path);
+            if (res == 0) {
+                propagation_path = link_maildir_path.buf;
+                queue_index_update(INDEX_REMOVE, link_maildir_path.buf);
+                queue_index_update(INDEX_ADD, from_maildir_path.buf);
+            }
+        }
+    }
+    res = 0;
+    if (!from_maildir_path.len) {
+        res = path_set(&from_maildir_path, link_maildir_path.buf);
+    }
+    if (!propagation_path) {
+        propagation_path = from_maildir_path.buf;
+    }
+
+    /* The new maildir path is the old one, with its last two segments
+     * replaced by the target directory and filename. */
+    const char *dir_segments =
+        last_segments(from_maildir_path.buf, from_maildir_path.len, 2);
+    if ((res == 0) && !dir_segments) {
+        syslog(LOG_ERR, "rename: unable to get directory for '%s'",
+               from_maildir_path.buf);
+        res = -1;
+    }
+    if (res == 0) {
+        res = path_set_len(&to_maildir_path, from_maildir_path.buf,
+                           dir_segments - from_maildir_path.buf);
+    }
+    if (res == 0) {
+        res = path_push(&to_maildir_path, to_dir_next_single);
+    }
+    if (res == 0) {
+        res = path_append(&to_maildir_path, "/");
+    }
+    if (res == 0) {
+        res = (flags ? append_with_flags(&to_maildir_path,
+                                         basename_view(from_maildir_path.buf),
+                                         flags)
+                     : path_append(&to_maildir_path, to_basename));
+    }
+    if (res == 0) {
+        res = move_message(link_maildir_path.buf, from_maildir_path.buf,
+                           propagation_path, to_maildir_path.buf,
+                           from_backing_path, to_backing_path,
+                           to_basename, flags);
+    }
+
+    path_free(&link_maildir_path);
+    path_free(&from_maildir_path);
+    path_free(&to_maildir_path);
+    return (res == 0) ? 0 : -1;
+}
+
+/* The maximum number of messages recorded in open_messages, beyond
+ * which the table is cleared. */
+#define OPEN_MESSAGES_MAX 65536
+
+/* The identity and modification time of a message file, as of when it
+ * was last opened by way of a given mount path. */
+struct message_version {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+};
+
+/* A map from mount path to the version of the message at that path
+ * when it was last opened, so that the kernel's cached pages for the
+ * message can be kept if it has not changed since then (see
+ * keep_message_cache). */
+static struct table open_messages;
+static pthread_mutex_t open_messages_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns a boolean indicating whether path is the mount path of a
+ * message (i.e. "/<query>/<cur|new>/<name>"). */
+static int is_message_path(const char *path)
+{
+    const char *subdir = strchr(path + 1, '/');
+    if (!subdir || (path[1] == '_')) {
+        return 0;
+    }
+    if ((strncmp(subdir, "/cur/", 5) != 0)
+            && (strncmp(subdir, "/new/", 5) != 0)) {
+        return 0;
+    }
+    return ((subdir[5] != '\0') && !strchr(subdir + 5, '/'));
+}
+
+/* Record the version of the message at the mount path path as it is
+ * opened.  Returns a boolean indicating whether the message is the
+ * same as when it was last opened by way of that path, in which case
+ * the kernel's cached pages for it are still valid.  Since maildir
+ * messages are not changed in place, this is ordinarily the case. */
+static int keep_message_cache(const char *path)
+{
+    struct path backing_path = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    struct stat stbuf;
+    int res = resolve_path(path, &backing_path);
+    if ((res == 0) && (stat(backing_path.buf, &stbuf) != 0)) {
+        /* The message may have been renamed by something other than
+         * fsmu. */
+        res = (((resolve_maildir_path(backing_path.buf,
+                                      &maildir_path) == 0)
+                    && (stat(maildir_path.buf, &stbuf) == 0))
+                  ? 0 : -1);
+    }
+    path_free(&backing_path);
+    path_free(&maildir_path);
+    if (res != 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&open_messages_mutex);
+    struct message_version *version = table_get(&open_messages, path);
+    int keep = (version
+                 && (version->dev == stbuf.st_dev)
+                 && (version->ino == stbuf.st_ino)
+                 && (version->mtime.tv_sec == stbuf.st_mtim.tv_sec)
+                 && (version->mtime.tv_nsec == stbuf.st_mtim.tv_nsec)
+                 && (version->size == stbuf.st_size));
+    if (!version) {
+        if (open_messages.count >= OPEN_MESSAGES_MAX) {
+            table_clear(&open_messages);
+        }
+        version = malloc(sizeof(struct message_version));
+        if (version
+                && (table_put(&open_messages, path, version,
+                              NULL) != 0)) {
+            free(version);
+            version = NULL;
+        }
+    }
+    if (version) {
+        version->dev = stbuf.st_dev;
+        version->ino = stbuf.st_ino;
+        version->mtime = stbuf.st_mtim;
+        version->size = stbuf.st_size;
+    }
+    pthread_mutex_unlock(&open_messages_mutex);
+    return keep;
+}
+
+/* Move the recorded version of the message at the mount path from to
+ * the mount path to (or forget it, if to is NULL), after the message
+ * has been renamed or removed by way of the mount. */
+static void move_message_version(const char *from, const char *to)
+{
+    pthread_mutex_lock(&open_messages_mutex);
+    struct message_version *version = table_remove(&open_messages, from);
+    void *previous = NULL;
+    if (version && to
+            && (table_put(&open_messages, to, version, &previous) == 0)) {
+        version = NULL;
+    }
+    pthread_mutex_unlock(&open_messages_mutex);
+    free(version);
+    free(previous);
+}
+
+/* As per move_message_version, but for the message at the backing
+ * path from (i.e. "<backing-dir>/_<query>/<cur|new>/<name>"), which
+ * has been renamed to the backing path to. */
+static void move_backing_message_version(const char *from, const char *to)
+{
+    size_t prefix_len = strlen(options.backing_dir) + 2;
+    if ((strlen(from) <= prefix_len) || (strlen(to) <= prefix_len)) {
+        return;
+    }
+    struct path from_mount = PATH_INIT;
+    struct path to_mount = PATH_INIT;
+    if ((path_setf(&from_mount, "/%s", from + prefix_len) == 0)
+            && (path_setf(&to_mount, "/%s", to + prefix_len) == 0)) {
+        move_message_version(from_mount.buf, to_mount.buf);
+    }
+    path_free(&from_mount);
+    path_free(&to_mount);
+}
+
 /* Rename the specified mount path. */
 static int fsmu_rename(const char *from, const char *to)
 {
@@ -1124,134 +8501,383 @@ static int fsmu_rename(const char *from, const char *to)
         return 0;
     }
 
-    char from_dir[PATH_MAX];
-    int res = dirname(from, from_dir);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get directory for '%s'", from);
+    /* The directories two levels up (i.e. the query directories) must
+     * match. */
+    size_t from_len = strlen(from);
+    size_t to_len = strlen(to);
+    const char *from_dir = last_segments(from, from_len, 2);
+    const char *to_dir = last_segments(to, to_len, 2);
+    if (!from_dir || !to_dir) {
+        syslog(LOG_ERR, "rename: unable to get directories for "
+                        "'%s' and '%s'", from, to);
         return -1;
     }
-    char to_dir[PATH_MAX];
-    res = dirname(to, to_dir);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get directory for '%s'", to);
+    if (((from_dir - from) != (to_dir - to))
+            || (strncmp(from, to, to_dir - to) != 0)) {
+        syslog(LOG_ERR, "rename: directories do not match: "
+                        "'%.*s' and '%.*s'",
+               (int) (from_dir - from), from,
+               (int) (to_dir - to), to);
         return -1;
     }
 
-    char from_dir_next[PATH_MAX];
-    res = dirname(from_dir, from_dir_next);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get directory for '%s'",
-               from_dir);
-        return -1;
+    const char *to_basename = basename_view(to);
+    char *to_dir_next_single =
+        strndup(to_dir + 1, to_basename - to_dir - 2);
+    struct path from_backing_path = PATH_INIT;
+    struct path to_backing_path = PATH_INIT;
+    int res = -1;
+    if (!to_dir_next_single) {
+        syslog(LOG_ERR, "rename: unable to get directory for '%s'", to);
+    } else if (resolve_path(from, &from_backing_path) != 0) {
+        syslog(LOG_ERR, "rename: unable to resolve '%s'", from);
+    } else if (resolve_path_noexists(to, &to_backing_path) != 0) {
+        syslog(LOG_ERR, "rename: unable to resolve '%s'", to);
+    } else {
+        struct trace_span span;
+        PHASE_BEGIN(span, rename_lock, from);
+        pthread_mutex_lock(&propagation_queue.mapping_mutex);
+        PHASE_END(span, rename_lock, from);
+        res = rename_message(from_backing_path.buf, to_backing_path.buf,
+                             to_dir_next_single, to_basename, flags);
+        pthread_mutex_unlock(&propagation_queue.mapping_mutex);
     }
-    char to_dir_next[PATH_MAX];
-    res = dirname(to_dir, to_dir_next);
+    free(to_dir_next_single);
+    path_free(&from_backing_path);
+    path_free(&to_backing_path);
     if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get directory for '%s'",
-               to_dir);
         return -1;
     }
+    move_message_version(from, to);
 
-    res = strcmp(from_dir_next, to_dir_next);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: directories do not match: "
-                        "'%s' and '%s'", from_dir_next,
-                        to_dir_next);
-        return -1;
+    syslog(LOG_DEBUG, "rename: '%s' to '%s' completed", from, to);
+    return 0;
+}
+
+/* Parse the flags argument from a .batch line (e.g. "RS", or ":2,RS")
+ * into a maildir info string (e.g. ":2,RS"), with the flags sorted and
+ * deduplicated, and write it to buf. */
+static int parse_batch_flags(const char *arg, char *buf)
+{
+    if (strncmp(arg, ":2,", 3) == 0) {
+        arg += 3;
+    }
+    int seen[26] = { 0 };
+    for (const char *c = arg; *c; c++) {
+        if ((*c < 'A') || (*c > 'Z')) {
+            return -1;
+        }
+        seen[*c - 'A'] = 1;
+    }
+    memcpy(buf, ":2,", 3);
+    int j = 3;
+    for (int i = 0; i < 26; i++) {
+        if (seen[i]) {
+            buf[j++] = 'A' + i;
+        }
     }
+    buf[j] = 0;
+    return 0;
+}
 
-    char to_dir_next_single[PATH_MAX];
-    res = basename(to_dir, to_dir_next_single);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get basename from '%s'",
-               to_dir);
-        return -1;
+/* Apply the flag changes in data (lines of the form "filename flags")
+ * to the messages in the given query directory, and record a result
+ * line for each.  The changes are applied while holding mapping_mutex
+ * throughout, so that propagation to the other query directories
+ * happens once the batch is complete, and index updates are flushed
+ * once for the whole batch.  Each message is still renamed by way of
+ * rename_message, so each one has its own propagation (and walk of
+ * its reverse mapping). */
+static void apply_batch(const char *query, char *data, size_t size)
+{
+    char *results = NULL;
+    size_t results_size = 0;
+    FILE *out = open_memstream(&results, &results_size);
+    if (!out) {
+        syslog(LOG_ERR, "batch: unable to allocate results for '%s'",
+               query);
+        return;
     }
 
-    char to_basename[PATH_MAX];
-    res = basename(to, to_basename);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get basename from '%s'",
-               to);
-        return -1;
+    struct path from_backing_path = PATH_INIT;
+    struct path to_backing_path = PATH_INIT;
+    if ((path_setf(&from_backing_path, "%s/_%s/",
+                   options.backing_dir, query) != 0)
+            || (path_set(&to_backing_path, from_backing_path.buf) != 0)) {
+        fclose(out);
+        free(results);
+        path_free(&from_backing_path);
+        return;
     }
+    size_t query_len = from_backing_path.len;
+
+    int count = 0;
+    int errors = 0;
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    char *end = data + size;
+    char *line = data;
+    while (line < end) {
+        char *line_end = memchr(line, '\n', end - line);
+        if (!line_end) {
+            line_end = end;
+        }
+        *line_end = 0;
+        char *next = line_end + 1;
+        while ((line_end > line)
+                && ((line_end[-1] == '\r') || (line_end[-1] == ' '))) {
+            *(--line_end) = 0;
+        }
+        if (line_end == line) {
+            line = next;
+            continue;
+        }
 
-    char from_backing_path[PATH_MAX];
-    res = resolve_path(from, from_backing_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to resolve '%s'", from);
-        return -1;
+        char *filename = line;
+        const char *flags_arg = "";
+        char *space = strrchr(line, ' ');
+        if (space) {
+            *space = 0;
+            flags_arg = space + 1;
+        }
+        line = next;
+        count++;
+        if ((strncmp(filename, "cur/", 4) == 0)
+                || (strncmp(filename, "new/", 4) == 0)) {
+            filename += 4;
+        }
+
+        char flags[32];
+        if (parse_batch_flags(flags_arg, flags) != 0) {
+            fprintf(out, "%s error invalid flags '%s'\n",
+                    filename, flags_arg);
+            errors++;
+            continue;
+        }
+        if ((filename[0] == 0) || strchr(filename, '/')
+                || is_upwards(filename)) {
+            fprintf(out, "%s error invalid filename\n", filename);
+            errors++;
+            continue;
+        }
+
+        /* The backing paths share the query directory prefix. */
+        struct stat stbuf;
+        path_truncate(&from_backing_path, query_len);
+        if (path_appendf(&from_backing_path, "cur/%s", filename) != 0) {
+            fprintf(out, "%s error out of memory\n", filename);
+            errors++;
+            continue;
+        }
+        int in_cur = (lstat(from_backing_path.buf, &stbuf) == 0);
+        if (!in_cur) {
+            memcpy(from_backing_path.buf + query_len, "new", 3);
+            if (lstat(from_backing_path.buf, &stbuf) != 0) {
+                fprintf(out, "%s error no such message\n", filename);
+                errors++;
+                continue;
+            }
+        }
+
+        path_truncate(&to_backing_path, query_len);
+        if ((path_append(&to_backing_path, "cur/") != 0)
+                || (append_with_flags(&to_backing_path, filename,
+                                      flags) != 0)) {
+            fprintf(out, "%s error out of memory\n", filename);
+            errors++;
+            continue;
+        }
+        const char *to_basename = basename_view(to_backing_path.buf);
+        if (in_cur && (strcmp(filename, to_basename) == 0)) {
+            fprintf(out, "%s ok %s\n", filename, to_basename);
+            continue;
+        }
+
+        int res = rename_message(from_backing_path.buf,
+                                 to_backing_path.buf,
+                                 "cur", to_basename, flags);
+        if (res != 0) {
+            fprintf(out, "%s error rename failed\n", filename);
+            errors++;
+            continue;
+        }
+        move_backing_message_version(from_backing_path.buf,
+                                     to_backing_path.buf);
+        fprintf(out, "%s ok %s\n", filename, to_basename);
     }
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    fclose(out);
+    path_free(&from_backing_path);
+    path_free(&to_backing_path);
 
-    char from_maildir_path[PATH_MAX];
-    ssize_t len = readlink(from_backing_path, from_maildir_path, PATH_MAX);
-    if (len == PATH_MAX) {
-        syslog(LOG_ERR, "rename: too much path data for '%s'",
-               from_backing_path);
-        return -1;
+    if (options.update_index) {
+        flush_index_updates();
     }
-    if (len == -1) {
-        syslog(LOG_ERR, "rename: unable to read link for '%s': %s",
-               from_backing_path, strerror(errno));
-        return -1;
+
+    pthread_mutex_lock(&batch_results_mutex);
+    char *previous = NULL;
+    if (table_put(&batch_results, query, results,
+                  (void **) &previous) != 0) {
+        free(results);
     }
-    from_maildir_path[len] = 0;
+    free(previous);
+    pthread_mutex_unlock(&batch_results_mutex);
 
-    char maildir_basename[PATH_MAX];
-    res = basename(from_maildir_path, maildir_basename);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get basename for '%s'",
-               from_maildir_path);
-        return -1;
+    syslog(LOG_INFO, "batch: '%s': applied %d changes (%d errors)",
+           query, count - errors, errors);
+}
+
+/* Write data to an open .batch file. */
+static int fsmu_write(const char *path, const char *buf, size_t size,
+                      off_t offset, struct fuse_file_info *info)
+{
+    syslog(LOG_DEBUG, "write: '%s'", path);
+    verify_path(path);
+
+    if (!is_batch_path(path) || !info->fh) {
+        return -EACCES;
+    }
+    struct batch_buffer *batch = (struct batch_buffer *) info->fh;
+    if ((offset + size) > BATCH_MAX_SIZE) {
+        return -EFBIG;
+    }
+    if ((offset + size) > batch->size) {
+        /* One extra byte is allocated, so that the last line can
+         * be terminated in place when the batch is applied. */
+        char *data = realloc(batch->data, offset + size + 1);
+        if (!data) {
+            return -ENOMEM;
+        }
+        if ((size_t) offset > batch->size) {
+            memset(data + batch->size, '\n', offset - batch->size);
+        }
+        batch->data = data;
+        batch->size = offset + size;
     }
+    memcpy(batch->data + offset, buf, size);
 
-    char from_maildir_dir[PATH_MAX];
-    char to_maildir_path[PATH_MAX];
-    res = dirname(from_maildir_path, from_maildir_dir);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get directory for '%s'",
-               from_maildir_path);
-        return -1;
+    syslog(LOG_DEBUG, "write: '%s' completed", path);
+    return size;
+}
+
+/* Flush the specified mount path.  For a .batch file, this applies
+ * the data written since the last flush. */
+static int fsmu_flush(const char *path, struct fuse_file_info *info)
+{
+    if (!is_batch_path(path) || !info->fh) {
+        return 0;
     }
-    res = dirname(from_maildir_dir, to_maildir_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to get directory for '%s'",
-               from_maildir_dir);
-        return -1;
+    struct batch_buffer *batch = (struct batch_buffer *) info->fh;
+    if (batch->size == 0) {
+        return 0;
     }
 
-    strcat(to_maildir_path, "/");
-    strcat(to_maildir_path, to_dir_next_single);
-    strcat(to_maildir_path, "/");
-    if (!flags) {
-        strcat(to_maildir_path, to_basename);
-    } else {
-        char *to_flags = strrchr(maildir_basename, ':');
-        if (!to_flags) {
-            strcat(to_maildir_path, maildir_basename);
-            strcat(to_maildir_path, flags);
-        } else {
-            strcpy(to_flags, flags);
-            strcat(to_maildir_path, maildir_basename);
+    char *query = get_query_name(path);
+    if (!query) {
+        return -ENOMEM;
+    }
+    apply_batch(query, batch->data, batch->size);
+    free(query);
+
+    free(batch->data);
+    batch->data = NULL;
+    batch->size = 0;
+    return 0;
+}
+
+/* Open the specified mount path.  If the path is a .batch file opened
+ * for writing, then the buffer for the written data is set up here.
+ * If --compressed is set, and the underlying maildir file is
+ * compressed, then the decompression state is set up here, so that it
+ * can be reused across reads.  Otherwise, the underlying file is
+ * opened on each read.  For a message, the kernel is told to keep its
+ * cached pages if the message has not changed since it was last
+ * opened. */
+static int fsmu_open(const char *path, struct fuse_file_info *info)
+{
+    info->fh = 0;
+    if (is_batch_path(path)) {
+        /* The file's contents depend on whether it has been written
+         * to, so the page cache and the reported size are bypassed. */
+        info->direct_io = 1;
+        if ((info->flags & O_ACCMODE) != O_RDONLY) {
+            struct batch_buffer *batch =
+                calloc(1, sizeof(struct batch_buffer));
+            if (!batch) {
+                return -ENOMEM;
+            }
+            info->fh = (uint64_t) (uintptr_t) batch;
+        }
+        return 0;
+    }
+    int has_cursor;
+    uint64_t cursor;
+    if (is_status_path(path)
+            || is_changes_path(path, &has_cursor, &cursor)) {
+        /* The status and the change log change with each refresh. */
+        info->direct_io = 1;
+        return 0;
+    }
+    if (is_mbox_path(path)) {
+        struct mbox_file *mf;
+        int res = open_mbox(path, &mf);
+        if (res != 0) {
+            return res;
+        }
+        info->direct_io = 1;
+        info->fh = (uint64_t) (uintptr_t) mf;
+        return 0;
+    }
+    if (is_message_path(path)) {
+        info->keep_cache = keep_message_cache(path);
+    }
+#ifdef FSMU_ZSTD
+    if (!options.compressed) {
+        return 0;
+    }
+    struct path backing_path = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    if ((resolve_path(path, &backing_path) == 0)
+            && (resolve_maildir_path(backing_path.buf,
+                                     &maildir_path) == 0)) {
+        struct compressed_file *cf = open_compressed(maildir_path.buf);
+        if (cf) {
+            info->fh = (uint64_t) (uintptr_t) cf;
+        }
+    }
+    path_free(&backing_path);
+    path_free(&maildir_path);
+#endif
+
+    return 0;
+}
+
+/* Release the specified mount path, freeing any batch buffer, .mbox
+ * state or decompression state set up by fsmu_open. */
+static int fsmu_release(const char *path, struct fuse_file_info *info)
+{
+    if (is_batch_path(path)) {
+        struct batch_buffer *batch = (struct batch_buffer *) info->fh;
+        if (batch) {
+            free(batch->data);
+            free(batch);
+            info->fh = 0;
         }
+        return 0;
     }
-    res = rename(from_maildir_path, to_maildir_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: unable to rename '%s' to '%s': %s",
-               from_maildir_path, to_maildir_path,
-               strerror(errno));
-        return -1;
+    if (is_mbox_path(path)) {
+        if (info->fh) {
+            free_mbox_file((struct mbox_file *) info->fh);
+            info->fh = 0;
+        }
+        return 0;
     }
-
-    res = update_link_mapping(from_maildir_path, to_maildir_path,
-                              to_basename, flags);
-    if (res != 0) {
-        syslog(LOG_ERR, "rename: update link mapping failed: %s",
-               strerror(errno));
-        return -1;
+#ifdef FSMU_ZSTD
+    if (info->fh) {
+        free_compressed_file((struct compressed_file *) info->fh);
+        info->fh = 0;
     }
+#endif
 
-    syslog(LOG_DEBUG, "rename: '%s' to '%s' completed", from, to);
     return 0;
 }
 
@@ -1267,7 +8893,7 @@ static int fsmu_read(const char *path, char *buf, size_t size,
         const char *tail = path + len - 9;
         if (strcmp(tail, "/.refresh") == 0) {
             syslog(LOG_INFO, "getattr: forcibly refreshing path");
-            refresh_dir(path, 1);
+            refresh_dir(path, 1, 0);
             /* This previously used to have a size of 0, but a change
              * somewhere else (possibly in a newer version of FUSE)
              * means that if the size is reported as 0, reading the
@@ -1278,15 +8904,81 @@ static int fsmu_read(const char *path, char *buf, size_t size,
             return 1;
         }
     }
+    if (is_batch_path(path)) {
+        return read_batch_results(path, buf, size, offset);
+    }
+    int has_cursor;
+    uint64_t cursor;
+    int is_status = is_status_path(path);
+    if (is_status || is_changes_path(path, &has_cursor, &cursor)) {
+        struct path contents = PATH_INIT;
+        int res = (is_status
+                      ? get_query_status(path, &contents)
+                      : get_changes(path, has_cursor, cursor, &contents));
+        if (res != 0) {
+            path_free(&contents);
+            return -ENOMEM;
+        }
+        size_t bytes = 0;
+        if ((size_t) offset < contents.len) {
+            bytes = contents.len - offset;
+            if (bytes > size) {
+                bytes = size;
+            }
+            memcpy(buf, contents.buf + offset, bytes);
+        }
+        path_free(&contents);
+        return bytes;
+    }
+    if (is_mbox_path(path)) {
+        if (!info || !info->fh) {
+            return -EBADF;
+        }
+        return mbox_read((struct mbox_file *) info->fh, buf, size, offset);
+    }
+
+#ifdef FSMU_ZSTD
+    if (info && info->fh) {
+        struct compressed_file *cf = (struct compressed_file *) info->fh;
+        pthread_mutex_lock(&cf->mutex);
+        ssize_t bytes = read_compressed(cf, buf, size, offset);
+        pthread_mutex_unlock(&cf->mutex);
+        if (bytes < 0) {
+            syslog(LOG_ERR, "read: '%s': failed to decompress", path);
+            return -EIO;
+        }
+        syslog(LOG_DEBUG, "read: '%s' completed", path);
+        return bytes;
+    }
+#endif
+
+    if (use_header_cache()) {
+        int bytes = read_header_cache(path, buf, size, offset);
+        if (bytes >= 0) {
+            syslog(LOG_DEBUG, "read: '%s' completed from header cache",
+                   path);
+            return bytes;
+        }
+    }
 
-    char backing_path[PATH_MAX];
-    int res = resolve_path(path, backing_path);
+    struct path backing_path = PATH_INIT;
+    int res = resolve_path(path, &backing_path);
     if (res != 0) {
         syslog(LOG_ERR, "read: unable to resolve '%s'", path);
+        path_free(&backing_path);
         return -1;
     }
 
-    FILE *backing_file = fopen(backing_path, "r");
+    FILE *backing_file = fopen(backing_path.buf, "r");
+    if (!backing_file && (errno == ENOENT)) {
+        struct path maildir_path = PATH_INIT;
+        res = resolve_maildir_path(backing_path.buf, &maildir_path);
+        if (res == 0) {
+            backing_file = fopen(maildir_path.buf, "r");
+        }
+        path_free(&maildir_path);
+    }
+    path_free(&backing_path);
     if (!backing_file) {
         syslog(LOG_ERR, "read: unable to open '%s': %s", path,
                strerror(errno));
@@ -1312,23 +9004,111 @@ static int fsmu_read(const char *path, char *buf, size_t size,
     return bytes;
 }
 
-/* Make a new query directory at the specified mount path. */
+/* Read data from the specified mount path into a buffer vector.  For
+ * a .mbox file, the message contents are returned as file descriptor
+ * buffers where possible, so that FUSE can splice them to the reader.
+ * Other files are read into memory by way of fsmu_read. */
+static int fsmu_read_buf(const char *path, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset,
+                         struct fuse_file_info *info)
+{
+    if (is_mbox_path(path) && info && info->fh) {
+        return mbox_read_buf((struct mbox_file *) info->fh, bufp, size,
+                             offset);
+    }
+
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    char *mem = malloc(size);
+    if (!bufv || !mem) {
+        free(bufv);
+        free(mem);
+        return -ENOMEM;
+    }
+    int res = fsmu_read(path, mem, size, offset, info);
+    if (res < 0) {
+        free(bufv);
+        free(mem);
+        return res;
+    }
+    *bufv = FUSE_BUFVEC_INIT(res);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+}
+
+/* Check that name, a query directory name, is a syntactically valid
+ * mu query: its parentheses and double quotes must be balanced.
+ * Returns -EINVAL if the name is not valid.  Fields are not checked,
+ * since mu treats a term with an unknown prefix (e.g. "Re:") as free
+ * text, and a query that mu does reject is caught by the failure
+ * backoff when it is first run (see record_query_failure). */
+static int validate_query(const char *name)
+{
+    if (name[0] == '_') {
+        syslog(LOG_ERR, "mkdir: '%s': query names may not begin "
+                        "with '_'", name);
+        return -EINVAL;
+    }
+
+    int depth = 0;
+    int quoted = 0;
+    for (const char *c = name; *c; c++) {
+        if (*c == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (*c == '(')) {
+            depth++;
+        } else if (!quoted && (*c == ')') && (--depth < 0)) {
+            break;
+        }
+    }
+    if (quoted) {
+        syslog(LOG_ERR, "mkdir: '%s': unbalanced quotes", name);
+        return -EINVAL;
+    }
+    if (depth != 0) {
+        syslog(LOG_ERR, "mkdir: '%s': unbalanced parentheses", name);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Make a new query directory at the specified mount path.  If the
+ * directory is at the top level, then its name must be a valid query
+ * (see validate_query). */
 static int fsmu_mkdir(const char *path, mode_t mode)
 {
     syslog(LOG_DEBUG, "mkdir: '%s'", path);
     verify_path(path);
 
-    char backing_path[PATH_MAX];
-    int res = resolve_path_noexists(path, backing_path);
+    int is_query = (strchr(path + 1, '/') == NULL);
+    if (is_query) {
+        int res = validate_query(path + 1);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    struct path backing_path = PATH_INIT;
+    int res = resolve_path_noexists(path, &backing_path);
+    if (res == -ENOENT) {
+        res = path_setf(&backing_path, "%s%s", options.backing_dir, path);
+    }
     if (res != 0) {
-        sprintf(backing_path, "%s%s", options.backing_dir, path);
+        path_free(&backing_path);
+        return -ENOMEM;
     }
-    res = mkdir(backing_path, mode);
+    res = mkdir(backing_path.buf, mode);
+    path_free(&backing_path);
     if (res != 0) {
         syslog(LOG_ERR, "mkdir: '%s': failed: %s",
                path, strerror(errno));
         return -1 * errno;
     }
+    if (is_query) {
+        /* Any failure recorded for a previous query directory with
+         * the same name no longer applies. */
+        clear_query_failure(path + 1);
+    }
 
     syslog(LOG_DEBUG, "mkdir: '%s' completed", path);
     return 0;
@@ -1346,204 +9126,513 @@ static int fsmu_rmdir(const char *path)
         return -1;
     }
 
-    char real_path[PATH_MAX];
-    sprintf(real_path, "%s%s", options.backing_dir, path);
-    int res = rmdir(real_path);
+    /* mapping_mutex is held throughout, so that a refresh that is
+     * running at the same time does not publish a new generation for
+     * the query directory once it has been removed. */
+    struct path real_path = PATH_INIT;
+    if (path_setf(&real_path, "%s%s", options.backing_dir, path) != 0) {
+        return -ENOMEM;
+    }
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    struct trace_span span;
+    PHASE_BEGIN(span, rmdir_marker, path);
+    int res = rmdir(real_path.buf);
     if (res != 0) {
         syslog(LOG_ERR, "rmdir: '%s': failed: %s",
                path, strerror(errno));
-        return -1 * errno;
+        res = -1 * errno;
+        PHASE_END(span, rmdir_marker, path);
+        pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+        path_free(&real_path);
+        return res;
     }
 
-    strcat(real_path, ".last-update");
-    res = unlink(real_path);
-    if (res != 0) {
+    res = path_append(&real_path, ".last-update");
+    if ((res == 0) && (unlink(real_path.buf) != 0)) {
         syslog(LOG_INFO, "rmdir: '%s': unable to remove "
                          "last-update file: %s",
                path, strerror(errno));
     }
-
-    path = path + 1;
-    char backing_path[PATH_MAX];
-    sprintf(backing_path, "%s/_%s/cur", options.backing_dir, path);
-    DIR *backing_handle = opendir(backing_path);
-    if (!backing_handle) {
-        syslog(LOG_ERR, "rmdir: cannot open '%s': %s",
-               backing_path, strerror(errno));
+    path_free(&real_path);
+    PHASE_END(span, rmdir_marker, path);
+
+    /* The links and their mappings are removed by the reaper, so
+     * that this does not depend on the number of results. */
+    PHASE_BEGIN(span, rmdir_bury, path);
+    res = unpublish_generation(path + 1);
+    PHASE_END(span, rmdir_bury, path);
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    clear_query_failure(path + 1);
+    clear_sliding_state(path + 1);
+    remove_change_log(path + 1);
+    clear_query_access(path + 1);
+    clear_query_stats(path + 1);
+    clear_refresh_state(path + 1);
+    if (res != 0) {
         return -1;
     }
-    struct dirent *dent;
-    while ((dent = readdir(backing_handle)) != NULL) {
-        if (is_upwards(dent->d_name)) {
-            continue;
-        }
-        char backing_file[PATH_MAX];
-        strcpy(backing_file, backing_path);
-        strcat(backing_file, "/");
-        strcat(backing_file, dent->d_name);
-
-        char maildir_path[PATH_MAX];
-        ssize_t len = readlink(backing_file, maildir_path, PATH_MAX);
-        if (len == PATH_MAX) {
-            syslog(LOG_ERR, "rmdir: too much path data for '%s'",
-                backing_file);
-            closedir(backing_handle);
-            return -1;
-        }
-        if (len == -1) {
-            syslog(LOG_ERR, "rmdir: unable to read link for '%s': %s",
-                backing_file, strerror(errno));
-            closedir(backing_handle);
-            return -1;
-        }
-        maildir_path[len] = 0;
 
-        res = unlink(backing_file);
-        if (res != 0) {
-            syslog(LOG_ERR, "rmdir: cannot remove file '%s': %s",
-                   backing_file, strerror(errno));
-            closedir(backing_handle);
-            return -1;
+    syslog(LOG_DEBUG, "rmdir: '%s' completed", path);
+    return 0;
+}
+
+/* Remove the specified mount path. */
+static int fsmu_unlink(const char *path)
+{
+    syslog(LOG_DEBUG, "unlink: '%s'", path);
+    verify_path(path);
+
+    if (!options.delete_remove) {
+        return -EPERM;
+    }
+
+    struct path backing_path = PATH_INIT;
+    struct path maildir_path = PATH_INIT;
+    int res = resolve_path(path, &backing_path);
+    if (res != 0) {
+        syslog(LOG_ERR, "unlink: unable to resolve '%s'",
+               path);
+    } else if ((res = resolve_maildir_path(backing_path.buf,
+                                           &maildir_path)) != 0) {
+        syslog(LOG_ERR, "unlink: unable to read link for '%s'",
+               backing_path.buf);
+    } else if ((res = unlink(maildir_path.buf)) != 0) {
+        syslog(LOG_ERR, "unlink: '%s': unable to remove: %s",
+               maildir_path.buf, strerror(errno));
+    } else {
+        queue_index_update(INDEX_REMOVE, maildir_path.buf);
+        forget_identity(maildir_path.buf);
+        /* The link mapping is keyed by the link's target, which may
+         * differ from maildir_path if a rename affecting the message
+         * has not yet been propagated. */
+        struct path link_path = PATH_INIT;
+        pthread_mutex_lock(&propagation_queue.mapping_mutex);
+        if ((path_readlink(&link_path, backing_path.buf) != 0)
+                || (remove_link_mapping(link_path.buf,
+                                        backing_path.buf) != 0)) {
+            syslog(LOG_INFO, "unlink: unable to remove link mapping "
+                             "for '%s'",
+                   backing_path.buf);
         }
-        res = remove_link_mapping(maildir_path, backing_file);
+        res = unlink(backing_path.buf);
+        pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+        path_free(&link_path);
         if (res != 0) {
-            closedir(backing_handle);
-            return -1;
+            syslog(LOG_ERR, "unlink: '%s': unable to remove: %s",
+                   backing_path.buf, strerror(errno));
+        } else {
+            log_change('D', backing_path.buf, NULL, 0);
+            char *name = get_query_name(path);
+            if (name) {
+                adjust_query_count(name, -1);
+                free(name);
+            }
         }
     }
-    closedir(backing_handle);
-    res = rmdir(backing_path);
+    path_free(&backing_path);
+    path_free(&maildir_path);
     if (res != 0) {
-        syslog(LOG_ERR, "rmdir: cannot remove '%s': %s",
-                backing_path, strerror(errno));
         return -1;
     }
+    move_message_version(path, NULL);
 
-    sprintf(backing_path, "%s/_%s/new", options.backing_dir, path);
-    backing_handle = opendir(backing_path);
-    if (!backing_handle) {
-        syslog(LOG_ERR, "rmdir: cannot open '%s': %s",
-               backing_path, strerror(errno));
-        return -1;
+    syslog(LOG_DEBUG, "unlink: '%s' completed", path);
+    return 0;
+}
+
+/* The extended attributes of a query directory. */
+static const char *query_xattrs[] = {
+    "user.fsmu.count",
+    "user.fsmu.last_refresh",
+    "user.fsmu.refresh_ms",
+    "user.fsmu.db_generation",
+    "user.fsmu.error",
+    "user.fsmu.refresh_interval",
+};
+#define QUERY_XATTR_COUNT \
+    ((int) (sizeof(query_xattrs) / sizeof(query_xattrs[0])))
+
+/* The extended attributes of the top-level directory, which describe
+ * the mu run scheduler (see acquire_mu_slot) and prefetching (see
+ * prefetch_totals).  The wait times are the mean times in
+ * milliseconds that queries of each priority class have waited to
+ * run. */
+static const char *root_xattrs[] = {
+    "user.fsmu.mu_running",
+    "user.fsmu.mu_queued_interactive",
+    "user.fsmu.mu_queued_background",
+    "user.fsmu.mu_wait_ms_interactive",
+    "user.fsmu.mu_wait_ms_background",
+    "user.fsmu.prefetched_bytes",
+    "user.fsmu.prefetched_new_bytes",
+};
+#define ROOT_XATTR_COUNT \
+    ((int) (sizeof(root_xattrs) / sizeof(root_xattrs[0])))
+
+/* Write the value of the extended attribute at index attr (see
+ * root_xattrs) of the top-level directory to buf. */
+static int get_root_xattr(int attr, struct path *buf)
+{
+    int res;
+    if (attr >= 5) {
+        pthread_mutex_lock(&prefetch_totals.mutex);
+        res = path_setf(buf, "%llu",
+                        (unsigned long long)
+                            ((attr == 5) ? prefetch_totals.bytes
+                                         : prefetch_totals.new_bytes));
+        pthread_mutex_unlock(&prefetch_totals.mutex);
+        return ((res == -1) ? -ENOMEM : res);
     }
-    while ((dent = readdir(backing_handle)) != NULL) {
-        if (is_upwards(dent->d_name)) {
-            continue;
+
+    pthread_mutex_lock(&mu_scheduler.mutex);
+    if (attr == 0) {
+        res = path_setf(buf, "%d", mu_scheduler.running);
+    } else if (attr <= 2) {
+        res = path_setf(buf, "%d", mu_scheduler.queued[attr - 1]);
+    } else {
+        int priority = attr - 3;
+        uint64_t runs = mu_scheduler.runs[priority];
+        res = path_setf(buf, "%llu",
+                        (unsigned long long)
+                            (runs ? mu_scheduler.waited_ms[priority] / runs
+                                  : 0));
+    }
+    pthread_mutex_unlock(&mu_scheduler.mutex);
+    return ((res == -1) ? -ENOMEM : res);
+}
+
+/* Returns a boolean indicating whether path is that of an existing
+ * query directory. */
+static int is_query_dir_path(const char *path)
+{
+    if ((strlen(path) <= 1) || (path[1] == '_')
+            || strchr(path + 1, '/')) {
+        return 0;
+    }
+    struct path marker_path = PATH_INIT;
+    struct stat stbuf;
+    int res = ((path_set(&marker_path, options.backing_dir) == 0)
+                && (path_append(&marker_path, path) == 0)
+                && (stat(marker_path.buf, &stbuf) == 0)
+                && S_ISDIR(stbuf.st_mode));
+    path_free(&marker_path);
+    return res;
+}
+
+/* Write the value of the extended attribute at index attr (see
+ * query_xattrs) for the query directory name to buf.  This only uses
+ * the state recorded in memory, so that it never leads to a refresh.
+ * Returns -ENODATA if the attribute has no value: the count,
+ * last_refresh and refresh_ms attributes have no value until the query
+ * directory has been refreshed, and the error attribute only has a
+ * value while the most recent refresh has failed.  The refresh_interval
+ * attribute is the current interval between refreshes (see
+ * get_refresh_interval). */
+static int get_query_xattr(const char *name, int attr, struct path *buf)
+{
+    int res = -ENODATA;
+    if (attr <= 2) {
+        pthread_mutex_lock(&query_stats_mutex);
+        struct query_stats *stats = table_get(&query_stats, name);
+        if (stats) {
+            res = ((attr == 0)
+                    ? path_setf(buf, "%zu", stats->count)
+                : (attr == 1)
+                    ? path_setf(buf, "%lld",
+                                (long long) stats->last_refresh)
+                    : path_setf(buf, "%ld", stats->refresh_ms));
         }
-        char backing_file[PATH_MAX];
-        strcpy(backing_file, backing_path);
-        strcat(backing_file, "/");
-        strcat(backing_file, dent->d_name);
-
-        char maildir_path[PATH_MAX];
-        ssize_t len = readlink(backing_file, maildir_path, PATH_MAX);
-        if (len == PATH_MAX) {
-            syslog(LOG_ERR, "rmdir: too much path data for '%s'",
-                   backing_file);
-            closedir(backing_handle);
-            return -1;
+        pthread_mutex_unlock(&query_stats_mutex);
+    } else if (attr == 3) {
+        pthread_mutex_lock(&change_logs_mutex);
+        struct change_log *log = get_change_log(name);
+        if (log) {
+            res = path_setf(buf, "%llu",
+                            (unsigned long long) (log->visible_seq - 1));
         }
-        if (len == -1) {
-            syslog(LOG_ERR, "rmdir: unable to read link for '%s': %s",
-                   backing_file, strerror(errno));
-            closedir(backing_handle);
-            return -1;
+        pthread_mutex_unlock(&change_logs_mutex);
+    } else if (attr == 4) {
+        pthread_mutex_lock(&query_failures_mutex);
+        struct query_failure *failure = table_get(&query_failures, name);
+        if (failure) {
+            res = path_set(buf, failure->error);
         }
-        maildir_path[len] = 0;
+        pthread_mutex_unlock(&query_failures_mutex);
+    } else {
+        res = path_setf(buf, "%d", get_refresh_interval(name));
+    }
+    return ((res == -1) ? -ENOMEM : res);
+}
 
-        res = unlink(backing_file);
-        if (res != 0) {
-            syslog(LOG_ERR, "rmdir: cannot remove file '%s': %s",
-                   backing_file, strerror(errno));
-            closedir(backing_handle);
-            return -1;
-        }
-        res = remove_link_mapping(maildir_path, backing_file);
-        if (res != 0) {
-            closedir(backing_handle);
-            return -1;
+/* Get the value of the extended attribute name for the specified
+ * mount path.  Only the top-level directory and query directories have
+ * extended attributes. */
+static int fsmu_getxattr(const char *path, const char *name, char *value,
+                         size_t size)
+{
+    syslog(LOG_DEBUG, "getxattr: '%s' '%s'", path, name);
+    verify_path(path);
+
+    int is_root = (strcmp(path, "/") == 0);
+    const char **xattrs = (is_root ? root_xattrs : query_xattrs);
+    int count = (is_root ? ROOT_XATTR_COUNT : QUERY_XATTR_COUNT);
+    int attr;
+    for (attr = 0; attr < count; attr++) {
+        if (strcmp(name, xattrs[attr]) == 0) {
+            break;
         }
     }
-    closedir(backing_handle);
-    res = rmdir(backing_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "rmdir: cannot remove '%s': %s",
-                backing_path, strerror(errno));
-        return -1;
+    if ((attr == count) || (!is_root && !is_query_dir_path(path))) {
+        return -ENODATA;
     }
-    sprintf(backing_path, "%s/_%s", options.backing_dir, path);
-    res = rmdir(backing_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "rmdir: cannot remove '%s': %s",
-                backing_path, strerror(errno));
-        return -1;
+
+    struct path buf = PATH_INIT;
+    int res = (is_root ? get_root_xattr(attr, &buf)
+                       : get_query_xattr(path + 1, attr, &buf));
+    if (res == 0) {
+        if (size == 0) {
+            res = buf.len;
+        } else if (size < buf.len) {
+            res = -ERANGE;
+        } else {
+            memcpy(value, buf.buf, buf.len);
+            res = buf.len;
+        }
     }
+    path_free(&buf);
+    return res;
+}
 
-    syslog(LOG_DEBUG, "rmdir: '%s' completed", path);
+/* Set the value of the extended attribute name for the specified mount
+ * path.  Only the refresh_interval attribute of a query directory can
+ * be set: a positive number of seconds is used as the interval between
+ * refreshes of the query directory, and 0 has the interval be derived
+ * from the query's refresh behaviour again. */
+static int fsmu_setxattr(const char *path, const char *name,
+                         const char *value, size_t size, int flags)
+{
+    syslog(LOG_DEBUG, "setxattr: '%s' '%s'", path, name);
+    verify_path(path);
+
+    if ((strcmp(name, "user.fsmu.refresh_interval") != 0)
+            || !is_query_dir_path(path)) {
+        return -ENOTSUP;
+    }
+    char buf[16];
+    if ((size == 0) || (size >= sizeof(buf))) {
+        return -EINVAL;
+    }
+    memcpy(buf, value, size);
+    buf[size] = '\0';
+    char *end;
+    long interval = strtol(buf, &end, 10);
+    if ((end == buf) || ((*end != '\0') && (*end != '\n'))
+            || (interval < 0) || (interval > INT_MAX)) {
+        return -EINVAL;
+    }
+    if (set_refresh_interval(path + 1, interval) != 0) {
+        return -ENOMEM;
+    }
     return 0;
 }
 
-/* Remove the specified mount path. */
-static int fsmu_unlink(const char *path)
+/* List the extended attributes that have values for the specified
+ * mount path. */
+static int fsmu_listxattr(const char *path, char *list, size_t size)
 {
-    syslog(LOG_DEBUG, "unlink: '%s'", path);
+    syslog(LOG_DEBUG, "listxattr: '%s'", path);
     verify_path(path);
 
-    if (!options.delete_remove) {
-        return -EPERM;
+    int is_root = (strcmp(path, "/") == 0);
+    if (!is_root && !is_query_dir_path(path)) {
+        return 0;
+    }
+    const char **xattrs = (is_root ? root_xattrs : query_xattrs);
+    int count = (is_root ? ROOT_XATTR_COUNT : QUERY_XATTR_COUNT);
+
+    struct path names = PATH_INIT;
+    struct path value = PATH_INIT;
+    int res = 0;
+    for (int i = 0; (i < count) && (res == 0); i++) {
+        int value_res = (is_root ? get_root_xattr(i, &value)
+                                 : get_query_xattr(path + 1, i, &value));
+        if (value_res == -ENODATA) {
+            continue;
+        }
+        res = value_res;
+        if (res == 0) {
+            /* Each name is followed by a NUL byte. */
+            res = path_append_len(&names, xattrs[i],
+                                  strlen(xattrs[i]) + 1);
+        }
+    }
+    path_free(&value);
+    if (res == 0) {
+        if (size == 0) {
+            res = names.len;
+        } else if (size < names.len) {
+            res = -ERANGE;
+        } else {
+            memcpy(list, names.buf, names.len);
+            res = names.len;
+        }
+    } else if (res == -1) {
+        res = -ENOMEM;
+    }
+    path_free(&names);
+    return res;
+}
+
+/* Start the rename propagation, reaper, index update and warm-up
+ * threads.  (This happens here rather than in main, because FUSE may
+ * fork after main has finished its setup.) */
+static void *fsmu_init(struct fuse_conn_info *conn)
+{
+#ifdef FUSE_CAP_SPLICE_WRITE
+    /* This lets the file descriptor buffers returned when reading
+     * .mbox files be spliced, rather than copied. */
+    if (conn && (conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
     }
+#endif
 
-    char backing_path[PATH_MAX];
-    int res = resolve_path(path, backing_path);
+    pthread_mutex_lock(&propagation_queue.mutex);
+    int res = pthread_create(&propagation_queue.thread, NULL,
+                             propagation_thread, NULL);
     if (res != 0) {
-        syslog(LOG_ERR, "unlink: unable to resolve '%s'",
-               path);
-        return -1;
+        syslog(LOG_ERR, "init: unable to start propagation thread: %s",
+               strerror(res));
+    } else {
+        propagation_queue.started = 1;
+    }
+    pthread_mutex_unlock(&propagation_queue.mutex);
+
+    /* Graveyard entries left over from a previous run are reaped
+     * first. */
+    pthread_mutex_lock(&propagation_queue.mapping_mutex);
+    for_each_grave(count_grave);
+    pthread_mutex_unlock(&propagation_queue.mapping_mutex);
+    pthread_mutex_lock(&reaper.mutex);
+    reaper.pending = 1;
+    res = pthread_create(&reaper.thread, NULL, reaper_thread, NULL);
+    if (res != 0) {
+        syslog(LOG_ERR, "init: unable to start reaper thread: %s",
+               strerror(res));
+    } else {
+        reaper.started = 1;
     }
+    pthread_mutex_unlock(&reaper.mutex);
 
-    char maildir_path[PATH_MAX];
-    ssize_t len = readlink(backing_path, maildir_path, PATH_MAX);
-    if (len == PATH_MAX) {
-        syslog(LOG_ERR, "unlink: too much path data for '%s'",
-               backing_path);
-        return -1;
+    if (options.update_index) {
+        pthread_mutex_lock(&index_queue.mutex);
+        res = pthread_create(&index_queue.thread, NULL,
+                             index_thread, NULL);
+        if (res != 0) {
+            syslog(LOG_ERR, "init: unable to start index thread: %s",
+                   strerror(res));
+        } else {
+            index_queue.started = 1;
+        }
+        pthread_mutex_unlock(&index_queue.mutex);
     }
-    if (len == -1) {
-        syslog(LOG_ERR, "unlink: unable to read link for '%s': %s",
-               backing_path, strerror(errno));
-        return -1;
+
+    /* The access log is also used for eviction, so it is loaded even
+     * if there is no warm-up. */
+    load_query_accesses();
+    if (options.warm_up > 0) {
+        pthread_mutex_lock(&warm_up.mutex);
+        warm_up.stop = 0;
+        res = pthread_create(&warm_up.thread, NULL, warm_up_thread, NULL);
+        if (res != 0) {
+            syslog(LOG_ERR, "init: unable to start warm-up thread: %s",
+                   strerror(res));
+        } else {
+            warm_up.started = 1;
+        }
+        pthread_mutex_unlock(&warm_up.mutex);
     }
-    maildir_path[len] = 0;
 
-    res = unlink(maildir_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "unlink: '%s': unable to remove: %s",
-               maildir_path, strerror(errno));
-        return -1;
+    return NULL;
+}
+
+/* Apply any outstanding rename propagations and index updates, stop
+ * the corresponding threads and the reaper, and finish the trace
+ * file. */
+static void fsmu_destroy(void *private_data)
+{
+    /* Warm-up threads finish the refreshes they have started before
+     * stopping. */
+    pthread_mutex_lock(&warm_up.mutex);
+    int started = warm_up.started;
+    warm_up.started = 0;
+    warm_up.stop = 1;
+    pthread_mutex_unlock(&warm_up.mutex);
+
+    if (started) {
+        pthread_join(warm_up.thread, NULL);
     }
-    res = unlink(backing_path);
-    if (res != 0) {
-        syslog(LOG_ERR, "unlink: '%s': unable to remove: %s",
-               backing_path, strerror(errno));
-        return -1;
+
+    pthread_mutex_lock(&propagation_queue.mutex);
+    started = propagation_queue.started;
+    propagation_queue.stop = 1;
+    pthread_cond_broadcast(&propagation_queue.cond);
+    pthread_mutex_unlock(&propagation_queue.mutex);
+
+    if (started) {
+        pthread_join(propagation_queue.thread, NULL);
     }
 
-    syslog(LOG_DEBUG, "unlink: '%s' completed", path);
-    return 0;
+    pthread_mutex_lock(&reaper.mutex);
+    started = reaper.started;
+    reaper.stop = 1;
+    pthread_cond_broadcast(&reaper.cond);
+    pthread_mutex_unlock(&reaper.mutex);
+
+    if (started) {
+        pthread_join(reaper.thread, NULL);
+    }
+
+    pthread_mutex_lock(&index_queue.mutex);
+    started = index_queue.started;
+    index_queue.stop = 1;
+    pthread_cond_broadcast(&index_queue.cond);
+    pthread_mutex_unlock(&index_queue.mutex);
+
+    if (started) {
+        pthread_join(index_queue.thread, NULL);
+    }
+    flush_index_updates();
+    save_query_accesses();
+    save_refresh_states();
+
+    if (trace_file) {
+        pthread_mutex_lock(&trace_mutex);
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+        pthread_mutex_unlock(&trace_mutex);
+    }
 }
 
 static const struct fuse_operations operations = {
-    .init     = fsmu_init,
-    .readdir  = fsmu_readdir,
-    .open     = fsmu_open,
-    .getattr  = fsmu_getattr,
-    .read     = fsmu_read,
-    .rename   = fsmu_rename,
-    .release  = fsmu_release,
-    .truncate = fsmu_truncate,
-    .mkdir    = fsmu_mkdir,
-    .rmdir    = fsmu_rmdir,
-    .unlink   = fsmu_unlink,
+    .init      = fsmu_init,
+    .destroy   = fsmu_destroy,
+    .readdir   = fsmu_readdir,
+    .open      = fsmu_open,
+    .getattr   = fsmu_getattr,
+    .read      = fsmu_read,
+    .read_buf  = fsmu_read_buf,
+    .write     = fsmu_write,
+    .flush     = fsmu_flush,
+    .rename    = fsmu_rename,
+    .release   = fsmu_release,
+    .truncate  = fsmu_truncate,
+    .mkdir     = fsmu_mkdir,
+    .rmdir     = fsmu_rmdir,
+    .unlink    = fsmu_unlink,
+    .setxattr  = fsmu_setxattr,
+    .getxattr  = fsmu_getxattr,
+    .listxattr = fsmu_listxattr,
 };
 
 static void usage(const char *progname)
@@ -1554,16 +9643,65 @@ static void usage(const char *progname)
            "    --refresh-timeout=<d>   Do not perform search again if\n"
            "                            requested within <d> seconds\n"
            "                            (default: 30)\n"
+           "    --refresh-min=<d>       Refresh stable or expensive\n"
+           "    --refresh-max=<d>       queries less often, and volatile\n"
+           "                            or cheap queries more often,\n"
+           "                            within these bounds in seconds\n"
+           "                            (default: --refresh-timeout)\n"
            "    --delete-remove         Whether deletions should take\n"
            "                            effect (default: false)\n"
+           "    --update-index          Whether renames and deletions\n"
+           "                            should be applied to the mu\n"
+           "                            index (default: false)\n"
+           "    --index-interval=<d>    Apply index updates at least\n"
+           "                            every <d> seconds (default: 5)\n"
+           "    --compressed            Serve zstd-compressed maildir\n"
+           "                            files decompressed\n"
+           "                            (default: false)\n"
+           "    --trace-file=<s>        Write Chrome trace format spans\n"
+           "                            for refresh/rename/rmdir phases\n"
+           "                            to this path\n"
+           "    --full-refresh-interval=<d>\n"
+           "                            Refresh queries with a sliding\n"
+           "                            date window in full at least\n"
+           "                            every <d> seconds, and\n"
+           "                            incrementally otherwise (0 to\n"
+           "                            disable incremental refreshes,\n"
+           "                            default: 3600)\n"
+           "    --evict-entries=<d>     Evict the results of the least\n"
+           "                            recently used query directories\n"
+           "                            while there are more than <d>\n"
+           "                            results in total (default: 0,\n"
+           "                            no limit)\n"
+           "    --evict-age=<d>         Evict the results of query\n"
+           "                            directories not used for <d>\n"
+           "                            seconds (default: 0, no limit)\n"
+           "    --prefetch=<d>          Read up to <d> bytes of the\n"
+           "                            messages added by each refresh\n"
+           "                            into the page cache (default: 0)\n"
+           "    --header-cache=<d>      Cache the header block, and at\n"
+           "                            least the first <d> bytes, of\n"
+           "                            each message at refresh time\n"
+           "                            (default: 0, no cache)\n"
+           "    --max-mu-runs=<d>       Run at most <d> queries using mu\n"
+           "                            at once (0 for no limit,\n"
+           "                            default: 4)\n"
+           "    --warm-up=<d>           Refresh the query directories\n"
+           "                            in the background at startup,\n"
+           "                            <d> at a time, most recently\n"
+           "                            used first (default: 0, no\n"
+           "                            warm-up)\n"
            "    --mu=<s>                Path to mu executable\n"
-           "    --muhome=<s>            --muhome option for mu calls\n"
+           "    --muhome=<s>[@<range>]  --muhome option for mu calls\n"
+           "                            (may be given more than once,\n"
+           "                            with an optional date range\n"
+           "                            hint for each)\n"
            "\n");
 }
 
-/* Expand any tildes (~) that appear in the given path, and write the
- * result to buf. */
-int expand_tilde(const char *path, char *buf)
+/* Expand any tildes (~) that appear in the given path, and return the
+ * result as a newly-allocated string. */
+char *expand_tilde(const char *path)
 {
     const char *homedir = getenv("HOME");
     if (!homedir) {
@@ -1571,28 +9709,91 @@ int expand_tilde(const char *path, char *buf)
         homedir = pw->pw_dir;
     }
 
-    int path_len = strlen(path);
-    int homedir_len = strlen(homedir);
-    int j = 0;
-    for (int i = 0; i < path_len; i++) {
-        if (path[i] == '~') {
-            strncpy(buf + j, homedir, homedir_len);
-            j += homedir_len;
-        } else {
-            buf[j++] = path[i];
+    struct path buf = PATH_INIT;
+    if (path_set(&buf, "") != 0) {
+        return NULL;
+    }
+    for (const char *c = path; *c; c++) {
+        int res = ((*c == '~') ? path_append(&buf, homedir)
+                               : path_append_len(&buf, c, 1));
+        if (res != 0) {
+            path_free(&buf);
+            return NULL;
         }
     }
-    buf[j] = 0;
 
+    return buf.buf;
+}
+
+/* Add a mu database for a --muhome option.  The value is a muhome
+ * path, optionally followed by '@' and a date range hint (e.g.
+ * "~/.mu-2019@2019..2019"). */
+static int add_shard(const char *value)
+{
+    struct shard *new_shards =
+        realloc(shards, (shard_count + 1) * sizeof(struct shard));
+    if (!new_shards) {
+        return -1;
+    }
+    shards = new_shards;
+    struct shard *shard = &shards[shard_count];
+    shard->range = NULL;
+
+    const char *at = strrchr(value, '@');
+    char *mu_home = NULL;
+    if (at && strstr(at, "..")) {
+        shard->range = strdup(at + 1);
+        mu_home = strndup(value, at - value);
+    } else {
+        mu_home = strdup(value);
+    }
+    shard->mu_home = (mu_home ? expand_tilde(mu_home) : NULL);
+    free(mu_home);
+    if (!shard->mu_home) {
+        free(shard->range);
+        return -1;
+    }
+    shard_count++;
+    return 0;
+}
+
+/* Handle the options that cannot be parsed directly into options. */
+static int fsmu_opt_proc(void *data, const char *arg, int key,
+                         struct fuse_args *outargs)
+{
+    if (key == KEY_MUHOME) {
+        const char *value = strchr(arg, '=') + 1;
+        if (add_shard(value) != 0) {
+            printf("unable to add muhome '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Replace the option string at option with its tilde-expanded form. */
+static int expand_option(const char **option)
+{
+    char *expanded = expand_tilde(*option);
+    if (!expanded) {
+        printf("unable to expand path '%s'\n", *option);
+        return -1;
+    }
+    free((char *) *option);
+    *option = expanded;
     return 0;
 }
 
 int main(int argc, char **argv)
 {
     options.refresh_timeout = 30;
+    options.index_interval = 5;
+    options.full_refresh_interval = 3600;
+    options.max_mu_runs = 4;
     options.mu = strdup("mu");
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
+    if (fuse_opt_parse(&args, &options, option_spec, fsmu_opt_proc) == -1) {
         return 1;
     }
 
@@ -1609,24 +9810,49 @@ int main(int argc, char **argv)
         usage(argv[0]);
         return 1;
     }
+#ifndef FSMU_ZSTD
+    if (options.compressed) {
+        printf("--compressed requires zstd support, which is not "
+               "available in this build.\n");
+        return 1;
+    }
+#endif
+    if (options.index_interval <= 0) {
+        printf("--index-interval must be greater than zero.\n");
+        return 1;
+    }
+    if ((options.refresh_min ? options.refresh_min
+                             : options.refresh_timeout)
+            > (options.refresh_max ? options.refresh_max
+                                   : options.refresh_timeout)) {
+        printf("--refresh-min must not be greater than --refresh-max "
+               "(which defaults to --refresh-timeout).\n");
+        return 1;
+    }
 
-    char backing_dir_final[PATH_MAX];
-    expand_tilde(options.backing_dir, backing_dir_final);
-    options.backing_dir = backing_dir_final;
-
-    char mu_final[PATH_MAX];
-    expand_tilde(options.mu, mu_final);
-    options.mu = mu_final;
+    if ((expand_option(&options.backing_dir) != 0)
+            || (expand_option(&options.mu) != 0)
+            || (options.trace_file
+                && (expand_option(&options.trace_file) != 0))) {
+        return 1;
+    }
 
-    if (options.mu_home) {
-        char mu_home_final[PATH_MAX];
-        expand_tilde(options.mu_home, mu_home_final);
-        options.mu_home = mu_home_final;
+    if (options.trace_file) {
+        trace_file = fopen(options.trace_file, "w");
+        if (!trace_file) {
+            printf("unable to open trace file '%s': %s\n",
+                   options.trace_file, strerror(errno));
+            return 1;
+        }
+        fputs("[\n", trace_file);
+        trace_epoch = trace_now();
     }
 
-    backing_dir_reverse = malloc(PATH_MAX);
-    strcpy(backing_dir_reverse, options.backing_dir);
-    strcat(backing_dir_reverse, "/_reverse");
+    struct path reverse = PATH_INIT;
+    if (path_setf(&reverse, "%s/_reverse", options.backing_dir) != 0) {
+        return 1;
+    }
+    backing_dir_reverse = reverse.buf;
 
     fuse_main(args.argc, args.argv, &operations, NULL);
     fuse_opt_free_args(&args);
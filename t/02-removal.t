@@ -16,16 +16,36 @@ use File::Slurp qw(read_file);
 use File::Temp qw(tempdir);
 use List::Util qw(first);
 
-use Test::More tests => 5;
+use Test::More tests => 11;
 
 my $mount_dir;
 my $pid;
 
+# Wait for the reaper to remove the query directories that have been
+# moved to the graveyard, and then the graveyard itself.  Returns a
+# boolean indicating whether it did so within ten seconds.
+
+sub wait_for_reaper
+{
+    my ($backing_dir) = @_;
+
+    for (1..50) {
+        if (not -e "$backing_dir/__graveyard") {
+            return 1;
+        }
+        select(undef, undef, undef, 0.2);
+    }
+    return 0;
+}
+
 {
     my @help = `./fsmu --help`;
     like($help[0], qr/^usage/, 'Got help details');
 
     my $dir = make_root_maildir();
+    my $entity = make_message('other@example.org', 'asdf1@example.net',
+                              'graveyard', 'data');
+    write_message($entity, "$dir/asdf/asdf1/new");
     my ($muhome, $refresh_cmd) = mu_init($dir);
     my $backing_dir = tempdir(UNLINK => 1);
     $mount_dir = tempdir(UNLINK => 1);
@@ -54,6 +74,7 @@ my $pid;
     is(@cur_files, 80, "Found 80 'cur' files");
 
     rmdir $query_dir;
+    ok(wait_for_reaper($backing_dir), 'Reaper emptied the graveyard');
     my @files;
     find(sub { push @files, $File::Find::name },
          $backing_dir);
@@ -84,12 +105,26 @@ my $pid;
     my $file_count2 = scalar @files;
 
     rmdir $query_dir2;
+    ok(wait_for_reaper($backing_dir), 'Reaper emptied the graveyard');
     @files = ();
     find(sub { push @files, $File::Find::name },
          $backing_dir);
     my $file_count3 = scalar @files;
     is($file_count3, $file_count,
         'Backing directory has previous file count');
+
+    # A query directory whose name is that of the graveyard, without
+    # the leading underscore, is not mistaken for the graveyard.
+
+    my $graveyard_dir = "$mount_dir/graveyard";
+    ok(mkdir($graveyard_dir), 'Able to make graveyard query directory');
+    my @graveyard_files = glob("$graveyard_dir/new/*");
+    is(@graveyard_files, 1, 'Found graveyard query result');
+    rmdir $query_dir;
+    ok(wait_for_reaper($backing_dir), 'Reaper emptied the graveyard');
+    @graveyard_files = glob("$graveyard_dir/new/*");
+    is(@graveyard_files, 1,
+       'Graveyard query result is kept once the graveyard is reaped');
 }
 
 END {
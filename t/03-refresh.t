@@ -16,7 +16,7 @@ use File::Slurp qw(read_file);
 use File::Temp qw(tempdir);
 use List::Util qw(first);
 
-use Test::More tests => 3;
+use Test::More tests => 6;
 
 my $mount_dir;
 my $pid;
@@ -65,6 +65,40 @@ my $pid;
          $query_dir);
     @cur_files = grep { /\/cur\/\d/ } @query_files;
     is(@cur_files, 82, "Found 82 'cur' files");
+
+    # Confirm that incremental refresh (for a query with a sliding
+    # date window) picks up new messages, and drops messages that have
+    # been removed.
+
+    my $window_query_dir = $mount_dir.'/maildir:+asdf+asdf1 AND date:1y..';
+    mkdir $window_query_dir;
+    @query_files = ();
+    find(sub { push @query_files, $File::Find::name },
+         $window_query_dir);
+    @cur_files = grep { /\/cur\/\d/ } @query_files;
+    is(@cur_files, 6, "Found 6 'cur' files (sliding window)");
+
+    my $entity3 = make_message('user@example.org', 'asdf',
+                               'asdf', 'asdf data data data');
+    write_message($entity3, $dir.'/asdf/asdf1/cur');
+    system($refresh_cmd);
+    @query_files = ();
+    system("cat '$window_query_dir/.refresh' >/tmp/null");
+    find(sub { push @query_files, $File::Find::name },
+         $window_query_dir);
+    @cur_files = grep { /\/cur\/\d/ } @query_files;
+    is(@cur_files, 7, "Found 7 'cur' files after incremental refresh");
+
+    my @md_cur_files = glob("$dir/asdf/asdf1/cur/*");
+    unlink $md_cur_files[0];
+    system($refresh_cmd);
+    @query_files = ();
+    system("cat '$window_query_dir/.refresh' >/tmp/null");
+    find(sub { push @query_files, $File::Find::name },
+         $window_query_dir);
+    @cur_files = grep { /\/cur\/\d/ } @query_files;
+    is(@cur_files, 6,
+        "Found 6 'cur' files after removal and incremental refresh");
 }
 
 END {
@@ -17,7 +17,7 @@ use File::Spec::Functions qw(no_upwards);
 use File::Temp qw(tempdir);
 use List::Util qw(first);
 
-use Test::More tests => 14;
+use Test::More tests => 15;
 
 my $mount_dir;
 my $top_pid = $$;
@@ -354,6 +354,23 @@ sub debug
         }
     }, $backing_dir);
     ok((not @tempdirs), 'No temporary directories found');
+
+    # Each generation directory should be the current generation for
+    # some query directory, since there are no readers left to keep
+    # previous generations around.
+    opendir(my $bdh, $backing_dir) or die $!;
+    my @entries = readdir($bdh);
+    closedir($bdh);
+    my %current_generations;
+    for my $entry (@entries) {
+        if (-l "$backing_dir/$entry") {
+            $current_generations{readlink("$backing_dir/$entry")} = 1;
+        }
+    }
+    my @unreferenced =
+        grep { /^_gen\./ and not $current_generations{$_} }
+            @entries;
+    ok((not @unreferenced), 'No unreferenced generations found');
 }
 
 END {
@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Find;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 9;
+
+my $mount_dir;
+my $pid;
+
+sub get_counts
+{
+    my ($query_dir) = @_;
+
+    my @query_files;
+    find(sub { push @query_files, $File::Find::name },
+         $query_dir);
+    my @cur_files = grep { /\/cur\/\d/ } @query_files;
+    my @new_files = grep { /\/new\/\d/ } @query_files;
+    return (scalar @cur_files, scalar @new_files);
+}
+
+{
+    my @help = `./fsmu --help`;
+    like($help[0], qr/^usage/, 'Got help details');
+
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    # Set up the query directories from which the others will be
+    # derived.
+
+    for my $query ('maildir:+asdf+asdf4',
+                   'maildir:+qwer+asdf4',
+                   'to:asdf4@example.net') {
+        mkdir "$mount_dir/$query";
+    }
+    my ($cur, $new) = get_counts("$mount_dir/maildir:+asdf+asdf4");
+    is($cur, 4, "Found 4 'cur' files in base query directory");
+    is($new, 5, "Found 5 'new' files in base query directory");
+
+    # Conjunction with a flag term.
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4 AND flag:new";
+    mkdir $query_dir;
+    ($cur, $new) = get_counts($query_dir);
+    is($cur, 0, "Found 0 'cur' files in conjunction");
+    is($new, 5, "Found 5 'new' files in conjunction");
+
+    # Disjunction of query directories.
+
+    $query_dir = "$mount_dir/maildir:+asdf+asdf4 OR maildir:+qwer+asdf4";
+    mkdir $query_dir;
+    ($cur, $new) = get_counts($query_dir);
+    is($cur, 8, "Found 8 'cur' files in disjunction");
+    is($new, 10, "Found 10 'new' files in disjunction");
+
+    # Negation of a query directory.
+
+    $query_dir = "$mount_dir/to:asdf4\@example.net AND ".
+                 "NOT maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    ($cur, $new) = get_counts($query_dir);
+    is($cur, 16, "Found 16 'cur' files in negation");
+    is($new, 20, "Found 20 'new' files in negation");
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
@@ -0,0 +1,87 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init
+                 get_files);
+use autodie;
+use File::Basename;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 8;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    my $other_query_dir = "$mount_dir/to:asdf4\@example.net";
+    mkdir $query_dir;
+    mkdir $other_query_dir;
+    my @new_files = get_files($query_dir, 'new');
+    is(@new_files, 5, "Found 5 'new' files");
+
+    # Mark all of the new messages as seen in a single batch, along
+    # with a line for a message that does not exist.
+
+    open my $fh, '>', "$query_dir/.batch";
+    for my $new_file (@new_files) {
+        print $fh basename($new_file)." S\n";
+    }
+    print $fh "1234_nonexistent S\n";
+    close $fh;
+
+    open $fh, '<', "$query_dir/.batch";
+    my @results = <$fh>;
+    close $fh;
+    is(@results, 6, 'Got a result for each batch line');
+    is((grep { / ok .*:2,S$/ } @results), 5,
+        'Batch changes succeeded');
+    is((grep { /^1234_nonexistent error/ } @results), 1,
+        'Batch change for nonexistent message failed');
+
+    my @cur_files = get_files($query_dir, 'cur');
+    @new_files = get_files($query_dir, 'new');
+    is(@new_files, 0, "No 'new' files left in query directory");
+    is((grep { /:2,S$/ } @cur_files), 5,
+        "Seen flag set on 5 'cur' files in query directory");
+
+    my @md_new_files = glob("$dir/asdf/asdf4/new/*");
+    is(@md_new_files, 0, "No 'new' files left in maildir");
+
+    # Allow time for the changes to reach the other query directory.
+
+    sleep(1);
+    @new_files = get_files($other_query_dir, 'new');
+    is(@new_files, 20, "Changes propagated to other query directory");
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
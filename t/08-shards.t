@@ -0,0 +1,77 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init
+                 get_files);
+use autodie;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 5;
+
+my $mount_dir;
+my $pid;
+
+{
+    # Each muhome has its own maildir, with the same structure.  The
+    # second muhome has a date range hint that does not cover its
+    # messages, so that queries restricted to recent messages skip
+    # it.
+
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $dir2 = make_root_maildir();
+    my ($muhome2, $refresh_cmd2) = mu_init($dir2);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--muhome=$muhome2\@2000..2001 ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    # Results from both muhomes are merged.
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @new_files = get_files($query_dir, 'new');
+    is(@new_files, 10, "Found 10 'new' files");
+    my @cur_files = get_files($query_dir, 'cur');
+    is(@cur_files, 8, "Found 8 'cur' files");
+
+    my @maildirs = map { readlink("$backing_dir/_maildir:+asdf+asdf4/".
+                                  "new/".(split /\//)[-1]) }
+                       @new_files;
+    is(scalar(grep { /^\Q$dir2\E/ } @maildirs), 5,
+        "Found 5 'new' files from the second muhome");
+
+    # The second muhome is skipped, based on its date range hint.
+
+    my $recent_query_dir = "$mount_dir/maildir:+asdf+asdf4 AND date:1y..";
+    mkdir $recent_query_dir;
+    @new_files = get_files($recent_query_dir, 'new');
+    is(@new_files, 5, "Found 5 'new' files (date range)");
+    @cur_files = get_files($recent_query_dir, 'cur');
+    is(@cur_files, 4, "Found 4 'cur' files (date range)");
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
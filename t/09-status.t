@@ -0,0 +1,77 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 8;
+
+my $mount_dir;
+my $pid;
+
+{
+    # The mu database is not initialised, so that every query fails
+    # when it is run.
+
+    my $muhome = tempdir(UNLINK => 1);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    # Invalid queries are rejected by mkdir.
+
+    ok((not mkdir("$mount_dir/(maildir:+asdf")),
+        'Unable to make query directory with unbalanced parentheses');
+    like($!, qr/Invalid argument/, 'Got invalid argument error');
+    ok((not mkdir("$mount_dir/subject:\"asdf")),
+        'Unable to make query directory with unbalanced quotes');
+
+    # Terms that look like fields, but that mu treats as free text,
+    # are accepted.
+
+    ok(mkdir("$mount_dir/Re: hello"),
+        'Able to make query directory with free-text prefix');
+    ok(mkdir("$mount_dir/Note:foo"),
+        'Able to make query directory with unknown field');
+
+    # A query that fails at runtime has its error recorded in the
+    # status file, and is not run again straight away.
+
+    my $query_dir = "$mount_dir/from:user\@example.org";
+    mkdir $query_dir;
+    my $status = read_file("$query_dir/.status");
+    is($status, "ok\n", 'Status is ok before first refresh');
+
+    opendir(my $dh, "$query_dir/cur");
+    $status = read_file("$query_dir/.status");
+    like($status, qr/^error: .*\nfailures: 1\n/,
+        'Status reports failure after refresh');
+
+    opendir($dh, "$query_dir/new");
+    $status = read_file("$query_dir/.status");
+    like($status, qr/\nfailures: 1\n/,
+        'Query not run again during backoff period');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
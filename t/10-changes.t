@@ -0,0 +1,86 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 make_message
+                 write_message
+                 mu_init);
+use autodie;
+use File::Basename;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 6;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @new_files = glob("$query_dir/new/*");
+    is(@new_files, 5, "Found 5 'new' files");
+
+    my $changes = read_file("$query_dir/.changes");
+    my ($seq) = ($changes =~ /^seq (\d+)\n$/);
+    ok($seq, 'Got current sequence number');
+
+    # A new message is reported as an addition after the next refresh.
+
+    my $entity = make_message('user@example.org', 'asdf',
+                              'asdf', 'asdf data');
+    write_message($entity, "$dir/asdf/asdf4/new");
+    system($refresh_cmd);
+    system("cat '$query_dir/.refresh' >/dev/null");
+    $changes = read_file("$query_dir/.changes.$seq");
+    my @lines = split /\n/, $changes;
+    is(@lines, 2, 'Got one change after refresh');
+    like($lines[1], qr/^\d+ A new\/\d+_/,
+         'New message reported as an addition');
+    ($seq) = ($changes =~ /^seq (\d+)/);
+
+    # A rename is reported as a single change.
+
+    @new_files = glob("$query_dir/new/*");
+    my $name = basename($new_files[0]);
+    rename($new_files[0], "$query_dir/cur/$name:2,S");
+    $changes = read_file("$query_dir/.changes.$seq");
+    like($changes,
+         qr/^seq \d+\n\d+ R new\/\Q$name\E cur\/\Q$name\E:2,S\n$/,
+         'Rename reported in change log');
+
+    # A cursor that is not from the change log leads to a reset.
+
+    $changes = read_file("$query_dir/.changes.1");
+    like($changes, qr/^reset \d+\n$/, 'Got reset for unknown cursor');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
@@ -0,0 +1,67 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 make_message
+                 write_message
+                 mu_init);
+use autodie;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 4;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my $entity = make_message('user@example.org', 'asdf4@example.net',
+                              'asdf4 message with separator',
+                              "data\nFrom here\n>From there\n");
+    write_message($entity, "$dir/asdf/asdf4/cur");
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 10, 'Found 10 files');
+
+    my $mbox = read_file("$query_dir/.mbox");
+    my @separators = ($mbox =~ /^From - .*$/mg);
+    is(@separators, 10, 'Found 10 messages in .mbox');
+    my @subjects = ($mbox =~ /^Subject: (.*)$/mg);
+    my @expected = map { "asdf4 message $_" } 1..9;
+    push @expected, 'asdf4 message with separator';
+    is_deeply([ sort @subjects ], [ sort @expected ],
+              'Each message is present in .mbox');
+    like($mbox, qr/^data\n>From here\n>>From there\n/m,
+         'Separator lines within messages are escaped');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
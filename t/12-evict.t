@@ -0,0 +1,60 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 5;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--refresh-timeout=1 ".
+                         "--evict-age=2 ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    my $results_link = "$backing_dir/_maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files');
+    ok((-l $results_link), 'Query directory has results');
+
+    sleep(6);
+    ok((not -l $results_link), 'Results evicted for idle query directory');
+
+    @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files after eviction');
+    ok((-l $results_link), 'Query directory has results again');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
@@ -0,0 +1,62 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init
+                 get_xattr);
+use autodie;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 7;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    is(get_xattr($query_dir, 'count'), undef,
+        'No count before the query directory is refreshed');
+    ok((not -l "$backing_dir/_maildir:+asdf+asdf4"),
+        'Getting an attribute does not refresh the query directory');
+
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files');
+    is(get_xattr($query_dir, 'count'), 9, 'Count is correct');
+    my $last_refresh = get_xattr($query_dir, 'last_refresh');
+    ok((abs(time() - $last_refresh) < 60), 'Last refresh time is set');
+    like(get_xattr($query_dir, 'db_generation'), qr/^\d+$/,
+         'Database generation is set');
+    is(get_xattr($query_dir, 'error'), undef,
+        'No error after a successful refresh');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
@@ -0,0 +1,61 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_bulk_root_maildir
+                 mu_init);
+use autodie;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 3;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $size = 20000;
+    my $dir = make_bulk_root_maildir($size);
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    # The first listing returns once the first results are available,
+    # before the query has finished.
+
+    my $query_dir = "$mount_dir/from:user\@example.org";
+    mkdir $query_dir;
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    ok(@files > 0, 'Found files on first listing');
+    ok(@files < $size, 'First listing has partial results');
+
+    # Reading .mbox waits for the query to finish.
+
+    open my $fh, '<', "$query_dir/.mbox";
+    close $fh;
+    @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, $size, 'Found all files once the query has finished');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
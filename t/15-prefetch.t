@@ -0,0 +1,91 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 make_message
+                 write_message
+                 mu_init
+                 get_xattr);
+use List::Util qw(max);
+use autodie;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 9;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+
+    # The budget allows for two or so messages to be prefetched.
+    my $maildir = "$dir/asdf/asdf4";
+    my $size = max(map { -s $_ } glob("$maildir/new/*"));
+    my $budget = int($size * 2.5);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--prefetch=$budget ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files with prefetching enabled');
+    my $data = read_file($files[0]);
+    like($data, qr/^Subject: asdf4 message/m,
+         'Message can be read with prefetching enabled');
+    my $bytes = get_xattr($mount_dir, 'prefetched_bytes');
+    cmp_ok($bytes, '>', 0, 'Messages were prefetched');
+    cmp_ok($bytes, '<=', $budget, 'Prefetching is limited to the budget');
+
+    # Only the messages added by a refresh are prefetched, and those
+    # in new are prefetched before those in cur.
+    for my $n (1..3) {
+        for my $subdir (qw(cur new)) {
+            my $entity = make_message('user@example.org',
+                                      'asdf4@example.net',
+                                      "asdf4 added $subdir $n",
+                                      "data");
+            write_message($entity, "$maildir/$subdir");
+        }
+    }
+    system($refresh_cmd);
+    my $new_bytes = get_xattr($mount_dir, 'prefetched_new_bytes');
+    open my $fh, '<', "$query_dir/.refresh";
+    close $fh;
+    @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 15, 'Found 15 files after refresh');
+    my $added = get_xattr($mount_dir, 'prefetched_bytes') - $bytes;
+    my $added_new =
+        get_xattr($mount_dir, 'prefetched_new_bytes') - $new_bytes;
+    cmp_ok($added, '>', 0, 'Added messages were prefetched');
+    cmp_ok($added, '<=', $budget,
+           'Prefetching after refresh is limited to the budget');
+    is($added_new, $added, 'Messages in new are prefetched first');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
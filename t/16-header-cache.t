@@ -0,0 +1,104 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Slurp qw(read_file write_file);
+use File::Spec::Functions qw(no_upwards);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 9;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--header-cache=16384 ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files with the header cache enabled');
+    my @caches = glob("$backing_dir/_gen.*.headers");
+    is(@caches, 1, 'Header cache was built');
+
+    # The header cache is kept outside the generation directory, so
+    # that it is not listed as part of the query directory.
+    opendir(my $dh, $query_dir);
+    my @entries = sort(no_upwards(readdir($dh)));
+    closedir($dh);
+    is_deeply(\@entries, [qw(cur new tmp)],
+              'Query directory only lists cur, new and tmp');
+
+    my $file = $files[0];
+    my ($rest) = ($file =~ /(\/(?:cur|new)\/[^\/]+)$/);
+    my $target = readlink("$backing_dir/_maildir:+asdf+asdf4$rest");
+    my $data = read_file($file);
+    is($data, read_file($target),
+       'Message contents are the same by way of the header cache');
+
+    # The cached data is used for a message that is unchanged (as far
+    # as its size and modification time show): overwriting part of
+    # its headers in place, and then restoring its modification time,
+    # leaves the cached headers in use.
+    my $other_file = $files[1];
+    ($rest) = ($other_file =~ /(\/(?:cur|new)\/[^\/]+)$/);
+    my $other_target =
+        readlink("$backing_dir/_maildir:+asdf+asdf4$rest");
+    my $original = read_file($other_target);
+    my $ref_dir = tempdir(UNLINK => 1);
+    system("touch -r '$other_target' '$ref_dir/ref'");
+    open my $ofh, '+<', $other_target;
+    print $ofh (($original =~ /^X/) ? 'Y' : 'X');
+    close $ofh;
+    system("touch -r '$ref_dir/ref' '$other_target'");
+    isnt(read_file($other_target), $original,
+         'Message was changed in place');
+    is(read_file($other_file), $original,
+       'Unchanged-looking message is read from the header cache');
+
+    # A message that changes after the refresh is read from the
+    # maildir, rather than from the stale cache entry.
+    write_file($target, { append => 1 }, "more data\n");
+    sleep(1);
+    $data = read_file($file);
+    like($data, qr/more data\n$/,
+         'Changed message is not read from the header cache');
+
+    open my $fh, '<', "$query_dir/.refresh";
+    close $fh;
+    @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files after refresh');
+    @caches = glob("$backing_dir/_gen.*.headers");
+    is(@caches, 1, 'Header cache of previous generation was removed');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
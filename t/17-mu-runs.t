@@ -0,0 +1,157 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init
+                 make_mu_wrapper
+                 get_xattr);
+use autodie;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+use POSIX qw(WNOHANG);
+
+use Test::More tests => 8;
+
+my $mount_dir;
+my $pid;
+
+sub start_fsmu
+{
+    my ($muhome, $backing_dir, $extra) = @_;
+
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--max-mu-runs=1 $extra ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+}
+
+sub stop_fsmu
+{
+    system("fusermount -u $mount_dir");
+    kill('TERM', $pid);
+    waitpid($pid, 0);
+    $pid = undef;
+}
+
+# Returns the arguments of the queries started by the mu wrapper, in
+# the order in which they were started, and the largest number that
+# ran at once.
+
+sub read_mu_log
+{
+    my ($log) = @_;
+
+    my @started;
+    my $running = 0;
+    my $max_running = 0;
+    my @lines = ((-e $log) ? read_file($log) : ());
+    for my $line (@lines) {
+        if ($line =~ /^start find (.*)$/) {
+            push @started, $1;
+            $running++;
+            $max_running = $running if $running > $max_running;
+        } elsif ($line =~ /^end find /) {
+            $running--;
+        }
+    }
+    return (\@started, $max_running);
+}
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    my $log_dir = tempdir(UNLINK => 1);
+    my $log = "$log_dir/mu.log";
+    $mount_dir = tempdir(UNLINK => 1);
+    my $mu = make_mu_wrapper($log, 1);
+    start_fsmu($muhome, $backing_dir, "--mu=$mu");
+
+    # Query directories listed at the same time are all populated,
+    # even though only one query is run at once.
+    my @names = map { "maildir:+asdf+asdf$_" } (1..5);
+    my @children;
+    for my $name (@names) {
+        mkdir "$mount_dir/$name";
+    }
+    for my $name (@names) {
+        my $child = fork();
+        if (!$child) {
+            my @files = (glob("$mount_dir/$name/cur/*"),
+                         glob("$mount_dir/$name/new/*"));
+            exit((@files == 9) ? 0 : 1);
+        }
+        push @children, $child;
+    }
+    my $failures = 0;
+    my $max_running = 0;
+    while (@children) {
+        my $running = get_xattr($mount_dir, 'mu_running');
+        if (defined $running and $running > $max_running) {
+            $max_running = $running;
+        }
+        for my $child (@children) {
+            if (waitpid($child, WNOHANG) == $child) {
+                $failures++ if $?;
+                $child = undef;
+            }
+        }
+        @children = grep { defined } @children;
+        select(undef, undef, undef, 0.1);
+    }
+    is($failures, 0, 'All query directories have their results');
+    cmp_ok($max_running, '<=', 1,
+           'No more than one query is reported as running');
+    my (undef, $max_logged) = read_mu_log($log);
+    is($max_logged, 1, 'No more than one query is run at once');
+
+    is(get_xattr($mount_dir, 'mu_running'), 0, 'No queries running');
+    is(get_xattr($mount_dir, 'mu_queued_interactive'), 0,
+       'No queries waiting to run');
+    like(get_xattr($mount_dir, 'mu_wait_ms_interactive'), qr/^\d+$/,
+         'Mean wait time is set');
+
+    # When fsmu is restarted, the warm-up refreshes the query
+    # directories in the background, and a query directory that is
+    # accessed in the meantime is populated before those refreshes
+    # that are still waiting to run.
+    stop_fsmu();
+    sleep(2);
+    unlink($log);
+    $mu = make_mu_wrapper($log, 2);
+    start_fsmu($muhome, $backing_dir,
+               "--mu=$mu --refresh-timeout=1 --warm-up=5");
+    my $name = "maildir:+qwer+asdf1";
+    mkdir "$mount_dir/$name";
+    my @files = (glob("$mount_dir/$name/cur/*"),
+                 glob("$mount_dir/$name/new/*"));
+    is(@files, 9, 'Found 9 files while warming up');
+    for (1..30) {
+        my ($started) = read_mu_log($log);
+        last if @$started >= 6;
+        sleep(1);
+    }
+    my ($started) = read_mu_log($log);
+    my ($index) = grep { $started->[$_] =~ /qwer/ } (0..$#$started);
+    my $later = (defined $index) ? (@$started - $index - 1) : 0;
+    cmp_ok($later, '>=', 2,
+           'Interactive query runs before waiting background queries');
+}
+
+END {
+    if ($pid) {
+        stop_fsmu();
+    }
+    exit(0);
+}
+
+1;
@@ -0,0 +1,108 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init
+                 get_xattr);
+use autodie;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 10;
+
+my $mount_dir;
+my $pid;
+
+sub start_fsmu
+{
+    my ($muhome, $backing_dir) = @_;
+
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--refresh-timeout=60 ".
+                         "--refresh-min=1 --refresh-max=600 ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+}
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    start_fsmu($muhome, $backing_dir);
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    my $state_path = "$backing_dir/__state/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files');
+
+    my $interval = get_xattr($query_dir, 'refresh_interval');
+    ok((($interval >= 1) and ($interval <= 600)),
+       'Refresh interval is within bounds');
+
+    # Refreshes that do not change the results lengthen the interval.
+
+    for (1..8) {
+        system("cat '$query_dir/.refresh' >/dev/null");
+    }
+    my $lengthened = get_xattr($query_dir, 'refresh_interval');
+    cmp_ok($lengthened, '>', $interval,
+           'Unchanged refreshes lengthen the refresh interval');
+    ok((not -e $state_path),
+       'Refresh state is not written after each refresh');
+
+    # The refresh state is written when fsmu stops, and is used when
+    # it is next started.
+
+    system("fusermount -u $mount_dir");
+    for (1..50) {
+        last if -f $state_path;
+        select(undef, undef, undef, 0.1);
+    }
+    ok((-f $state_path),
+       'Refresh state is kept in the backing directory');
+    kill('TERM', $pid);
+    waitpid($pid, 0);
+
+    start_fsmu($muhome, $backing_dir);
+    is(get_xattr($query_dir, 'refresh_interval'), $lengthened,
+       'Refresh interval persists across restarts');
+
+    system("setfattr -n user.fsmu.refresh_interval -v 1234 '$query_dir'");
+    is(get_xattr($query_dir, 'refresh_interval'), 1234,
+       'Refresh interval can be set');
+    system("setfattr -n user.fsmu.refresh_interval -v 0 '$query_dir'");
+    isnt(get_xattr($query_dir, 'refresh_interval'), 1234,
+         'Refresh interval can be unset');
+
+    # The minimum refresh interval may not exceed the maximum.
+
+    my $cmd = "./fsmu --backing-dir=$backing_dir ".
+              "--refresh-min=20 --refresh-max=10 $mount_dir";
+    my $output = `$cmd 2>&1`;
+    isnt($?, 0, 'Unable to start with --refresh-min above --refresh-max');
+    like($output, qr/--refresh-min must not be greater/,
+         'Got refresh bounds error');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
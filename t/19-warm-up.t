@@ -0,0 +1,92 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Spec::Functions qw(no_upwards);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 5;
+
+my $mount_dir;
+my $pid;
+
+sub start_fsmu
+{
+    my ($muhome, $backing_dir, $extra) = @_;
+
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--refresh-timeout=1 $extra ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+}
+
+sub stop_fsmu
+{
+    system("fusermount -u $mount_dir");
+    kill('TERM', $pid);
+    waitpid($pid, 0);
+    $pid = undef;
+}
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+
+    start_fsmu($muhome, $backing_dir, '');
+    my @names = map { "maildir:+asdf+asdf$_" } (1..3);
+    for my $name (@names) {
+        mkdir "$mount_dir/$name";
+        my @files = glob("$mount_dir/$name/cur/*");
+    }
+    # A query directory whose name is that of the state directory,
+    # without the leading underscore, is not mistaken for it.
+    my $state_dir = "$mount_dir/state";
+    ok(mkdir($state_dir), 'Able to make state query directory');
+    my @state_files = glob("$state_dir/cur/*");
+    stop_fsmu();
+    # The access log is written as fsmu stops, after the unmount.
+    sleep(1);
+    ok((-f "$backing_dir/__state/_access"),
+       'Access log is written when fsmu stops');
+
+    my %before = map { $_ => (stat("$backing_dir/$_.last-update"))[9] }
+                     @names;
+    sleep(2);
+    start_fsmu($muhome, $backing_dir, '--warm-up=2');
+    sleep(2);
+    my $refreshed = grep {
+        (stat("$backing_dir/$_.last-update"))[9] > $before{$_}
+    } @names;
+    is($refreshed, 3, 'Query directories are refreshed at startup');
+
+    my @files = (glob("$mount_dir/$names[0]/cur/*"),
+                 glob("$mount_dir/$names[0]/new/*"));
+    is(@files, 9, 'Found 9 files after warm-up');
+    opendir(my $dh, $state_dir);
+    my @entries = sort(no_upwards(readdir($dh)));
+    closedir($dh);
+    is_deeply(\@entries, [qw(cur new tmp)],
+              'State query directory only lists cur, new and tmp');
+}
+
+END {
+    if ($pid) {
+        stop_fsmu();
+    }
+    exit(0);
+}
+
+1;
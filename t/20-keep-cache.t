@@ -0,0 +1,72 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Slurp qw(read_file write_file);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 4;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = glob("$query_dir/cur/*");
+    ok(@files, 'Found files in query directory');
+
+    my $file = $files[0];
+    my ($rest) = ($file =~ /(\/cur\/[^\/]+)$/);
+    my $target = readlink("$backing_dir/_maildir:+asdf+asdf4$rest");
+    my $data = read_file($file);
+    is(read_file($file), $data,
+       'Message contents are the same when reopened');
+
+    # A message that changes between opens is not served from the
+    # pages cached for the previous version.
+    write_file($target, { append => 1 }, "more data\n");
+    sleep(1);
+    like(read_file($file), qr/more data\n$/,
+         'Changed message is read afresh');
+
+    # Renaming the message within the mount does not change its
+    # contents.
+    my $renamed = $file;
+    $renamed =~ s/(:2,[A-Z]*)?$/:2,S/;
+    rename($file, $renamed);
+    like(read_file($renamed), qr/more data\n$/,
+         'Renamed message has the same contents');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
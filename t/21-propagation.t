@@ -0,0 +1,93 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Basename;
+use File::Temp qw(tempdir);
+
+use Test::More tests => 4;
+
+my $mount_dir;
+my $pid;
+
+sub get_stem
+{
+    my ($path) = @_;
+
+    my $name = basename($path);
+    $name =~ s/^\d+_//;
+    $name =~ s/:2,.*$//;
+    return $name;
+}
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    # The two query directories overlap, so that a rename in one has
+    # to be propagated to the other.
+
+    my $first_dir = "$mount_dir/maildir:+asdf+asdf4";
+    my $second_dir = "$mount_dir/to:asdf4\@example.net";
+    mkdir $first_dir;
+    mkdir $second_dir;
+    my @files = glob("$first_dir/cur/*");
+    ok(@files, 'Found files in first query directory');
+    my $stem = get_stem($files[0]);
+    my @second_files = grep { get_stem($_) eq $stem }
+                            glob("$second_dir/cur/*");
+    is(@second_files, 1, 'Message is present in second query directory');
+
+    # Rename the message repeatedly in quick succession, so that the
+    # propagations are queued (and coalesced) before they are applied.
+
+    my $file = $files[0];
+    for my $flags (qw(S RS FS S FRS)) {
+        my $renamed = $file;
+        $renamed =~ s/(:2,[A-Z]*)?$/:2,$flags/;
+        rename($file, $renamed);
+        $file = $renamed;
+    }
+    ok((-e $file), 'Message renamed in first query directory');
+
+    my $found;
+    for (1..10) {
+        @second_files = grep { get_stem($_) eq $stem }
+                             glob("$second_dir/cur/*");
+        if ((@second_files == 1) and ($second_files[0] =~ /:2,FRS$/)) {
+            $found = 1;
+            last;
+        }
+        sleep(1);
+    }
+    ok($found, 'Final rename propagated to second query directory');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
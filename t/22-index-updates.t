@@ -0,0 +1,78 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init
+                 make_mu_wrapper);
+use autodie;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 6;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    my $log = tempdir(UNLINK => 1).'/mu.log';
+    my $mu = make_mu_wrapper($log);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--mu=$mu --update-index ".
+                         "--index-interval=3600 ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = glob("$query_dir/cur/*");
+    is(@files, 4, "Found 4 'cur' files");
+
+    # Renames are queued, rather than being applied to the index
+    # straightaway.
+    for my $file (@files[0..2]) {
+        rename($file, "$file:2,S");
+    }
+    my @lines = grep { /^start (add|remove) / } read_file($log);
+    is(@lines, 0, 'Index not updated after renames');
+
+    # The queued updates are applied before the next query is run,
+    # with a single command for each type of update.
+    system("cat '$query_dir/.refresh' >/dev/null");
+    my @removes = grep { /^start remove / } read_file($log);
+    my @adds = grep { /^start add / } read_file($log);
+    is(@removes, 1, 'Removals applied by a single mu command');
+    is(@adds, 1, 'Additions applied by a single mu command');
+    my $added = () = ($adds[0] =~ /:2,S/g);
+    is($added, 3, 'All renamed messages added to the index');
+
+    my @indexed =
+        `mu find --muhome=$muhome --fields=l maildir:/asdf/asdf4 2>/dev/null`;
+    my $renamed = grep { /:2,S$/ } @indexed;
+    is($renamed, 3, 'Index has the renamed messages');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
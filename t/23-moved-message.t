@@ -0,0 +1,80 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 make_message
+                 write_message
+                 mu_init);
+use autodie;
+use File::Basename;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+
+use Test::More tests => 5;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = glob("$query_dir/cur/*");
+    is(@files, 4, "Found 4 'cur' files");
+
+    my $file = $files[0];
+    my $name = basename($file);
+    my $target = readlink("$backing_dir/_maildir:+asdf+asdf4/cur/$name");
+    my $data = read_file($file);
+
+    # Rename the message outside of fsmu, such that nothing in its new
+    # filename matches its old one, so that it can only be found by
+    # way of its recorded inode.
+    my $moved = dirname($target)."/moved.$$:2,S";
+    rename($target, $moved);
+    ok((not -e $file), 'Original name no longer present after move');
+
+    my @moved = grep { /moved\.$$/ } glob("$query_dir/cur/*");
+    is(@moved, 1, 'Moved message found in query directory');
+    is(read_file($moved[0]), $data, 'Moved message has the same contents');
+
+    # Remove the message outside of fsmu, and deliver another message
+    # to the same directory, which may well reuse its inode.  The new
+    # message is not mistaken for the removed one.
+    unlink($moved);
+    my $entity = make_message('other@example.org', 'asdf4@example.net',
+                              'unrelated message', 'other data');
+    write_message($entity, dirname($moved));
+    my $content = eval { read_file($moved[0]) };
+    ok(((not defined $content) or ($content !~ /unrelated message/)),
+       'Removed message is not replaced by an unrelated message');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
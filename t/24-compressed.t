@@ -0,0 +1,93 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+
+use Test::More;
+
+my $mount_dir;
+my $pid;
+
+{
+    my $output = `./fsmu --backing-dir=/nonexistent --compressed 2>&1`;
+    if ($output =~ /requires zstd support/) {
+        plan skip_all => 'fsmu was built without zstd support';
+    }
+    if (system('zstd --version >/dev/null 2>&1') != 0) {
+        plan skip_all => 'zstd is not available';
+    }
+    plan tests => 4;
+
+    # The messages are indexed before they are compressed, since mu
+    # cannot read compressed messages.
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my %originals;
+    for my $path (glob("$dir/asdf/asdf4/cur/*"),
+                  glob("$dir/asdf/asdf4/new/*")) {
+        $originals{$path} = read_file($path);
+        system("zstd -q -f '$path' -o '$path.zst' && mv '$path.zst' '$path'");
+    }
+
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--compressed ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = (glob("$query_dir/cur/*"), glob("$query_dir/new/*"));
+    is(@files, 9, 'Found 9 files');
+
+    my ($size_matches, $content_matches) = (0, 0);
+    for my $file (@files) {
+        my ($rest) = ($file =~ /(\/(?:cur|new)\/[^\/]+)$/);
+        my $target = readlink("$backing_dir/_maildir:+asdf+asdf4$rest");
+        my $original = $originals{$target};
+        next if not defined $original;
+        $size_matches++ if ((-s $file) == length($original));
+        $content_matches++ if (read_file($file) eq $original);
+    }
+    is($size_matches, 9, 'Sizes are the uncompressed sizes');
+    is($content_matches, 9, 'Contents are decompressed');
+
+    # Reads that start part-way through a message are served
+    # correctly.
+    open my $fh, '<', $files[0];
+    seek($fh, 10, 0);
+    my $data;
+    read($fh, $data, 20);
+    close $fh;
+    my ($rest) = ($files[0] =~ /(\/(?:cur|new)\/[^\/]+)$/);
+    my $target = readlink("$backing_dir/_maildir:+asdf+asdf4$rest");
+    is($data, substr($originals{$target}, 10, 20),
+       'Read from an offset is decompressed correctly');
+}
+
+END {
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+    }
+    exit(0);
+}
+
+1;
@@ -0,0 +1,88 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_root_maildir
+                 mu_init);
+use autodie;
+use File::Slurp qw(read_file);
+use File::Temp qw(tempdir);
+use JSON::PP qw(decode_json);
+
+use Test::More tests => 6;
+
+my $mount_dir;
+my $pid;
+
+sub stop_fsmu
+{
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+        $mount_dir = undef;
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+        $pid = undef;
+    }
+}
+
+{
+    my $dir = make_root_maildir();
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    my $trace_path = tempdir(UNLINK => 1).'/trace.json';
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "--trace-file=$trace_path ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $query_dir = "$mount_dir/maildir:+asdf+asdf4";
+    mkdir $query_dir;
+    my @files = glob("$query_dir/cur/*");
+    rename($files[0], "$files[0]:2,S");
+    rmdir $query_dir;
+
+    # The trace file is only complete once fsmu has exited.
+    stop_fsmu();
+    sleep(1);
+
+    my $trace = read_file($trace_path);
+    my $events = eval { decode_json($trace) };
+    ok($events, 'Trace file is valid JSON');
+    is(ref($events), 'ARRAY', 'Trace file is an array of events');
+    my @complete = grep { ($_->{'ph'} eq 'X')
+                          and defined($_->{'ts'})
+                          and defined($_->{'dur'}) } @{$events || []};
+    is(@complete, @{$events || []}, 'All events are complete events');
+    my %names = map { $_->{'name'} => 1 } @complete;
+    ok(($names{'mu_find'} and $names{'refresh_update_cur'}),
+       'Refresh phases are traced');
+    ok(($names{'rename_maildir'} and $names{'rename_relink'}),
+       'Rename phases are traced');
+
+    SKIP: {
+        skip 'sys/sdt.h is not available', 1
+            if not -e '/usr/include/sys/sdt.h';
+        skip 'readelf is not available', 1
+            if system('readelf --version >/dev/null 2>&1') != 0;
+        my $notes = `readelf -n ./fsmu`;
+        like($notes, qr/mu_find_entry/, 'Binary includes static probes');
+    }
+}
+
+END {
+    stop_fsmu();
+    exit(0);
+}
+
+1;
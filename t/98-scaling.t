@@ -0,0 +1,145 @@
+#!/usr/bin/perl
+
+use warnings;
+use strict;
+
+use lib './t/lib';
+use FsmuUtils qw(make_bulk_root_maildir
+                 mu_init);
+use File::Find;
+use File::Temp qw(tempdir);
+use Proc::ProcessTable;
+use Time::HiRes qw(time);
+
+# Archive sizes to test, and the per-item budgets for each metric.  An
+# item is a single mail item present in a single query directory, so
+# that a message matched by three query directories counts three
+# times.  Each of these can be overridden by way of the environment.
+# The 100k archive takes some time to build and index, so it is only
+# included by default if FSMU_SCALING_LARGE is set.
+
+my $default_sizes =
+    ($ENV{'FSMU_SCALING_LARGE'} ? '1000,10000,100000' : '1000,10000');
+my @sizes =
+    split /,/, ($ENV{'FSMU_SCALING_SIZES'} || $default_sizes);
+my %budgets = (
+    'bytes'      => ($ENV{'FSMU_BUDGET_BYTES'}      || 20480),
+    'inodes'     => ($ENV{'FSMU_BUDGET_INODES'}     || 8),
+    'rss'        => ($ENV{'FSMU_BUDGET_RSS'}        || 2048),
+    'refresh_us' => ($ENV{'FSMU_BUDGET_REFRESH_US'} || 2000),
+);
+my @metrics = qw(bytes inodes rss refresh_us);
+
+use Test::More;
+plan tests => (@sizes * (@metrics + 1));
+
+my $mount_dir;
+my $pid;
+
+sub get_rss
+{
+    my ($muhome) = @_;
+
+    my $p = Proc::ProcessTable->new(cache_ttys => 1);
+    for my $proc (@{$p->table()}) {
+        if ($proc->cmndline() =~ /fsmu.*$muhome/) {
+            return $proc->rss();
+        }
+    }
+    die "Unable to find fsmu process";
+}
+
+sub stop_fsmu
+{
+    if ($mount_dir) {
+        system("fusermount -u $mount_dir");
+        $mount_dir = undef;
+    }
+    if ($pid) {
+        kill('TERM', $pid);
+        waitpid($pid, 0);
+        $pid = undef;
+    }
+}
+
+for my $size (@sizes) {
+    my $dir = make_bulk_root_maildir($size);
+    my ($muhome, $refresh_cmd) = mu_init($dir);
+    my $backing_dir = tempdir(UNLINK => 1);
+    $mount_dir = tempdir(UNLINK => 1);
+    if ($pid = fork()) {
+        sleep(1);
+    } else {
+        my $res = system("./fsmu -s --muhome=$muhome ".
+                         "--backing-dir=$backing_dir ".
+                         "$mount_dir");
+        sleep(3600);
+        exit();
+    }
+
+    my $initial_rss = get_rss($muhome);
+
+    # Query directories overlap: the first covers the whole archive,
+    # and the others each cover some part of it.
+
+    my @queries = (
+        'from:user@example.org',
+        'subject:even',
+        'subject:odd',
+        'to:asdf1@example.net',
+    );
+
+    my $start = time();
+    my $items = 0;
+    for my $query (@queries) {
+        my $query_dir = "$mount_dir/$query";
+        mkdir $query_dir;
+        find(sub { $items++ if /^\d/ }, $query_dir);
+    }
+    my $refresh_us = (time() - $start) * 1000000;
+    ok($items >= $size, "$size: found $items items");
+    $items ||= 1;
+
+    my $rss = get_rss($muhome) - $initial_rss;
+
+    my $bytes = 0;
+    my $reverse_inodes = 0;
+    my $query_inodes = 0;
+    find({ no_chdir => 1,
+           wanted => sub {
+               my @st = lstat($File::Find::name);
+               if (@st) {
+                   $bytes += $st[12] * 512;
+               }
+               if ($File::Find::name =~ /\/_reverse(\/|$)/) {
+                   $reverse_inodes++;
+               } else {
+                   $query_inodes++;
+               }
+           } }, $backing_dir);
+    diag "$size: $reverse_inodes inodes under _reverse, ".
+         "$query_inodes inodes elsewhere";
+
+    my %values = (
+        'bytes'      => $bytes,
+        'inodes'     => ($reverse_inodes + $query_inodes),
+        'rss'        => $rss,
+        'refresh_us' => $refresh_us,
+    );
+    for my $metric (@metrics) {
+        my $per_item = $values{$metric} / $items;
+        my $budget = $budgets{$metric};
+        ok(($per_item <= $budget),
+            sprintf("%d: %s per item (%.1f) within budget (%d)",
+                    $size, $metric, $per_item, $budget));
+    }
+
+    stop_fsmu();
+}
+
+END {
+    stop_fsmu();
+    exit(0);
+}
+
+1;
@@ -4,6 +4,7 @@ use warnings;
 use strict;
 
 use autodie;
+use File::Find;
 use File::Slurp qw(read_file write_file);
 use File::Temp qw(tempdir);
 use MIME::Entity;
@@ -12,10 +13,14 @@ use Sys::Hostname;
 use base qw(Exporter);
 our @EXPORT_OK = qw(make_maildir
                     make_root_maildir
+                    make_bulk_root_maildir
                     make_message
                     write_message
                     mu_init
-                    mu_cmd);
+                    mu_cmd
+                    make_mu_wrapper
+                    get_files
+                    get_xattr);
 
 my $counter = 1;
 
@@ -89,6 +94,45 @@ sub make_root_maildir
     return $dir;
 }
 
+sub make_bulk_root_maildir
+{
+    my ($count) = @_;
+
+    # MIME::Entity is too slow for archives with very large numbers of
+    # messages, so the messages are written out directly here.
+
+    my $dir = tempdir(UNLINK => 1);
+    my @names = qw(asdf qwer zxcv tyui ghjk);
+    my $host = hostname();
+    my $date = 'Mon, 01 Jan 2018 00:00:00 +0000';
+    for my $name (@names) {
+        for my $n (1..10) {
+            for my $subdir (@subdirs) {
+                my $path = "$dir/$name/asdf$n/$subdir";
+                system("mkdir", "-p", $path);
+            }
+        }
+    }
+    for my $m (1..$count) {
+        my $name = $names[$m % @names];
+        my $n = 1 + (int($m / @names) % 10);
+        my $to = "asdf$n\@example.net";
+        my $parity = ($m % 2) ? 'odd' : 'even';
+        my $subdir = $subdirs[$m % 2];
+        my $fn = time().'.'.$$.'_'.$counter++.'.'.$host;
+        open my $fh, '>', "$dir/$name/asdf$n/$subdir/$fn";
+        print $fh "From: user\@example.org\n".
+                  "To: $to\n".
+                  "Date: $date\n".
+                  "Message-ID: <bulk.$m.$$\@example.org>\n".
+                  "Subject: bulk message $m $parity\n".
+                  "\n".
+                  "data\n";
+        close $fh;
+    }
+    return $dir;
+}
+
 sub mu_init
 {
     my ($dir) = @_;
@@ -133,4 +177,53 @@ sub mu_cmd
     }
 }
 
+sub make_mu_wrapper
+{
+    my ($log, $delay) = @_;
+
+    # The wrapper runs mu as usual, but records the start and end of
+    # each command in the log, and optionally waits for the given
+    # number of seconds before running it.
+
+    $delay ||= 0;
+    my $dir = tempdir(UNLINK => 1);
+    my $path = "$dir/mu";
+    open my $fh, '>', $path;
+    print $fh "#!/bin/sh\n".
+              "echo \"start \$*\" >> '$log'\n".
+              "sleep $delay\n".
+              "mu \"\$@\"\n".
+              "res=\$?\n".
+              "echo \"end \$*\" >> '$log'\n".
+              "exit \$res\n";
+    close $fh;
+    chmod 0755, $path;
+    return $path;
+}
+
+sub get_files
+{
+    my ($query_dir, $type) = @_;
+
+    # Returns the paths of the messages in the given subdirectory
+    # ("cur" or "new") of the query directory.
+
+    my @query_files;
+    find(sub { push @query_files, $File::Find::name },
+         $query_dir);
+    return grep { /\/$type\/\d/ } @query_files;
+}
+
+sub get_xattr
+{
+    my ($path, $name) = @_;
+
+    # Returns the value of the fsmu extended attribute with the given
+    # name, or undef if it cannot be read.
+
+    my $value =
+        `getfattr --only-values -n user.fsmu.$name '$path' 2>/dev/null`;
+    return (($? == 0) ? $value : undef);
+}
+
 1;